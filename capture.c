@@ -0,0 +1,206 @@
+/* SPDX-License-Identifier: MIT
+ *
+ * Copyright (C) 2019 WireGuard LLC. All Rights Reserved.
+ */
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "dbg.h"
+#include "lease.h"
+
+/* Records are collected here and written out by capture_sync(), or whenever
+ * the buffer fills up
+ */
+#define CAPTURE_BUFSIZE 1024
+
+struct capture {
+	int fd;
+	pthread_mutex_t mutex;
+	uint64_t start; /* CLOCK_BOOTTIME, in ns */
+	struct capture_record buf[CAPTURE_BUFSIZE];
+	size_t buflen;
+};
+
+static uint64_t get_time_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	if (clock_gettime(clock, &ts))
+		fatal("clock_gettime()");
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void write_all(int wfd, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	while (len > 0) {
+		ssize_t ret = write(wfd, p, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			fatal("write()");
+		}
+
+		p += ret;
+		len -= ret;
+	}
+}
+
+static void flush_buf(struct capture *c)
+{
+	if (!c->buflen)
+		return;
+
+	write_all(c->fd, c->buf, c->buflen * sizeof *c->buf);
+	c->buflen = 0;
+}
+
+/* Returns a zeroed record to fill in, with the mutex held until append_end()
+ */
+static struct capture_record *append_begin(struct capture *c, uint8_t iface,
+					   enum capture_type type)
+{
+	struct capture_record *rec;
+
+	pthread_mutex_lock(&c->mutex);
+	if (c->buflen == CAPTURE_BUFSIZE)
+		flush_buf(c);
+
+	rec = &c->buf[c->buflen++];
+	memset(rec, 0, sizeof *rec);
+	rec->time = get_time_ns(CLOCK_BOOTTIME) - c->start;
+	rec->type = type;
+	rec->iface = iface;
+
+	return rec;
+}
+
+static void append_end(struct capture *c)
+{
+	pthread_mutex_unlock(&c->mutex);
+}
+
+struct capture *capture_open(const char *fname,
+			     struct wg_dynamic_leases *const *leases, size_t n)
+{
+	struct capture_header hdr = {
+		.record_size = sizeof(struct capture_record),
+		.ninterfaces = n,
+	};
+	struct capture *c;
+
+	if (n > CAPTURE_MAX_INTERFACES)
+		die("Can't capture more than %d interfaces\n",
+		    CAPTURE_MAX_INTERFACES);
+
+	c = calloc(1, sizeof *c);
+	if (!c)
+		fatal("calloc()");
+
+	c->fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (c->fd < 0)
+		fatal("Creating capture file %s failed", fname);
+	pthread_mutex_init(&c->mutex, NULL);
+
+	memcpy(hdr.magic, CAPTURE_MAGIC, sizeof hdr.magic);
+	c->start = get_time_ns(CLOCK_BOOTTIME);
+	hdr.start_boot = c->start;
+	hdr.start_real = get_time_ns(CLOCK_REALTIME);
+	write_all(c->fd, &hdr, sizeof hdr);
+
+	for (size_t i = 0; i < n; ++i) {
+		char name[IFNAMSIZ] = { 0 };
+
+		strncpy(name, leases_devname(leases[i]), sizeof name - 1);
+		write_all(c->fd, name, sizeof name);
+	}
+
+	/* writes the pools and leases there are right away */
+	for (size_t i = 0; i < n; ++i)
+		leases_set_capture(leases[i], c, i);
+	capture_sync(c);
+
+	return c;
+}
+
+void capture_set_lease(struct capture *c, uint8_t iface, const wg_key pubkey,
+		       uint32_t leasetime, const struct in6_addr *lladdr,
+		       const struct in_addr *ipv4, const struct in6_addr *ipv6,
+		       const struct in_addr *lease_ipv4,
+		       const struct in6_addr *lease_ipv6)
+{
+	struct capture_record *rec = append_begin(c, iface, CAPTURE_SET_LEASE);
+
+	memcpy(rec->pubkey, pubkey, sizeof rec->pubkey);
+	rec->leasetime = leasetime;
+	if (lladdr) {
+		rec->flags |= CAPTURE_LLADDR;
+		rec->lladdr = *lladdr;
+	}
+	if (ipv4) {
+		rec->flags |= CAPTURE_IPV4;
+		rec->ipv4 = *ipv4;
+	}
+	if (ipv6) {
+		rec->flags |= CAPTURE_IPV6;
+		rec->ipv6 = *ipv6;
+	}
+	rec->lease_ipv4 = *lease_ipv4;
+	rec->lease_ipv6 = *lease_ipv6;
+	append_end(c);
+}
+
+void capture_flush(struct capture *c, uint8_t iface)
+{
+	append_begin(c, iface, CAPTURE_FLUSH);
+	append_end(c);
+}
+
+void capture_pool(struct capture *c, uint8_t iface, int family,
+		  const void *addr, uint8_t cidr, bool exists)
+{
+	struct capture_record *rec;
+
+	rec = append_begin(c, iface, exists ? CAPTURE_POOL_ADD :
+					      CAPTURE_POOL_DEL);
+	rec->cidr = cidr;
+	if (family == AF_INET) {
+		rec->flags = CAPTURE_IPV4;
+		memcpy(&rec->ipv4, addr, sizeof rec->ipv4);
+	} else {
+		rec->flags = CAPTURE_IPV6;
+		memcpy(&rec->ipv6, addr, sizeof rec->ipv6);
+	}
+	append_end(c);
+}
+
+void capture_lease(struct capture *c, uint8_t iface, enum capture_type type,
+		   const struct journal_record *rec)
+{
+	struct capture_record *crec = append_begin(c, iface, type);
+
+	memcpy(crec->pubkey, rec->pubkey, sizeof crec->pubkey);
+	crec->lladdr = rec->lladdr;
+	crec->ipv4 = rec->ipv4;
+	crec->ipv6 = rec->ipv6;
+	crec->leasetime = rec->leasetime;
+	crec->start_real = rec->start_real;
+	append_end(c);
+}
+
+void capture_sync(struct capture *c)
+{
+	pthread_mutex_lock(&c->mutex);
+	flush_buf(c);
+	pthread_mutex_unlock(&c->mutex);
+}
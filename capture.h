@@ -0,0 +1,107 @@
+/* SPDX-License-Identifier: MIT
+ *
+ * Copyright (C) 2019 WireGuard LLC. All Rights Reserved.
+ */
+
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#include <net/if.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "journal.h"
+#include "netlink.h"
+
+/* A trace of everything that drives the lease engine, to be fed back into
+ * it by tests/wg-dynamic-replay. The file starts with a header and the names
+ * of the interfaces, followed by fixed size records in the order the calls
+ * were made. The first records of each interface describe its pools and
+ * leases at the time the capture started. All fields are in host byte order,
+ * except for the addresses.
+ */
+#define CAPTURE_MAGIC "wgdyntr\2"
+
+struct capture_header {
+	uint8_t magic[8];
+	uint32_t record_size;
+	uint32_t ninterfaces;
+	/* CLOCK_REALTIME and CLOCK_BOOTTIME at the start, in ns */
+	int64_t start_real;
+	uint64_t start_boot;
+	/* followed by ninterfaces names of IFNAMSIZ bytes each */
+};
+
+enum capture_type {
+	CAPTURE_SET_LEASE = 1, /* set_lease() */
+	CAPTURE_FLUSH, /* leases_flush() with updates queued */
+	CAPTURE_POOL_ADD, /* a pool appeared, or gone away, in ipv4 or */
+	CAPTURE_POOL_DEL, /* ipv6 with cidr, see CAPTURE_IPV6 */
+	CAPTURE_IMPORT, /* a lease taken over from a journal_record */
+	CAPTURE_REMOVE, /* a lease removed by leases_replicate() */
+};
+
+/* Which of the pointer arguments of set_lease() weren't NULL. For pools,
+ * CAPTURE_IPV6 tells the family.
+ */
+#define CAPTURE_LLADDR (1U << 0)
+#define CAPTURE_IPV4 (1U << 1)
+#define CAPTURE_IPV6 (1U << 2)
+
+struct capture_record {
+	uint64_t time; /* ns since the start of the capture */
+	uint8_t type; /* enum capture_type */
+	uint8_t iface; /* position of the interface in the header */
+	uint8_t flags;
+	uint8_t cidr;
+	uint32_t leasetime;
+	wg_key pubkey;
+	struct in6_addr lladdr;
+	struct in6_addr ipv6;
+	struct in_addr ipv4;
+	/* the addresses set_lease() left the lease with */
+	struct in_addr lease_ipv4;
+	int64_t start_real; /* of imported leases */
+	struct in6_addr lease_ipv6;
+};
+
+/* At most this many interfaces can be captured */
+#define CAPTURE_MAX_INTERFACES 256
+
+struct capture;
+struct wg_dynamic_leases;
+
+/*
+ * Creates (or truncates) the trace file fname and starts capturing the n
+ * leases, beginning with their current state. Dies if fname can't be
+ * created.
+ */
+struct capture *capture_open(const char *fname,
+			     struct wg_dynamic_leases *const *leases, size_t n);
+
+/*
+ * Append a record of the respective call to the leases of interface iface.
+ * Thread safe, records end up in the order of the calls. Only meant to be
+ * called by lease.c.
+ */
+void capture_set_lease(struct capture *c, uint8_t iface, const wg_key pubkey,
+		       uint32_t leasetime, const struct in6_addr *lladdr,
+		       const struct in_addr *ipv4, const struct in6_addr *ipv6,
+		       const struct in_addr *lease_ipv4,
+		       const struct in6_addr *lease_ipv6);
+void capture_flush(struct capture *c, uint8_t iface);
+void capture_pool(struct capture *c, uint8_t iface, int family,
+		  const void *addr, uint8_t cidr, bool exists);
+void capture_lease(struct capture *c, uint8_t iface, enum capture_type type,
+		   const struct journal_record *rec);
+
+/*
+ * Writes out all records appended so far. Meant to be called once per event
+ * loop iteration, before answering requests, so the trace covers everything
+ * a client saw even if the server is killed.
+ */
+void capture_sync(struct capture *c);
+
+#endif
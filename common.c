@@ -23,21 +23,18 @@
 union kvalues {
 	uint32_t u32;
 	struct wg_combined_ip ip;
-	char errmsg[256];
+	char errmsg[MAX_ERRMSG_SIZE];
 };
 
-static void request_ip(enum wg_dynamic_key key, union kvalues kv, void **dest)
+static void request_ip(enum wg_dynamic_key key, union kvalues kv,
+		       struct wg_dynamic_request *req)
 {
 	struct wg_combined_ip *ip = &kv.ip;
-	struct wg_dynamic_request_ip *r = (struct wg_dynamic_request_ip *)*dest;
+	struct wg_dynamic_request_ip *r = &req->result.ip;
 
 	switch (key) {
 	case WGKEY_REQUEST_IP:
-		BUG_ON(*dest);
-		*dest = calloc(1, sizeof(struct wg_dynamic_request_ip));
-		if (!*dest)
-			fatal("calloc()");
-
+		memset(r, 0, sizeof *r);
 		break;
 	case WGKEY_IP:
 		if (ip->family == AF_INET) {
@@ -60,7 +57,10 @@ static void request_ip(enum wg_dynamic_key key, union kvalues kv, void **dest)
 		r->wg_errno = kv.u32;
 		break;
 	case WGKEY_ERRMSG:
-		r->errmsg = strdup(kv.errmsg);
+		memcpy(r->errmsg, kv.errmsg, sizeof r->errmsg);
+		break;
+	case WGKEY_RETRYAFTER:
+		r->retry_after = kv.u32;
 		break;
 	default:
 		debug("Invalid key %d, aborting\n", key);
@@ -69,43 +69,210 @@ static void request_ip(enum wg_dynamic_key key, union kvalues kv, void **dest)
 }
 
 static void (*const deserialize_fptr[])(enum wg_dynamic_key key,
-					union kvalues kv, void **dest) = {
+					union kvalues kv,
+					struct wg_dynamic_request *req) = {
 	NULL,
 	NULL,
 	request_ip,
 };
 
+static int hex_value(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+
+	return -1;
+}
+
+/* Accepts exactly what inet_pton(AF_INET) accepts, in [str, end) */
+static bool parse_ipv4(const char *str, const char *end, uint8_t dst[4])
+{
+	unsigned int octets = 0, val = 0;
+	bool saw_digit = false;
+	uint8_t tmp[4];
+
+	for (; str < end; ++str) {
+		if (*str >= '0' && *str <= '9') {
+			if (saw_digit && val == 0)
+				return false; /* no leading zeros */
+
+			val = val * 10 + (*str - '0');
+			if (val > 255)
+				return false;
+
+			if (!saw_digit) {
+				if (++octets > 4)
+					return false;
+				saw_digit = true;
+			}
+			tmp[octets - 1] = val;
+		} else if (*str == '.' && saw_digit) {
+			if (octets == 4)
+				return false;
+			saw_digit = false;
+			val = 0;
+		} else {
+			return false;
+		}
+	}
+
+	if (octets < 4 || !saw_digit)
+		return false;
+
+	memcpy(dst, tmp, sizeof tmp);
+	return true;
+}
+
+/* Accepts exactly what inet_pton(AF_INET6) accepts, in [str, end) */
+static bool parse_ipv6(const char *str, const char *end, uint8_t dst[16])
+{
+	uint8_t tmp[16] = { 0 }, *tp = tmp, *colonp = NULL;
+	const char *curtok;
+	unsigned int digits = 0, val = 0;
+
+	if (str == end)
+		return false;
+
+	/* a leading :: needs special handling */
+	if (*str == ':' && (++str == end || *str != ':'))
+		return false;
+
+	curtok = str;
+	while (str < end) {
+		char c = *str++;
+		int digit = hex_value(c);
+
+		if (digit >= 0) {
+			if (digits == 4)
+				return false;
+
+			val = (val << 4) | digit;
+			++digits;
+			continue;
+		}
+
+		if (c == ':') {
+			curtok = str;
+			if (!digits) {
+				if (colonp)
+					return false;
+				colonp = tp;
+				continue;
+			} else if (str == end) {
+				return false;
+			}
+
+			if (tp + 2 > tmp + sizeof tmp)
+				return false;
+
+			*tp++ = val >> 8;
+			*tp++ = val & 0xff;
+			digits = val = 0;
+			continue;
+		}
+
+		/* the last 32 bits may be given as an IPv4 address */
+		if (c == '.' && tp + 4 <= tmp + sizeof tmp &&
+		    parse_ipv4(curtok, end, tp)) {
+			tp += 4;
+			digits = 0;
+			break;
+		}
+
+		return false;
+	}
+
+	if (digits) {
+		if (tp + 2 > tmp + sizeof tmp)
+			return false;
+
+		*tp++ = val >> 8;
+		*tp++ = val & 0xff;
+	}
+
+	if (colonp) {
+		size_t n = tp - colonp;
+
+		/* :: must stand for at least one group of zeros */
+		if (tp == tmp + sizeof tmp)
+			return false;
+
+		memmove(tmp + sizeof tmp - n, colonp, n);
+		memset(colonp, 0, tmp + sizeof tmp - n - colonp);
+		tp = tmp + sizeof tmp;
+	}
+
+	if (tp != tmp + sizeof tmp)
+		return false;
+
+	memcpy(dst, tmp, sizeof tmp);
+	return true;
+}
+
+/* Parses a plain run of digits directly and leaves anything else, like signs
+ * or leading whitespace, to strtoumax() so we accept the same values as
+ * before.
+ */
+static bool parse_u32(const char *str, uint32_t *res)
+{
+	const char *p = str;
+	uint64_t val = 0;
+	char *endptr;
+	uintmax_t uresult;
+
+	for (; *p >= '0' && *p <= '9'; ++p) {
+		val = val * 10 + (*p - '0');
+		if (val > UINT32_MAX)
+			return false;
+	}
+
+	if (p != str && *p == '\0') {
+		*res = (uint32_t)val;
+		return true;
+	}
+
+	uresult = strtoumax(str, &endptr, 10);
+	if (uresult > UINT32_MAX || *endptr != '\0')
+		return false;
+
+	*res = (uint32_t)uresult;
+	return true;
+}
+
 static bool parse_ip_cidr(struct wg_combined_ip *ip, char *value)
 {
-	char *sep;
+	char *sep, *end;
+	uint32_t res;
 
 	sep = strchr(value, '/');
 	if (sep) {
-		char *endptr;
-		uintmax_t res = strtoumax(sep + 1, &endptr, 10);
-		if (res > UINT8_MAX || *endptr != '\0' || sep + 1 == endptr)
+		if (sep[1] == '\0' || !parse_u32(sep + 1, &res) ||
+		    res > UINT8_MAX)
 			return false;
 
 		if ((ip->family == AF_INET && res > 32) ||
 		    (ip->family == AF_INET6 && res > 128))
 			return false;
 
-		*sep = '\0';
+		end = sep;
 		ip->cidr = (uint8_t)res;
 	} else {
+		end = value + strlen(value);
 		ip->cidr = ip->family == AF_INET ? 32 : 128;
 	}
 
-	if (inet_pton(ip->family, value, ip) != 1)
-		return false;
+	if (ip->family == AF_INET)
+		return parse_ipv4(value, end, (uint8_t *)&ip->ip4);
 
-	return true;
+	return parse_ipv6(value, end, ip->ip6.s6_addr);
 }
 
 static bool parse_value(enum wg_dynamic_key key, char *str, union kvalues *kv)
 {
-	char *endptr;
-	uintmax_t uresult;
 	struct wg_combined_ip *ip;
 
 	switch (key) {
@@ -120,11 +287,10 @@ static bool parse_value(enum wg_dynamic_key key, char *str, union kvalues *kv)
 	case WGKEY_LEASESTART:
 	case WGKEY_LEASETIME:
 	case WGKEY_ERRNO:
-		uresult = strtoumax(str, &endptr, 10);
-		if (uresult > UINT32_MAX || *endptr != '\0')
+	case WGKEY_RETRYAFTER:
+		if (!parse_u32(str, &kv->u32))
 			return false;
 
-		kv->u32 = (uint32_t)uresult;
 		break;
 	case WGKEY_ERRMSG:
 		strncpy(kv->errmsg, str, sizeof kv->errmsg);
@@ -138,26 +304,26 @@ static bool parse_value(enum wg_dynamic_key key, char *str, union kvalues *kv)
 	return true;
 }
 
-static enum wg_dynamic_key parse_key(char *key)
+static enum wg_dynamic_key parse_key(const char *key, size_t len)
 {
 	for (enum wg_dynamic_key e = 2; e < ARRAY_SIZE(WG_DYNAMIC_KEY); ++e)
-		if (!strcmp(key, WG_DYNAMIC_KEY[e]))
+		if (WG_DYNAMIC_KEY_LEN[e] == len &&
+		    WG_DYNAMIC_KEY[e][0] == key[0] &&
+		    !memcmp(key, WG_DYNAMIC_KEY[e], len))
 			return e;
 
 	return WGKEY_UNKNOWN;
 }
 
 /* Consumes one full line from buf, or up to MAX_LINESIZE bytes if no newline
- * character was found. If less then MAX_LINESIZE bytes are available, a new
- * buffer will be allocated and req->buf and req->len set accordingly.
+ * character was found. The line is parsed in place.
  *
  * Return values:
  *   > 0 : Amount of bytes consumed (<= MAX_LINESIZE)
- *   = 0 : Consumed len bytes; need more for a full line
+ *   = 0 : Nothing consumed; need more for a full line
  *   < 0 : Error
  */
 static ssize_t parse_line(unsigned char *buf, size_t len,
-			  struct wg_dynamic_request *req,
 			  enum wg_dynamic_key *key, union kvalues *kv)
 {
 	unsigned char *line_end, *key_end;
@@ -168,12 +334,6 @@ static ssize_t parse_line(unsigned char *buf, size_t len,
 		if (len >= MAX_LINESIZE)
 			return -E2BIG;
 
-		req->len = len;
-		req->buf = malloc(len);
-		if (!req->buf)
-			fatal("malloc()");
-
-		memcpy(req->buf, buf, len);
 		return 0;
 	}
 
@@ -190,7 +350,7 @@ static ssize_t parse_line(unsigned char *buf, size_t len,
 		return -EINVAL;
 
 	*key_end = '\0';
-	*key = parse_key((char *)buf);
+	*key = parse_key((char *)buf, key_end - buf);
 	if (*key == WGKEY_UNKNOWN)
 		return line_len;
 
@@ -200,74 +360,88 @@ static ssize_t parse_line(unsigned char *buf, size_t len,
 	return line_len;
 }
 
-static ssize_t parse_request(struct wg_dynamic_request *req, unsigned char *buf,
-			     size_t len)
+/* Parses all complete lines in req->buf, advancing req->start past them. A
+ * trailing partial line is left in place for the next call.
+ *
+ * Return values:
+ *   1   : A full request was parsed
+ *   0   : Need more data
+ *   < 0 : Error
+ */
+static int parse_request(struct wg_dynamic_request *req)
 {
-	ssize_t ret, offset = 0;
 	enum wg_dynamic_key key;
 	union kvalues kv;
-	void (*deserialize)(enum wg_dynamic_key key, union kvalues kv,
-			    void **dest);
+	ssize_t ret;
 
-	if (memchr(buf, '\0', len))
-		return -EINVAL; /* don't allow null bytes */
-
-	if (req->cmd == WGKEY_UNKNOWN) {
-		ret = parse_line(buf, len, req, &req->cmd, &kv);
+	while (req->start < req->end) {
+		ret = parse_line(req->buf + req->start, req->end - req->start,
+				 &key, &kv);
 		if (ret <= 0)
 			return ret;
 
-		req->version = kv.u32;
-		if (req->cmd >= WGKEY_ENDCMD || req->cmd <= WGKEY_EOMSG ||
-		    req->version != 1)
-			return -EPROTONOSUPPORT;
+		req->start += ret;
 
-		len -= ret;
-		offset += ret;
+		if (req->cmd == WGKEY_UNKNOWN) {
+			req->cmd = key;
+			req->version = kv.u32;
+			if (req->cmd >= WGKEY_ENDCMD ||
+			    req->cmd <= WGKEY_EOMSG || req->version != 1)
+				return -EPROTONOSUPPORT;
 
-		deserialize = deserialize_fptr[req->cmd];
-		deserialize(req->cmd, kv, &req->result);
-	} else {
-		deserialize = deserialize_fptr[req->cmd];
-	}
-
-	while (len > 0) {
-		ret = parse_line(buf + offset, len, req, &key, &kv);
-		if (ret <= 0)
-			return ret;
-
-		len -= ret;
-		offset += ret;
+			deserialize_fptr[req->cmd](req->cmd, kv, req);
+			continue;
+		}
 
 		if (key == WGKEY_EOMSG)
-			return offset;
+			return 1;
 		else if (key == WGKEY_UNKNOWN)
 			continue;
 		else if (key <= WGKEY_ENDCMD)
 			return -EINVAL;
 
-		deserialize(key, kv, &req->result);
+		deserialize_fptr[req->cmd](key, kv, req);
 	}
 
 	return 0;
 }
 
-int handle_request(int fd, struct wg_dynamic_request *req,
-		   unsigned char buf[RECV_BUFSIZE + MAX_LINESIZE],
-		   size_t *remaining)
+/* Parses what is left in the buffer of req and makes room behind it for more,
+ * if that didn't complete a request
+ */
+static int next_request(struct wg_dynamic_request *req)
 {
-	ssize_t bytes, processed;
-	size_t leftover;
+	/* pipelined requests may already be waiting in the buffer */
+	int ret = parse_request(req);
+	if (ret)
+		return ret;
+
+	if (req->start == req->end) {
+		req->start = req->end = 0;
+	} else if (req->end == sizeof req->buf) {
+		/* only a partial line is left, which is shorter than
+		 * MAX_LINESIZE and thus leaves enough room behind it
+		 */
+		memmove(req->buf, req->buf + req->start, req->end - req->start);
+		req->end -= req->start;
+		req->start = 0;
+	}
 
-	BUG_ON((*remaining > 0 && req->buf) || (req->buf && !req->len));
+	return 0;
+}
 
-	do {
-		leftover = req->len;
-		if (*remaining > 0)
-			bytes = *remaining;
-		else
-			bytes = read(fd, buf + leftover, RECV_BUFSIZE);
+int handle_request(int fd, struct wg_dynamic_request *req)
+{
+	ssize_t bytes;
+	int ret;
+
+	while (1) {
+		ret = next_request(req);
+		if (ret)
+			return ret;
 
+		bytes = read(fd, req->buf + req->end,
+			     sizeof req->buf - req->end);
 		if (bytes < 0) {
 			if (errno == EWOULDBLOCK || errno == EAGAIN ||
 			    errno == EINTR)
@@ -280,37 +454,142 @@ int handle_request(int fd, struct wg_dynamic_request *req,
 			return -1;
 		}
 
-		if (req->buf) {
-			memcpy(buf, req->buf, leftover);
-			free(req->buf);
-			req->buf = NULL;
-			req->len = 0;
-		}
+		if (memchr(req->buf + req->end, '\0', bytes))
+			return -EINVAL; /* don't allow null bytes */
 
-		processed = parse_request(req, buf, bytes + leftover);
-		if (processed < 0)
-			return processed; /* Parsing error */
-		if (!processed)
-			*remaining = 0;
-	} while (processed == 0);
+		req->end += bytes;
+	}
+}
 
-	*remaining = (bytes + leftover) - processed;
-	memmove(buf, buf + processed, *remaining);
+int handle_request_data(struct wg_dynamic_request *req,
+			const unsigned char **data, size_t *len)
+{
+	size_t bytes;
+	int ret;
+
+	while (1) {
+		ret = next_request(req);
+		if (ret || !*len)
+			return ret;
 
-	return 1;
+		bytes = MIN(*len, sizeof req->buf - req->end);
+		if (memchr(*data, '\0', bytes))
+			return -EINVAL; /* don't allow null bytes */
+
+		memcpy(req->buf + req->end, *data, bytes);
+		req->end += bytes;
+		*data += bytes;
+		*len -= bytes;
+	}
 }
 
 void free_wg_dynamic_request(struct wg_dynamic_request *req)
 {
-	BUG_ON(req->buf || req->len);
-
 	req->cmd = WGKEY_UNKNOWN;
 	req->version = 0;
-	if (req->result) {
-		free(((struct wg_dynamic_request_ip *)req->result)->errmsg);
-		free(req->result);
-		req->result = NULL;
+}
+
+static void put(char *buf, size_t len, size_t *off, const char *str,
+		size_t n)
+{
+	if (n + *off >= len) {
+		debug("Outbuffer too small: %zu + %zu >= %zu\n", n, *off, len);
+		BUG();
+	}
+
+	memcpy(buf + *off, str, n);
+	*off += n;
+}
+
+#define PUT_LITERAL(buf, len, off, str) put(buf, len, off, str, sizeof(str) - 1)
+
+static size_t format_u32(char *out, uint32_t val)
+{
+	char tmp[10];
+	size_t n = 0;
+
+	do {
+		tmp[n++] = '0' + val % 10;
+		val /= 10;
+	} while (val);
+
+	for (size_t i = 0; i < n; ++i)
+		out[i] = tmp[n - 1 - i];
+
+	return n;
+}
+
+static void put_u32(char *buf, size_t len, size_t *off, uint32_t val)
+{
+	char tmp[10];
+
+	put(buf, len, off, tmp, format_u32(tmp, val));
+}
+
+static size_t format_ipv4(char *out, const uint8_t addr[4])
+{
+	size_t n = 0;
+
+	for (int i = 0; i < 4; ++i) {
+		if (i)
+			out[n++] = '.';
+		n += format_u32(out + n, addr[i]);
+	}
+
+	return n;
+}
+
+/* Produces the same output as inet_ntop(AF_INET6): the first longest run of
+ * at least two zero groups is shortened to ::, and v4-mapped and v4-compatible
+ * addresses end in dotted decimal.
+ */
+static size_t format_ipv6(char *out, const uint8_t addr[16])
+{
+	static const char hex[] = "0123456789abcdef";
+	int best_base = -1, best_len = 0, cur_base = -1, cur_len = 0;
+	uint16_t words[8];
+	size_t n = 0;
+
+	for (int i = 0; i < 8; ++i) {
+		words[i] = (addr[2 * i] << 8) | addr[2 * i + 1];
+		if (!words[i]) {
+			if (cur_base == -1)
+				cur_base = i, cur_len = 0;
+			if (++cur_len > best_len)
+				best_base = cur_base, best_len = cur_len;
+		} else {
+			cur_base = -1;
+		}
+	}
+
+	if (best_len < 2)
+		best_base = -1;
+
+	for (int i = 0; i < 8; ++i) {
+		if (best_base != -1 && i >= best_base &&
+		    i < best_base + best_len) {
+			if (i == best_base)
+				out[n++] = ':';
+			continue;
+		}
+
+		if (i)
+			out[n++] = ':';
+
+		if (i == 6 && best_base == 0 &&
+		    (best_len == 6 || (best_len == 5 && words[5] == 0xffff)))
+			return n + format_ipv4(out + n, addr + 12);
+
+		for (int shift = 12; shift >= 0; shift -= 4) {
+			if (words[i] >> shift || !shift)
+				out[n++] = hex[(words[i] >> shift) & 0xf];
+		}
 	}
+
+	if (best_base != -1 && best_base + best_len == 8)
+		out[n++] = ':';
+
+	return n;
 }
 
 size_t serialize_request_ip(bool send, char *buf, size_t len,
@@ -320,34 +599,51 @@ size_t serialize_request_ip(bool send, char *buf, size_t len,
 	char addrbuf[INET6_ADDRSTRLEN];
 
 	if (send)
-		print_to_buf(buf, len, &off, "request_ip=1\n");
+		PUT_LITERAL(buf, len, &off, "request_ip=1\n");
 
 	if (rip->has_ipv4) {
-		if (!inet_ntop(AF_INET, &rip->ipv4, addrbuf, sizeof addrbuf))
-			fatal("inet_ntop()");
-
-		print_to_buf(buf, len, &off, "ip=%s/32\n", addrbuf);
+		PUT_LITERAL(buf, len, &off, "ip=");
+		put(buf, len, &off, addrbuf,
+		    format_ipv4(addrbuf, (uint8_t *)&rip->ipv4));
+		PUT_LITERAL(buf, len, &off, "/32\n");
 	}
 
 	if (rip->has_ipv6) {
-		if (!inet_ntop(AF_INET6, &rip->ipv6, addrbuf, sizeof addrbuf))
-			fatal("inet_ntop()");
+		PUT_LITERAL(buf, len, &off, "ip=");
+		put(buf, len, &off, addrbuf,
+		    format_ipv6(addrbuf, rip->ipv6.s6_addr));
+		PUT_LITERAL(buf, len, &off, "/128\n");
+	}
 
-		print_to_buf(buf, len, &off, "ip=%s/128\n", addrbuf);
+	if (rip->has_ipv4 || rip->has_ipv6) {
+		PUT_LITERAL(buf, len, &off, "leasestart=");
+		put_u32(buf, len, &off, rip->start);
+		PUT_LITERAL(buf, len, &off, "\nleasetime=");
+		put_u32(buf, len, &off, rip->leasetime);
+		PUT_LITERAL(buf, len, &off, "\n");
 	}
 
-	if (rip->has_ipv4 || rip->has_ipv6)
-		print_to_buf(buf, len, &off, "leasestart=%u\nleasetime=%u\n",
-			     rip->start, rip->leasetime);
+	if (!send) {
+		PUT_LITERAL(buf, len, &off, "errno=");
+		put_u32(buf, len, &off, rip->wg_errno);
+		PUT_LITERAL(buf, len, &off, "\n");
+	}
 
-	if (!send)
-		print_to_buf(buf, len, &off, "errno=%u\n", rip->wg_errno);
+	if (rip->wg_errno) {
+		PUT_LITERAL(buf, len, &off, "errmsg=");
+		put(buf, len, &off, WG_DYNAMIC_ERR[rip->wg_errno],
+		    strlen(WG_DYNAMIC_ERR[rip->wg_errno]));
+		PUT_LITERAL(buf, len, &off, "\n");
+	}
 
-	if (rip->wg_errno)
-		print_to_buf(buf, len, &off, "errmsg=%s\n",
-			     WG_DYNAMIC_ERR[rip->wg_errno]);
+	if (rip->retry_after) {
+		PUT_LITERAL(buf, len, &off, "retryafter=");
+		put_u32(buf, len, &off, rip->retry_after);
+		PUT_LITERAL(buf, len, &off, "\n");
+	}
 
-	print_to_buf(buf, len, &off, "\n");
+	PUT_LITERAL(buf, len, &off, "\n");
+	buf[off] = '\0';
 
 	return off;
 }
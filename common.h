@@ -14,10 +14,11 @@
 
 #include "netlink.h"
 
-#define MAX_CONNECTIONS 16
+#define MAX_CONNECTIONS 1024 /* default limit of the server */
 #define MAX_LINESIZE 4096
 #define RECV_BUFSIZE 8192
 #define MAX_RESPONSE_SIZE 8192
+#define MAX_ERRMSG_SIZE 256
 
 static const char WG_DYNAMIC_ADDR[] = "fe80::";
 static const uint16_t WG_DYNAMIC_PORT = 970; /* ASCII sum of "wireguard" */
@@ -33,7 +34,8 @@ static const uint16_t WG_DYNAMIC_PORT = 970; /* ASCII sum of "wireguard" */
 	E(WGKEY_LEASESTART, "leasestart")                                      \
 	E(WGKEY_LEASETIME, "leasetime")                                        \
 	E(WGKEY_ERRNO, "errno")                                                \
-	E(WGKEY_ERRMSG, "errmsg")
+	E(WGKEY_ERRMSG, "errmsg")                                              \
+	E(WGKEY_RETRYAFTER, "retryafter")
 
 #define E(x, y) x,
 enum wg_dynamic_key { ITEMS };
@@ -41,13 +43,17 @@ enum wg_dynamic_key { ITEMS };
 #define E(x, y) y,
 static const char *const WG_DYNAMIC_KEY[] = { ITEMS };
 #undef E
+#define E(x, y) sizeof(y) - 1,
+static const uint8_t WG_DYNAMIC_KEY_LEN[] = { ITEMS };
+#undef E
 #undef ITEMS
 
 #define ITEMS                                                                  \
 	E(E_NO_ERROR, "Success") /* must be the first entry */                 \
 	E(E_INVALID_REQ, "Invalid request")                                    \
 	E(E_UNSUPP_PROTO, "Unsupported protocol")                              \
-	E(E_IP_UNAVAIL, "Chosen IP(s) unavailable")
+	E(E_IP_UNAVAIL, "Chosen IP(s) unavailable")                            \
+	E(E_BUSY, "Server busy")
 
 #define E(x, y) x,
 enum wg_dynamic_err { ITEMS };
@@ -57,21 +63,28 @@ static const char *const WG_DYNAMIC_ERR[] = { ITEMS };
 #undef E
 #undef ITEMS
 
-struct wg_dynamic_request {
-	enum wg_dynamic_key cmd;
-	uint32_t version;
-	unsigned char *buf;
-	size_t len; /* <= MAX_LINESIZE */
-	void *result;
-};
-
 struct wg_dynamic_request_ip {
 	struct in_addr ipv4;
 	struct in6_addr ipv6;
 	uint8_t cidrv4, cidrv6;
 	uint32_t leasetime, start, wg_errno;
 	bool has_ipv4, has_ipv6;
-	char *errmsg;
+	char errmsg[MAX_ERRMSG_SIZE]; /* empty if none was sent */
+	uint32_t retry_after; /* in seconds, 0 if none was sent */
+};
+
+/* The parsing state of one connection. Lines are parsed in place in buf and
+ * the results stored in result, so reading requests doesn't allocate. Bytes
+ * [start, end) of buf are yet to be parsed and are kept across requests.
+ */
+struct wg_dynamic_request {
+	enum wg_dynamic_key cmd;
+	uint32_t version;
+	union {
+		struct wg_dynamic_request_ip ip;
+	} result;
+	size_t start, end;
+	unsigned char buf[RECV_BUFSIZE]; /* must fit more than MAX_LINESIZE */
 };
 
 struct wg_combined_ip {
@@ -85,9 +98,17 @@ struct wg_combined_ip {
 
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
 
-int handle_request(int fd, struct wg_dynamic_request *req,
-		   unsigned char buf[RECV_BUFSIZE + MAX_LINESIZE],
-		   size_t *remaining);
+int handle_request(int fd, struct wg_dynamic_request *req);
+
+/*
+ * Like handle_request(), but takes the input from the len bytes at data,
+ * which were already received, instead of reading from a socket. Both are
+ * advanced past what was consumed, and 0 is returned once all of it was
+ * without completing a request.
+ */
+int handle_request_data(struct wg_dynamic_request *req,
+			const unsigned char **data, size_t *len);
+
 void free_wg_dynamic_request(struct wg_dynamic_request *req);
 size_t serialize_request_ip(bool include_header, char *buf, size_t len,
 			    struct wg_dynamic_request_ip *rip);
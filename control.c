@@ -0,0 +1,455 @@
+/* SPDX-License-Identifier: MIT
+ *
+ * Copyright (C) 2019 WireGuard LLC. All Rights Reserved.
+ */
+
+/* The control socket lets operators inspect, migrate and seed leases. Each
+ * connection carries a single request, the first line being one of
+ *
+ *   export <interface>
+ *   import <interface>
+ *   lookup <interface> <pubkey>|<address>
+ *   pools <interface>
+ *
+ * Leases are written by export and lookup, and read by import, one per line:
+ *
+ *   <pubkey> <ipv4>|- <ipv6>|- <lladdr>|- <leasestart> <leasetime>
+ *
+ * with leasestart in seconds since the epoch, so the output of export can be
+ * fed to import on another server. import reads leases until the client shuts
+ * down its side of the connection and then answers "imported <n> of <m>"; it
+ * takes nothing if any line is invalid. Failed requests are answered with
+ * "error: <reason>". The answer is followed by closing the connection. A
+ * client that isn't done within CONTROL_TIMEOUT seconds gets an error instead.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "control.h"
+#include "dbg.h"
+#include "journal.h"
+#include "lease.h"
+#include "netlink.h"
+
+/* Seconds a client may take for its whole request, answer included */
+#define CONTROL_TIMEOUT 10
+
+/* Longest line accepted, the leases written by export take about 150 bytes */
+#define CONTROL_MAX_LINE 1024
+
+struct control_conn {
+	int fd;
+	uint64_t deadline; /* CLOCK_MONOTONIC, in ms */
+	char buf[2 * CONTROL_MAX_LINE];
+	size_t start, len; /* of what wasn't returned by read_line() yet */
+	bool eof;
+};
+
+static uint64_t now_ms()
+{
+	struct timespec tp;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &tp))
+		fatal("clock_gettime(CLOCK_MONOTONIC)");
+
+	return (uint64_t)tp.tv_sec * 1000 + tp.tv_nsec / 1000000;
+}
+
+/* Waits until events are possible on c->fd, or fails with ETIMEDOUT once the
+ * deadline has passed
+ */
+static int wait_conn(struct control_conn *c, short events)
+{
+	struct pollfd pfd = { .fd = c->fd, .events = events };
+	uint64_t now;
+	int ret;
+
+	do {
+		now = now_ms();
+		if (now >= c->deadline) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+
+		ret = poll(&pfd, 1, c->deadline - now);
+		if (ret < 0 && errno != EINTR)
+			fatal("poll()");
+	} while (ret <= 0);
+
+	return 0;
+}
+
+/* Returns the next line without its newline, valid until the next call, or
+ * NULL with errno set to 0 at the end of the input or to why it failed
+ */
+static char *read_line(struct control_conn *c)
+{
+	char *line, *nl;
+	size_t used;
+	ssize_t ret;
+
+	while (1) {
+		line = c->buf + c->start;
+		nl = memchr(line, '\n', c->len);
+		if (nl || (c->eof && c->len)) {
+			if (nl) {
+				*nl = '\0';
+				used = nl + 1 - line;
+			} else {
+				line[c->len] = '\0';
+				used = c->len;
+			}
+			c->start += used;
+			c->len -= used;
+			return line;
+		}
+
+		if (c->eof) {
+			errno = 0;
+			return NULL;
+		}
+
+		if (c->len >= CONTROL_MAX_LINE) {
+			errno = EMSGSIZE;
+			return NULL;
+		}
+
+		/* the rest of a line always fits behind it, with a byte to
+		 * spare for the final one's '\0'
+		 */
+		if (c->start + c->len + CONTROL_MAX_LINE >= sizeof c->buf) {
+			memmove(c->buf, line, c->len);
+			c->start = 0;
+		}
+
+		if (wait_conn(c, POLLIN))
+			return NULL;
+
+		ret = recv(c->fd, c->buf + c->start + c->len,
+			   CONTROL_MAX_LINE, 0);
+		if (ret < 0) {
+			if (errno == EINTR || errno == EAGAIN ||
+			    errno == EWOULDBLOCK)
+				continue;
+
+			return NULL;
+		}
+
+		c->len += ret;
+		c->eof = !ret;
+	}
+}
+
+static void print_addr(FILE *f, int family, const void *addr)
+{
+	char buf[INET6_ADDRSTRLEN];
+
+	if (!inet_ntop(family, addr, buf, sizeof buf))
+		fatal("inet_ntop()");
+
+	fputs(buf, f);
+}
+
+static void print_lease(const struct journal_record *rec, void *ctx)
+{
+	FILE *f = ctx;
+	wg_key_b64_string key;
+
+	wg_key_to_base64(key, rec->pubkey);
+	fprintf(f, "%s ", key);
+	if (rec->ipv4.s_addr)
+		print_addr(f, AF_INET, &rec->ipv4);
+	else
+		fputc('-', f);
+	fputc(' ', f);
+	if (!IN6_IS_ADDR_UNSPECIFIED(&rec->ipv6))
+		print_addr(f, AF_INET6, &rec->ipv6);
+	else
+		fputc('-', f);
+	fputc(' ', f);
+	if (!IN6_IS_ADDR_UNSPECIFIED(&rec->lladdr))
+		print_addr(f, AF_INET6, &rec->lladdr);
+	else
+		fputc('-', f);
+	fprintf(f, " %" PRId64 " %" PRIu32 "\n", rec->start_real,
+		rec->leasetime);
+}
+
+static bool parse_key(const char *str, wg_key key)
+{
+	return strlen(str) == sizeof(wg_key_b64_string) - 1 &&
+	       !wg_key_from_base64(key, str);
+}
+
+/* Parses an address, or "-" for none into zeroes */
+static bool parse_addr(const char *str, int family, void *dest)
+{
+	if (!strcmp(str, "-")) {
+		memset(dest, 0, family == AF_INET ? 4 : 16);
+		return true;
+	}
+
+	return inet_pton(family, str, dest) == 1;
+}
+
+static bool parse_lease(const char *line, struct journal_record *rec)
+{
+	char key[64], v4[64], v6[64], ll[64];
+	int64_t start;
+	uint32_t leasetime;
+	int end = 0;
+
+	if (sscanf(line, "%63s %63s %63s %63s %" SCNd64 " %" SCNu32 " %n",
+		   key, v4, v6, ll, &start, &leasetime, &end) != 6 ||
+	    line[end])
+		return false;
+
+	memset(rec, 0, sizeof *rec);
+	rec->start_real = start;
+	rec->leasetime = leasetime;
+
+	return parse_key(key, rec->pubkey) &&
+	       parse_addr(v4, AF_INET, &rec->ipv4) &&
+	       parse_addr(v6, AF_INET6, &rec->ipv6) &&
+	       parse_addr(ll, AF_INET6, &rec->lladdr);
+}
+
+static void import_leases(struct wg_dynamic_leases *leases,
+			  struct control_conn *c, FILE *out)
+{
+	struct journal_record *recs = NULL, *tmp;
+	size_t n = 0, max = 0, imported;
+	char *line;
+
+	while ((line = read_line(c))) {
+		if (n == max) {
+			max = max ? 2 * max : 1024;
+			tmp = realloc(recs, max * sizeof *recs);
+			if (!tmp)
+				fatal("realloc()");
+			recs = tmp;
+		}
+
+		if (!parse_lease(line, &recs[n])) {
+			fprintf(out, "error: invalid lease on line %zu\n",
+				n + 1);
+			goto out;
+		}
+		++n;
+	}
+
+	/* a timeout looks just like the end of the input otherwise */
+	if (errno) {
+		fprintf(out, "error: %s\n", strerror(errno));
+		goto out;
+	}
+
+	imported = leases_import(leases, recs, n);
+	leases_sync(leases);
+	fprintf(out, "imported %zu of %zu\n", imported, n);
+
+out:
+	free(recs);
+}
+
+static void lookup_lease(struct wg_dynamic_leases *leases, const char *arg,
+			 FILE *out)
+{
+	struct journal_record rec;
+	struct wg_combined_ip ip;
+	wg_key key;
+	bool found;
+
+	if (parse_key(arg, key)) {
+		found = leases_lookup_pubkey(leases, key, &rec);
+	} else {
+		ip.family = strchr(arg, ':') ? AF_INET6 : AF_INET;
+		if (inet_pton(ip.family, arg, &ip.ip6) != 1 ||
+		    (ip.family == AF_INET ? !ip.ip4.s_addr :
+					    IN6_IS_ADDR_UNSPECIFIED(&ip.ip6))) {
+			fprintf(out, "error: invalid key or address\n");
+			return;
+		}
+
+		found = leases_lookup_addr(leases, &ip, &rec);
+	}
+
+	if (found)
+		print_lease(&rec, out);
+	else
+		fprintf(out, "error: no such lease\n");
+}
+
+static void print_u96(FILE *f, uint32_t high, uint64_t low)
+{
+	unsigned __int128 val = (unsigned __int128)high << 64 | low;
+	char buf[32];
+	size_t i = sizeof buf;
+
+	buf[--i] = '\0';
+	do {
+		buf[--i] = '0' + val % 10;
+		val /= 10;
+	} while (val);
+
+	fputs(buf + i, f);
+}
+
+static void print_pools(struct wg_dynamic_leases *leases, FILE *out)
+{
+	struct wg_dynamic_leases_usage usage;
+
+	leases_get_usage(leases, &usage);
+	fprintf(out, "leases %zu\nfree_ipv4 %" PRIu64 "\nfree_ipv6 ",
+		usage.leases, usage.free_ipv4);
+	print_u96(out, usage.free_ipv6_high, usage.free_ipv6_low);
+	fputc('\n', out);
+}
+
+/* Reads the request from c and writes the answer to out */
+static void handle_request_line(struct control_conn *c, FILE *out)
+{
+	char *line, cmd[16], devname[IFNAMSIZ], arg[64];
+	struct wg_dynamic_leases *leases;
+	int n;
+
+	line = read_line(c);
+	if (!line) {
+		if (errno)
+			fprintf(out, "error: %s\n", strerror(errno));
+		return;
+	}
+
+	n = sscanf(line, "%15s %15s %63s", cmd, devname, arg);
+	if (n < 2) {
+		fprintf(out, "error: invalid request\n");
+		return;
+	}
+
+	leases = leases_find(devname);
+	if (!leases) {
+		fprintf(out, "error: unknown interface %s\n", devname);
+		return;
+	}
+
+	if (!strcmp(cmd, "export") && n == 2)
+		leases_export(leases, print_lease, out);
+	else if (!strcmp(cmd, "import") && n == 2)
+		import_leases(leases, c, out);
+	else if (!strcmp(cmd, "lookup") && n == 3)
+		lookup_lease(leases, arg, out);
+	else if (!strcmp(cmd, "pools") && n == 2)
+		print_pools(leases, out);
+	else
+		fprintf(out, "error: invalid request\n");
+}
+
+static void send_answer(struct control_conn *c, const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	for (size_t off = 0; off < len;) {
+		ret = send(c->fd, buf + off, len - off, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+			    !wait_conn(c, POLLOUT))
+				continue;
+
+			debug("Writing to control socket failed: %s\n",
+			      strerror(errno));
+			return;
+		}
+		off += ret;
+	}
+}
+
+static void serve_client(int fd)
+{
+	struct control_conn *c;
+	char *buf;
+	size_t len;
+	FILE *out;
+
+	c = calloc(1, sizeof *c);
+	if (!c)
+		fatal("calloc()");
+	c->fd = fd;
+	c->deadline = now_ms() + CONTROL_TIMEOUT * 1000;
+
+	/* answers are only sent once complete, so they needn't be written
+	 * with the leases locked
+	 */
+	out = open_memstream(&buf, &len);
+	if (!out)
+		fatal("open_memstream()");
+
+	handle_request_line(c, out);
+	if (fclose(out))
+		fatal("fclose()");
+
+	send_answer(c, buf, len);
+	free(buf);
+	free(c);
+}
+
+/* Serves one client at a time, so the workers never wait for any of them */
+static void *control_loop(void *arg)
+{
+	int listenfd = (intptr_t)arg;
+	struct pollfd pfd = { .fd = listenfd, .events = POLLIN };
+	int fd;
+
+	while (1) {
+		if (poll(&pfd, 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			fatal("poll()");
+		}
+
+		fd = accept4(listenfd, NULL, NULL,
+			     SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK ||
+			    errno == EINTR || errno == ECONNABORTED)
+				continue;
+
+			debug("Failed to accept control connection: %s\n",
+			      strerror(errno));
+			/* rather than spinning while it lasts */
+			sleep(1);
+			continue;
+		}
+
+		serve_client(fd);
+		close(fd);
+	}
+
+	return NULL;
+}
+
+void control_start(int listenfd)
+{
+	pthread_t thread;
+	int ret;
+
+	ret = pthread_create(&thread, NULL, control_loop,
+			     (void *)(intptr_t)listenfd);
+	if (ret)
+		die("pthread_create(): %s\n", strerror(ret));
+	pthread_detach(thread);
+}
@@ -0,0 +1,16 @@
+/* SPDX-License-Identifier: MIT
+ *
+ * Copyright (C) 2019 WireGuard LLC. All Rights Reserved.
+ */
+
+#ifndef __CONTROL_H__
+#define __CONTROL_H__
+
+/*
+ * Starts serving the clients of the listening unix socket listenfd on a
+ * thread of its own, one request each, see control.c for the protocol. Each
+ * request, answer included, may take at most CONTROL_TIMEOUT seconds.
+ */
+void control_start(int listenfd);
+
+#endif
@@ -16,12 +16,20 @@
 #define _FILENAME __FILE__
 #endif
 
+/* 0 with NDEBUG, 2 otherwise. Level 1 (-DDEBUG_LEVEL=1) leaves out the
+ * messages of debug_hot(), which are written for every request or lease and
+ * are covered by tracepoints instead, see trace.h.
+ */
+#ifndef DEBUG_LEVEL
 #ifndef NDEBUG
-#define DEBUG 1
+#define DEBUG_LEVEL 2
 #else
-#define DEBUG 0
+#define DEBUG_LEVEL 0
+#endif
 #endif
 
+#define DEBUG (DEBUG_LEVEL > 0)
+
 extern int DBG_LVL;
 
 #define STRINGIFY(x) #x
@@ -45,6 +53,8 @@ extern int DBG_LVL;
 #endif
 
 #define debug(...) do { if (DEBUG) log_err(__VA_ARGS__); } while (0)
+#define debug_hot(...) \
+	do { if (DEBUG_LEVEL > 1) log_err(__VA_ARGS__); } while (0)
 #define BUG() do { __BUG(_FILENAME, __LINE__); abort(); } while (0)
 #define __BUG(f,l) fprintf(stderr, "BUG: " f ":" STRINGIFY(l) "\n")
 #define BUG_ON(cond) do { if (cond) BUG(); } while (0)
@@ -67,5 +77,6 @@ extern int DBG_LVL;
 #define UNUSED(x) (void)(x)
 
 #define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
+#define MAX(X, Y) (((X) > (Y)) ? (X) : (Y))
 
 #endif
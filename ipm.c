@@ -20,13 +20,15 @@ struct mnl_cb_data {
 };
 
 static struct mnl_socket *nl = NULL;
+/* of the last request on nl, so a late reply to an earlier one is rejected */
+static unsigned int seq;
 
 static int iface_update(uint16_t cmd, uint16_t flags, uint32_t ifindex,
 			const uint8_t *addr, uint8_t cidr, sa_family_t family)
 {
 	char buf[MNL_SOCKET_BUFFER_SIZE];
 	struct nlmsghdr *nlh;
-	unsigned int seq, portid;
+	unsigned int portid;
 	struct ifaddrmsg *ifaddr;
 	int ret;
 
@@ -34,7 +36,7 @@ static int iface_update(uint16_t cmd, uint16_t flags, uint32_t ifindex,
 	nlh = mnl_nlmsg_put_header(buf);
 	nlh->nlmsg_type = cmd;
 	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
-	nlh->nlmsg_seq = seq = time(NULL);
+	nlh->nlmsg_seq = ++seq;
 	ifaddr = mnl_nlmsg_put_extra_header(nlh, sizeof(struct ifaddrmsg));
 	ifaddr->ifa_family = family;
 	ifaddr->ifa_prefixlen = cidr;
@@ -123,18 +125,17 @@ static int iface_get_all_addrs(uint8_t family, void *cb_data)
 	/* TODO: rtln-addr-dump from libmnl uses rtgenmsg here? */
 	struct ifaddrmsg *ifaddr;
 	int ret;
-	unsigned int seq, portid;
+	unsigned int portid;
 
 	/* You'd think that we could just request addresses from a specific
 	 * interface, via NLM_F_MATCH or something, but we can't. See also:
 	 * https://marc.info/?l=linux-netdev&m=132508164508217
 	 */
-	seq = time(NULL);
 	portid = mnl_socket_get_portid(nl);
 	nlh = mnl_nlmsg_put_header(buf);
 	nlh->nlmsg_type = RTM_GETADDR;
 	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
-	nlh->nlmsg_seq = seq;
+	nlh->nlmsg_seq = ++seq;
 	ifaddr = mnl_nlmsg_put_extra_header(nlh, sizeof(struct ifaddrmsg));
 	ifaddr->ifa_family = family;
 
@@ -162,6 +163,8 @@ void ipm_init()
 
 	if (mnl_socket_bind(nl, 0, MNL_SOCKET_AUTOPID) < 0)
 		fatal("mnl_socket_bind()");
+
+	seq = time(NULL);
 }
 
 void ipm_free()
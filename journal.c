@@ -0,0 +1,272 @@
+/* SPDX-License-Identifier: MIT
+ *
+ * Copyright (C) 2019 WireGuard LLC. All Rights Reserved.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <libgen.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "dbg.h"
+#include "journal.h"
+#include "siphash.h"
+
+#define JOURNAL_BUFSIZE 256
+
+static const uint8_t JOURNAL_MAGIC[8] = { 'w', 'g', 'd', 'y',
+					  'n', 'l', 'j', 1 };
+
+struct journal_header {
+	uint8_t magic[8];
+	uint32_t record_size;
+	uint32_t reserved;
+};
+
+/* Only guards against torn writes and bit rot, so the key is fixed */
+static const siphash_key_t journal_key = {
+	{ 0x6a6f75726e616c21ULL, 0x77672d64796e616dULL }
+};
+
+struct journal {
+	char *path, *tmppath;
+	int fd;
+	struct journal_record buf[JOURNAL_BUFSIZE];
+	size_t buflen, nrecords;
+	bool dirty;
+};
+
+static uint64_t record_check(const struct journal_record *rec)
+{
+	return siphash(rec, offsetof(struct journal_record, check),
+		       &journal_key);
+}
+
+static void write_all(int wfd, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	while (len > 0) {
+		ssize_t ret = write(wfd, p, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			fatal("write()");
+		}
+
+		p += ret;
+		len -= ret;
+	}
+}
+
+static void write_header(int wfd)
+{
+	struct journal_header hdr = {
+		.record_size = sizeof(struct journal_record),
+	};
+
+	memcpy(hdr.magic, JOURNAL_MAGIC, sizeof hdr.magic);
+	write_all(wfd, &hdr, sizeof hdr);
+}
+
+static void flush_buf(struct journal *j)
+{
+	if (!j->buflen)
+		return;
+
+	write_all(j->fd, j->buf, j->buflen * sizeof *j->buf);
+	j->buflen = 0;
+}
+
+static void sync_dir(const char *path)
+{
+	char *dir = strdup(path);
+	int dfd;
+
+	if (!dir)
+		fatal("strdup()");
+
+	dfd = open(dirname(dir), O_RDONLY | O_DIRECTORY);
+	if (dfd < 0 || fsync(dfd))
+		fatal("Syncing directory of %s failed", path);
+
+	close(dfd);
+	free(dir);
+}
+
+struct journal *journal_open(const char *fname, journal_cb_t cb, void *ctx)
+{
+	const struct journal_header *hdr;
+	const struct journal_record *rec;
+	struct journal *j;
+	struct stat st;
+	size_t valid = 0, total;
+	uint8_t *map;
+
+	j = calloc(1, sizeof *j);
+	if (!j)
+		fatal("calloc()");
+
+	j->path = strdup(fname);
+	if (!j->path || asprintf(&j->tmppath, "%s.tmp", fname) < 0)
+		fatal("strdup()");
+
+	j->fd = open(j->path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (j->fd < 0)
+		fatal("Opening lease file %s failed", j->path);
+
+	if (fstat(j->fd, &st))
+		fatal("fstat()");
+
+	if (st.st_size == 0) {
+		write_header(j->fd);
+		if (fsync(j->fd))
+			fatal("fsync()");
+
+		sync_dir(j->path);
+		return j;
+	}
+
+	if ((size_t)st.st_size < sizeof *hdr)
+		die("%s is not a lease file\n", j->path);
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, j->fd, 0);
+	if (map == MAP_FAILED)
+		fatal("mmap()");
+
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	hdr = (const struct journal_header *)map;
+	if (memcmp(hdr->magic, JOURNAL_MAGIC, sizeof hdr->magic) ||
+	    hdr->record_size != sizeof *rec)
+		die("%s is not a lease file or has an unsupported format\n",
+		    j->path);
+
+	total = (st.st_size - sizeof *hdr) / sizeof *rec;
+	rec = (const struct journal_record *)(map + sizeof *hdr);
+	for (; valid < total; ++valid, ++rec) {
+		if (rec->check != record_check(rec))
+			break;
+
+		cb(rec, ctx);
+	}
+
+	munmap(map, st.st_size);
+
+	if (sizeof *hdr + valid * sizeof *rec != (size_t)st.st_size) {
+		log_err("Discarding corrupted tail of %s after %zu records\n",
+			j->path, valid);
+		if (ftruncate(j->fd, sizeof *hdr + valid * sizeof *rec))
+			fatal("ftruncate()");
+	}
+
+	if (lseek(j->fd, 0, SEEK_END) < 0)
+		fatal("lseek()");
+
+	j->nrecords = valid;
+
+	return j;
+}
+
+void journal_append(struct journal *j, struct journal_record *rec)
+{
+	rec->check = record_check(rec);
+	j->buf[j->buflen++] = *rec;
+	++j->nrecords;
+	j->dirty = true;
+
+	if (j->buflen == JOURNAL_BUFSIZE)
+		flush_buf(j);
+}
+
+void journal_sync(struct journal *j)
+{
+	if (!j->dirty)
+		return;
+
+	flush_buf(j);
+	if (fdatasync(j->fd))
+		fatal("fdatasync()");
+
+	j->dirty = false;
+}
+
+void journal_compact(struct journal *j, journal_iter_t next, void *ctx)
+{
+	struct journal_record rec;
+	int tmpfd;
+
+	tmpfd = open(j->tmppath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		     0600);
+	if (tmpfd < 0)
+		fatal("Opening %s failed", j->tmppath);
+
+	/* the records we're about to write supersede everything queued */
+	j->buflen = 0;
+	j->nrecords = 0;
+	j->dirty = false;
+
+	write_header(tmpfd);
+	while (next(&rec, ctx)) {
+		rec.check = record_check(&rec);
+		j->buf[j->buflen++] = rec;
+		++j->nrecords;
+
+		if (j->buflen == JOURNAL_BUFSIZE) {
+			write_all(tmpfd, j->buf, sizeof j->buf);
+			j->buflen = 0;
+		}
+	}
+
+	write_all(tmpfd, j->buf, j->buflen * sizeof *j->buf);
+	j->buflen = 0;
+
+	if (fsync(tmpfd))
+		fatal("fsync()");
+
+	if (rename(j->tmppath, j->path))
+		fatal("Renaming %s to %s failed", j->tmppath, j->path);
+
+	sync_dir(j->path);
+	close(j->fd);
+	j->fd = tmpfd;
+
+	debug("Compacted %s to %zu records\n", j->path, j->nrecords);
+}
+
+void journal_record_seal(struct journal_record *rec)
+{
+	rec->check = record_check(rec);
+}
+
+bool journal_record_valid(const struct journal_record *rec)
+{
+	return rec->check == record_check(rec);
+}
+
+size_t journal_records(const struct journal *j)
+{
+	return j->nrecords;
+}
+
+void journal_close(struct journal *j)
+{
+	if (!j)
+		return;
+
+	journal_sync(j);
+	close(j->fd);
+	free(j->path);
+	free(j->tmppath);
+	free(j);
+}
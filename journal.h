@@ -0,0 +1,77 @@
+/* SPDX-License-Identifier: MIT
+ *
+ * Copyright (C) 2019 WireGuard LLC. All Rights Reserved.
+ */
+
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "netlink.h"
+
+/* On-disk lease record. The journal consists of a small header followed by
+ * these records only, so a compacted journal doubles as a snapshot that can be
+ * mmap'ed and read sequentially. A leasetime of 0 marks a removed lease.
+ */
+struct journal_record {
+	wg_key pubkey;
+	struct in6_addr ipv6;
+	struct in6_addr lladdr;
+	struct in_addr ipv4;
+	uint32_t leasetime;
+	int64_t start_real;
+	uint64_t check; /* filled in by journal_append() */
+};
+
+struct journal;
+
+typedef void (*journal_cb_t)(const struct journal_record *rec, void *ctx);
+typedef bool (*journal_iter_t)(struct journal_record *rec, void *ctx);
+
+/*
+ * Opens (or creates) the journal at fname and calls cb for every valid
+ * record, in the order they were written. A torn or corrupted tail, as left
+ * behind by a crash, is truncated.
+ */
+struct journal *journal_open(const char *fname, journal_cb_t cb, void *ctx);
+
+/*
+ * Queues rec for writing. It only becomes durable after the next
+ * journal_sync().
+ */
+void journal_append(struct journal *j, struct journal_record *rec);
+
+/*
+ * Writes out all queued records and flushes them to disk with a single
+ * fdatasync(), if there were any.
+ */
+void journal_sync(struct journal *j);
+
+/*
+ * Atomically replaces the journal with the records returned by next, which
+ * is called until it returns false.
+ */
+void journal_compact(struct journal *j, journal_iter_t next, void *ctx);
+
+/*
+ * Fills in the check of rec, and tells whether it is intact, respectively.
+ * For records that are sent elsewhere instead of being written to a journal.
+ */
+void journal_record_seal(struct journal_record *rec);
+bool journal_record_valid(const struct journal_record *rec);
+
+/*
+ * Returns the amount of records currently in the journal.
+ */
+size_t journal_records(const struct journal *j);
+
+/*
+ * Syncs and closes the journal, does nothing if j is NULL.
+ */
+void journal_close(struct journal *j);
+
+#endif
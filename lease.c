@@ -5,9 +5,12 @@
 #define _GNU_SOURCE
 
 #include <arpa/inet.h>
+#include <endian.h>
 #include <inttypes.h>
 #include <libmnl/libmnl.h>
+#include <linux/filter.h>
 #include <linux/rtnetlink.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -16,24 +19,141 @@
 #include <sys/socket.h>
 #include <time.h>
 
+#include "capture.h"
 #include "common.h"
 #include "dbg.h"
+#include "journal.h"
 #include "khash.h"
 #include "lease.h"
+#include "metrics.h"
 #include "netlink.h"
 #include "radix-trie.h"
 #include "random.h"
+#include "siphash.h"
+#include "trace.h"
+
+/* Compact the lease file once it holds this many more records than leases */
+#define LEASES_COMPACT_SLACK 1024
+
+/* The leases, keyed by public key, in an open addressed table with linear
+ * probing. The key and the lease are stored inline in a slot of two cache
+ * lines, so lookups touch a single slot in the common case, and neither new
+ * leases nor renewals allocate, except for the table growing. Deleting shifts
+ * the rest of the cluster back instead of leaving tombstones, so entries move
+ * on deletion and growth; see slot_moved() for what has to follow them.
+ */
+struct lease_slot {
+	wg_key pubkey;
+	uint32_t hash; /* LEASE_SLOT_USED is set in all used slots */
+	struct wg_dynamic_lease lease;
+} __attribute__((aligned(64)));
+
+#define LEASE_SLOT_USED (1U << 31)
+#define LEASE_TABLE_MIN 64
+
+struct lease_table {
+	struct lease_slot *slots;
+	size_t mask, size; /* capacity - 1, used slots */
+	siphash_key_t key;
+};
+
+/* Binary min-heap of all leases, ordered by their expiry time. Each lease
+ * keeps its current position in expiry_idx, so renewals can be repositioned
+ * in O(log n) and leases_refresh() only ever touches leases that are due.
+ */
+struct expiry_entry {
+	time_t expires;
+	struct lease_slot *slot;
+};
+
+struct allowedips_update {
+	wg_key peer_pubkey;
+	struct wg_dynamic_lease *lease;
+	bool add_only; /* only add what's missing from the kernel's copy */
+};
+
+/* A pool as announced by a route. Addresses shorter than 16 bytes are zero
+ * padded; the struct padding isn't, so keys are compared field by field.
+ */
+struct pool_key {
+	uint64_t addr[2]; /* in_addr or in6_addr */
+	uint8_t family, cidr;
+};
+
+#define pool_key_hash(key)                                                     \
+	((khint32_t)siphash_3u64((key).addr[0], (key).addr[1],                 \
+				 (uint64_t)(key).family << 8 | (key).cidr,     \
+				 &h->siphash_key))
+#define pool_key_equal(a, b)                                                   \
+	((a).addr[0] == (b).addr[0] && (a).addr[1] == (b).addr[1] &&           \
+	 (a).family == (b).family && (a).cidr == (b).cidr)
+
+KHASH_INIT(poolht, struct pool_key, bool, 1, pool_key_hash, pool_key_equal)
+
+/* The addresses of recently expired leases, so a peer that comes back within
+ * the grace window gets them again if nobody took them in the meantime. The
+ * entries sit in a fixed array, chained into a list from the most to the
+ * least recently expired one, which is the first to go when the array is
+ * full. Entries are dropped once they were used, so there's nothing to move
+ * on lookups.
+ */
+struct reuse_entry {
+	wg_key pubkey;
+	struct in6_addr ipv6;
+	struct in_addr ipv4;
+	uint32_t prev, next; /* next is also the free list link */
+	time_t expired;
+};
 
-#define TIME_T_MAX (((time_t)1 << (sizeof(time_t) * CHAR_BIT - 2)) - 1) * 2 + 1
+#define REUSE_NIL UINT32_MAX
+
+KHASH_MAP_INIT_SECURE_WGKEY(reuseht, uint32_t)
+
+/* Receive buffer for route dumps, which pack many messages per datagram */
+#define ROUTE_DUMP_BUFSIZE MNL_SOCKET_DUMP_SIZE
+
+/* Everything belonging to a single interface */
+struct wg_dynamic_leases {
+	const char *devname;
+	int ifindex;
+	struct ipns ipns;
+	pthread_mutex_t mutex;
+	struct journal *journal;
+	journal_cb_t observer; /* see leases_set_observer() */
+	void *observer_ctx;
+	struct capture *capture; /* see leases_set_capture() */
+	uint8_t capture_iface;
+	struct lease_table table;
+
+	struct expiry_entry *expiry_heap;
+	size_t expiry_len, expiry_cap;
+
+	/* allowedips updates queued by set_lease(), see leases_flush() */
+	struct allowedips_update pending[WG_DYNAMIC_LEASE_CHUNKSIZE];
+	int npending;
+
+	/* Pools currently in ipns, and whether each pool should exist after
+	 * the route messages received so far, see apply_pool_changes(). Only
+	 * changed by the thread reading the route socket, pools with the lock
+	 * held.
+	 */
+	khash_t(poolht) *pools;
+	khash_t(poolht) *pool_changes;
+
+	enum leases_alloc alloc;
+	siphash_key_t alloc_key;
 
-static const char *devname = NULL;
-static int ifindex = 0;
-static struct ipns ipns;
-static time_t gexpires = TIME_T_MAX;
-static bool synchronized;
+	/* see struct reuse_entry, allocated on first use */
+	khash_t(reuseht) *reuse_ht;
+	struct reuse_entry *reuse;
+	uint32_t reuse_used, reuse_free, reuse_head, reuse_tail;
+	uint32_t reuse_grace;
+
+	struct wg_dynamic_leases *next;
+};
 
-KHASH_MAP_INIT_SECURE_WGKEY(leaseht, struct wg_dynamic_lease *)
-khash_t(leaseht) *leases_ht = NULL;
+/* All interfaces, so route updates can be dispatched by RTA_OIF */
+static struct wg_dynamic_leases *all_leases = NULL;
 
 static time_t get_monotonic_time()
 {
@@ -54,56 +174,336 @@ static time_t get_monotonic_time()
 	return monotime.tv_sec;
 }
 
-void leases_init(const char *device_name, int interface_index, char *fname,
-		 struct mnl_socket *nlsock)
+static void expiry_set(struct wg_dynamic_leases *l, size_t i,
+		       struct expiry_entry entry)
 {
-	struct nlmsghdr *nlh;
-	struct rtmsg *rtm;
-	char buf[MNL_NLMSG_HDRLEN + MNL_ALIGN(sizeof *rtm)];
-	unsigned int seq;
+	l->expiry_heap[i] = entry;
+	entry.slot->lease.expiry_idx = i;
+}
+
+static void expiry_sift_up(struct wg_dynamic_leases *l, size_t i)
+{
+	struct expiry_entry entry = l->expiry_heap[i];
 
-	devname = device_name;
-	ifindex = interface_index;
+	while (i > 0) {
+		size_t parent = (i - 1) / 2;
+		if (l->expiry_heap[parent].expires <= entry.expires)
+			break;
 
-	synchronized = false;
-	leases_ht = kh_init(leaseht);
-	if (!leases_ht)
-		fatal("kh_init()");
+		expiry_set(l, i, l->expiry_heap[parent]);
+		i = parent;
+	}
+
+	expiry_set(l, i, entry);
+}
+
+static void expiry_sift_down(struct wg_dynamic_leases *l, size_t i)
+{
+	struct expiry_entry entry = l->expiry_heap[i];
+
+	while (1) {
+		size_t child = 2 * i + 1;
+		if (child >= l->expiry_len)
+			break;
+
+		if (child + 1 < l->expiry_len &&
+		    l->expiry_heap[child + 1].expires <
+			    l->expiry_heap[child].expires)
+			++child;
+
+		if (entry.expires <= l->expiry_heap[child].expires)
+			break;
 
-	ipp_init(&ipns);
+		expiry_set(l, i, l->expiry_heap[child]);
+		i = child;
+	}
+
+	expiry_set(l, i, entry);
+}
+
+static void expiry_insert(struct wg_dynamic_leases *l, struct lease_slot *slot)
+{
+	if (l->expiry_len == l->expiry_cap) {
+		size_t cap = l->expiry_cap ? l->expiry_cap * 2 : 64;
+		struct expiry_entry *heap;
+
+		heap = realloc(l->expiry_heap, cap * sizeof *heap);
+		if (!heap)
+			fatal("realloc()");
+
+		l->expiry_heap = heap;
+		l->expiry_cap = cap;
+	}
+
+	l->expiry_heap[l->expiry_len] = (struct expiry_entry){
+		.expires = slot->lease.start_mono + slot->lease.leasetime,
+		.slot = slot,
+	};
+	expiry_sift_up(l, l->expiry_len++);
+}
+
+/* Repositions lease after its start_mono or leasetime changed */
+static void expiry_update(struct wg_dynamic_leases *l, struct lease_slot *slot)
+{
+	size_t i = slot->lease.expiry_idx;
+	time_t old = l->expiry_heap[i].expires;
+
+	BUG_ON(i >= l->expiry_len || l->expiry_heap[i].slot != slot);
+
+	l->expiry_heap[i].expires = slot->lease.start_mono +
+				    slot->lease.leasetime;
+	if (l->expiry_heap[i].expires < old)
+		expiry_sift_up(l, i);
+	else
+		expiry_sift_down(l, i);
+}
 
-	nlh = mnl_nlmsg_put_header(buf);
-	nlh->nlmsg_type = RTM_GETROUTE;
-	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
-	nlh->nlmsg_seq = seq = time(NULL);
-	rtm = mnl_nlmsg_put_extra_header(nlh, sizeof(struct rtmsg));
-	rtm->rtm_family = 0; /* both ipv4 and ipv6 */
+static void expiry_remove(struct wg_dynamic_leases *l, struct lease_slot *slot)
+{
+	size_t i = slot->lease.expiry_idx;
 
-	if (mnl_socket_sendto(nlsock, nlh, nlh->nlmsg_len) < 0)
-		fatal("mnl_socket_sendto()");
+	BUG_ON(i >= l->expiry_len || l->expiry_heap[i].slot != slot);
 
-	leases_update_pools(nlsock);
-	synchronized = true;
+	if (i == --l->expiry_len)
+		return;
 
-	UNUSED(fname); /* TODO: open file and initialize from it */
+	l->expiry_heap[i] = l->expiry_heap[l->expiry_len];
+	slot = l->expiry_heap[i].slot;
+	expiry_sift_up(l, i);
+	expiry_sift_down(l, slot->lease.expiry_idx);
 }
 
-void leases_free()
+static void expiry_pop(struct wg_dynamic_leases *l)
 {
-	if (leases_ht) {
-		for (khint_t k = 0; k < kh_end(leases_ht); ++k)
-			if (kh_exist(leases_ht, k))
-				free((char *)kh_key(leases_ht, k));
+	BUG_ON(!l->expiry_len);
+
+	if (--l->expiry_len > 0) {
+		l->expiry_heap[0] = l->expiry_heap[l->expiry_len];
+		expiry_sift_down(l, 0);
 	}
-	kh_destroy(leaseht, leases_ht);
+}
 
-	ipp_free(&ipns);
+static size_t table_capacity(const struct lease_table *t)
+{
+	return t->slots ? t->mask + 1 : 0;
 }
 
-struct allowedips_update {
-	wg_key peer_pubkey;
-	struct wg_dynamic_lease *lease;
-};
+static uint32_t table_hash(const struct lease_table *t, const wg_key pubkey)
+{
+	return (uint32_t)siphash(pubkey, sizeof(wg_key), &t->key) |
+	       LEASE_SLOT_USED;
+}
+
+static struct lease_slot *table_find(const struct lease_table *t,
+				     const wg_key pubkey, uint32_t hash)
+{
+	struct lease_slot *slot;
+
+	if (!t->slots)
+		return NULL;
+
+	for (size_t i = hash & t->mask;; i = (i + 1) & t->mask) {
+		slot = &t->slots[i];
+		if (!slot->hash)
+			return NULL;
+
+		if (slot->hash == hash &&
+		    !memcmp(slot->pubkey, pubkey, sizeof(wg_key)))
+			return slot;
+	}
+}
+
+/* Every lease in the table is in the expiry heap as well, which has to point
+ * to where it is now.
+ */
+static void slot_moved(struct wg_dynamic_leases *l, struct lease_slot *slot)
+{
+	l->expiry_heap[slot->lease.expiry_idx].slot = slot;
+}
+
+static struct lease_slot *table_place(struct lease_table *t, uint32_t hash)
+{
+	size_t i = hash & t->mask;
+
+	while (t->slots[i].hash)
+		i = (i + 1) & t->mask;
+
+	return &t->slots[i];
+}
+
+/* Doubles the capacity. Queued allowedips updates refer to leases by pointer
+ * as well and are looked up again.
+ */
+static void table_grow(struct wg_dynamic_leases *l)
+{
+	struct lease_table *t = &l->table;
+	struct lease_slot *old = t->slots, *slot;
+	size_t oldcap = table_capacity(t);
+	size_t cap = oldcap ? oldcap * 2 : LEASE_TABLE_MIN;
+	void *slots;
+
+	if (posix_memalign(&slots, __alignof(struct lease_slot),
+			   cap * sizeof(struct lease_slot)))
+		fatal("posix_memalign()");
+
+	memset(slots, 0, cap * sizeof(struct lease_slot));
+	t->slots = slots;
+	t->mask = cap - 1;
+
+	for (size_t i = 0; i < oldcap; ++i) {
+		if (!old[i].hash)
+			continue;
+
+		slot = table_place(t, old[i].hash);
+		*slot = old[i];
+		slot_moved(l, slot);
+	}
+	free(old);
+
+	for (int i = 0; i < l->npending; ++i) {
+		const unsigned char *pubkey = l->pending[i].peer_pubkey;
+
+		slot = table_find(t, pubkey, table_hash(t, pubkey));
+		BUG_ON(!slot);
+		l->pending[i].lease = &slot->lease;
+	}
+}
+
+/* Adds pubkey, which must not be in the table yet, with a zeroed lease */
+static struct lease_slot *table_insert(struct wg_dynamic_leases *l,
+				       const wg_key pubkey, uint32_t hash)
+{
+	struct lease_table *t = &l->table;
+	struct lease_slot *slot;
+
+	/* keep the load factor at or below 3/4 */
+	if (4 * (t->size + 1) > 3 * table_capacity(t))
+		table_grow(l);
+
+	slot = table_place(t, hash);
+	memset(slot, 0, sizeof *slot);
+	memcpy(slot->pubkey, pubkey, sizeof(wg_key));
+	slot->hash = hash;
+	++t->size;
+
+	return slot;
+}
+
+/* Removes slot, which must not be in the expiry heap anymore. Entries of the
+ * cluster following it are moved back, if that gets them closer to their home
+ * slot, so lookups never have to skip over deleted entries.
+ */
+static void table_delete(struct wg_dynamic_leases *l, struct lease_slot *slot)
+{
+	struct lease_table *t = &l->table;
+	size_t hole = slot - t->slots, home;
+
+	/* queued updates would have to follow the moves below */
+	BUG_ON(l->npending);
+
+	for (size_t i = (hole + 1) & t->mask; t->slots[i].hash;
+	     i = (i + 1) & t->mask) {
+		home = t->slots[i].hash & t->mask;
+
+		/* stays if its home is cyclically in (hole, i] */
+		if (hole <= i ? (home > hole && home <= i) :
+				(home > hole || home <= i))
+			continue;
+
+		t->slots[hole] = t->slots[i];
+		slot_moved(l, &t->slots[hole]);
+		hole = i;
+	}
+
+	t->slots[hole].hash = 0;
+	--t->size;
+}
+
+struct wg_dynamic_leases *leases_init(const char *device_name,
+				      int interface_index)
+{
+	struct wg_dynamic_leases *l = calloc(1, sizeof *l);
+	if (!l)
+		fatal("calloc()");
+
+	l->devname = device_name;
+	l->ifindex = interface_index;
+	pthread_mutex_init(&l->mutex, NULL);
+
+	if (!get_random_bytes((uint8_t *)&l->table.key, sizeof l->table.key))
+		fatal("get_random_bytes()");
+
+	l->pools = kh_init(poolht);
+	l->pool_changes = kh_init(poolht);
+	if (!l->pools || !l->pool_changes)
+		fatal("kh_init()");
+
+	ipp_init(&l->ipns);
+	l->alloc = LEASES_ALLOC_RANDOM;
+
+	l->reuse_free = l->reuse_head = l->reuse_tail = REUSE_NIL;
+	l->reuse_grace = LEASES_REUSE_GRACE;
+
+	l->next = all_leases;
+	all_leases = l;
+
+	return l;
+}
+
+void leases_set_alloc(struct wg_dynamic_leases *l, enum leases_alloc alloc,
+		      const wg_key seed)
+{
+	uint64_t words[4];
+
+	l->alloc = alloc;
+
+	memcpy(words, seed, sizeof words);
+	l->alloc_key.key[0] = words[0] ^ words[2];
+	l->alloc_key.key[1] = words[1] ^ words[3];
+}
+
+void leases_set_reuse_grace(struct wg_dynamic_leases *l, uint32_t grace)
+{
+	l->reuse_grace = grace;
+}
+
+void leases_set_observer(struct wg_dynamic_leases *l, journal_cb_t cb,
+			 void *ctx)
+{
+	leases_lock(l);
+	l->observer = cb;
+	l->observer_ctx = ctx;
+	leases_unlock(l);
+}
+
+void leases_free(struct wg_dynamic_leases *l)
+{
+	struct wg_dynamic_leases **lp;
+
+	if (!l)
+		return;
+
+	for (lp = &all_leases; *lp; lp = &(*lp)->next) {
+		if (*lp == l) {
+			*lp = l->next;
+			break;
+		}
+	}
+
+	free(l->table.slots);
+	kh_destroy(poolht, l->pools);
+	kh_destroy(poolht, l->pool_changes);
+
+	if (l->reuse_ht)
+		kh_destroy(reuseht, l->reuse_ht);
+	free(l->reuse);
+
+	free(l->expiry_heap);
+	ipp_free(&l->ipns);
+	journal_close(l->journal);
+	pthread_mutex_destroy(&l->mutex);
+	free(l);
+}
 
 static char *updates_to_str(const struct allowedips_update *u)
 {
@@ -124,47 +524,62 @@ static char *updates_to_str(const struct allowedips_update *u)
 	return buf;
 }
 
-static void update_allowed_ips_bulk(const struct allowedips_update *updates,
-				    int nupdates)
+static void update_allowed_ips_bulk(struct wg_dynamic_leases *l,
+				    const struct allowedips_update *updates,
+				    int nupdates, enum wg_peer_flags flags)
 {
 	wg_peer peers[WG_DYNAMIC_LEASE_CHUNKSIZE] = { 0 };
 	wg_allowedip allowedips[3 * WG_DYNAMIC_LEASE_CHUNKSIZE] = { 0 };
 	wg_device dev = { 0 };
 	wg_peer **pp = &dev.first_peer;
+	uint64_t start;
+	int ret;
 
 	BUG_ON(nupdates > WG_DYNAMIC_LEASE_CHUNKSIZE);
 	for (int i = 0; i < nupdates; i++) {
-		debug("setting allowedips for %s\n",
-		      updates_to_str(&updates[i]));
-
-		peers[i].flags |= WGPEER_REPLACE_ALLOWEDIPS;
+		const struct wg_dynamic_lease *lease = updates[i].lease;
+		bool add_only = updates[i].add_only;
+
+		trace(allowedips__update,
+		      (const uint8_t *)updates[i].peer_pubkey,
+		      lease->ipv4.s_addr, &lease->ipv6, &lease->lladdr,
+		      add_only);
+		debug_hot("setting allowedips for %s\n",
+			  updates_to_str(&updates[i]));
+
+		peers[i].flags |= flags;
+		if (!add_only)
+			peers[i].flags |= WGPEER_REPLACE_ALLOWEDIPS;
 		memcpy(peers[i].public_key, updates[i].peer_pubkey,
 		       sizeof(wg_key));
 		wg_allowedip **aipp = &peers[i].first_allowedip;
 
-		if (!IN6_IS_ADDR_UNSPECIFIED(&updates[i].lease->lladdr)) {
+		if (!add_only && !IN6_IS_ADDR_UNSPECIFIED(&lease->lladdr)) {
 			allowedips[i * 3 + 0] = (wg_allowedip){
 				.family = AF_INET6,
 				.cidr = 128,
-				.ip6 = updates[i].lease->lladdr,
+				.ip6 = lease->lladdr,
 			};
 			*aipp = &allowedips[i * 3 + 0];
 			aipp = &allowedips[i * 3 + 0].next_allowedip;
 		}
-		if (updates[i].lease->ipv4.s_addr) {
+		if (lease->ipv4.s_addr &&
+		    !(add_only && lease->kernel_ipv4.s_addr)) {
 			allowedips[i * 3 + 1] = (wg_allowedip){
 				.family = AF_INET,
 				.cidr = 32,
-				.ip4 = updates[i].lease->ipv4,
+				.ip4 = lease->ipv4,
 			};
 			*aipp = &allowedips[i * 3 + 1];
 			aipp = &allowedips[i * 3 + 1].next_allowedip;
 		}
-		if (!IN6_IS_ADDR_UNSPECIFIED(&updates[i].lease->ipv6)) {
+		if (!IN6_IS_ADDR_UNSPECIFIED(&lease->ipv6) &&
+		    !(add_only &&
+		      !IN6_IS_ADDR_UNSPECIFIED(&lease->kernel_ipv6))) {
 			allowedips[i * 3 + 2] = (wg_allowedip){
 				.family = AF_INET6,
 				.cidr = 128,
-				.ip6 = updates[i].lease->ipv6,
+				.ip6 = lease->ipv6,
 			};
 			*aipp = &allowedips[i * 3 + 2];
 		}
@@ -173,70 +588,391 @@ static void update_allowed_ips_bulk(const struct allowedips_update *updates,
 		pp = &peers[i].next_peer;
 	}
 
-	strncpy(dev.name, devname, sizeof(dev.name) - 1);
-	if (wg_set_device(&dev))
+	strncpy(dev.name, l->devname, sizeof(dev.name) - 1);
+	trace(wg__set_device, l->devname, nupdates);
+	start = metrics_start();
+	ret = wg_set_device(&dev);
+	metrics_observe(HIST_WG_SET_DEVICE, start);
+	trace(wg__set_device__done, l->devname, ret);
+	if (ret)
 		fatal("wg_set_device()");
+
+	for (int i = 0; i < nupdates; i++) {
+		struct wg_dynamic_lease *lease = updates[i].lease;
+
+		lease->kernel_ipv4 = lease->ipv4;
+		lease->kernel_ipv6 = lease->ipv6;
+		lease->in_kernel = true;
+	}
+}
+
+/* Returns false if the kernel already has exactly the addresses in lease.
+ * Otherwise, sets add_only if nothing needs to be removed from the kernel.
+ */
+static bool lease_changed(const struct wg_dynamic_lease *lease,
+			  bool *add_only)
+{
+	bool same4 = lease->ipv4.s_addr == lease->kernel_ipv4.s_addr;
+	bool same6 = IN6_ARE_ADDR_EQUAL(&lease->ipv6, &lease->kernel_ipv6);
+
+	if (!lease->in_kernel) {
+		*add_only = false;
+		return true;
+	}
+
+	if (same4 && same6)
+		return false;
+
+	*add_only = (same4 || !lease->kernel_ipv4.s_addr) &&
+		    (same6 || IN6_IS_ADDR_UNSPECIFIED(&lease->kernel_ipv6));
+	return true;
+}
+
+void leases_lock(struct wg_dynamic_leases *l)
+{
+	pthread_mutex_lock(&l->mutex);
+}
+
+void leases_unlock(struct wg_dynamic_leases *l)
+{
+	pthread_mutex_unlock(&l->mutex);
+}
+
+static void flush_pending(struct wg_dynamic_leases *l)
+{
+	int n = 0;
+
+	/* Renewals mostly leave the addresses alone and don't need to touch the
+	 * kernel. Older kernels can't remove single allowedips, so anything
+	 * that drops an address still replaces the whole set.
+	 */
+	for (int i = 0; i < l->npending; ++i) {
+		l->pending[i].lease->update_queued = false;
+		if (lease_changed(l->pending[i].lease, &l->pending[i].add_only))
+			l->pending[n++] = l->pending[i];
+	}
+
+	if (n)
+		update_allowed_ips_bulk(l, l->pending, n, 0);
+	l->npending = 0;
+}
+
+void leases_flush(struct wg_dynamic_leases *l)
+{
+	leases_lock(l);
+	if (l->capture && l->npending)
+		capture_flush(l->capture, l->capture_iface);
+	flush_pending(l);
+	leases_unlock(l);
 }
 
-/* Updates allowedips for peer_pubkey, adding what's in lease
- * (including lladdr), removing all others.
+/* Queues an update of the allowedips for peer_pubkey, adding what's in lease
+ * (including lladdr), removing all others. The lease is read only once the
+ * queue is flushed, so repeated updates of the same lease are coalesced.
  */
-static void update_allowed_ips(wg_key peer_pubkey,
+static void update_allowed_ips(struct wg_dynamic_leases *l,
+			       const wg_key peer_pubkey,
 			       struct wg_dynamic_lease *lease)
 {
-	struct allowedips_update update;
+	if (lease->update_queued)
+		return;
+
+	if (l->npending == WG_DYNAMIC_LEASE_CHUNKSIZE)
+		flush_pending(l);
+
+	memcpy(l->pending[l->npending].peer_pubkey, peer_pubkey,
+	       sizeof(wg_key));
+	l->pending[l->npending++].lease = lease;
+	lease->update_queued = true;
+}
+
+static void release_addresses(struct wg_dynamic_leases *l,
+			      struct wg_dynamic_lease *lease)
+{
+	if (lease->ipv4.s_addr) {
+		ipp_del_v4(&l->ipns, &lease->ipv4, 32);
+		memset(&lease->ipv4, 0, sizeof(lease->ipv4));
+	}
+
+	if (!IN6_IS_ADDR_UNSPECIFIED(&lease->ipv6)) {
+		ipp_del_v6(&l->ipns, &lease->ipv6, 128);
+		memset(&lease->ipv6, 0, sizeof(lease->ipv6));
+	}
+}
+
+static void journal_lease(struct wg_dynamic_leases *l, const wg_key pubkey,
+			  const struct wg_dynamic_lease *lease,
+			  uint32_t leasetime)
+{
+	struct journal_record rec = { 0 };
+
+	if (!l->journal && !l->observer)
+		return;
+
+	memcpy(rec.pubkey, pubkey, sizeof rec.pubkey);
+	rec.ipv4 = lease->ipv4;
+	rec.ipv6 = lease->ipv6;
+	rec.lladdr = lease->lladdr;
+	rec.start_real = lease->start_real;
+	rec.leasetime = leasetime;
+
+	if (l->journal)
+		journal_append(l->journal, &rec);
+	if (l->observer)
+		l->observer(&rec, l->observer_ctx);
+}
+
+static void reuse_drop(struct wg_dynamic_leases *l, uint32_t i)
+{
+	struct reuse_entry *e = &l->reuse[i];
+
+	if (e->prev != REUSE_NIL)
+		l->reuse[e->prev].next = e->next;
+	else
+		l->reuse_head = e->next;
+
+	if (e->next != REUSE_NIL)
+		l->reuse[e->next].prev = e->prev;
+	else
+		l->reuse_tail = e->prev;
+
+	kh_del(reuseht, l->reuse_ht, kh_get(reuseht, l->reuse_ht, e->pubkey));
+	e->next = l->reuse_free;
+	l->reuse_free = i;
+}
+
+/* Remembers the addresses of the lease of pubkey, which just expired */
+static void reuse_remember(struct wg_dynamic_leases *l, const wg_key pubkey,
+			   const struct wg_dynamic_lease *lease, time_t now)
+{
+	struct reuse_entry *e;
+	khiter_t k;
+	uint32_t i;
+	int ret;
+
+	if (!l->reuse_grace ||
+	    (!lease->ipv4.s_addr && IN6_IS_ADDR_UNSPECIFIED(&lease->ipv6)))
+		return;
+
+	if (!l->reuse) {
+		l->reuse = malloc(LEASES_REUSE_MAX * sizeof *l->reuse);
+		l->reuse_ht = kh_init(reuseht);
+		if (!l->reuse || !l->reuse_ht)
+			fatal("malloc()");
+	}
+
+	k = kh_get(reuseht, l->reuse_ht, pubkey);
+	if (k != kh_end(l->reuse_ht))
+		reuse_drop(l, kh_value(l->reuse_ht, k));
+	else if (l->reuse_free == REUSE_NIL &&
+		 l->reuse_used == LEASES_REUSE_MAX)
+		reuse_drop(l, l->reuse_tail);
+
+	if (l->reuse_free != REUSE_NIL) {
+		i = l->reuse_free;
+		l->reuse_free = l->reuse[i].next;
+	} else {
+		i = l->reuse_used++;
+	}
+
+	e = &l->reuse[i];
+	memcpy(e->pubkey, pubkey, sizeof e->pubkey);
+	e->ipv4 = lease->ipv4;
+	e->ipv6 = lease->ipv6;
+	e->expired = now;
+	e->prev = REUSE_NIL;
+	e->next = l->reuse_head;
+	if (l->reuse_head != REUSE_NIL)
+		l->reuse[l->reuse_head].prev = i;
+	else
+		l->reuse_tail = i;
+	l->reuse_head = i;
+
+	/* the key lives in the entry, which never moves */
+	k = kh_put(reuseht, l->reuse_ht, e->pubkey, &ret);
+	if (ret < 0)
+		fatal("kh_put()");
+	kh_value(l->reuse_ht, k) = i;
+}
+
+/* Drops everything that expired longer than the grace window ago */
+static void reuse_expire(struct wg_dynamic_leases *l, time_t now)
+{
+	while (l->reuse_tail != REUSE_NIL &&
+	       now - l->reuse[l->reuse_tail].expired > l->reuse_grace)
+		reuse_drop(l, l->reuse_tail);
+}
+
+/* Looks up and forgets the addresses pubkey had, if its lease expired within
+ * the grace window
+ */
+static bool reuse_take(struct wg_dynamic_leases *l, const wg_key pubkey,
+		       struct reuse_entry *dest)
+{
+	khiter_t k;
+
+	if (!l->reuse_ht)
+		return false;
+
+	k = kh_get(reuseht, l->reuse_ht, pubkey);
+	if (k == kh_end(l->reuse_ht))
+		return false;
+
+	*dest = l->reuse[kh_value(l->reuse_ht, k)];
+	reuse_drop(l, kh_value(l->reuse_ht, k));
+
+	return get_monotonic_time() - dest->expired <= l->reuse_grace;
+}
+
+static uint64_t low_bits(unsigned int n)
+{
+	return n >= 64 ? UINT64_MAX : (1ULL << n) - 1;
+}
+
+/* Takes the address that pubkey hashes to, in one of the largest pools: the
+ * one whose hash of pubkey is the highest. That way a peer keeps its address
+ * across restarts and lease expiries as long as nobody else took it, and
+ * adding or removing smaller pools doesn't move it. Returns false if it's
+ * taken, or if there's no pool of that family. Costs one hash per pool.
+ */
+static bool add_sticky(struct wg_dynamic_leases *l, const wg_key pubkey,
+		       int family, void *dest)
+{
+	const struct pool_key *pool = NULL;
+	uint64_t words[4], h, best = 0, hi, lo;
+	unsigned int hostbits;
+
+	memcpy(words, pubkey, sizeof words);
+	for (khint_t k = 0; k < kh_end(l->pools); ++k) {
+		const struct pool_key *key = &kh_key(l->pools, k);
+
+		if (!kh_exist(l->pools, k) || key->family != family)
+			continue;
+
+		if (pool && key->cidr > pool->cidr)
+			continue;
+
+		h = siphash_4u64(words[0] ^ key->addr[0],
+				 words[1] ^ key->addr[1],
+				 words[2] ^ key->cidr, words[3], &l->alloc_key);
+		if (!pool || key->cidr < pool->cidr || h > best) {
+			pool = key;
+			best = h;
+		}
+	}
 
-	memcpy(update.peer_pubkey, peer_pubkey, sizeof(wg_key));
-	update.lease = lease;
+	if (!pool)
+		return false;
 
-	update_allowed_ips_bulk(&update, 1);
+	/* the host part comes from two more hashes */
+	h = siphash_1u64(best, &l->alloc_key);
+	if (family == AF_INET) {
+		struct in_addr ipv4;
+		uint32_t host;
+
+		hostbits = 32 - pool->cidr;
+		memcpy(&ipv4, pool->addr, sizeof ipv4);
+		host = ntohl(ipv4.s_addr) | (h & low_bits(hostbits));
+		ipv4.s_addr = htonl(host);
+		if (ipp_add_v4(&l->ipns, &ipv4, 32))
+			return false;
+
+		memcpy(dest, &ipv4, sizeof ipv4);
+		return true;
+	}
+
+	struct in6_addr ipv6;
+
+	hostbits = 128 - pool->cidr;
+	hi = be64toh(pool->addr[0]);
+	lo = be64toh(pool->addr[1]) | (h & low_bits(hostbits));
+	if (hostbits > 64)
+		hi |= siphash_1u64(h, &l->alloc_key) & low_bits(hostbits - 64);
+
+	hi = htobe64(hi);
+	lo = htobe64(lo);
+	memcpy(ipv6.s6_addr, &hi, 8);
+	memcpy(ipv6.s6_addr + 8, &lo, 8);
+	if (ipp_add_v6(&l->ipns, &ipv6, 128))
+		return false;
+
+	memcpy(dest, &ipv6, sizeof ipv6);
+	return true;
 }
 
-struct wg_dynamic_lease *set_lease(wg_key pubkey, uint32_t leasetime,
+struct wg_dynamic_lease *set_lease(struct wg_dynamic_leases *l,
+				   const wg_key pubkey, uint32_t leasetime,
 				   const struct in6_addr *lladdr,
 				   const struct in_addr *ipv4,
 				   const struct in6_addr *ipv6)
 {
 	bool delete_ipv4 = !ipv4 || (ipv4 && !ipv4->s_addr);
 	bool delete_ipv6 = !ipv6 || (ipv6 && IN6_IS_ADDR_UNSPECIFIED(ipv6));
+	uint32_t hash = table_hash(&l->table, pubkey);
 	struct wg_dynamic_lease *lease;
+	struct reuse_entry prev = { 0 };
+	struct lease_slot *slot;
 	struct timespec tp;
-	khiter_t k;
-	int kh_ret;
-
-	lease = get_leases(pubkey);
-	if (!lease) {
-		lease = calloc(1, sizeof(*lease));
-		lease->lladdr = *lladdr;
+	bool is_new;
+
+	trace(lease__set, (const uint8_t *)pubkey, ipv4, ipv6);
+	slot = table_find(&l->table, pubkey, hash);
+	is_new = !slot;
+	if (is_new) {
+		slot = table_insert(l, pubkey, hash);
+		if (lladdr)
+			slot->lease.lladdr = *lladdr;
+
+		/* only used below if the kept addresses are still free */
+		if (!reuse_take(l, pubkey, &prev))
+			memset(&prev, 0, sizeof prev);
 	}
+	lease = &slot->lease;
 
 	if (delete_ipv4 && lease->ipv4.s_addr) {
-		if (ipp_del_v4(&ipns, &lease->ipv4, 32))
+		if (ipp_del_v4(&l->ipns, &lease->ipv4, 32))
 			die("ipp_del_v4()\n");
 		memset(&lease->ipv4, 0, sizeof(lease->ipv4));
 	}
 
 	if (delete_ipv6 && !IN6_IS_ADDR_UNSPECIFIED(&lease->ipv6)) {
-		if (ipp_del_v6(&ipns, &lease->ipv6, 128))
+		if (ipp_del_v6(&l->ipns, &lease->ipv6, 128))
 			die("ipp_del_v6()\n");
 		memset(&lease->ipv6, 0, sizeof(lease->ipv6));
 	}
 
 	if (ipv4 && !ipv4->s_addr) {
-		if (!ipns.total_ipv4) {
+		if (!l->ipns.total_ipv4) {
 			debug("IPv4 pool empty\n");
+			metrics_inc(METRIC_POOL_EXHAUSTED);
 			memset(&lease->ipv4, 0, sizeof(lease->ipv4));
+		} else if (prev.ipv4.s_addr &&
+			   !ipp_add_v4(&l->ipns, &prev.ipv4, 32)) {
+			debug_hot("new_lease(v4): reused\n");
+			lease->ipv4 = prev.ipv4;
+			metrics_inc(METRIC_REUSED_ADDRESSES);
+		} else if (l->alloc == LEASES_ALLOC_STICKY_HASH &&
+			   add_sticky(l, pubkey, AF_INET, &lease->ipv4)) {
+			debug_hot("new_lease(v4): sticky\n");
 		} else {
-			uint32_t index = random_bounded(ipns.total_ipv4);
-			debug("new_lease(v4): %u of %ju\n", index,
-			      ipns.total_ipv4);
-			ipp_addnth_v4(&ipns, &lease->ipv4, index);
+			uint32_t index = 0;
+
+			if (l->alloc != LEASES_ALLOC_COMPACT)
+				index = random_bounded(l->ipns.total_ipv4);
+			debug_hot("new_lease(v4): %u of %ju\n", index,
+				  l->ipns.total_ipv4);
+			ipp_addnth_v4(&l->ipns, &lease->ipv4, index);
 		}
 	} else if (ipv4) {
 		if (!memcmp(&lease->ipv4, ipv4, sizeof(*ipv4))) {
-			debug("extending(v4)\n");
+			debug_hot("extending(v4)\n");
 		} else {
-			if (!ipp_add_v4(&ipns, ipv4, 32)) {
+			/* the address held so far goes back to the pool */
+			if (lease->ipv4.s_addr &&
+			    ipp_del_v4(&l->ipns, &lease->ipv4, 32))
+				die("ipp_del_v4()\n");
+
+			if (!ipp_add_v4(&l->ipns, ipv4, 32)) {
 				lease->ipv4 = *ipv4;
 			} else {
 				memset(&lease->ipv4, 0, sizeof(lease->ipv4));
@@ -245,29 +981,46 @@ struct wg_dynamic_lease *set_lease(wg_key pubkey, uint32_t leasetime,
 	}
 
 	if (ipv6 && IN6_IS_ADDR_UNSPECIFIED(ipv6)) {
-		if (!ipns.totalh_ipv6 && !ipns.totall_ipv6) {
+		if (!l->ipns.totalh_ipv6 && !l->ipns.totall_ipv6) {
 			debug("IPv6 pool empty\n");
+			metrics_inc(METRIC_POOL_EXHAUSTED);
 			memset(&lease->ipv6, 0, sizeof(lease->ipv6));
+		} else if (!IN6_IS_ADDR_UNSPECIFIED(&prev.ipv6) &&
+			   !ipp_add_v6(&l->ipns, &prev.ipv6, 128)) {
+			debug_hot("new_lease(v6): reused\n");
+			lease->ipv6 = prev.ipv6;
+			metrics_inc(METRIC_REUSED_ADDRESSES);
+		} else if (l->alloc == LEASES_ALLOC_STICKY_HASH &&
+			   add_sticky(l, pubkey, AF_INET6, &lease->ipv6)) {
+			debug_hot("new_lease(v6): sticky\n");
 		} else {
 			uint64_t index_l;
 			uint32_t index_h;
-			if (ipns.totalh_ipv6 > 0) {
+			if (l->alloc == LEASES_ALLOC_COMPACT) {
+				index_l = 0;
+				index_h = 0;
+			} else if (l->ipns.totalh_ipv6 > 0) {
 				index_l = random_u64();
-				index_h = random_bounded(ipns.totalh_ipv6);
+				index_h = random_bounded(l->ipns.totalh_ipv6);
 			} else {
-				index_l = random_bounded(ipns.totall_ipv6);
+				index_l = random_bounded(l->ipns.totall_ipv6);
 				index_h = 0;
 			}
 
-			debug("new_lease(v6): %u:%ju of %u:%ju\n", index_h,
-			      index_l, ipns.totalh_ipv6, ipns.totall_ipv6);
-			ipp_addnth_v6(&ipns, &lease->ipv6, index_l, index_h);
+			debug_hot("new_lease(v6): %u:%ju of %u:%ju\n",
+				  index_h, index_l, l->ipns.totalh_ipv6,
+				  l->ipns.totall_ipv6);
+			ipp_addnth_v6(&l->ipns, &lease->ipv6, index_l, index_h);
 		}
 	} else if (ipv6) {
 		if (!memcmp(&lease->ipv6, ipv6, sizeof(*ipv6))) {
-			debug("extending(v6)\n");
+			debug_hot("extending(v6)\n");
 		} else {
-			if (!ipp_add_v6(&ipns, ipv6, 128)) {
+			if (!IN6_IS_ADDR_UNSPECIFIED(&lease->ipv6) &&
+			    ipp_del_v6(&l->ipns, &lease->ipv6, 128))
+				die("ipp_del_v6()\n");
+
+			if (!ipp_add_v6(&l->ipns, ipv6, 128)) {
 				lease->ipv6 = *ipv6;
 			} else {
 				memset(&lease->ipv6, 0, sizeof(lease->ipv6));
@@ -275,7 +1028,7 @@ struct wg_dynamic_lease *set_lease(wg_key pubkey, uint32_t leasetime,
 		}
 	}
 
-	update_allowed_ips(pubkey, lease);
+	update_allowed_ips(l, pubkey, lease);
 
 	if (clock_gettime(CLOCK_REALTIME, &tp))
 		fatal("clock_gettime(CLOCK_REALTIME)");
@@ -283,95 +1036,712 @@ struct wg_dynamic_lease *set_lease(wg_key pubkey, uint32_t leasetime,
 	lease->start_mono = get_monotonic_time();
 	lease->leasetime = leasetime;
 
-	wg_key *pubcopy = malloc(sizeof(wg_key));
-	if (!pubcopy)
-		fatal("malloc()");
-
-	memcpy(pubcopy, pubkey, sizeof(wg_key));
-	k = kh_put(leaseht, leases_ht, *pubcopy, &kh_ret);
-
-	if (kh_ret < 0)
-		die("kh_put(): %d\n", kh_ret);
-
-	kh_value(leases_ht, k) = lease;
-
-	if (lease->start_mono + lease->leasetime < gexpires)
-		gexpires = lease->start_mono + lease->leasetime;
+	if (is_new) {
+		expiry_insert(l, slot);
+		metrics_inc(METRIC_NEW_LEASES);
+	} else {
+		expiry_update(l, slot);
+		metrics_inc(METRIC_RENEWALS);
+	}
 
-	/* TODO: add record to file */
+	journal_lease(l, pubkey, lease, lease->leasetime);
+	if (l->capture)
+		capture_set_lease(l->capture, l->capture_iface, pubkey,
+				  leasetime, lladdr, ipv4, ipv6, &lease->ipv4,
+				  &lease->ipv6);
+	trace(lease__set__done, (const uint8_t *)pubkey, lease->ipv4.s_addr,
+	      &lease->ipv6, is_new);
 
 	return lease;
 }
 
-struct wg_dynamic_lease *get_leases(wg_key pubkey)
+struct wg_dynamic_lease *get_leases(struct wg_dynamic_leases *l,
+				    wg_key pubkey)
 {
-	khiter_t k = kh_get(leaseht, leases_ht, pubkey);
+	struct lease_slot *slot;
 
-	if (k == kh_end(leases_ht))
-		return NULL;
-	else
-		return kh_val(leases_ht, k);
+	slot = table_find(&l->table, pubkey, table_hash(&l->table, pubkey));
+	return slot ? &slot->lease : NULL;
 }
 
-int leases_refresh()
+int leases_refresh(struct wg_dynamic_leases *l)
 {
 	time_t cur_time = get_monotonic_time();
 	struct allowedips_update updates[WG_DYNAMIC_LEASE_CHUNKSIZE] = { 0 };
+	/* where the leases go when they're taken out of the table */
+	struct wg_dynamic_lease expired[WG_DYNAMIC_LEASE_CHUNKSIZE];
+	int i = 0;
 
-	if (cur_time < gexpires)
-		return MIN(INT_MAX / 1000, gexpires - cur_time);
+	leases_lock(l);
 
-	gexpires = TIME_T_MAX;
+	/* expired leases are deleted below, which moves others around */
+	flush_pending(l);
 
-	int i = 0;
-	for (khint_t k = kh_begin(leases_ht); k != kh_end(leases_ht); ++k) {
-		if (!kh_exist(leases_ht, k))
-			continue;
-		struct wg_dynamic_lease *lease = kh_val(leases_ht, k);
-		BUG_ON(!lease);
-		time_t expires = lease->start_mono + lease->leasetime;
-		if (cur_time >= expires) {
-			if (lease->ipv4.s_addr) {
-				ipp_del_v4(&ipns, &lease->ipv4, 32);
-				memset(&lease->ipv4, 0, sizeof(lease->ipv4));
-			}
+	while (l->expiry_len && l->expiry_heap[0].expires <= cur_time) {
+		struct lease_slot *slot = l->expiry_heap[0].slot;
 
-			if (!IN6_IS_ADDR_UNSPECIFIED(&lease->ipv6)) {
-				ipp_del_v6(&ipns, &lease->ipv6, 128);
-				memset(&lease->ipv6, 0, sizeof(lease->ipv6));
-			}
+		expiry_pop(l);
+		reuse_remember(l, slot->pubkey, &slot->lease, cur_time);
+		release_addresses(l, &slot->lease);
 
-			memcpy(updates[i].peer_pubkey, kh_key(leases_ht, k),
-			       sizeof(wg_key));
-			updates[i].lease = lease;
+		memcpy(updates[i].peer_pubkey, slot->pubkey, sizeof(wg_key));
+		expired[i] = slot->lease;
+		updates[i].lease = &expired[i];
+		table_delete(l, slot);
 
+		trace(lease__expire, (const uint8_t *)updates[i].peer_pubkey,
+		      expired[i].ipv4.s_addr, &expired[i].ipv6);
+		if (DEBUG_LEVEL > 1) {
 			wg_key_b64_string pubkey_asc;
+
 			wg_key_to_base64(pubkey_asc, updates[i].peer_pubkey);
-			debug("Peer losing its lease: %s\n", pubkey_asc);
-
-			++i;
-			if (i == WG_DYNAMIC_LEASE_CHUNKSIZE) {
-				update_allowed_ips_bulk(updates, i);
-				while (i)
-					free(updates[--i].lease);
-				memset(updates, 0, sizeof updates);
-			}
+			debug_hot("Peer losing its lease: %s\n", pubkey_asc);
+		}
+		metrics_inc(METRIC_EXPIRIES);
 
-			free((char *)kh_key(leases_ht, k));
-			kh_del(leaseht, leases_ht, k);
-		} else {
-			if (expires < gexpires)
-				gexpires = expires;
+		journal_lease(l, updates[i].peer_pubkey, &expired[i], 0);
+
+		++i;
+		if (i == WG_DYNAMIC_LEASE_CHUNKSIZE) {
+			update_allowed_ips_bulk(l, updates, i, 0);
+			memset(updates, 0, sizeof updates);
+			i = 0;
 		}
 	}
 
-	if (i) {
-		update_allowed_ips_bulk(updates, i);
-		while (i)
-			free(updates[--i].lease);
+	if (i)
+		update_allowed_ips_bulk(l, updates, i, 0);
+
+	reuse_expire(l, cur_time);
+
+	if (!l->expiry_len)
+		i = INT_MAX / 1000;
+	else
+		i = MIN(INT_MAX / 1000, l->expiry_heap[0].expires - cur_time);
+
+	leases_unlock(l);
+
+	return i;
+}
+
+struct restore_ctx {
+	struct wg_dynamic_leases *l;
+	time_t now_real, now_mono;
+};
+
+/* Applies a single journal record. Records for the same pubkey supersede each
+ * other, so the last one written wins. Leases that ran out while we were gone
+ * are dropped like removed ones, and with them from the lease file by the
+ * compaction after restoring. Expiring them later would push them to the
+ * kernel without WGPEER_UPDATE_ONLY, recreating peers removed meanwhile.
+ */
+static void restore_record(const struct journal_record *rec, void *ctx)
+{
+	struct restore_ctx *rc = ctx;
+	struct wg_dynamic_leases *l = rc->l;
+	uint32_t hash = table_hash(&l->table, rec->pubkey);
+	struct wg_dynamic_lease *lease;
+	struct lease_slot *slot;
+	bool removed = !rec->leasetime ||
+		       rec->start_real + rec->leasetime <= rc->now_real;
+
+	slot = table_find(&l->table, rec->pubkey, hash);
+	if (slot) {
+		release_addresses(l, &slot->lease);
+		expiry_remove(l, slot);
+
+		if (removed) {
+			table_delete(l, slot);
+			return;
+		}
+	} else {
+		if (removed)
+			return;
+
+		slot = table_insert(l, rec->pubkey, hash);
+	}
+	lease = &slot->lease;
+
+	/* addresses that aren't part of any pool anymore are dropped */
+	if (rec->ipv4.s_addr && !ipp_add_v4(&l->ipns, &rec->ipv4, 32))
+		lease->ipv4 = rec->ipv4;
+
+	if (!IN6_IS_ADDR_UNSPECIFIED(&rec->ipv6) &&
+	    !ipp_add_v6(&l->ipns, &rec->ipv6, 128))
+		lease->ipv6 = rec->ipv6;
+
+	lease->lladdr = rec->lladdr;
+	lease->start_real = rec->start_real;
+	lease->start_mono = rc->now_mono - (rc->now_real - rec->start_real);
+	lease->leasetime = rec->leasetime;
+
+	expiry_insert(l, slot);
+}
+
+static void lease_to_record(const struct lease_slot *slot,
+			    struct journal_record *rec)
+{
+	memset(rec, 0, sizeof *rec);
+	memcpy(rec->pubkey, slot->pubkey, sizeof rec->pubkey);
+	rec->ipv4 = slot->lease.ipv4;
+	rec->ipv6 = slot->lease.ipv6;
+	rec->lladdr = slot->lease.lladdr;
+	rec->start_real = slot->lease.start_real;
+	rec->leasetime = slot->lease.leasetime;
+}
+
+struct compact_ctx {
+	struct wg_dynamic_leases *l;
+	size_t i;
+};
+
+static bool next_lease_record(struct journal_record *rec, void *ctx)
+{
+	struct compact_ctx *cc = ctx;
+	struct wg_dynamic_leases *l = cc->l;
+
+	for (; cc->i < table_capacity(&l->table); ++cc->i)
+		if (l->table.slots[cc->i].hash)
+			break;
+
+	if (cc->i == table_capacity(&l->table))
+		return false;
+
+	lease_to_record(&l->table.slots[cc->i], rec);
+	++cc->i;
+
+	return true;
+}
+
+static void compact_leases(struct wg_dynamic_leases *l)
+{
+	struct compact_ctx cc = { .l = l, .i = 0 };
+
+	journal_compact(l->journal, next_lease_record, &cc);
+}
+
+int leases_restore(struct wg_dynamic_leases *l, const char *fname)
+{
+	struct restore_ctx rc;
+	struct timespec tp;
+
+	if (clock_gettime(CLOCK_REALTIME, &tp))
+		fatal("clock_gettime(CLOCK_REALTIME)");
+	rc.now_real = tp.tv_sec;
+	rc.now_mono = get_monotonic_time();
+	rc.l = l;
+
+	/* the kernel is brought in line by leases_adopt() and
+	 * leases_reconcile()
+	 */
+	l->journal = journal_open(fname, restore_record, &rc);
+
+	compact_leases(l);
+	debug("Restored %zu leases from %s\n", l->table.size, fname);
+
+	return l->table.size;
+}
+
+/* Whether the kernel holds exactly the addresses of lease for peer */
+static bool peer_matches(const struct leases_peer *peer,
+			 const struct wg_dynamic_lease *lease)
+{
+	return peer->exact && peer->ipv4.s_addr == lease->ipv4.s_addr &&
+	       IN6_ARE_ADDR_EQUAL(&peer->ipv6, &lease->ipv6) &&
+	       IN6_ARE_ADDR_EQUAL(&peer->lladdr, &lease->lladdr);
+}
+
+static void adopt_peer(struct wg_dynamic_leases *l,
+		       const struct restore_ctx *rc,
+		       const struct leases_peer *peer, uint32_t leasetime)
+{
+	uint32_t hash = table_hash(&l->table, peer->pubkey);
+	struct wg_dynamic_lease *lease;
+	struct lease_slot *slot;
+
+	slot = table_find(&l->table, peer->pubkey, hash);
+	if (!slot) {
+		if (!peer->ipv4.s_addr && IN6_IS_ADDR_UNSPECIFIED(&peer->ipv6))
+			return;
+
+		slot = table_insert(l, peer->pubkey, hash);
+		lease = &slot->lease;
+		if (peer->ipv4.s_addr &&
+		    !ipp_add_v4(&l->ipns, &peer->ipv4, 32))
+			lease->ipv4 = peer->ipv4;
+		if (!IN6_IS_ADDR_UNSPECIFIED(&peer->ipv6) &&
+		    !ipp_add_v6(&l->ipns, &peer->ipv6, 128))
+			lease->ipv6 = peer->ipv6;
+		lease->lladdr = peer->lladdr;
+		lease->start_real = rc->now_real;
+		lease->start_mono = rc->now_mono;
+		lease->leasetime = leasetime;
+		expiry_insert(l, slot);
+		journal_lease(l, peer->pubkey, lease, leasetime);
+	}
+	lease = &slot->lease;
+
+	if (peer_matches(peer, lease)) {
+		lease->kernel_ipv4 = lease->ipv4;
+		lease->kernel_ipv6 = lease->ipv6;
+		lease->in_kernel = true;
+	}
+}
+
+size_t leases_adopt(struct wg_dynamic_leases *l,
+		    const struct leases_peer *peers, size_t n,
+		    uint32_t leasetime)
+{
+	struct restore_ctx rc = { .l = l };
+	struct timespec tp;
+	size_t before;
+
+	if (clock_gettime(CLOCK_REALTIME, &tp))
+		fatal("clock_gettime(CLOCK_REALTIME)");
+	rc.now_real = tp.tv_sec;
+	rc.now_mono = get_monotonic_time();
+
+	leases_lock(l);
+	before = l->table.size;
+	for (size_t i = 0; i < n; ++i)
+		adopt_peer(l, &rc, &peers[i], leasetime);
+	n = l->table.size - before;
+	leases_unlock(l);
+
+	return n;
+}
+
+size_t leases_reconcile(struct wg_dynamic_leases *l)
+{
+	struct allowedips_update updates[WG_DYNAMIC_LEASE_CHUNKSIZE];
+	size_t pushed = 0, npass;
+
+	/* Entries move when others are deleted while the lock is dropped, so
+	 * a pass may miss some. Whatever it pushes won't be found again, so
+	 * passes are repeated until one finds nothing.
+	 */
+	do {
+		size_t k = 0;
+		bool done;
+
+		npass = 0;
+		do {
+			time_t now = get_monotonic_time();
+			struct wg_dynamic_lease *lease;
+			int i = 0;
+
+			leases_lock(l);
+			for (; k < table_capacity(&l->table) &&
+			       i < WG_DYNAMIC_LEASE_CHUNKSIZE;
+			     ++k) {
+				struct lease_slot *slot = &l->table.slots[k];
+
+				/* queued ones are left to leases_flush(),
+				 * expired ones to leases_refresh()
+				 */
+				lease = &slot->lease;
+				if (!slot->hash || lease->update_queued ||
+				    lease->start_mono + lease->leasetime <= now)
+					continue;
+				if (!lease_changed(lease, &updates[i].add_only))
+					continue;
+
+				memcpy(updates[i].peer_pubkey, slot->pubkey,
+				       sizeof(wg_key));
+				updates[i++].lease = lease;
+			}
+
+			/* Peers removed while we were gone must not be
+			 * recreated, hence UPDATE_ONLY
+			 */
+			if (i)
+				update_allowed_ips_bulk(l, updates, i,
+							WGPEER_UPDATE_ONLY);
+			done = k >= table_capacity(&l->table);
+			leases_unlock(l);
+
+			npass += i;
+		} while (!done);
+
+		pushed += npass;
+	} while (npass);
+
+	return pushed;
+}
+
+struct wg_dynamic_leases *leases_find(const char *devname)
+{
+	for (struct wg_dynamic_leases *l = all_leases; l; l = l->next)
+		if (!strcmp(l->devname, devname))
+			return l;
+
+	return NULL;
+}
+
+const char *leases_devname(const struct wg_dynamic_leases *l)
+{
+	return l->devname;
+}
+
+void leases_export(struct wg_dynamic_leases *l, journal_cb_t cb, void *ctx)
+{
+	struct compact_ctx cc = { .l = l, .i = 0 };
+	struct journal_record rec;
+
+	leases_lock(l);
+	while (next_lease_record(&rec, &cc))
+		cb(&rec, ctx);
+	leases_unlock(l);
+}
+
+void leases_set_capture(struct wg_dynamic_leases *l, struct capture *c,
+			uint8_t iface)
+{
+	struct compact_ctx cc = { .l = l, .i = 0 };
+	struct journal_record rec;
+
+	leases_lock(l);
+	l->capture = c;
+	l->capture_iface = iface;
+
+	for (khint_t i = 0; c && i < kh_end(l->pools); ++i) {
+		const struct pool_key *key = &kh_key(l->pools, i);
+
+		if (kh_exist(l->pools, i))
+			capture_pool(c, iface, key->family, key->addr,
+				     key->cidr, true);
 	}
 
-	return MIN(INT_MAX / 1000, gexpires - cur_time);
+	while (c && next_lease_record(&rec, &cc))
+		capture_lease(c, iface, CAPTURE_IMPORT, &rec);
+	leases_unlock(l);
+}
+
+/* Takes over a single record like restore_record(), but also journals the
+ * lease and queues the update of the allowedips. Returns whether the lease got
+ * all the addresses of rec.
+ */
+static bool import_record(struct wg_dynamic_leases *l,
+			  const struct restore_ctx *rc,
+			  const struct journal_record *rec)
+{
+	uint32_t hash = table_hash(&l->table, rec->pubkey);
+	struct wg_dynamic_lease *lease;
+	struct lease_slot *slot;
+	bool complete = true, is_new;
+
+	slot = table_find(&l->table, rec->pubkey, hash);
+	is_new = !slot;
+	if (is_new)
+		slot = table_insert(l, rec->pubkey, hash);
+	lease = &slot->lease;
+	release_addresses(l, lease);
+
+	if (rec->ipv4.s_addr) {
+		if (!ipp_add_v4(&l->ipns, &rec->ipv4, 32))
+			lease->ipv4 = rec->ipv4;
+		else
+			complete = false;
+	}
+
+	if (!IN6_IS_ADDR_UNSPECIFIED(&rec->ipv6)) {
+		if (!ipp_add_v6(&l->ipns, &rec->ipv6, 128))
+			lease->ipv6 = rec->ipv6;
+		else
+			complete = false;
+	}
+
+	if (!IN6_IS_ADDR_UNSPECIFIED(&rec->lladdr))
+		lease->lladdr = rec->lladdr;
+	lease->start_real = rec->start_real;
+	lease->start_mono = rc->now_mono - (rc->now_real - rec->start_real);
+	lease->leasetime = rec->leasetime;
+
+	if (is_new)
+		expiry_insert(l, slot);
+	else
+		expiry_update(l, slot);
+
+	update_allowed_ips(l, rec->pubkey, lease);
+	journal_lease(l, rec->pubkey, lease, lease->leasetime);
+	if (l->capture)
+		capture_lease(l->capture, l->capture_iface, CAPTURE_IMPORT,
+			      rec);
+
+	return complete;
+}
+
+size_t leases_import(struct wg_dynamic_leases *l,
+		     const struct journal_record *recs, size_t n)
+{
+	struct restore_ctx rc = { .l = l };
+	struct timespec tp;
+	size_t imported = 0;
+
+	if (clock_gettime(CLOCK_REALTIME, &tp))
+		fatal("clock_gettime(CLOCK_REALTIME)");
+	rc.now_real = tp.tv_sec;
+	rc.now_mono = get_monotonic_time();
+
+	leases_lock(l);
+	for (size_t i = 0; i < n; ++i) {
+		const struct journal_record *rec = &recs[i];
+
+		if (!rec->leasetime ||
+		    rec->start_real + rec->leasetime <= rc.now_real ||
+		    (!rec->ipv4.s_addr && IN6_IS_ADDR_UNSPECIFIED(&rec->ipv6)))
+			continue;
+
+		/* update_allowed_ips() pushes every full chunk */
+		if (import_record(l, &rc, rec))
+			++imported;
+	}
+	flush_pending(l);
+	leases_unlock(l);
+
+	return imported;
+}
+
+/* Takes the lease of pubkey out of the table, the way leases_refresh() does
+ * when it expires, and adds the update of its allowedips to updates. Returns
+ * false if there is no such lease.
+ */
+static bool remove_lease(struct wg_dynamic_leases *l, const wg_key pubkey,
+			 struct allowedips_update *update,
+			 struct wg_dynamic_lease *removed)
+{
+	struct lease_slot *slot;
+
+	slot = table_find(&l->table, pubkey, table_hash(&l->table, pubkey));
+	if (!slot)
+		return false;
+
+	expiry_remove(l, slot);
+	reuse_remember(l, slot->pubkey, &slot->lease, get_monotonic_time());
+	release_addresses(l, &slot->lease);
+
+	memcpy(update->peer_pubkey, slot->pubkey, sizeof(wg_key));
+	*removed = slot->lease;
+	update->lease = removed;
+	update->add_only = false;
+	table_delete(l, slot);
+
+	journal_lease(l, pubkey, removed, 0);
+	if (l->capture) {
+		struct journal_record rec = { 0 };
+
+		memcpy(rec.pubkey, pubkey, sizeof rec.pubkey);
+		capture_lease(l->capture, l->capture_iface, CAPTURE_REMOVE,
+			      &rec);
+	}
+
+	return true;
+}
+
+/* Kernel updates of leases removed by leases_replicate(), which are pushed in
+ * chunks like the queued ones
+ */
+struct replicate_ctx {
+	struct restore_ctx rc;
+	struct allowedips_update updates[WG_DYNAMIC_LEASE_CHUNKSIZE];
+	struct wg_dynamic_lease removed[WG_DYNAMIC_LEASE_CHUNKSIZE];
+	int nremoved;
+	size_t applied;
+};
+
+/* Removals move other leases around in the table, so the queued updates must
+ * be pushed before them, and the removals before more updates are queued, or
+ * the kernel might see them out of order.
+ */
+static void replicate_record(struct wg_dynamic_leases *l,
+			     struct replicate_ctx *ctx,
+			     const struct journal_record *rec)
+{
+	if (!rec->leasetime ||
+	    rec->start_real + rec->leasetime <= ctx->rc.now_real ||
+	    (!rec->ipv4.s_addr && IN6_IS_ADDR_UNSPECIFIED(&rec->ipv6))) {
+		flush_pending(l);
+		if (ctx->nremoved == WG_DYNAMIC_LEASE_CHUNKSIZE) {
+			update_allowed_ips_bulk(l, ctx->updates, ctx->nremoved,
+						0);
+			ctx->nremoved = 0;
+		}
+
+		if (remove_lease(l, rec->pubkey, &ctx->updates[ctx->nremoved],
+				 &ctx->removed[ctx->nremoved]))
+			++ctx->nremoved;
+		++ctx->applied;
+		return;
+	}
+
+	if (ctx->nremoved) {
+		update_allowed_ips_bulk(l, ctx->updates, ctx->nremoved, 0);
+		ctx->nremoved = 0;
+	}
+
+	if (import_record(l, &ctx->rc, rec))
+		++ctx->applied;
+}
+
+static int compare_pubkey(const void *key, const void *rec)
+{
+	return memcmp(key, ((const struct journal_record *)rec)->pubkey,
+		      sizeof(wg_key));
+}
+
+static int compare_records(const void *a, const void *b)
+{
+	return compare_pubkey(((const struct journal_record *)a)->pubkey, b);
+}
+
+/* Makes way for the snapshot in recs, sorted by pubkey: leases of peers that
+ * aren't in it are removed, and the addresses of those that are in it with
+ * other addresses are released. Otherwise, applying the snapshot in any order
+ * could run into addresses held by a peer whose record comes later.
+ */
+static void replicate_prepare(struct wg_dynamic_leases *l,
+			      struct replicate_ctx *ctx,
+			      const struct journal_record *recs, size_t n)
+{
+	struct journal_record *stale = NULL, *tmp;
+	size_t nstale = 0, cap = 0;
+
+	for (size_t i = 0; i < table_capacity(&l->table); ++i) {
+		struct lease_slot *slot = &l->table.slots[i];
+		const struct journal_record *rec;
+
+		if (!slot->hash)
+			continue;
+
+		rec = bsearch(slot->pubkey, recs, n, sizeof *recs,
+			      compare_pubkey);
+		if (rec) {
+			if (slot->lease.ipv4.s_addr != rec->ipv4.s_addr ||
+			    !IN6_ARE_ADDR_EQUAL(&slot->lease.ipv6, &rec->ipv6))
+				release_addresses(l, &slot->lease);
+			continue;
+		}
+
+		/* the table can't change while we walk it */
+		if (nstale == cap) {
+			cap = cap ? 2 * cap : 256;
+			tmp = realloc(stale, cap * sizeof *stale);
+			if (!tmp)
+				fatal("realloc()");
+			stale = tmp;
+		}
+		memset(&stale[nstale], 0, sizeof *stale);
+		memcpy(stale[nstale++].pubkey, slot->pubkey, sizeof(wg_key));
+	}
+
+	for (size_t i = 0; i < nstale; ++i)
+		replicate_record(l, ctx, &stale[i]);
+	free(stale);
+}
+
+size_t leases_replicate(struct wg_dynamic_leases *l,
+			struct journal_record *recs, size_t n, bool snapshot)
+{
+	struct replicate_ctx *ctx;
+	struct timespec tp;
+	size_t applied;
+
+	ctx = calloc(1, sizeof *ctx);
+	if (!ctx)
+		fatal("calloc()");
+
+	if (clock_gettime(CLOCK_REALTIME, &tp))
+		fatal("clock_gettime(CLOCK_REALTIME)");
+	ctx->rc.l = l;
+	ctx->rc.now_real = tp.tv_sec;
+	ctx->rc.now_mono = get_monotonic_time();
+
+	leases_lock(l);
+	if (snapshot) {
+		qsort(recs, n, sizeof *recs, compare_records);
+		replicate_prepare(l, ctx, recs, n);
+		ctx->applied = 0;
+	}
+
+	for (size_t i = 0; i < n; ++i)
+		replicate_record(l, ctx, &recs[i]);
+
+	if (ctx->nremoved)
+		update_allowed_ips_bulk(l, ctx->updates, ctx->nremoved, 0);
+	flush_pending(l);
+	leases_unlock(l);
+
+	applied = ctx->applied;
+	free(ctx);
+
+	return applied;
+}
+
+bool leases_lookup_pubkey(struct wg_dynamic_leases *l, const wg_key pubkey,
+			  struct journal_record *rec)
+{
+	struct lease_slot *slot;
+
+	leases_lock(l);
+	slot = table_find(&l->table, pubkey, table_hash(&l->table, pubkey));
+	if (slot)
+		lease_to_record(slot, rec);
+	leases_unlock(l);
+
+	return slot;
+}
+
+bool leases_lookup_addr(struct wg_dynamic_leases *l,
+			const struct wg_combined_ip *ip,
+			struct journal_record *rec)
+{
+	const struct wg_dynamic_lease *lease;
+	bool found = false;
+
+	leases_lock(l);
+	for (size_t i = 0; !found && i < table_capacity(&l->table); ++i) {
+		if (!l->table.slots[i].hash)
+			continue;
+
+		lease = &l->table.slots[i].lease;
+		if (ip->family == AF_INET)
+			found = lease->ipv4.s_addr == ip->ip4.s_addr;
+		else
+			found = IN6_ARE_ADDR_EQUAL(&lease->ipv6, &ip->ip6) ||
+				IN6_ARE_ADDR_EQUAL(&lease->lladdr, &ip->ip6);
+
+		if (found)
+			lease_to_record(&l->table.slots[i], rec);
+	}
+	leases_unlock(l);
+
+	return found;
+}
+
+void leases_get_usage(struct wg_dynamic_leases *l,
+		      struct wg_dynamic_leases_usage *usage)
+{
+	leases_lock(l);
+	usage->devname = l->devname;
+	usage->leases = l->table.size;
+	usage->free_ipv4 = l->ipns.total_ipv4;
+	usage->free_ipv6_low = l->ipns.totall_ipv6;
+	usage->free_ipv6_high = l->ipns.totalh_ipv6;
+	leases_unlock(l);
+}
+
+void leases_sync(struct wg_dynamic_leases *l)
+{
+	if (!l->journal)
+		return;
+
+	leases_lock(l);
+	if (journal_records(l->journal) >
+	    2 * l->table.size + LEASES_COMPACT_SLACK)
+		compact_leases(l);
+	else
+		journal_sync(l->journal);
+	leases_unlock(l);
 }
 
 static int data_ipv4_attr_cb(const struct nlattr *attr, void *data)
@@ -420,27 +1790,118 @@ static int data_ipv6_attr_cb(const struct nlattr *attr, void *data)
 	return MNL_CB_OK;
 }
 
+/* Only remembers whether the pool should exist, so that a burst of messages
+ * about the same route results in a single change of the pools, if any.
+ */
+static void queue_pool_change(struct wg_dynamic_leases *l,
+			      const struct pool_key *key, bool exists)
+{
+	khiter_t k;
+	int ret;
+
+	k = kh_put(poolht, l->pool_changes, *key, &ret);
+	if (ret < 0)
+		fatal("kh_put()");
+
+	kh_val(l->pool_changes, k) = exists;
+}
+
+static void apply_pool_changes(struct wg_dynamic_leases *l)
+{
+	if (!kh_size(l->pool_changes))
+		return;
+
+	leases_lock(l);
+	for (khint_t i = 0; i < kh_end(l->pool_changes); ++i) {
+		struct pool_key *key;
+		void *addr;
+		khiter_t k;
+		int ret;
+
+		if (!kh_exist(l->pool_changes, i))
+			continue;
+
+		key = &kh_key(l->pool_changes, i);
+		addr = key->addr;
+		k = kh_get(poolht, l->pools, *key);
+		if (kh_val(l->pool_changes, i) == (k != kh_end(l->pools)))
+			continue;
+
+		if (l->capture)
+			capture_pool(l->capture, l->capture_iface, key->family,
+				     addr, key->cidr,
+				     kh_val(l->pool_changes, i));
+
+		if (kh_val(l->pool_changes, i)) {
+			if (key->family == AF_INET)
+				ret = ipp_addpool_v4(&l->ipns, addr, key->cidr);
+			else
+				ret = ipp_addpool_v6(&l->ipns, addr, key->cidr);
+
+			/* e.g. too small to hand out addresses from */
+			if (ret) {
+				debug("Ignoring route to /%u\n", key->cidr);
+				continue;
+			}
+
+			kh_put(poolht, l->pools, *key, &ret);
+			if (ret < 0)
+				fatal("kh_put()");
+		} else {
+			if (key->family == AF_INET)
+				ret = ipp_removepool_v4(&l->ipns, addr,
+							key->cidr);
+			else
+				ret = ipp_removepool_v6(&l->ipns, addr,
+							key->cidr);
+			if (ret)
+				die("ipp_removepool()\n");
+
+			kh_del(poolht, l->pools, k);
+		}
+	}
+	leases_unlock(l);
+
+	kh_clear(poolht, l->pool_changes);
+}
+
+void leases_set_pool(struct wg_dynamic_leases *l, int family,
+		     const void *addr, uint8_t cidr, bool exists)
+{
+	struct pool_key key = { .family = family, .cidr = cidr };
+
+	memcpy(key.addr, addr, family == AF_INET ? sizeof(struct in_addr) :
+						   sizeof(struct in6_addr));
+	queue_pool_change(l, &key, exists);
+	apply_pool_changes(l);
+}
+
 static int process_nlpacket_cb(const struct nlmsghdr *nlh, void *data)
 {
 	struct nlattr *tb[RTA_MAX + 1] = {};
 	struct rtmsg *rm = mnl_nlmsg_get_payload(nlh);
-	uint32_t ifindex;
+	struct wg_dynamic_leases *l;
+	struct pool_key key;
+	uint32_t oif;
 
-	BUG_ON(!data);
-	ifindex = *((int *)data);
+	(void)data;
 
 	if (rm->rtm_family == AF_INET)
 		mnl_attr_parse(nlh, sizeof(*rm), data_ipv4_attr_cb, tb);
 	else if (rm->rtm_family == AF_INET6)
 		mnl_attr_parse(nlh, sizeof(*rm), data_ipv6_attr_cb, tb);
 
-	if (!tb[RTA_OIF] || mnl_attr_get_u32(tb[RTA_OIF]) != ifindex) {
-		debug("ignoring interface %u (want %u)\n",
-		      tb[RTA_OIF] ? mnl_attr_get_u32(tb[RTA_OIF]) : 0, ifindex);
+	oif = tb[RTA_OIF] ? mnl_attr_get_u32(tb[RTA_OIF]) : 0;
+	for (l = all_leases; l; l = l->next)
+		if ((uint32_t)l->ifindex == oif)
+			break;
+
+	if (!l) {
+		debug("ignoring interface %u\n", oif);
 		return MNL_CB_OK;
 	}
 
-	if (tb[RTA_GATEWAY])
+	if (tb[RTA_GATEWAY] || rm->rtm_type != RTN_UNICAST)
 		return MNL_CB_OK;
 
 	if (!tb[RTA_DST]) {
@@ -453,40 +1914,204 @@ static int process_nlpacket_cb(const struct nlmsghdr *nlh, void *data)
 	    (is_link_local(addr) || IN6_IS_ADDR_MULTICAST(addr)))
 		return MNL_CB_OK;
 
-	if (nlh->nlmsg_type == RTM_NEWROUTE) {
-		if (rm->rtm_family == AF_INET) {
-			if (ipp_addpool_v4(&ipns, addr, rm->rtm_dst_len))
-				die("ipp_addpool_v4()\n");
-		} else if (rm->rtm_family == AF_INET6) {
-			if (ipp_addpool_v6(&ipns, addr, rm->rtm_dst_len))
-				die("ipp_addpool_v6()\n");
-		}
-	} else if (nlh->nlmsg_type == RTM_DELROUTE) {
-		if (rm->rtm_family == AF_INET) {
-			if (ipp_removepool_v4(&ipns, addr, rm->rtm_dst_len) &&
-			    synchronized)
-				die("ipp_removepool_v4()\n");
-		} else if (rm->rtm_family == AF_INET6) {
-			if (ipp_removepool_v6(&ipns, addr, rm->rtm_dst_len) &&
-			    synchronized)
-				die("ipp_removepool_v6()\n");
+	memset(&key, 0, sizeof key);
+	memcpy(key.addr, addr, rm->rtm_family == AF_INET ? 4 : 16);
+	key.family = rm->rtm_family;
+	key.cidr = rm->rtm_dst_len;
+	queue_pool_change(l, &key, nlh->nlmsg_type == RTM_NEWROUTE);
+
+	return MNL_CB_OK;
+}
+
+/* Dumps the routes of all interfaces into their pool changes, over a socket
+ * of its own so that the dump doesn't mix with route updates. With strict
+ * checking, the kernel only returns routes via the right interface;
+ * otherwise, one dump of all routes is filtered by process_nlpacket_cb().
+ */
+static void dump_routes()
+{
+	struct mnl_socket *sock;
+	struct wg_dynamic_leases *l;
+	unsigned int seq = time(NULL), portid;
+	bool strict = true;
+	int val = 1, ret;
+	char *buf;
+
+	buf = malloc(ROUTE_DUMP_BUFSIZE);
+	sock = mnl_socket_open(NETLINK_ROUTE);
+	if (!buf || !sock)
+		fatal("mnl_socket_open(NETLINK_ROUTE)");
+
+	if (mnl_socket_bind(sock, 0, MNL_SOCKET_AUTOPID) < 0)
+		fatal("mnl_socket_bind()");
+	portid = mnl_socket_get_portid(sock);
+
+	if (mnl_socket_setsockopt(sock, NETLINK_GET_STRICT_CHK, &val,
+				  sizeof val) < 0) {
+		debug("No strict netlink checking, dumping all routes\n");
+		strict = false;
+	}
+
+	for (l = all_leases; l; l = strict ? l->next : NULL) {
+		struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+		struct rtmsg *rtm;
+
+		nlh->nlmsg_type = RTM_GETROUTE;
+		nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+		nlh->nlmsg_seq = ++seq;
+		rtm = mnl_nlmsg_put_extra_header(nlh, sizeof *rtm);
+		rtm->rtm_family = AF_UNSPEC; /* both ipv4 and ipv6 */
+		if (strict)
+			mnl_attr_put_u32(nlh, RTA_OIF, l->ifindex);
+
+		if (mnl_socket_sendto(sock, nlh, nlh->nlmsg_len) < 0)
+			fatal("mnl_socket_sendto()");
+
+		do {
+			ret = mnl_socket_recvfrom(sock, buf,
+						  ROUTE_DUMP_BUFSIZE);
+			if (ret < 0)
+				fatal("mnl_socket_recvfrom()");
+
+			ret = mnl_cb_run(buf, ret, seq, portid,
+					 process_nlpacket_cb, NULL);
+			if (ret == MNL_CB_ERROR)
+				fatal("mnl_cb_run()");
+		} while (ret > MNL_CB_STOP);
+	}
+
+	mnl_socket_close(sock);
+	free(buf);
+}
+
+/* Attaches a socket filter that drops route messages not via one of our
+ * interfaces, so a host with a full routing table doesn't wake us up for each
+ * of its route changes. Route notifications come one per datagram, which is
+ * what the filter looks at. Anything else is let through.
+ */
+#define FILTER_HEAD 11
+
+static void filter_routes(struct mnl_socket *nlsock)
+{
+	struct wg_dynamic_leases *l;
+	struct sock_filter *code;
+	struct sock_fprog prog;
+	unsigned int n = 0, drop, accept;
+
+	for (l = all_leases; l; l = l->next)
+		++n;
+
+	/* jump offsets are only 8 bits */
+	if (FILTER_HEAD + n > 255) {
+		debug("Too many interfaces for a route filter\n");
+		return;
+	}
+
+	drop = FILTER_HEAD + n;
+	accept = drop + 1;
+	code = calloc(accept + 1, sizeof *code);
+	if (!code)
+		fatal("calloc()");
+
+	/* BPF loads are big endian, netlink is in host byte order */
+	code[0] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_H | BPF_ABS,
+					       offsetof(struct nlmsghdr,
+							nlmsg_type));
+	code[1] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+					       htons(RTM_NEWROUTE), 1, 0);
+	code[2] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+					       htons(RTM_DELROUTE), 0,
+					       accept - 3);
+	code[3] = (struct sock_filter)BPF_STMT(
+		BPF_LD | BPF_B | BPF_ABS,
+		NLMSG_HDRLEN + offsetof(struct rtmsg, rtm_type));
+	code[4] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+					       RTN_UNICAST, 0, drop - 5);
+	/* A = offset of the RTA_OIF attribute, searching from A */
+	code[5] = (struct sock_filter)BPF_STMT(
+		BPF_LD | BPF_IMM,
+		NLMSG_HDRLEN + NLMSG_ALIGN(sizeof(struct rtmsg)));
+	code[6] = (struct sock_filter)BPF_STMT(BPF_LDX | BPF_IMM, RTA_OIF);
+	code[7] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+					       SKF_AD_OFF + SKF_AD_NLATTR);
+	code[8] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0,
+					       drop - 9, 0);
+	code[9] = (struct sock_filter)BPF_STMT(BPF_MISC | BPF_TAX, 0);
+	code[10] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_IND,
+						sizeof(struct nlattr));
+
+	n = FILTER_HEAD;
+	for (l = all_leases; l; l = l->next, ++n)
+		code[n] = (struct sock_filter)BPF_JUMP(
+			BPF_JMP | BPF_JEQ | BPF_K, htonl(l->ifindex),
+			accept - (n + 1), 0);
+
+	code[drop] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+	code[accept] =
+		(struct sock_filter)BPF_STMT(BPF_RET | BPF_K, UINT32_MAX);
+
+	prog.len = accept + 1;
+	prog.filter = code;
+	if (setsockopt(mnl_socket_get_fd(nlsock), SOL_SOCKET,
+		       SO_ATTACH_FILTER, &prog, sizeof prog))
+		debug("Failed to attach route filter: %s\n", strerror(errno));
+
+	free(code);
+}
+
+void leases_dump_pools(struct mnl_socket *nlsock)
+{
+	struct wg_dynamic_leases *l;
+
+	filter_routes(nlsock);
+	dump_routes();
+
+	for (l = all_leases; l; l = l->next)
+		apply_pool_changes(l);
+}
+
+/* Route updates were lost, so we drop whatever is still queued and start
+ * over from a fresh dump. Pools that aren't in it anymore are removed.
+ */
+static void resync_pools(struct mnl_socket *nlsock, char *buf, size_t len)
+{
+	struct wg_dynamic_leases *l;
+
+	debug("Route updates overflowed the netlink socket, resyncing\n");
+	metrics_inc(METRIC_ROUTE_RESYNCS);
+
+	while (mnl_socket_recvfrom(nlsock, buf, len) > 0 || errno == ENOBUFS)
+		;
+
+	for (l = all_leases; l; l = l->next) {
+		kh_clear(poolht, l->pool_changes);
+		for (khint_t k = 0; k < kh_end(l->pools); ++k) {
+			if (kh_exist(l->pools, k))
+				queue_pool_change(l, &kh_key(l->pools, k),
+						  false);
 		}
 	}
 
-	return MNL_CB_OK;
+	dump_routes();
 }
 
 void leases_update_pools(struct mnl_socket *nlsock)
 {
-	int ret;
+	struct wg_dynamic_leases *l;
 	char buf[MNL_SOCKET_BUFFER_SIZE];
+	int ret;
 
 	while ((ret = mnl_socket_recvfrom(nlsock, buf, sizeof buf)) > 0) {
-		if (mnl_cb_run(buf, ret, 0, 0, process_nlpacket_cb,
-			       (void *)&ifindex) == -1)
+		if (mnl_cb_run(buf, ret, 0, 0, process_nlpacket_cb, NULL) ==
+		    -1)
 			fatal("mnl_cb_run()");
 	}
 
-	if (ret == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+	if (ret == -1 && errno == ENOBUFS)
+		resync_pools(nlsock, buf, sizeof buf);
+	else if (ret == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
 		fatal("mnl_socket_recvfrom()");
+
+	for (l = all_leases; l; l = l->next)
+		apply_pool_changes(l);
 }
@@ -6,11 +6,13 @@
 #ifndef __LEASE_H__
 #define __LEASE_H__
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <sys/socket.h>
 #include <libmnl/libmnl.h>
 
 #include "common.h"
+#include "journal.h"
 #include "netlink.h"
 
 #define WG_DYNAMIC_LEASE_CHUNKSIZE 256
@@ -22,43 +24,246 @@ struct wg_dynamic_lease {
 	struct in_addr ipv4;
 	struct in6_addr ipv6;
 	struct in6_addr lladdr;
+	size_t expiry_idx; /* position in the expiry index, internal */
+	bool update_queued; /* allowedips update pending, internal */
+	/* addresses last pushed to the kernel, internal */
+	bool in_kernel;
+	struct in_addr kernel_ipv4;
+	struct in6_addr kernel_ipv6;
 };
 
+/* The leases and address pools of a single interface */
+struct wg_dynamic_leases;
+
+/*
+ * Creates the lease state for the interface device_name. Its pools are empty
+ * until routes were read with leases_dump_pools() or leases_update_pools().
+ */
+struct wg_dynamic_leases *leases_init(const char *device_name,
+				      int interface_index);
+
+/* How set_lease() picks an address for a peer that doesn't ask for one */
+enum leases_alloc {
+	LEASES_ALLOC_RANDOM, /* uniformly from all free addresses, default */
+	LEASES_ALLOC_COMPACT, /* the lowest free address, so leases cluster */
+	LEASES_ALLOC_STICKY_HASH, /* derived from the peer's public key */
+};
+
+/*
+ * Selects the allocation strategy of leases. With LEASES_ALLOC_STICKY_HASH,
+ * the address a peer gets is derived from a hash of its public key, keyed
+ * with seed, falling back to a random one if it is taken.
+ */
+void leases_set_alloc(struct wg_dynamic_leases *leases, enum leases_alloc alloc,
+		      const wg_key seed);
+
+/* Expired leases are remembered this long, in seconds, by default */
+#define LEASES_REUSE_GRACE (24 * 3600)
+/* and at most this many of them per interface */
+#define LEASES_REUSE_MAX 16384
+
 /*
- * Initializes internal state, retrieves routes from nlsock and reads leases
- * from fname.
+ * Sets for how long, in seconds, a peer whose lease expired gets its
+ * previous addresses back when it returns, provided they are still free. 0
+ * turns that off. This takes precedence over the allocation strategy.
  */
-void leases_init(const char *device_name, int interface_index, char *fname,
-		 struct mnl_socket *nlsock);
+void leases_set_reuse_grace(struct wg_dynamic_leases *leases, uint32_t grace);
+
+/*
+ * Requests all routes from the kernel and adds them to the pools of the
+ * interfaces they belong to. Call once, after all interfaces were set up.
+ */
+void leases_dump_pools(struct mnl_socket *nlsock);
+
+/*
+ * Restores leases from the lease file fname. All further lease changes are
+ * journaled to that file. Leases that ran out meanwhile are dropped. The
+ * kernel isn't updated, see leases_reconcile().
+ * Returns the amount of leases restored.
+ */
+int leases_restore(struct wg_dynamic_leases *leases, const char *fname);
+
+/* The allowedips of a peer, as found on the device at startup */
+struct leases_peer {
+	wg_key pubkey;
+	struct in6_addr lladdr;
+	struct in_addr ipv4;
+	struct in6_addr ipv6;
+	bool exact; /* the peer has no allowedips besides these */
+};
+
+/*
+ * Reconciles the leases with the n peers found on the device, in a single
+ * pass and without talking to the kernel. Leases whose peer has exactly
+ * their addresses as allowedips are marked as being in the kernel. Peers
+ * without a lease, e.g. because there is no lease file or we crashed before
+ * it was synced, get one of leasetime seconds for the addresses they have,
+ * as far as these are in the pools and not taken, so they can't be handed
+ * out to anyone else. Everything else is left to leases_reconcile().
+ * Returns the amount of leases created.
+ */
+size_t leases_adopt(struct wg_dynamic_leases *leases,
+		    const struct leases_peer *peers, size_t n,
+		    uint32_t leasetime);
+
+/*
+ * Pushes the allowedips of all leases the kernel might not have, like after
+ * leases_restore() or leases_adopt(), in chunks of WG_DYNAMIC_LEASE_CHUNKSIZE
+ * peers, each with the lock taken. Peers that don't exist aren't created.
+ * Meant to run in a thread of its own while requests are already served.
+ * Returns the amount of peers updated.
+ */
+size_t leases_reconcile(struct wg_dynamic_leases *leases);
 
 /*
  * Frees everything, closes file.
  */
-void leases_free();
+void leases_free(struct wg_dynamic_leases *leases);
+
+/*
+ * Serializes access to the leases between threads. set_lease(), get_leases()
+ * and reading the returned leases require holding the lock, all other
+ * functions take it themselves. Doesn't need to be held during setup and
+ * leases_free().
+ */
+void leases_lock(struct wg_dynamic_leases *leases);
+
+void leases_unlock(struct wg_dynamic_leases *leases);
 
 /*
  * Creates a new lease and returns a pointer to it, or NULL if either
  * we ran out of assignable IPs or the requested IP's are already
- * taken. Frees currently held lease, if any. Updates allowedips for
- * the peer.
+ * taken. Frees currently held lease, if any. Queues an update of the
+ * allowedips for the peer, which is only applied by leases_flush().
+ * Leases are stored inline in a table and move when it changes, so the
+ * pointer is only valid until the lock is released.
  */
-struct wg_dynamic_lease *set_lease(wg_key pubkey, uint32_t leasetime,
+struct wg_dynamic_lease *set_lease(struct wg_dynamic_leases *leases,
+				   const wg_key pubkey, uint32_t leasetime,
 				   const struct in6_addr *lladdr,
 				   const struct in_addr *ipv4,
 				   const struct in6_addr *ipv6);
 
 /*
- * Returns all leases belonging to pubkey, or NULL if there are none.
+ * Returns all leases belonging to pubkey, or NULL if there are none. Like for
+ * set_lease(), the pointer is only valid until the lock is released.
+ */
+struct wg_dynamic_lease *get_leases(struct wg_dynamic_leases *leases,
+				    wg_key pubkey);
+
+/* Removes all expired leases, only looking at the ones that are actually due.
+ * Returns the amount of seconds until the next lease will expire, or at most
+ * INT_MAX/1000.
+ */
+int leases_refresh(struct wg_dynamic_leases *leases);
+
+/*
+ * Pushes all queued allowedips updates to the kernel, batched into as few
+ * netlink transactions as possible. Must be called before answering requests
+ * that changed a lease.
+ */
+void leases_flush(struct wg_dynamic_leases *leases);
+
+struct wg_dynamic_leases_usage {
+	const char *devname;
+	size_t leases;
+	/* free addresses left in the pools */
+	uint64_t free_ipv4, free_ipv6_low;
+	uint32_t free_ipv6_high;
+};
+
+/*
+ * Fills in usage with the current amount of leases and free addresses.
+ */
+void leases_get_usage(struct wg_dynamic_leases *leases,
+		      struct wg_dynamic_leases_usage *usage);
+
+/*
+ * Returns the leases of the interface devname, or NULL if it isn't served.
+ */
+struct wg_dynamic_leases *leases_find(const char *devname);
+
+/*
+ * Returns the name of the interface the leases belong to.
+ */
+const char *leases_devname(const struct wg_dynamic_leases *leases);
+
+/*
+ * Calls cb with a record of every lease, in no particular order. The lock is
+ * held meanwhile, so cb must not call into the leases.
+ */
+void leases_export(struct wg_dynamic_leases *leases, journal_cb_t cb,
+		   void *ctx);
+
+/*
+ * Takes over the leases in recs as if each peer had been given exactly those
+ * addresses at start_real, replacing any lease it holds. Records that already
+ * ran out or have no addresses are skipped, as are addresses outside the
+ * pools or taken by another peer. The allowedips are pushed to the kernel in
+ * chunks of WG_DYNAMIC_LEASE_CHUNKSIZE peers before this returns. Returns the
+ * amount of records that got all their addresses.
  */
-struct wg_dynamic_lease *get_leases(wg_key pubkey);
+size_t leases_import(struct wg_dynamic_leases *leases,
+		     const struct journal_record *recs, size_t n);
 
-/* Refreshes all leases, meaning expired ones will be removed. Returns the
- * amount of seconds until the next lease will expire, or at most INT_MAX/1000.
+/*
+ * Applies records as streamed from another server, see replication.c. Each
+ * record replaces the lease its peer holds like with leases_import(), but
+ * records of removed leases, or ones that ran out or have no addresses,
+ * remove the lease the peer holds, if any. If snapshot is set, recs are all
+ * leases there are, sorted by pubkey in place, and peers without a record
+ * lose their lease. All allowedips are pushed to the kernel before this
+ * returns. Returns the amount of records that were applied in full.
+ */
+size_t leases_replicate(struct wg_dynamic_leases *leases,
+			struct journal_record *recs, size_t n, bool snapshot);
+
+/*
+ * Calls cb with a record of every change to the leases, as written to the
+ * lease file, from whichever thread made it and with the lock held. cb must
+ * not block or call into the leases. A NULL cb stops the calls.
+ */
+void leases_set_observer(struct wg_dynamic_leases *leases, journal_cb_t cb,
+			 void *ctx);
+
+struct capture;
+
+/*
+ * Records every call that changes the leases to the trace c, as the
+ * interface at position iface, see capture.h. The current pools and leases
+ * are recorded first, as pool additions and imports. A NULL c stops it.
+ */
+void leases_set_capture(struct wg_dynamic_leases *leases, struct capture *c,
+			uint8_t iface);
+
+/*
+ * Fill in rec with the lease of pubkey, or with the lease holding ip (which
+ * may also be its lladdr) respectively. The latter walks all leases. Return
+ * false if there is no such lease.
+ */
+bool leases_lookup_pubkey(struct wg_dynamic_leases *leases, const wg_key pubkey,
+			  struct journal_record *rec);
+bool leases_lookup_addr(struct wg_dynamic_leases *leases,
+			const struct wg_combined_ip *ip,
+			struct journal_record *rec);
+
+/*
+ * Makes all lease changes since the last call durable, with a single sync of
+ * the lease file. Meant to be called once per event loop iteration.
+ */
+void leases_sync(struct wg_dynamic_leases *leases);
+
+/*
+ * Adds (exists) or removes the pool addr/cidr of family AF_INET or AF_INET6,
+ * as if a route to it via the interface had appeared or gone away. Must not
+ * be called concurrently with leases_update_pools().
  */
-int leases_refresh();
+void leases_set_pool(struct wg_dynamic_leases *leases, int family,
+		     const void *addr, uint8_t cidr, bool exists);
 
 /*
- * Updates all pools with information from the mnl socket nlsock.
+ * Updates the pools of all interfaces with information from the mnl socket
+ * nlsock, dispatching routes by their output interface.
  */
 void leases_update_pools(struct mnl_socket *nlsock);
 
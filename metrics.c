@@ -0,0 +1,172 @@
+/* SPDX-License-Identifier: MIT
+ *
+ * Copyright (C) 2019 WireGuard LLC. All Rights Reserved.
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+#include "dbg.h"
+#include "metrics.h"
+
+/* Histogram buckets are log-linear, like in HdrHistogram: every power of two
+ * is split into HIST_SUB buckets, so each bucket covers at most 1/HIST_SUB of
+ * its values, up to 2^(HIST_MIN_SHIFT + HIST_OCTAVES) ns (~17s) and with
+ * everything below 2^HIST_MIN_SHIFT ns (~1us) in the first bucket. Finding
+ * the bucket of a value takes a single clz.
+ */
+#define HIST_MIN_SHIFT 10
+#define HIST_OCTAVES 24
+#define HIST_SUB_BITS 2
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (1 + HIST_OCTAVES * HIST_SUB + 1)
+
+struct histogram {
+	uint64_t buckets[HIST_BUCKETS];
+	uint64_t sum; /* in ns */
+};
+
+uint64_t metrics_counters[METRIC_COUNTERS];
+static struct histogram histograms[METRIC_HISTOGRAMS];
+
+static const char *const counter_names[METRIC_COUNTERS][2] = {
+	[METRIC_REQUESTS] = { "requests_total", "Requests answered" },
+	[METRIC_NEW_LEASES] = { "new_leases_total",
+				"Leases handed out to peers without one" },
+	[METRIC_RENEWALS] = { "renewals_total", "Leases renewed or changed" },
+	[METRIC_EXPIRIES] = { "expired_leases_total", "Leases that expired" },
+	[METRIC_POOL_EXHAUSTED] = { "pool_exhausted_total",
+				    "Addresses not handed out, the pool was "
+				    "empty" },
+	[METRIC_INDEX_REBUILDS] = { "index_rebuilds_total",
+				    "Rebuilds of the lladdr to peer index" },
+	[METRIC_ACCEPT_REJECTED] = { "accept_rejected_total",
+				     "Connections rejected, mostly from "
+				     "unknown peers" },
+	[METRIC_ROUTE_RESYNCS] = { "route_resyncs_total",
+				   "Route dumps after updates were lost" },
+	[METRIC_CONNECTIONS_EVICTED] = { "connections_evicted_total",
+					 "Idle connections closed early to "
+					 "make room for new ones" },
+	[METRIC_BUSY_RESPONSES] = { "busy_responses_total",
+				    "Requests turned away because all "
+				    "connections were in use" },
+	[METRIC_REUSED_ADDRESSES] = { "reused_addresses_total",
+				      "Addresses given back to a peer whose "
+				      "lease had expired" },
+	[METRIC_REPLICATED_RECORDS] = { "replicated_records_total",
+					"Lease records sent to a standby, or "
+					"applied from the primary" },
+	[METRIC_REPLICATION_SNAPSHOTS] = { "replication_snapshots_total",
+					   "Snapshots of all leases sent to a "
+					   "standby" },
+	[METRIC_REPLICATION_STREAMS] = { "replication_streams_total",
+					 "Replication connections established, "
+					 "to a standby or the primary" },
+};
+
+static const char *const histogram_names[METRIC_HISTOGRAMS][2] = {
+	[HIST_HANDLE_CLIENT] = { "handle_client_seconds",
+				 "Time spent in handle_client()" },
+	[HIST_SET_LEASE] = { "set_lease_seconds", "Time spent in set_lease()" },
+	[HIST_WG_SET_DEVICE] = { "wg_set_device_seconds",
+				 "Time spent in wg_set_device()" },
+	[HIST_LEASES_REFRESH] = { "leases_refresh_seconds",
+				  "Time spent in leases_refresh()" },
+	[HIST_UPDATE_POOLS] = { "update_pools_seconds",
+				"Time spent in leases_update_pools()" },
+};
+
+uint64_t metrics_start()
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts))
+		fatal("clock_gettime(CLOCK_MONOTONIC)");
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Shifted by one, so the upper bound of a bucket is part of it, like the le
+ * label of Prometheus says
+ */
+static unsigned int bucket_of(uint64_t ns)
+{
+	uint64_t v = ns ? ns - 1 : 0;
+	unsigned int msb;
+
+	if (v < (1ULL << HIST_MIN_SHIFT))
+		return 0;
+
+	msb = 63 - __builtin_clzll(v);
+	if (msb - HIST_MIN_SHIFT >= HIST_OCTAVES)
+		return HIST_BUCKETS - 1;
+
+	return 1 + (msb - HIST_MIN_SHIFT) * HIST_SUB +
+	       ((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* Largest value in bucket i, in ns */
+static uint64_t bucket_le(unsigned int i)
+{
+	unsigned int octave, sub;
+
+	if (!i)
+		return 1ULL << HIST_MIN_SHIFT;
+
+	octave = (i - 1) / HIST_SUB;
+	sub = (i - 1) % HIST_SUB;
+	return (uint64_t)(HIST_SUB + sub + 1)
+	       << (octave + HIST_MIN_SHIFT - HIST_SUB_BITS);
+}
+
+void metrics_observe(enum metrics_histogram hist, uint64_t start)
+{
+	struct histogram *h = &histograms[hist];
+	uint64_t ns = metrics_start() - start;
+
+	__atomic_fetch_add(&h->buckets[bucket_of(ns)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->sum, ns, __ATOMIC_RELAXED);
+}
+
+void metrics_write(FILE *f)
+{
+	for (int i = 0; i < METRIC_COUNTERS; ++i) {
+		fprintf(f, "# HELP wg_dynamic_%s %s\n", counter_names[i][0],
+			counter_names[i][1]);
+		fprintf(f, "# TYPE wg_dynamic_%s counter\n",
+			counter_names[i][0]);
+		fprintf(f, "wg_dynamic_%s %ju\n", counter_names[i][0],
+			(uintmax_t)__atomic_load_n(&metrics_counters[i],
+						   __ATOMIC_RELAXED));
+	}
+
+	for (int i = 0; i < METRIC_HISTOGRAMS; ++i) {
+		const char *name = histogram_names[i][0];
+		struct histogram *h = &histograms[i];
+		uint64_t count = 0;
+
+		fprintf(f, "# HELP wg_dynamic_%s %s\n", name,
+			histogram_names[i][1]);
+		fprintf(f, "# TYPE wg_dynamic_%s histogram\n", name);
+
+		/* the count is summed up from the buckets, so it always
+		 * matches the +Inf bucket even while observations come in
+		 */
+		for (unsigned int j = 0; j < HIST_BUCKETS; ++j) {
+			count += __atomic_load_n(&h->buckets[j],
+						 __ATOMIC_RELAXED);
+			if (j == HIST_BUCKETS - 1)
+				fprintf(f, "wg_dynamic_%s_bucket{le=\"+Inf\"} "
+					"%ju\n", name, (uintmax_t)count);
+			else
+				fprintf(f, "wg_dynamic_%s_bucket{le=\"%.9g\"} "
+					"%ju\n", name, bucket_le(j) / 1e9,
+					(uintmax_t)count);
+		}
+
+		fprintf(f, "wg_dynamic_%s_sum %.9f\n", name,
+			__atomic_load_n(&h->sum, __ATOMIC_RELAXED) / 1e9);
+		fprintf(f, "wg_dynamic_%s_count %ju\n", name, (uintmax_t)count);
+	}
+}
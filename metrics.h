@@ -0,0 +1,70 @@
+/* SPDX-License-Identifier: MIT
+ *
+ * Copyright (C) 2019 WireGuard LLC. All Rights Reserved.
+ */
+
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+enum metrics_counter {
+	METRIC_REQUESTS,
+	METRIC_NEW_LEASES,
+	METRIC_RENEWALS,
+	METRIC_EXPIRIES,
+	METRIC_POOL_EXHAUSTED,
+	METRIC_INDEX_REBUILDS,
+	METRIC_ACCEPT_REJECTED,
+	METRIC_ROUTE_RESYNCS,
+	METRIC_CONNECTIONS_EVICTED,
+	METRIC_BUSY_RESPONSES,
+	METRIC_REUSED_ADDRESSES,
+	METRIC_REPLICATED_RECORDS,
+	METRIC_REPLICATION_SNAPSHOTS,
+	METRIC_REPLICATION_STREAMS,
+	METRIC_COUNTERS
+};
+
+enum metrics_histogram {
+	HIST_HANDLE_CLIENT,
+	HIST_SET_LEASE,
+	HIST_WG_SET_DEVICE,
+	HIST_LEASES_REFRESH,
+	HIST_UPDATE_POOLS,
+	METRIC_HISTOGRAMS
+};
+
+extern uint64_t metrics_counters[METRIC_COUNTERS];
+
+/* Counters and histograms are only ever updated with relaxed atomics, so
+ * they can be used from any thread without taking a lock.
+ */
+static inline void metrics_inc(enum metrics_counter counter)
+{
+	__atomic_fetch_add(&metrics_counters[counter], 1, __ATOMIC_RELAXED);
+}
+
+static inline void metrics_add(enum metrics_counter counter, uint64_t n)
+{
+	__atomic_fetch_add(&metrics_counters[counter], n, __ATOMIC_RELAXED);
+}
+
+/*
+ * Returns the current time in ns, to be passed to metrics_observe() later.
+ */
+uint64_t metrics_start();
+
+/*
+ * Records the time since start, as returned by metrics_start(), in the
+ * latency histogram hist.
+ */
+void metrics_observe(enum metrics_histogram hist, uint64_t start);
+
+/*
+ * Writes all counters and histograms to f, in the Prometheus text format.
+ */
+void metrics_write(FILE *f);
+
+#endif
@@ -49,7 +49,8 @@ enum wgdevice_attribute {
 
 enum wgpeer_flag {
 	WGPEER_F_REMOVE_ME = 1U << 0,
-	WGPEER_F_REPLACE_ALLOWEDIPS = 1U << 1
+	WGPEER_F_REPLACE_ALLOWEDIPS = 1U << 1,
+	WGPEER_F_UPDATE_ONLY = 1U << 2
 };
 enum wgpeer_attribute {
 	WGPEER_A_UNSPEC,
@@ -93,8 +94,7 @@ static struct nlmsghdr *__mnlg_msg_prepare(struct mnlg_socket *nlg, uint8_t cmd,
 	nlh = mnl_nlmsg_put_header(nlg->buf);
 	nlh->nlmsg_type	= id;
 	nlh->nlmsg_flags = flags;
-	nlg->seq = time(NULL);
-	nlh->nlmsg_seq = nlg->seq;
+	nlh->nlmsg_seq = ++nlg->seq;
 
 	genl = mnl_nlmsg_put_extra_header(nlh, sizeof(struct genlmsghdr));
 	genl->cmd = cmd;
@@ -178,6 +178,22 @@ static int mnlg_socket_recv_run(struct mnlg_socket *nlg, mnl_cb_t data_cb, void
 	return err;
 }
 
+/* Collects the ACKs of n requests sent back to back, the first of which had
+ * sequence number first_seq
+ */
+static int mnlg_socket_recv_acks(struct mnlg_socket *nlg, unsigned int first_seq,
+				 unsigned int n)
+{
+	for (unsigned int i = 0; i < n; ++i) {
+		nlg->seq = first_seq + i;
+		errno = 0;
+		if (mnlg_socket_recv_run(nlg, NULL, NULL) < 0)
+			return errno ? -errno : -EINVAL;
+	}
+
+	return 0;
+}
+
 static int get_family_id_attr_cb(const struct nlattr *attr, void *data)
 {
 	const struct nlattr **tb = data;
@@ -232,6 +248,7 @@ static struct mnlg_socket *mnlg_socket_open(const char *family_name, uint8_t ver
 	}
 
 	nlg->portid = mnl_socket_get_portid(nlg->nl);
+	nlg->seq = time(NULL);
 
 	nlh = __mnlg_msg_prepare(nlg, CTRL_CMD_GETFAMILY,
 				 NLM_F_REQUEST | NLM_F_ACK, GENL_ID_CTRL, 1);
@@ -272,6 +289,31 @@ static void mnlg_socket_close(struct mnlg_socket *nlg)
 	free(nlg);
 }
 
+/* Each thread keeps its genetlink socket, along with the resolved family id,
+ * instead of opening one per request. It is dropped after any error, since
+ * replies to an aborted request may still be queued on it, and reopened on
+ * next use.
+ */
+static __thread struct mnlg_socket *wg_nlg;
+
+/* How many SET_DEVICE messages are sent before their ACKs are collected */
+#define WG_SET_DEVICE_INFLIGHT 32
+
+static struct mnlg_socket *wg_socket(bool *cached)
+{
+	*cached = wg_nlg;
+	if (!wg_nlg)
+		wg_nlg = mnlg_socket_open(WG_GENL_NAME, WG_GENL_VERSION);
+	return wg_nlg;
+}
+
+void wg_close_netlink(void)
+{
+	if (wg_nlg)
+		mnlg_socket_close(wg_nlg);
+	wg_nlg = NULL;
+}
+
 struct inflatable_buffer {
 	char *buffer;
 	char *next;
@@ -486,21 +528,19 @@ cleanup:
 	return ret;
 }
 
-int wg_set_device(wg_device *dev)
+static int __wg_set_device(struct mnlg_socket *nlg, wg_device *dev)
 {
 	int ret = 0;
 	wg_peer *peer = NULL;
 	wg_allowedip *allowedip = NULL;
 	struct nlattr *peers_nest, *peer_nest, *allowedips_nest, *allowedip_nest;
 	struct nlmsghdr *nlh;
-	struct mnlg_socket *nlg;
-
-	nlg = mnlg_socket_open(WG_GENL_NAME, WG_GENL_VERSION);
-	if (!nlg)
-		return -errno;
+	unsigned int first_seq = 0, inflight = 0;
 
 again:
 	nlh = mnlg_msg_prepare(nlg, WG_CMD_SET_DEVICE, NLM_F_REQUEST | NLM_F_ACK);
+	if (!inflight)
+		first_seq = nlh->nlmsg_seq;
 	mnl_attr_put_strz(nlh, WGDEVICE_A_IFNAME, dev->name);
 
 	if (!peer) {
@@ -531,6 +571,8 @@ again:
 			goto toobig_peers;
 		if (peer->flags & WGPEER_REMOVE_ME)
 			flags |= WGPEER_F_REMOVE_ME;
+		if (peer->flags & WGPEER_UPDATE_ONLY)
+			flags |= WGPEER_F_UPDATE_ONLY;
 		if (!allowedip) {
 			if (peer->flags & WGPEER_REPLACE_ALLOWEDIPS)
 				flags |= WGPEER_F_REPLACE_ALLOWEDIPS;
@@ -606,16 +648,41 @@ send:
 		ret = -errno;
 		goto out;
 	}
-	errno = 0;
-	if (mnlg_socket_recv_run(nlg, NULL, NULL) < 0) {
-		ret = errno ? -errno : -EINVAL;
+	/* the kernel copied the message, so the next one can be built in the
+	 * same buffer before this one is acknowledged
+	 */
+	if (peer && ++inflight < WG_SET_DEVICE_INFLIGHT)
+		goto again;
+	ret = mnlg_socket_recv_acks(nlg, first_seq, inflight + !peer);
+	if (ret)
 		goto out;
-	}
+	inflight = 0;
 	if (peer)
 		goto again;
 
 out:
-	mnlg_socket_close(nlg);
+	errno = -ret;
+	return ret;
+}
+
+int wg_set_device(wg_device *dev)
+{
+	struct mnlg_socket *nlg;
+	bool cached;
+	int ret;
+
+	nlg = wg_socket(&cached);
+	if (!nlg)
+		return -errno;
+
+	ret = __wg_set_device(nlg, dev);
+	if (ret) {
+		wg_close_netlink();
+		/* the family may have been re-registered since we cached it */
+		if (cached)
+			return wg_set_device(dev);
+	}
+
 	errno = -ret;
 	return ret;
 }
@@ -837,13 +904,14 @@ int wg_get_device(wg_device **device, const char *device_name)
 	int ret = 0;
 	struct nlmsghdr *nlh;
 	struct mnlg_socket *nlg;
+	bool cached;
 
 try_again:
 	*device = calloc(1, sizeof(wg_device));
 	if (!*device)
 		return -errno;
 
-	nlg = mnlg_socket_open(WG_GENL_NAME, WG_GENL_VERSION);
+	nlg = wg_socket(&cached);
 	if (!nlg) {
 		wg_free_device(*device);
 		*device = NULL;
@@ -864,11 +932,10 @@ try_again:
 	coalesce_peers(*device);
 
 out:
-	if (nlg)
-		mnlg_socket_close(nlg);
 	if (ret) {
+		wg_close_netlink();
 		wg_free_device(*device);
-		if (ret == -EINTR)
+		if (ret == -EINTR || cached)
 			goto try_again;
 		*device = NULL;
 	}
@@ -876,6 +943,171 @@ out:
 	return ret;
 }
 
+/* State of wg_for_each_peer_stream(). The peer last parsed is held back in
+ * peer, since the kernel continues the allowedips of a peer in the next
+ * message if they don't fit, repeating only its public key. Allowedips are
+ * kept in one array, reused for all peers.
+ */
+struct peer_stream {
+	wg_device *device;
+	wg_peer peer, next;
+	bool pending; /* peer is yet to be handed to cb */
+	wg_allowedip *allowedips;
+	size_t nallowedips, maxallowedips;
+	wg_peer_cb cb;
+	void *ctx;
+	int ret; /* of cb, if it stopped the dump */
+};
+
+/* Hands the pending peer with the first n allowedips to the callback */
+static int stream_flush_peer(struct peer_stream *s, size_t n)
+{
+	wg_peer *peer = &s->peer;
+
+	peer->first_allowedip = peer->last_allowedip = NULL;
+	peer->next_peer = NULL;
+	for (size_t i = 0; i < n; ++i)
+		s->allowedips[i].next_allowedip = i + 1 < n ? &s->allowedips[i + 1] : NULL;
+	if (n) {
+		peer->first_allowedip = &s->allowedips[0];
+		peer->last_allowedip = &s->allowedips[n - 1];
+	}
+
+	s->pending = false;
+	s->ret = s->cb(s->device, peer, s->ctx);
+	return s->ret;
+}
+
+static int stream_parse_allowedips(const struct nlattr *attr, void *data)
+{
+	struct peer_stream *s = data;
+	wg_allowedip *allowedip;
+	int ret;
+
+	if (s->nallowedips == s->maxallowedips) {
+		size_t max = s->maxallowedips ? 2 * s->maxallowedips : 16;
+		wg_allowedip *tmp = realloc(s->allowedips, max * sizeof(*tmp));
+
+		if (!tmp)
+			return MNL_CB_ERROR;
+		s->allowedips = tmp;
+		s->maxallowedips = max;
+	}
+	allowedip = &s->allowedips[s->nallowedips];
+	memset(allowedip, 0, sizeof(*allowedip));
+	ret = mnl_attr_parse_nested(attr, parse_allowedip, allowedip);
+	if (!ret)
+		return ret;
+	if (!((allowedip->family == AF_INET && allowedip->cidr <= 32) || (allowedip->family == AF_INET6 && allowedip->cidr <= 128))) {
+		errno = EAFNOSUPPORT;
+		return MNL_CB_ERROR;
+	}
+	++s->nallowedips;
+	return MNL_CB_OK;
+}
+
+static int stream_parse_peer(const struct nlattr *attr, void *data)
+{
+	struct peer_stream *s = data;
+
+	if (mnl_attr_get_type(attr) == WGPEER_A_ALLOWEDIPS)
+		return mnl_attr_parse_nested(attr, stream_parse_allowedips, s);
+	return parse_peer(attr, &s->next);
+}
+
+static int stream_parse_peers(const struct nlattr *attr, void *data)
+{
+	struct peer_stream *s = data;
+	size_t first = s->nallowedips;
+	int ret;
+
+	memset(&s->next, 0, sizeof(s->next));
+	ret = mnl_attr_parse_nested(attr, stream_parse_peer, s);
+	if (!ret)
+		return ret;
+	if (!(s->next.flags & WGPEER_HAS_PUBLIC_KEY)) {
+		errno = ENXIO;
+		return MNL_CB_ERROR;
+	}
+
+	/* continues the pending peer, whose other attributes came first */
+	if (s->pending && !memcmp(s->peer.public_key, s->next.public_key, sizeof(wg_key)))
+		return MNL_CB_OK;
+
+	if (s->pending && stream_flush_peer(s, first))
+		return MNL_CB_ERROR;
+	memmove(s->allowedips, s->allowedips + first, (s->nallowedips - first) * sizeof(*s->allowedips));
+	s->nallowedips -= first;
+	s->peer = s->next;
+	s->pending = true;
+	return MNL_CB_OK;
+}
+
+static int stream_parse_device(const struct nlattr *attr, void *data)
+{
+	struct peer_stream *s = data;
+
+	if (mnl_attr_get_type(attr) == WGDEVICE_A_PEERS)
+		return mnl_attr_parse_nested(attr, stream_parse_peers, s);
+	return parse_device(attr, s->device);
+}
+
+static int read_stream_cb(const struct nlmsghdr *nlh, void *data)
+{
+	return mnl_attr_parse(nlh, sizeof(struct genlmsghdr), stream_parse_device, data);
+}
+
+int wg_for_each_peer_stream(const char *device_name, wg_device *device,
+			    wg_peer_cb cb, void *ctx)
+{
+	struct peer_stream s = { .cb = cb, .ctx = ctx };
+	struct nlmsghdr *nlh;
+	struct mnlg_socket *nlg;
+	wg_device local;
+	bool cached;
+	int ret;
+
+	s.device = device ? device : &local;
+
+try_again:
+	memset(s.device, 0, sizeof(*s.device));
+	s.pending = false;
+	s.nallowedips = 0;
+
+	nlg = wg_socket(&cached);
+	if (!nlg) {
+		ret = -errno;
+		goto out;
+	}
+
+	nlh = mnlg_msg_prepare(nlg, WG_CMD_GET_DEVICE, NLM_F_REQUEST | NLM_F_ACK | NLM_F_DUMP);
+	mnl_attr_put_strz(nlh, WGDEVICE_A_IFNAME, device_name);
+	if (mnlg_socket_send(nlg, nlh) < 0) {
+		ret = -errno;
+		goto err;
+	}
+	errno = 0;
+	if (mnlg_socket_recv_run(nlg, read_stream_cb, &s) < 0) {
+		ret = errno ? -errno : -EINVAL;
+		goto err;
+	}
+	ret = s.pending ? stream_flush_peer(&s, s.nallowedips) : 0;
+	goto out;
+
+err:
+	/* the rest of the dump may still be queued on the socket */
+	wg_close_netlink();
+	if (s.ret)
+		ret = s.ret;
+	else if (ret == -EINTR || cached)
+		goto try_again;
+out:
+	free(s.allowedips);
+	if (ret < 0)
+		errno = -ret;
+	return ret;
+}
+
 /* first\0second\0third\0forth\0last\0\0 */
 char *wg_list_device_names(void)
 {
@@ -38,7 +38,8 @@ enum wg_peer_flags {
 	WGPEER_REPLACE_ALLOWEDIPS = 1U << 1,
 	WGPEER_HAS_PUBLIC_KEY = 1U << 2,
 	WGPEER_HAS_PRESHARED_KEY = 1U << 3,
-	WGPEER_HAS_PERSISTENT_KEEPALIVE_INTERVAL = 1U << 4
+	WGPEER_HAS_PERSISTENT_KEEPALIVE_INTERVAL = 1U << 4,
+	WGPEER_UPDATE_ONLY = 1U << 5
 };
 
 typedef struct wg_peer {
@@ -88,8 +89,18 @@ typedef struct wg_device {
 #define wg_for_each_peer(__dev, __peer) for ((__peer) = (__dev)->first_peer; (__peer); (__peer) = (__peer)->next_peer)
 #define wg_for_each_allowedip(__peer, __allowedip) for ((__allowedip) = (__peer)->first_allowedip; (__allowedip); (__allowedip) = (__allowedip)->next_allowedip)
 
+typedef int (*wg_peer_cb)(const wg_device *dev, const wg_peer *peer, void *ctx);
+
 int wg_set_device(wg_device *dev);
 int wg_get_device(wg_device **dev, const char *device_name);
+/* Dumps the peers of a device without building a wg_device of them: cb is
+ * called with each peer, which is only valid during the call, and with dev
+ * holding the attributes of the device. dev may be NULL, else it is filled
+ * in as well, even without any peers; its peer list stays empty. A non-zero
+ * return value of cb stops the dump and is returned. If the peers change
+ * during the dump, it starts over and cb may see a peer again.
+ */
+int wg_for_each_peer_stream(const char *device_name, wg_device *dev, wg_peer_cb cb, void *ctx);
 int wg_add_device(const char *device_name);
 int wg_del_device(const char *device_name);
 void wg_free_device(wg_device *dev);
@@ -97,5 +108,6 @@ char *wg_list_device_names(void); /* first\0second\0third\0forth\0last\0\0 */
 void wg_key_to_base64(wg_key_b64_string base64, const wg_key key);
 int wg_key_from_base64(wg_key key, const wg_key_b64_string base64);
 bool wg_key_is_zero(const wg_key key);
+void wg_close_netlink(void); /* of the calling thread, reopened when needed */
 
 #endif
@@ -9,12 +9,17 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
 
 #include "dbg.h"
 #include "radix-trie.h"
+#include "trace.h"
 
 #ifndef __aligned
 #define __aligned(x) __attribute__((aligned(x)))
@@ -24,14 +29,39 @@ enum radix_node_flags {
 	RNODE_IS_LEAF = 1U << 0,
 	RNODE_IS_POOLNODE = 1U << 1,
 	RNODE_IS_SHADOWED = 1U << 2,
+	RNODE_IS_BLOCK = 1U << 3,
 };
 
+/* The key is stored inline at the end of the node and is only as long as the
+ * address family requires, so ipv4 nodes are smaller than ipv6 ones. Nodes are
+ * never allocated directly, but always through new_node() from the slab of the
+ * corresponding trie.
+ */
 struct radix_node {
 	struct radix_node *bit[2];
 	uint64_t left;
 	uint64_t right;
-	uint8_t bits[16];
 	uint8_t cidr, bit_at_a, bit_at_b, flags;
+	uint8_t bits[] __aligned(__alignof(uint64_t));
+};
+
+/* Dense parts of a pool are kept in blocks of RADIX_BLOCK_SIZE addresses, with
+ * a bitmap of the ones taken stored right after the key, instead of one leaf
+ * node per address. A block is a node like any other, without children, and
+ * its left and right count what's free in either half of the bitmap. Blocks
+ * are only created in ranges that lie entirely inside a pool and don't
+ * contain any other node, so a lonely address costs about what a leaf does.
+ * A range that already has leaves in it keeps growing leaves, and a block is
+ * turned back into leaves if a pool is added inside of it.
+ */
+#define RADIX_BLOCK_BITS 6
+#define RADIX_BLOCK_SIZE (1U << RADIX_BLOCK_BITS)
+
+#define RADIX_SLAB_CHUNK 1024
+
+struct radix_chunk {
+	struct radix_chunk *next;
+	uint64_t data[];
 };
 
 struct radix_pool {
@@ -79,15 +109,115 @@ static uint8_t common_bits(const struct radix_node *node, const uint8_t *key,
 	return 0;
 }
 
-static struct radix_node *new_node(const uint8_t *key, uint8_t cidr,
-				   uint8_t bits)
+static size_t key_size(uint8_t bits)
+{
+	size_t align = __alignof(uint64_t);
+
+	return (bits / 8U + align - 1) / align * align;
+}
+
+static uint64_t *block_map(struct radix_node *block, uint8_t bits)
+{
+	return (uint64_t *)(block->bits + key_size(bits));
+}
+
+/* Position of key in the block covering it */
+static unsigned int block_index(const uint8_t *key, uint8_t bits)
+{
+	if (bits == 32)
+		return *(const uint32_t *)key & (RADIX_BLOCK_SIZE - 1);
+
+	return *(const uint64_t *)&key[8] & (RADIX_BLOCK_SIZE - 1);
+}
+
+/* Position of the n-th zero bit in word, counting from the lowest one */
+static unsigned int nth_zero(uint64_t word, unsigned int n)
+{
+	uint64_t free = ~word;
+#ifdef __BMI2__
+	return __builtin_ctzll(_pdep_u64(1ULL << n, free));
+#else
+	unsigned int pos = 0, count;
+
+	for (unsigned int width = 32; width >= 8; width /= 2) {
+		count = __builtin_popcountll(free & ((1ULL << width) - 1));
+		if (n >= count) {
+			n -= count;
+			free >>= width;
+			pos += width;
+		}
+	}
+
+	while (n--)
+		free &= free - 1;
+
+	return pos + __builtin_ctzll(free);
+#endif
+}
+
+static void slab_init(struct radix_slab *slab, size_t size)
+{
+	size_t align = __alignof(struct radix_node);
+
+	slab->objsize = offsetof(struct radix_node, bits) + size;
+	slab->objsize = (slab->objsize + align - 1) / align * align;
+	slab->chunks = NULL;
+	slab->freelist = NULL;
+	slab->chunk_used = RADIX_SLAB_CHUNK;
+}
+
+static void slab_release(struct radix_slab *slab)
+{
+	for (struct radix_chunk *next, *cur = slab->chunks; cur; cur = next) {
+		next = cur->next;
+		free(cur);
+	}
+
+	slab->chunks = NULL;
+	slab->freelist = NULL;
+	slab->chunk_used = RADIX_SLAB_CHUNK;
+}
+
+static struct radix_node *slab_alloc(struct radix_slab *slab)
+{
+	struct radix_chunk *chunk;
+	void *obj;
+
+	if (slab->freelist) {
+		obj = slab->freelist;
+		slab->freelist = *(void **)obj;
+		return obj;
+	}
+
+	if (slab->chunk_used == RADIX_SLAB_CHUNK) {
+		chunk = malloc(sizeof *chunk + RADIX_SLAB_CHUNK * slab->objsize);
+		if (!chunk)
+			fatal("malloc()");
+
+		chunk->next = slab->chunks;
+		slab->chunks = chunk;
+		slab->chunk_used = 0;
+	}
+
+	obj = (uint8_t *)slab->chunks->data + slab->chunk_used * slab->objsize;
+	++slab->chunk_used;
+
+	return obj;
+}
+
+static void slab_free(struct radix_slab *slab, struct radix_node *node)
+{
+	*(void **)node = slab->freelist;
+	slab->freelist = node;
+}
+
+static struct radix_node *new_node(struct radix_slab *slab, const uint8_t *key,
+				   uint8_t cidr, uint8_t bits)
 {
 	struct radix_node *node;
 	uint64_t mask;
 
-	node = malloc(sizeof *node);
-	if (!node)
-		fatal("malloc()");
+	node = slab_alloc(slab);
 
 	node->bit[0] = node->bit[1] = NULL;
 	node->cidr = cidr;
@@ -118,8 +248,9 @@ static bool prefix_matches(const struct radix_node *node, const uint8_t *key,
 	return common_bits(node, key, bits) >= node->cidr;
 }
 
-#define CHOOSE_NODE(parent, key)                                               \
-	(parent)->bit[(key[(parent)->bit_at_a] >> (parent)->bit_at_b) & 1]
+#define CHOOSE_BIT(parent, key)                                                \
+	((key[(parent)->bit_at_a] >> (parent)->bit_at_b) & 1)
+#define CHOOSE_NODE(parent, key) (parent)->bit[CHOOSE_BIT(parent, key)]
 
 static uint64_t subnet_diff(uint8_t *ip1, uint8_t *ip2, uint8_t bits)
 {
@@ -137,12 +268,72 @@ static uint64_t taken_ips(struct radix_node *node, uint8_t bits)
 	return (1ULL << (bits - node->cidr)) - (node->left + node->right);
 }
 
-static void add_nth(struct radix_node *start, uint8_t bits, uint64_t n,
-		    uint8_t *dest)
+/* A block holding only key, which is taken */
+static struct radix_node *new_block(struct radix_slab *blocks,
+				    const uint8_t *key, uint8_t bits)
+{
+	struct radix_node *block;
+	unsigned int index = block_index(key, bits);
+
+	block = new_node(blocks, key, bits - RADIX_BLOCK_BITS, bits);
+	block->flags = RNODE_IS_BLOCK;
+	*block_map(block, bits) = 1ULL << index;
+	if (index >= RADIX_BLOCK_SIZE / 2)
+		--block->right;
+	else
+		--block->left;
+
+	return block;
+}
+
+/* Hangs newnode below parent, where down is in the way if it's not NULL */
+static void link_node(struct radix_slab *slab, struct radix_node *parent,
+		      struct radix_node *down, struct radix_node *newnode,
+		      uint8_t bits)
+{
+	struct radix_node *between;
+	uint8_t cidr;
+
+	if (!down) {
+		CHOOSE_NODE(parent, newnode->bits) = newnode;
+		return;
+	}
+
+	cidr = MIN(newnode->cidr, common_bits(down, newnode->bits, bits));
+	between = new_node(slab, newnode->bits, cidr, bits);
+
+	CHOOSE_NODE(between, down->bits) = down;
+	CHOOSE_NODE(between, newnode->bits) = newnode;
+	CHOOSE_NODE(parent, between->bits) = between;
+
+	between->left -= taken_ips(between->bit[0], bits);
+	between->right -= taken_ips(between->bit[1], bits);
+}
+
+/* Takes the address key from the nodes above start, which add_nth() only
+ * counts from start on, like decrement_radix() does for the others
+ */
+static void decrement_above(struct radix_node *trie, struct radix_node *start,
+			    const uint8_t *key)
+{
+	for (struct radix_node *node = trie; node != start;
+	     node = CHOOSE_NODE(node, key)) {
+		if (CHOOSE_BIT(node, key))
+			--(node->right);
+		else
+			--(node->left);
+	}
+}
+
+/* Takes the n-th free address below start, a node of trie, and stores it in
+ * dest
+ */
+static void add_nth(struct radix_slab *slab, struct radix_slab *blocks,
+		    struct radix_node *trie, struct radix_node *start,
+		    uint8_t bits, uint64_t n, uint8_t *dest)
 {
-	struct radix_node *target = start, *parent, *newnode, *between;
+	struct radix_node *target = start, *parent, *newnode;
 	uint8_t ip[16] __aligned(__alignof(uint64_t));
-	uint8_t cidr = bits;
 	uint64_t result, free_ips, diff;
 
 	BUG_ON(n > target->left + target->right - 1);
@@ -150,6 +341,18 @@ static void add_nth(struct radix_node *start, uint8_t bits, uint64_t n,
 	do {
 		parent = target;
 
+		if (parent->flags & RNODE_IS_BLOCK) {
+			n = nth_zero(*block_map(parent, bits), n);
+			*block_map(parent, bits) |= 1ULL << n;
+			if (n >= RADIX_BLOCK_SIZE / 2)
+				--(parent->right);
+			else
+				--(parent->left);
+
+			target = NULL;
+			break;
+		}
+
 		if (n >= parent->left) {
 			target = parent->bit[1];
 			BUG_ON(!parent->right);
@@ -191,28 +394,28 @@ static void add_nth(struct radix_node *start, uint8_t bits, uint64_t n,
 		memcpy(ip, &parent->bits, 8);
 		memcpy(ip + 8, &result, 8);
 	}
-
-	newnode = new_node(ip, cidr, bits);
-	newnode->flags |= RNODE_IS_LEAF;
 	swap_endian(dest, (const uint8_t *)ip, bits);
+	decrement_above(trie, start, ip);
 
-	if (!target) {
-		CHOOSE_NODE(parent, newnode->bits) = newnode;
-	} else {
-		cidr = MIN(cidr, common_bits(target, ip, bits));
-		between = new_node(newnode->bits, cidr, bits);
-
-		CHOOSE_NODE(between, target->bits) = target;
-		CHOOSE_NODE(between, newnode->bits) = newnode;
-		CHOOSE_NODE(parent, between->bits) = between;
+	if (parent->flags & RNODE_IS_BLOCK)
+		return;
 
-		between->left -= taken_ips(between->bit[0], bits);
-		between->right -= taken_ips(between->bit[1], bits);
+	/* start a block if its range has nothing else in it */
+	if (parent->cidr < bits - RADIX_BLOCK_BITS &&
+	    (!target ||
+	     common_bits(target, ip, bits) < bits - RADIX_BLOCK_BITS)) {
+		newnode = new_block(blocks, ip, bits);
+	} else {
+		newnode = new_node(slab, ip, bits, bits);
+		newnode->flags = RNODE_IS_LEAF;
 	}
+
+	link_node(slab, parent, target, newnode, bits);
 }
 
-static struct radix_node *add(struct radix_node **trie, uint8_t bits,
-			      const uint8_t *key, uint8_t cidr, uint8_t type)
+static struct radix_node *add(struct radix_slab *slab, struct radix_node **trie,
+			      uint8_t bits, const uint8_t *key, uint8_t cidr,
+			      uint8_t type)
 {
 	struct radix_node *node = NULL, *newnode, *down, *parent, *tmp = *trie;
 	bool exact = false, in_pool = false;
@@ -228,7 +431,7 @@ static struct radix_node *add(struct radix_node **trie, uint8_t bits,
 			return NULL;
 		}
 
-		*trie = new_node(key, cidr, bits);
+		*trie = new_node(slab, key, cidr, bits);
 		(*trie)->flags = type;
 		return *trie;
 	}
@@ -262,7 +465,7 @@ static struct radix_node *add(struct radix_node **trie, uint8_t bits,
 		return node;
 	}
 
-	newnode = new_node(key, cidr, bits);
+	newnode = new_node(slab, key, cidr, bits);
 	newnode->flags = type;
 
 	if (!node) {
@@ -285,7 +488,7 @@ static struct radix_node *add(struct radix_node **trie, uint8_t bits,
 		else
 			CHOOSE_NODE(parent, newnode->bits) = newnode;
 	} else {
-		node = new_node(newnode->bits, cidr, bits);
+		node = new_node(slab, newnode->bits, cidr, bits);
 
 		CHOOSE_NODE(node, down->bits) = down;
 		CHOOSE_NODE(node, newnode->bits) = newnode;
@@ -304,20 +507,6 @@ static struct radix_node *add(struct radix_node **trie, uint8_t bits,
 	return newnode;
 }
 
-static void radix_free_nodes(struct radix_node *node)
-{
-	for (struct radix_node *next; node; node = next) {
-		next = node->bit[0];
-		if (next) {
-			node->bit[0] = next->bit[1];
-			next->bit[1] = node;
-		} else {
-			next = node->bit[1];
-			free(node);
-		}
-	}
-}
-
 static void decrement_radix(struct radix_node *trie, uint8_t bits,
 			    const uint8_t *key)
 {
@@ -327,48 +516,81 @@ static void decrement_radix(struct radix_node *trie, uint8_t bits,
 		if (node->cidr == bits)
 			break;
 
-		if (CHOOSE_NODE(node, key) == node->bit[0])
-			--(node->left);
-		else
+		if (CHOOSE_BIT(node, key))
 			--(node->right);
+		else
+			--(node->left);
 
 		node = CHOOSE_NODE(node, key);
 	}
 }
 
-static int insert_v4(struct radix_node **root, const struct in_addr *ip,
-		     uint8_t cidr)
+/* Marks key as taken in the block covering it, creating that block if it may
+ * have one. Returns 1 if key belongs into a leaf instead, see add().
+ */
+static int add_to_block(struct radix_slab *slab, struct radix_slab *blocks,
+			struct radix_node **trie, uint8_t bits,
+			const uint8_t *key)
 {
-	/* Aligned so it can be passed to fls */
-	uint8_t key[4] __aligned(__alignof(uint32_t));
+	struct radix_node *node = NULL, *tmp = *trie, *down;
+	uint8_t cidr = bits - RADIX_BLOCK_BITS;
+	unsigned int index = block_index(key, bits);
+	bool in_pool = false;
 
-	swap_endian(key, (const uint8_t *)ip, 32);
+	while (tmp && tmp->cidr <= cidr && prefix_matches(tmp, key, bits)) {
+		node = tmp;
+		if (node->flags & RNODE_IS_POOLNODE)
+			in_pool = true;
 
-	if (add(root, 32, key, cidr, RNODE_IS_LEAF)) {
-		decrement_radix(*root, 32, (uint8_t *)key);
-		return 0;
+		if (node->flags & RNODE_IS_BLOCK) {
+			if (*block_map(node, bits) & (1ULL << index)) {
+				errno = EEXIST;
+				return -1;
+			}
+
+			*block_map(node, bits) |= 1ULL << index;
+			decrement_radix(*trie, bits, key);
+			return 0;
+		}
+
+		if (node->cidr == cidr)
+			return 1;
+
+		tmp = CHOOSE_NODE(node, key);
 	}
 
-	return -1;
+	/* the whole block has to be in a pool, with nothing else in it */
+	if (!in_pool)
+		return 1;
+
+	down = CHOOSE_NODE(node, key);
+	if (down && common_bits(down, key, bits) >= cidr)
+		return 1;
+
+	/* stops at node, since down doesn't cover key */
+	decrement_radix(*trie, bits, key);
+	link_node(slab, node, down, new_block(blocks, key, bits), bits);
+	return 0;
 }
 
-static int insert_v6(struct radix_node **root, const struct in6_addr *ip,
-		     uint8_t cidr)
+/* Takes the single address key, which must be inside of a pool */
+static int insert(struct radix_slab *slab, struct radix_slab *blocks,
+		  struct radix_node **root, uint8_t bits, const uint8_t *key)
 {
-	/* Aligned so it can be passed to fls64 */
-	uint8_t key[16] __aligned(__alignof(uint64_t));
+	int ret = add_to_block(slab, blocks, root, bits, key);
 
-	swap_endian(key, (const uint8_t *)ip, 128);
+	if (ret <= 0)
+		return ret;
 
-	if (add(root, 128, key, cidr, RNODE_IS_LEAF)) {
-		decrement_radix(*root, 128, (uint8_t *)key);
-		return 0;
-	}
+	if (!add(slab, root, bits, key, bits, RNODE_IS_LEAF))
+		return -1;
 
-	return -1;
+	decrement_radix(*root, bits, key);
+	return 0;
 }
 
-static int remove_node(struct radix_node **trie, const uint8_t *key,
+static int remove_node(struct radix_slab *slab, struct radix_slab *blocks,
+		       struct radix_node **trie, const uint8_t *key,
 		       uint8_t bits)
 {
 	struct radix_node **node = trie, **target = NULL;
@@ -381,10 +603,21 @@ static int remove_node(struct radix_node **trie, const uint8_t *key,
 			break;
 		}
 
-		if (CHOOSE_NODE(*node, key) == (*node)->bit[0])
-			pnodes[i++] = &((*node)->left);
-		else
+		if (CHOOSE_BIT(*node, key))
 			pnodes[i++] = &((*node)->right);
+		else
+			pnodes[i++] = &((*node)->left);
+
+		if ((*node)->flags & RNODE_IS_BLOCK) {
+			uint64_t bit = 1ULL << block_index(key, bits);
+
+			if (!(*block_map(*node, bits) & bit))
+				return 1; /* key not found in block */
+
+			*block_map(*node, bits) &= ~bit;
+			target = node;
+			break;
+		}
 
 		BUG_ON(i >= 127);
 		node = &CHOOSE_NODE(*node, key);
@@ -396,27 +629,94 @@ static int remove_node(struct radix_node **trie, const uint8_t *key,
 	for (int j = 0; j < i; ++j)
 		++(*(pnodes[j]));
 
-	free(*node);
-	*target = NULL;
+	if ((*target)->flags & RNODE_IS_LEAF) {
+		slab_free(slab, *target);
+		*target = NULL;
+	} else if (!*block_map(*target, bits)) {
+		slab_free(blocks, *target);
+		*target = NULL;
+	}
 
 	return 0;
 }
 
-static void totalip_inc(struct ipns *ns, uint8_t bits, uint8_t val)
+/* Turns block back into one leaf per address taken, before a pool is added
+ * inside of its range.
+ */
+static void split_block(struct radix_slab *slab, struct radix_slab *blocks,
+			struct radix_node **root, struct radix_node *block,
+			uint8_t bits)
+{
+	uint8_t key[16] __aligned(__alignof(uint64_t));
+	uint64_t map = *block_map(block, bits), base, tmp;
+
+	memcpy(key, block->bits, bits / 8U);
+	if (bits == 32)
+		base = *(const uint32_t *)key;
+	else
+		base = *(const uint64_t *)&key[8];
+
+	/* the block is freed along with its last address */
+	for (int pass = 0; pass < 2; ++pass) {
+		for (tmp = map; tmp; tmp &= tmp - 1) {
+			uint64_t addr = base + __builtin_ctzll(tmp);
+
+			if (bits == 32)
+				*(uint32_t *)key = addr;
+			else
+				*(uint64_t *)&key[8] = addr;
+
+			if (!pass) {
+				BUG_ON(remove_node(slab, blocks, root, key,
+						   bits));
+				continue;
+			}
+
+			BUG_ON(!add(slab, root, bits, key, bits,
+				    RNODE_IS_LEAF));
+			decrement_radix(*root, bits, key);
+		}
+	}
+}
+
+/* Adds left + right addresses to the totals; the sum may be 2^64 */
+static void totalip_add(struct ipns *ns, uint8_t bits, uint64_t left,
+			uint64_t right)
 {
 	if (bits == 32) {
-		BUG_ON(val > 32);
-		ns->total_ipv4 += 1ULL << val;
+		ns->total_ipv4 += left + right;
 	} else if (bits == 128) {
-		uint64_t tmp = ns->totall_ipv6;
-		BUG_ON(val > 64);
-		ns->totall_ipv6 += (val == 64) ? 0 : 1ULL << val;
-		if (ns->totall_ipv6 <= tmp)
-			++ns->totalh_ipv6;
+		uint64_t low = left + right, tmp = ns->totall_ipv6;
+		uint32_t high = low < left;
+
+		ns->totall_ipv6 += low;
+		if (ns->totall_ipv6 < tmp)
+			++high;
+		ns->totalh_ipv6 += high;
+	}
+}
+
+/* Removes left + right addresses from the totals; the sum may be 2^64 */
+static void totalip_sub(struct ipns *ns, uint8_t bits, uint64_t left,
+			uint64_t right)
+{
+	if (bits == 32) {
+		ns->total_ipv4 -= left + right;
+	} else if (bits == 128) {
+		uint64_t low = left + right, tmp = ns->totall_ipv6;
+		uint32_t high = low < left;
+
+		ns->totall_ipv6 -= low;
+		if (ns->totall_ipv6 > tmp)
+			++high;
+		ns->totalh_ipv6 -= high;
 	}
 }
 
-static void shadow_nodes(struct radix_node *node)
+/* Shadows the pools below node, whose free addresses are then counted by the
+ * pool containing them instead
+ */
+static void shadow_nodes(struct ipns *ns, struct radix_node *node, uint8_t bits)
 {
 	if (!node)
 		return;
@@ -424,25 +724,40 @@ static void shadow_nodes(struct radix_node *node)
 	if (node->flags & RNODE_IS_POOLNODE) {
 		BUG_ON(node->flags & RNODE_IS_SHADOWED);
 		node->flags |= RNODE_IS_SHADOWED;
+		totalip_sub(ns, bits, node->left, node->right);
 		return;
 	}
 
-	if (node->flags & RNODE_IS_LEAF)
+	if (node->flags & (RNODE_IS_LEAF | RNODE_IS_BLOCK))
 		return;
 
-	shadow_nodes(node->bit[0]);
-	shadow_nodes(node->bit[1]);
+	shadow_nodes(ns, node->bit[0], bits);
+	shadow_nodes(ns, node->bit[1], bits);
 }
 
-static int ipp_addpool(struct ipns *ns, struct radix_pool **pool,
-		       struct radix_node **root, uint8_t bits,
-		       const uint8_t *key, uint8_t cidr)
+static int ipp_addpool(struct ipns *ns, struct radix_slab *slab,
+		       struct radix_slab *blocks, struct radix_pool **pool,
+		       struct radix_node **root, uint8_t bits, const uint8_t *key,
+		       uint8_t cidr)
 {
 	struct radix_node **node = root, *newnode;
 	struct radix_pool *newpool;
 	bool shadow = false, good_match = false;
 	uint8_t flags;
 
+	/* blocks never have a pool inside of them */
+	while (*node && (*node)->cidr <= cidr &&
+	       prefix_matches(*node, key, bits)) {
+		if ((*node)->flags & RNODE_IS_BLOCK) {
+			split_block(slab, blocks, root, *node, bits);
+			node = root;
+			continue;
+		}
+
+		node = &CHOOSE_NODE(*node, key);
+	}
+
+	node = root;
 	while (*node && (*node)->cidr <= cidr &&
 	       prefix_matches(*node, key, bits)) {
 		if ((*node)->cidr == cidr) {
@@ -467,7 +782,7 @@ static int ipp_addpool(struct ipns *ns, struct radix_pool **pool,
 
 		newnode = *node;
 	} else {
-		newnode = add(node, bits, key, cidr, flags);
+		newnode = add(slab, node, bits, key, cidr, flags);
 		if (newnode->bit[0])
 			newnode->left -= taken_ips(newnode->bit[0], bits);
 
@@ -476,8 +791,8 @@ static int ipp_addpool(struct ipns *ns, struct radix_pool **pool,
 	}
 
 	if (!shadow) {
-		shadow_nodes(newnode->bit[0]);
-		shadow_nodes(newnode->bit[1]);
+		shadow_nodes(ns, newnode->bit[0], bits);
+		shadow_nodes(ns, newnode->bit[1], bits);
 	}
 
 	if (bits == 32) {
@@ -486,8 +801,9 @@ static int ipp_addpool(struct ipns *ns, struct radix_pool **pool,
 		/* TODO: special case /31 ?, see RFC 3021 */
 	}
 
+	/* what's taken in the pools shadowed isn't free */
 	if (!shadow)
-		totalip_inc(ns, bits, bits - cidr);
+		totalip_add(ns, bits, newnode->left, newnode->right);
 
 	newpool = malloc(sizeof *newpool);
 	if (!newpool)
@@ -500,7 +816,12 @@ static int ipp_addpool(struct ipns *ns, struct radix_pool **pool,
 	return 0;
 }
 
-static int orphan_nodes(struct radix_node *node, uint64_t *val)
+/* Frees what's taken below node outside of other pools, storing the amount
+ * of addresses in val, and brings the pools below it back
+ */
+static int orphan_nodes(struct ipns *ns, struct radix_slab *slab,
+			struct radix_slab *blocks, struct radix_node *node,
+			uint8_t bits, uint64_t *val)
 {
 	uint64_t v1 = 0, v2 = 0;
 
@@ -510,20 +831,27 @@ static int orphan_nodes(struct radix_node *node, uint64_t *val)
 	if (node->flags & RNODE_IS_POOLNODE) {
 		BUG_ON(!(node->flags & RNODE_IS_SHADOWED));
 		node->flags &= ~RNODE_IS_SHADOWED;
+		totalip_add(ns, bits, node->left, node->right);
 		return 0;
 	}
 
 	if (node->flags & RNODE_IS_LEAF) {
 		BUG_ON(node->bit[0] || node->bit[1]);
 		*val = 1;
-		free(node);
+		slab_free(slab, node);
 		return 1;
 	}
 
-	if (orphan_nodes(node->bit[0], &v1))
+	if (node->flags & RNODE_IS_BLOCK) {
+		*val = __builtin_popcountll(*block_map(node, bits));
+		slab_free(blocks, node);
+		return 1;
+	}
+
+	if (orphan_nodes(ns, slab, blocks, node->bit[0], bits, &v1))
 		node->bit[0] = NULL;
 
-	if (orphan_nodes(node->bit[1], &v2))
+	if (orphan_nodes(ns, slab, blocks, node->bit[1], bits, &v2))
 		node->bit[1] = NULL;
 
 	node->left += v1;
@@ -533,7 +861,7 @@ static int orphan_nodes(struct radix_node *node, uint64_t *val)
 	if (node->bit[0] || node->bit[1])
 		return 0; /* still need this node */
 
-	free(node);
+	slab_free(slab, node);
 	return 1;
 }
 
@@ -541,9 +869,22 @@ static int ipp_removepool(struct ipns *ns, uint8_t bits, const uint8_t *key,
 			  uint8_t cidr)
 {
 	struct radix_pool **current, *next;
-	struct radix_node *node;
+	struct radix_node *node, *root;
+	struct radix_slab *slab, *blocks;
 
-	for (current = &ns->ip4_pools; *current; current = &(*current)->next) {
+	if (bits == 32) {
+		current = &ns->ip4_pools;
+		root = ns->ip4_root;
+		slab = &ns->ip4_slab;
+		blocks = &ns->ip4_blocks;
+	} else {
+		current = &ns->ip6_pools;
+		root = ns->ip6_root;
+		slab = &ns->ip6_slab;
+		blocks = &ns->ip6_blocks;
+	}
+
+	for (; *current; current = &(*current)->next) {
 		struct radix_node *node = (*current)->node;
 		if (node->cidr == cidr && common_bits(node, key, bits) >= cidr)
 			break;
@@ -557,13 +898,16 @@ static int ipp_removepool(struct ipns *ns, uint8_t bits, const uint8_t *key,
 	if (node->flags & RNODE_IS_SHADOWED) {
 		node->flags &= ~RNODE_IS_SHADOWED;
 	} else {
-		struct radix_node *n = ns->ip4_root;
+		struct radix_node *n = root;
 		uint64_t v1 = 0, v2 = 0;
 
-		if (orphan_nodes(node->bit[0], &v1))
+		/* whatever is still free in the pool is no longer available */
+		totalip_sub(ns, bits, node->left, node->right);
+
+		if (orphan_nodes(ns, slab, blocks, node->bit[0], bits, &v1))
 			node->bit[0] = NULL;
 
-		if (orphan_nodes(node->bit[1], &v2))
+		if (orphan_nodes(ns, slab, blocks, node->bit[1], bits, &v2))
 			node->bit[1] = NULL;
 
 		node->left += v1;
@@ -626,10 +970,11 @@ static void debug_print_trie(struct radix_node *root, uint8_t bits)
 	node_to_str(root->bit[0], child1, bits);
 	node_to_str(root->bit[1], child2, bits);
 
-	debug("%s (%zu, %zu, %c%c%c) -> %s, %s\n", parent, root->left,
+	debug("%s (%zu, %zu, %c%c%c%c) -> %s, %s\n", parent, root->left,
 	      root->right, root->flags & RNODE_IS_LEAF ? 'l' : '-',
 	      root->flags & RNODE_IS_POOLNODE ? 'p' : '-',
-	      root->flags & RNODE_IS_SHADOWED ? 's' : '-', child1, child2);
+	      root->flags & RNODE_IS_SHADOWED ? 's' : '-',
+	      root->flags & RNODE_IS_BLOCK ? 'b' : '-', child1, child2);
 
 	debug_print_trie(root->bit[0], bits);
 	debug_print_trie(root->bit[1], bits);
@@ -651,14 +996,21 @@ void ipp_init(struct ipns *ns)
 	ns->ip4_root = ns->ip6_root = NULL;
 	ns->ip4_pools = ns->ip6_pools = NULL;
 	ns->totall_ipv6 = ns->totalh_ipv6 = ns->total_ipv4 = 0;
+	slab_init(&ns->ip4_slab, key_size(32));
+	slab_init(&ns->ip6_slab, key_size(128));
+	slab_init(&ns->ip4_blocks, key_size(32) + RADIX_BLOCK_SIZE / 8U);
+	slab_init(&ns->ip6_blocks, key_size(128) + RADIX_BLOCK_SIZE / 8U);
 }
 
 void ipp_free(struct ipns *ns)
 {
 	struct radix_pool *next;
 
-	radix_free_nodes(ns->ip4_root);
-	radix_free_nodes(ns->ip6_root);
+	slab_release(&ns->ip4_slab);
+	slab_release(&ns->ip6_slab);
+	slab_release(&ns->ip4_blocks);
+	slab_release(&ns->ip6_blocks);
+	ns->ip4_root = ns->ip6_root = NULL;
 
 	for (struct radix_pool *cur = ns->ip4_pools; cur; cur = next) {
 		next = cur->next;
@@ -671,9 +1023,47 @@ void ipp_free(struct ipns *ns)
 	}
 }
 
+static int insert_v4(struct ipns *ns, const struct in_addr *ip, uint8_t cidr)
+{
+	/* Aligned so it can be passed to fls */
+	uint8_t key[4] __aligned(__alignof(uint32_t));
+
+	swap_endian(key, (const uint8_t *)ip, 32);
+
+	if (cidr == 32)
+		return insert(&ns->ip4_slab, &ns->ip4_blocks, &ns->ip4_root, 32,
+			      key);
+
+	if (add(&ns->ip4_slab, &ns->ip4_root, 32, key, cidr, RNODE_IS_LEAF)) {
+		decrement_radix(ns->ip4_root, 32, key);
+		return 0;
+	}
+
+	return -1;
+}
+
+static int insert_v6(struct ipns *ns, const struct in6_addr *ip, uint8_t cidr)
+{
+	/* Aligned so it can be passed to fls64 */
+	uint8_t key[16] __aligned(__alignof(uint64_t));
+
+	swap_endian(key, (const uint8_t *)ip, 128);
+
+	if (cidr == 128)
+		return insert(&ns->ip6_slab, &ns->ip6_blocks, &ns->ip6_root,
+			      128, key);
+
+	if (add(&ns->ip6_slab, &ns->ip6_root, 128, key, cidr, RNODE_IS_LEAF)) {
+		decrement_radix(ns->ip6_root, 128, key);
+		return 0;
+	}
+
+	return -1;
+}
+
 int ipp_add_v4(struct ipns *ns, const struct in_addr *ip, uint8_t cidr)
 {
-	int ret = insert_v4(&ns->ip4_root, ip, cidr);
+	int ret = insert_v4(ns, ip, cidr);
 	if (!ret)
 		--ns->total_ipv4;
 
@@ -682,7 +1072,7 @@ int ipp_add_v4(struct ipns *ns, const struct in_addr *ip, uint8_t cidr)
 
 int ipp_add_v6(struct ipns *ns, const struct in6_addr *ip, uint8_t cidr)
 {
-	int ret = insert_v6(&ns->ip6_root, ip, cidr);
+	int ret = insert_v6(ns, ip, cidr);
 	if (!ret) {
 		if (ns->totall_ipv6 == 0)
 			--ns->totalh_ipv6;
@@ -699,7 +1089,8 @@ int ipp_del_v4(struct ipns *ns, const struct in_addr *ip, uint8_t cidr)
 	int ret;
 
 	swap_endian(key, (const uint8_t *)ip, 32);
-	ret = remove_node(&ns->ip4_root, key, cidr);
+	ret = remove_node(&ns->ip4_slab, &ns->ip4_blocks, &ns->ip4_root, key,
+			  cidr);
 	if (!ret)
 		++ns->total_ipv4;
 
@@ -712,7 +1103,8 @@ int ipp_del_v6(struct ipns *ns, const struct in6_addr *ip, uint8_t cidr)
 	int ret;
 
 	swap_endian(key, (const uint8_t *)ip, 128);
-	ret = remove_node(&ns->ip6_root, key, cidr);
+	ret = remove_node(&ns->ip6_slab, &ns->ip6_blocks, &ns->ip6_root, key,
+			  cidr);
 	if (!ret) {
 		++ns->totall_ipv6;
 		if (ns->totall_ipv6 == 0)
@@ -730,7 +1122,8 @@ int ipp_addpool_v4(struct ipns *ns, const struct in_addr *ip, uint8_t cidr)
 		return -1;
 
 	swap_endian(key, (const uint8_t *)ip, 32);
-	return ipp_addpool(ns, &ns->ip4_pools, &ns->ip4_root, 32, key, cidr);
+	return ipp_addpool(ns, &ns->ip4_slab, &ns->ip4_blocks, &ns->ip4_pools,
+			   &ns->ip4_root, 32, key, cidr);
 }
 
 int ipp_addpool_v6(struct ipns *ns, const struct in6_addr *ip, uint8_t cidr)
@@ -741,7 +1134,8 @@ int ipp_addpool_v6(struct ipns *ns, const struct in6_addr *ip, uint8_t cidr)
 		return -1;
 
 	swap_endian(key, (const uint8_t *)ip, 128);
-	return ipp_addpool(ns, &ns->ip6_pools, &ns->ip6_root, 128, key, cidr);
+	return ipp_addpool(ns, &ns->ip6_slab, &ns->ip6_blocks, &ns->ip6_pools,
+			   &ns->ip6_root, 128, key, cidr);
 }
 
 int ipp_removepool_v4(struct ipns *ns, const struct in_addr *ip, uint8_t cidr)
@@ -770,6 +1164,7 @@ void ipp_addnth_v4(struct ipns *ns, struct in_addr *dest, uint32_t index)
 {
 	struct radix_pool *current;
 
+	trace(pool__addnth, AF_INET, (uint64_t)index, 0);
 	for (current = ns->ip4_pools; current; current = current->next) {
 		if (current->node->flags & RNODE_IS_SHADOWED)
 			continue;
@@ -782,8 +1177,10 @@ void ipp_addnth_v4(struct ipns *ns, struct in_addr *dest, uint32_t index)
 
 	BUG_ON(!current);
 
-	add_nth(current->node, 32, index, (uint8_t *)&dest->s_addr);
+	add_nth(&ns->ip4_slab, &ns->ip4_blocks, ns->ip4_root, current->node, 32,
+		index, (uint8_t *)&dest->s_addr);
 	--ns->total_ipv4;
+	trace(pool__addnth__done, AF_INET, dest);
 }
 
 void ipp_addnth_v6(struct ipns *ns, struct in6_addr *dest, uint32_t index_low,
@@ -792,6 +1189,7 @@ void ipp_addnth_v6(struct ipns *ns, struct in6_addr *dest, uint32_t index_low,
 	struct radix_pool *current;
 	uint64_t tmp;
 
+	trace(pool__addnth, AF_INET6, index_low, index_high);
 	for (current = ns->ip6_pools; current; current = current->next) {
 		if (current->node->flags & RNODE_IS_SHADOWED ||
 		    (current->node->left == 0 && current->node->right == 0))
@@ -813,9 +1211,11 @@ void ipp_addnth_v6(struct ipns *ns, struct in6_addr *dest, uint32_t index_low,
 
 	BUG_ON(!current || index_high);
 
-	add_nth(current->node, 128, index_low, (uint8_t *)&dest->s6_addr);
+	add_nth(&ns->ip6_slab, &ns->ip6_blocks, ns->ip6_root, current->node,
+		128, index_low, (uint8_t *)&dest->s6_addr);
 	if (ns->totall_ipv6 == 0)
 		--ns->totalh_ipv6;
 
 	--ns->totall_ipv6;
+	trace(pool__addnth__done, AF_INET6, dest);
 }
@@ -8,8 +8,19 @@
 
 #include <arpa/inet.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+/* Per-trie node allocator. Nodes are carved out of large chunks and freed
+ * nodes are kept on a free-list for reuse; all chunks are released at once by
+ * ipp_free().
+ */
+struct radix_slab {
+	size_t objsize, chunk_used;
+	void *freelist;
+	struct radix_chunk *chunks;
+};
+
 struct ipns {
 	/* Total amount of available addresses over all pools */
 	uint64_t totall_ipv6, total_ipv4;
@@ -17,6 +28,9 @@ struct ipns {
 
 	struct radix_node *ip4_root, *ip6_root;
 	struct radix_pool *ip4_pools, *ip6_pools;
+	struct radix_slab ip4_slab, ip6_slab;
+	/* Bitmap blocks for densely leased ranges, see radix-trie.c */
+	struct radix_slab ip4_blocks, ip6_blocks;
 };
 
 void ipp_init(struct ipns *ns);
@@ -5,9 +5,11 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -68,11 +70,159 @@ get_random_bytes(uint8_t *out, size_t len)
 	return i == len;
 }
 
+/* Random numbers are taken from a ChaCha20 keystream, so we don't need a
+ * syscall for each of them. Every thread has its own generator; it is seeded
+ * from the kernel on first use, and fresh kernel entropy is mixed into the key
+ * after every RNG_RESEED_BYTES and in the child after fork(). After each
+ * refill of the buffer, the first RNG_KEYSIZE bytes of it replace the key, and
+ * all bytes are cleared once handed out, so neither past nor buffered output
+ * can be reconstructed from a later state (fast key erasure).
+ */
+#define RNG_KEYSIZE 32
+#define RNG_BUFSIZE (16 * 64) /* 16 ChaCha20 blocks */
+#define RNG_RESEED_BYTES (1U << 20)
+
+struct rng_state {
+	uint32_t input[16]; /* constants, key, block counter, nonce */
+	union {
+		uint32_t words[RNG_BUFSIZE / 4];
+		uint8_t bytes[RNG_BUFSIZE];
+	} buf;
+	size_t avail; /* unused bytes, at the end of buf */
+	size_t until_reseed;
+	unsigned long generation; /* of fork_generation when last seeded */
+	bool seeded;
+};
+
+static __thread struct rng_state rng;
+
+/* Only ever changed in the child after fork(), when there's a single thread */
+static unsigned long fork_generation;
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define QUARTERROUND(a, b, c, d)                                               \
+	do {                                                                   \
+		a += b;                                                        \
+		d = ROTL32(d ^ a, 16);                                         \
+		c += d;                                                        \
+		b = ROTL32(b ^ c, 12);                                         \
+		a += b;                                                        \
+		d = ROTL32(d ^ a, 8);                                          \
+		c += d;                                                        \
+		b = ROTL32(b ^ c, 7);                                          \
+	} while (0)
+
+static void chacha20_block(uint32_t out[static 16], const uint32_t in[16])
+{
+	uint32_t x[16];
+
+	memcpy(x, in, sizeof x);
+	for (int i = 0; i < 10; ++i) {
+		QUARTERROUND(x[0], x[4], x[8], x[12]);
+		QUARTERROUND(x[1], x[5], x[9], x[13]);
+		QUARTERROUND(x[2], x[6], x[10], x[14]);
+		QUARTERROUND(x[3], x[7], x[11], x[15]);
+		QUARTERROUND(x[0], x[5], x[10], x[15]);
+		QUARTERROUND(x[1], x[6], x[11], x[12]);
+		QUARTERROUND(x[2], x[7], x[8], x[13]);
+		QUARTERROUND(x[3], x[4], x[9], x[14]);
+	}
+
+	for (int i = 0; i < 16; ++i)
+		out[i] = x[i] + in[i];
+}
+
+static void rng_forked()
+{
+	++fork_generation;
+}
+
+static void rng_register_atfork()
+{
+	if (pthread_atfork(NULL, NULL, rng_forked))
+		die("pthread_atfork() failed\n");
+}
+
+static void rng_reseed(struct rng_state *s)
+{
+	uint32_t seed[RNG_KEYSIZE / 4 + 2];
+
+	pthread_once(&atfork_once, rng_register_atfork);
+
+	if (!get_random_bytes((uint8_t *)seed, sizeof seed))
+		fatal("get_random_bytes()");
+
+	if (!s->seeded) {
+		/* "expand 32-byte k" */
+		s->input[0] = 0x61707865;
+		s->input[1] = 0x3320646e;
+		s->input[2] = 0x79622d32;
+		s->input[3] = 0x6b206574;
+		memset(&s->input[4], 0, sizeof s->input - 4 * sizeof(uint32_t));
+		s->seeded = true;
+	}
+
+	/* mix in rather than replace, so a weak seed can't make things worse */
+	for (int i = 0; i < RNG_KEYSIZE / 4; ++i)
+		s->input[4 + i] ^= seed[i];
+	s->input[14] ^= seed[RNG_KEYSIZE / 4];
+	s->input[15] ^= seed[RNG_KEYSIZE / 4 + 1];
+	memset(seed, 0, sizeof seed);
+
+	/* whatever is still buffered came from the old key */
+	memset(s->buf.bytes, 0, sizeof s->buf.bytes);
+	s->avail = 0;
+	s->until_reseed = RNG_RESEED_BYTES;
+	s->generation = fork_generation;
+}
+
+static void rng_refill(struct rng_state *s)
+{
+	if (s->until_reseed < RNG_BUFSIZE)
+		rng_reseed(s);
+
+	for (int i = 0; i < RNG_BUFSIZE / 64; ++i) {
+		chacha20_block(&s->buf.words[i * 16], s->input);
+		if (!++s->input[12])
+			++s->input[13];
+	}
+
+	memcpy(&s->input[4], s->buf.bytes, RNG_KEYSIZE);
+	memset(s->buf.bytes, 0, RNG_KEYSIZE);
+	s->avail = RNG_BUFSIZE - RNG_KEYSIZE;
+	s->until_reseed -= RNG_BUFSIZE;
+}
+
+static void random_fill(uint8_t *out, size_t len)
+{
+	struct rng_state *s = &rng;
+
+	if (!s->seeded || s->generation != fork_generation)
+		rng_reseed(s);
+
+	while (len) {
+		size_t n;
+		uint8_t *p;
+
+		if (!s->avail)
+			rng_refill(s);
+
+		n = len < s->avail ? len : s->avail;
+		p = s->buf.bytes + RNG_BUFSIZE - s->avail;
+		memcpy(out, p, n);
+		memset(p, 0, n);
+		s->avail -= n;
+		out += n;
+		len -= n;
+	}
+}
+
 uint64_t random_u64()
 {
 	uint64_t ret;
-	if (!get_random_bytes((uint8_t *)&ret, sizeof(ret)))
-		fatal("get_random_bytes()");
+
+	random_fill((uint8_t *)&ret, sizeof(ret));
 
 	return ret;
 }
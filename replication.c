@@ -0,0 +1,705 @@
+/* SPDX-License-Identifier: MIT
+ *
+ * Copyright (C) 2019 WireGuard LLC. All Rights Reserved.
+ */
+
+/* Replication keeps the leases of a standby server in step with those of the
+ * primary, so that the standby can take over without its clients being
+ * renumbered or all coming back for new leases at once. The standby connects
+ * to the primary, which sends a header like the one of the lease file and
+ * then frames of
+ *
+ *   struct replication_frame, followed by nrecords struct journal_record
+ *
+ * The first frames of a connection, and then those sent every
+ * REPLICATION_SNAPSHOT_INTERVAL seconds, hold snapshots of all leases, one
+ * interface after the other, marked with REPLICATION_SNAPSHOT. The last frame
+ * of each, which may be empty, is also marked with REPLICATION_SNAPSHOT_END.
+ * Only then does the standby apply the snapshot, replacing all the leases it
+ * has. All other frames hold the changes since, exactly as they were
+ * journaled, and are applied right away. A frame without an interface or
+ * records is sent as a heartbeat after REPLICATION_HEARTBEAT seconds without
+ * any other.
+ *
+ * Interfaces are matched by name. Records are sent as they are in memory, so
+ * both servers must run on the same architecture. The stream is neither
+ * encrypted nor authenticated, the primary should only listen on a link
+ * between the two.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dbg.h"
+#include "journal.h"
+#include "lease.h"
+#include "metrics.h"
+#include "netlink.h"
+#include "replication.h"
+
+/* Records in a frame at most, about 100KiB */
+#define REPLICATION_FRAME_MAX 1024
+/* Changes waiting for the standby at most. Once there are more, they are
+ * dropped and a snapshot is sent instead.
+ */
+#define REPLICATION_QUEUE_MAX (64 * 1024)
+/* All in seconds */
+#define REPLICATION_SNAPSHOT_INTERVAL 300
+#define REPLICATION_HEARTBEAT 5
+/* How long the standby waits for a frame, and the primary for one to be
+ * sent, before they give up on the connection
+ */
+#define REPLICATION_TIMEOUT (3 * REPLICATION_HEARTBEAT)
+/* Delay between the attempts of the standby to connect */
+#define REPLICATION_RETRY 2
+
+static const uint8_t REPLICATION_MAGIC[8] = { 'w', 'g', 'd', 'y',
+					      'n', 'r', 'p', 1 };
+
+struct replication_header {
+	uint8_t magic[8];
+	uint32_t record_size;
+	uint32_t reserved;
+};
+
+struct replication_frame {
+	char devname[IFNAMSIZ]; /* empty for heartbeats */
+	uint32_t nrecords;
+	uint32_t flags;
+};
+
+enum {
+	REPLICATION_SNAPSHOT = 1,
+	REPLICATION_SNAPSHOT_END = 2,
+};
+
+struct change {
+	const char *devname;
+	struct journal_record rec;
+};
+
+struct change_queue {
+	struct change *changes;
+	size_t len, cap;
+};
+
+/* A frame being filled, the header right in front of the records so that
+ * both go out with a single send()
+ */
+struct frame_buf {
+	const char *devname;
+	uint32_t flags;
+	size_t n;
+	struct replication_frame hdr;
+	struct journal_record recs[REPLICATION_FRAME_MAX];
+};
+
+/* Changes are queued by queue_change() from whichever thread made them and
+ * taken by the thread of the primary. Only while a standby is connected,
+ * since every connection starts with a snapshot.
+ */
+static struct {
+	pthread_mutex_t lock;
+	struct change_queue queue;
+	bool streaming, overflow;
+	int listenfd, wakefd;
+	struct wg_dynamic_leases **leases;
+	size_t nleases;
+} primary = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static struct frame_buf frame;
+static char *standby_host, *standby_port;
+
+static time_t now()
+{
+	struct timespec tp;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &tp))
+		fatal("clock_gettime(CLOCK_MONOTONIC)");
+
+	return tp.tv_sec;
+}
+
+/* Splits address into host and port, see replication_start_primary() */
+static void parse_address(const char *address, char **host, char **port)
+{
+	const char *colon = strrchr(address, ':');
+	size_t hostlen;
+
+	if (!colon || !colon[1])
+		die("Invalid address %s, expected <host>:<port>\n", address);
+
+	hostlen = colon - address;
+	if (hostlen >= 2 && address[0] == '[' && address[hostlen - 1] == ']') {
+		++address;
+		hostlen -= 2;
+	}
+
+	*host = strndup(address, hostlen);
+	*port = strdup(colon + 1);
+	if (!*host || !*port)
+		fatal("strdup()");
+}
+
+static bool send_all(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	while (len > 0) {
+		ssize_t ret = send(fd, p, len, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			debug("Writing to the standby failed: %s\n",
+			      strerror(errno));
+			return false;
+		}
+
+		p += ret;
+		len -= ret;
+	}
+
+	return true;
+}
+
+static bool recv_all(int fd, void *buf, size_t len)
+{
+	uint8_t *p = buf;
+
+	while (len > 0) {
+		ssize_t ret = recv(fd, p, len, MSG_WAITALL);
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret <= 0) {
+			debug("Reading from the primary failed: %s\n",
+			      ret ? strerror(errno) : "connection closed");
+			return false;
+		}
+
+		p += ret;
+		len -= ret;
+	}
+
+	return true;
+}
+
+static void queue_change(const struct journal_record *rec, void *ctx)
+{
+	struct change_queue *q = &primary.queue;
+	bool wake = false;
+
+	pthread_mutex_lock(&primary.lock);
+	if (!primary.streaming || primary.overflow)
+		goto out;
+
+	if (q->len == REPLICATION_QUEUE_MAX) {
+		primary.overflow = true;
+		q->len = 0;
+		goto out;
+	}
+
+	if (q->len == q->cap) {
+		size_t cap = q->cap ? 2 * q->cap : 256;
+		struct change *tmp = realloc(q->changes, cap * sizeof *tmp);
+
+		if (!tmp)
+			fatal("realloc()");
+		q->changes = tmp;
+		q->cap = cap;
+	}
+
+	q->changes[q->len].devname = ctx;
+	q->changes[q->len++].rec = *rec;
+
+	/* the thread takes all of them when it wakes up */
+	wake = q->len == 1;
+
+out:
+	pthread_mutex_unlock(&primary.lock);
+
+	if (wake && eventfd_write(primary.wakefd, 1))
+		fatal("eventfd_write()");
+}
+
+/* Swaps the queued changes into dest. Returns false if changes were dropped
+ * since the last call, and a snapshot must be sent.
+ */
+static bool take_changes(struct change_queue *dest)
+{
+	struct change_queue tmp;
+	bool complete;
+
+	dest->len = 0;
+
+	pthread_mutex_lock(&primary.lock);
+	tmp = primary.queue;
+	primary.queue = *dest;
+	*dest = tmp;
+	complete = !primary.overflow;
+	primary.overflow = false;
+	pthread_mutex_unlock(&primary.lock);
+
+	return complete;
+}
+
+static void set_streaming(bool streaming)
+{
+	pthread_mutex_lock(&primary.lock);
+	primary.streaming = streaming;
+	primary.overflow = false;
+	primary.queue.len = 0;
+	pthread_mutex_unlock(&primary.lock);
+}
+
+static bool flush_frame(int fd, struct frame_buf *f)
+{
+	size_t len = (uint8_t *)&f->recs[f->n] - (uint8_t *)&f->hdr;
+	bool ret;
+
+	memset(&f->hdr, 0, sizeof f->hdr);
+	if (f->devname)
+		strncpy(f->hdr.devname, f->devname, sizeof f->hdr.devname - 1);
+	f->hdr.nrecords = f->n;
+	f->hdr.flags = f->flags;
+
+	ret = send_all(fd, &f->hdr, len);
+	metrics_add(METRIC_REPLICATED_RECORDS, f->n);
+	f->n = 0;
+
+	return ret;
+}
+
+/* Adds rec to the frame, sending it first if it is full or for another
+ * interface. All devnames come from leases_devname(), so they are compared
+ * by address.
+ */
+static bool add_to_frame(int fd, struct frame_buf *f, const char *devname,
+			 const struct journal_record *rec)
+{
+	if (f->n && (f->n == REPLICATION_FRAME_MAX || f->devname != devname) &&
+	    !flush_frame(fd, f))
+		return false;
+
+	f->devname = devname;
+	f->recs[f->n] = *rec;
+	journal_record_seal(&f->recs[f->n++]);
+
+	return true;
+}
+
+struct snapshot {
+	struct journal_record *recs;
+	size_t n, cap;
+};
+
+static void add_to_snapshot(const struct journal_record *rec, void *ctx)
+{
+	struct snapshot *s = ctx;
+
+	if (s->n == s->cap) {
+		size_t cap = s->cap ? 2 * s->cap : 1024;
+		struct journal_record *tmp;
+
+		tmp = realloc(s->recs, cap * sizeof *tmp);
+		if (!tmp)
+			fatal("realloc()");
+		s->recs = tmp;
+		s->cap = cap;
+	}
+
+	s->recs[s->n++] = *rec;
+}
+
+/* The leases are copied first, so that a slow standby doesn't hold up
+ * everyone waiting for their lock
+ */
+static bool send_snapshot(int fd)
+{
+	static struct snapshot s;
+
+	for (size_t i = 0; i < primary.nleases; ++i) {
+		const char *devname = leases_devname(primary.leases[i]);
+
+		s.n = 0;
+		leases_export(primary.leases[i], add_to_snapshot, &s);
+
+		frame.devname = devname;
+		frame.flags = REPLICATION_SNAPSHOT;
+		for (size_t k = 0; k < s.n; ++k)
+			if (!add_to_frame(fd, &frame, devname, &s.recs[k]))
+				return false;
+
+		frame.flags |= REPLICATION_SNAPSHOT_END;
+		if (!flush_frame(fd, &frame))
+			return false;
+	}
+
+	frame.flags = 0;
+	metrics_inc(METRIC_REPLICATION_SNAPSHOTS);
+	return true;
+}
+
+static int accept_standby(void)
+{
+	struct timeval tv = { .tv_sec = REPLICATION_TIMEOUT };
+	struct replication_header hdr = {
+		.record_size = sizeof(struct journal_record),
+	};
+	int fd;
+
+	fd = accept4(primary.listenfd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0) {
+		debug("Failed to accept standby: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv))
+		fatal("setsockopt()");
+
+	memcpy(hdr.magic, REPLICATION_MAGIC, sizeof hdr.magic);
+	if (!send_all(fd, &hdr, sizeof hdr)) {
+		close(fd);
+		return -1;
+	}
+
+	metrics_inc(METRIC_REPLICATION_STREAMS);
+	debug("Streaming leases to a new standby\n");
+
+	return fd;
+}
+
+/* Sends everything that changed since the last call, or a snapshot if one is
+ * due. Returns false if the standby can't keep up.
+ */
+static bool stream_changes(int fd, struct change_queue *changes,
+			   time_t *next_snapshot, time_t *last_sent)
+{
+	time_t cur = now();
+
+	if (!take_changes(changes) || cur >= *next_snapshot) {
+		/* everything taken so far is part of the snapshot anyway */
+		changes->len = 0;
+		if (!send_snapshot(fd))
+			return false;
+
+		*next_snapshot = cur + REPLICATION_SNAPSHOT_INTERVAL;
+		*last_sent = cur;
+	}
+
+	for (size_t i = 0; i < changes->len; ++i)
+		if (!add_to_frame(fd, &frame, changes->changes[i].devname,
+				  &changes->changes[i].rec))
+			return false;
+
+	if (changes->len) {
+		if (!flush_frame(fd, &frame))
+			return false;
+		*last_sent = cur;
+	}
+
+	if (cur - *last_sent >= REPLICATION_HEARTBEAT) {
+		frame.devname = NULL;
+		if (!flush_frame(fd, &frame))
+			return false;
+		*last_sent = cur;
+	}
+
+	return true;
+}
+
+static void *primary_loop(void *arg)
+{
+	struct change_queue changes = { 0 };
+	time_t next_snapshot = 0, last_sent = 0;
+	int fd = -1;
+
+	UNUSED(arg);
+
+	while (1) {
+		struct pollfd pfds[] = {
+			{ .fd = primary.listenfd, .events = POLLIN },
+			{ .fd = primary.wakefd, .events = POLLIN },
+			{ .fd = fd, .events = POLLIN },
+		};
+		int timeout = -1;
+		bool lost = false;
+		eventfd_t val;
+
+		if (fd >= 0) {
+			time_t due = MIN(next_snapshot,
+					 last_sent + REPLICATION_HEARTBEAT);
+			timeout = 1000 * MAX(0, due - now());
+		}
+
+		if (poll(pfds, fd >= 0 ? 3 : 2, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			fatal("poll()");
+		}
+
+		if (pfds[1].revents & POLLIN)
+			eventfd_read(primary.wakefd, &val);
+
+		if (pfds[0].revents & POLLIN) {
+			int newfd = accept_standby();
+
+			/* the last standby to connect wins */
+			if (newfd >= 0) {
+				if (fd >= 0)
+					close(fd);
+				fd = newfd;
+				next_snapshot = 0;
+				set_streaming(true);
+			}
+		} else if (fd >= 0 && pfds[2].revents) {
+			/* the standby never sends anything, so it went away */
+			lost = true;
+		}
+
+		if (fd < 0)
+			continue;
+
+		if (lost ||
+		    !stream_changes(fd, &changes, &next_snapshot, &last_sent)) {
+			log_err("Lost the standby, replication stopped\n");
+			set_streaming(false);
+			close(fd);
+			fd = -1;
+		}
+	}
+
+	return NULL;
+}
+
+static int listen_on(const char *address)
+{
+	struct addrinfo hints = {
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags = AI_PASSIVE,
+	};
+	struct addrinfo *res, *ai;
+	char *host, *port;
+	int fd = -1, ret, on = 1;
+
+	parse_address(address, &host, &port);
+	ret = getaddrinfo(*host ? host : NULL, port, &hints, &res);
+	if (ret)
+		die("Resolving %s failed: %s\n", address, gai_strerror(ret));
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+			    ai->ai_protocol);
+		if (fd < 0)
+			continue;
+
+		if (!setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on) &&
+		    !bind(fd, ai->ai_addr, ai->ai_addrlen) && !listen(fd, 1))
+			break;
+
+		close(fd);
+		fd = -1;
+	}
+
+	if (fd < 0)
+		fatal("Listening for standbys on %s failed", address);
+
+	freeaddrinfo(res);
+	free(host);
+	free(port);
+
+	return fd;
+}
+
+void replication_start_primary(const char *address,
+			       struct wg_dynamic_leases *const *leases,
+			       size_t n)
+{
+	pthread_t thread;
+	int ret;
+
+	primary.listenfd = listen_on(address);
+	primary.wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (primary.wakefd < 0)
+		fatal("eventfd()");
+
+	primary.leases = calloc(n, sizeof *primary.leases);
+	if (!primary.leases)
+		fatal("calloc()");
+
+	for (size_t i = 0; i < n; ++i) {
+		primary.leases[i] = leases[i];
+		leases_set_observer(leases[i], queue_change,
+				    (void *)leases_devname(leases[i]));
+	}
+	primary.nleases = n;
+
+	ret = pthread_create(&thread, NULL, primary_loop, NULL);
+	if (ret)
+		die("pthread_create(): %s\n", strerror(ret));
+	pthread_detach(thread);
+}
+
+static int connect_primary(void)
+{
+	struct addrinfo hints = { .ai_socktype = SOCK_STREAM };
+	struct timeval tv = { .tv_sec = REPLICATION_TIMEOUT };
+	struct addrinfo *res, *ai;
+	int fd = -1, ret;
+
+	ret = getaddrinfo(standby_host, standby_port, &hints, &res);
+	if (ret) {
+		debug("Resolving %s failed: %s\n", standby_host,
+		      gai_strerror(ret));
+		return -1;
+	}
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+			    ai->ai_protocol);
+		if (fd < 0)
+			continue;
+
+		if (!connect(fd, ai->ai_addr, ai->ai_addrlen))
+			break;
+
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+
+	if (fd < 0) {
+		debug("Connecting to the primary failed: %s\n",
+		      strerror(errno));
+		return -1;
+	}
+
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv))
+		fatal("setsockopt()");
+
+	return fd;
+}
+
+/* Applies frames until the stream breaks */
+static void follow_primary(int fd)
+{
+	static struct journal_record recs[REPLICATION_FRAME_MAX];
+	static struct snapshot s;
+	char devname[IFNAMSIZ] = { 0 };
+	struct replication_header hdr;
+	struct replication_frame f;
+	struct wg_dynamic_leases *l;
+	bool in_snapshot = false;
+
+	if (!recv_all(fd, &hdr, sizeof hdr))
+		return;
+
+	if (memcmp(hdr.magic, REPLICATION_MAGIC, sizeof hdr.magic) ||
+	    hdr.record_size != sizeof *recs) {
+		log_err("%s:%s isn't a primary or has an unsupported format\n",
+			standby_host, standby_port);
+		return;
+	}
+
+	metrics_inc(METRIC_REPLICATION_STREAMS);
+	debug("Following the primary at %s:%s\n", standby_host, standby_port);
+
+	s.n = 0;
+	while (recv_all(fd, &f, sizeof f)) {
+		if (f.nrecords > REPLICATION_FRAME_MAX ||
+		    !memchr(f.devname, '\0', sizeof f.devname) ||
+		    (in_snapshot && !(f.flags & REPLICATION_SNAPSHOT))) {
+			log_err("Invalid frame from the primary\n");
+			return;
+		}
+
+		if (!recv_all(fd, recs, f.nrecords * sizeof *recs))
+			return;
+
+		for (uint32_t i = 0; i < f.nrecords; ++i) {
+			if (!journal_record_valid(&recs[i])) {
+				log_err("Corrupted record from the primary\n");
+				return;
+			}
+		}
+
+		if (f.flags & REPLICATION_SNAPSHOT) {
+			if (in_snapshot && strcmp(devname, f.devname)) {
+				log_err("Invalid frame from the primary\n");
+				return;
+			}
+
+			strcpy(devname, f.devname);
+			for (uint32_t i = 0; i < f.nrecords; ++i)
+				add_to_snapshot(&recs[i], &s);
+
+			in_snapshot = !(f.flags & REPLICATION_SNAPSHOT_END);
+			if (in_snapshot)
+				continue;
+		} else if (!f.nrecords) {
+			continue;
+		}
+
+		l = leases_find(f.devname);
+		if (!l) {
+			debug("Ignoring leases of unknown interface %s\n",
+			      f.devname);
+		} else if (f.flags & REPLICATION_SNAPSHOT) {
+			leases_replicate(l, s.recs, s.n, true);
+			leases_sync(l);
+			metrics_add(METRIC_REPLICATED_RECORDS, s.n);
+		} else {
+			leases_replicate(l, recs, f.nrecords, false);
+			leases_sync(l);
+			metrics_add(METRIC_REPLICATED_RECORDS, f.nrecords);
+		}
+		s.n = 0;
+	}
+}
+
+static void *standby_loop(void *arg)
+{
+	UNUSED(arg);
+
+	while (1) {
+		int fd = connect_primary();
+
+		if (fd >= 0) {
+			follow_primary(fd);
+			close(fd);
+			log_err("Lost the primary at %s:%s, reconnecting\n",
+				standby_host, standby_port);
+		}
+
+		sleep(REPLICATION_RETRY);
+	}
+
+	return NULL;
+}
+
+void replication_start_standby(const char *address)
+{
+	pthread_t thread;
+	int ret;
+
+	parse_address(address, &standby_host, &standby_port);
+
+	ret = pthread_create(&thread, NULL, standby_loop, NULL);
+	if (ret)
+		die("pthread_create(): %s\n", strerror(ret));
+	pthread_detach(thread);
+}
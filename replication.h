@@ -0,0 +1,31 @@
+/* SPDX-License-Identifier: MIT
+ *
+ * Copyright (C) 2019 WireGuard LLC. All Rights Reserved.
+ */
+
+#ifndef __REPLICATION_H__
+#define __REPLICATION_H__
+
+#include <stddef.h>
+
+#include "lease.h"
+
+/*
+ * Starts a thread that waits for a standby to connect on address, given as
+ * <host>:<port> with an IPv6 host in brackets and an empty one for any, and
+ * then streams the n leases to it, see replication.c. Must be called once
+ * the leases were restored and before they are first changed by another
+ * thread. Dies if address can't be bound.
+ */
+void replication_start_primary(const char *address,
+			       struct wg_dynamic_leases *const *leases,
+			       size_t n);
+
+/*
+ * Starts a thread that connects to the primary at address, given as for
+ * replication_start_primary(), and applies all it streams to the leases of
+ * the interfaces with the same names. Reconnects whenever the stream breaks.
+ */
+void replication_start_standby(const char *address);
+
+#endif
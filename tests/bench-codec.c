@@ -0,0 +1,337 @@
+/* SPDX-License-Identifier: MIT
+ *
+ * Copyright (C) 2019 WireGuard LLC. All Rights Reserved.
+ */
+
+/* Compares the protocol codec in common.c against the libc based one it
+ * replaced, both for identical output and for speed.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <arpa/inet.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "../common.h"
+#include "../dbg.h"
+
+#define ROUNDS 200000
+#define NADDRS 1024
+#define BATCH 64
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t rng(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts))
+		fatal("clock_gettime()");
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* The codec as it was before, built on printf(), inet_ntop(), strtoumax()
+ * and inet_pton().
+ */
+static size_t ref_serialize(bool send, char *buf, size_t len,
+			    struct wg_dynamic_request_ip *rip)
+{
+	size_t off = 0;
+	char addrbuf[INET6_ADDRSTRLEN];
+
+	if (send)
+		print_to_buf(buf, len, &off, "request_ip=1\n");
+
+	if (rip->has_ipv4) {
+		if (!inet_ntop(AF_INET, &rip->ipv4, addrbuf, sizeof addrbuf))
+			fatal("inet_ntop()");
+
+		print_to_buf(buf, len, &off, "ip=%s/32\n", addrbuf);
+	}
+
+	if (rip->has_ipv6) {
+		if (!inet_ntop(AF_INET6, &rip->ipv6, addrbuf, sizeof addrbuf))
+			fatal("inet_ntop()");
+
+		print_to_buf(buf, len, &off, "ip=%s/128\n", addrbuf);
+	}
+
+	if (rip->has_ipv4 || rip->has_ipv6)
+		print_to_buf(buf, len, &off, "leasestart=%u\nleasetime=%u\n",
+			     rip->start, rip->leasetime);
+
+	if (!send)
+		print_to_buf(buf, len, &off, "errno=%u\n", rip->wg_errno);
+
+	if (rip->wg_errno)
+		print_to_buf(buf, len, &off, "errmsg=%s\n",
+			     WG_DYNAMIC_ERR[rip->wg_errno]);
+
+	print_to_buf(buf, len, &off, "\n");
+
+	return off;
+}
+
+static bool ref_parse_u32(const char *str, uint32_t *res)
+{
+	char *endptr;
+	uintmax_t uresult = strtoumax(str, &endptr, 10);
+
+	if (uresult > UINT32_MAX || *endptr != '\0')
+		return false;
+
+	*res = (uint32_t)uresult;
+	return true;
+}
+
+static bool ref_parse_ip(char *value, struct wg_dynamic_request_ip *rip)
+{
+	int family = strchr(value, ':') ? AF_INET6 : AF_INET;
+	char *sep = strchr(value, '/');
+
+	if (sep) {
+		char *endptr;
+		uintmax_t res = strtoumax(sep + 1, &endptr, 10);
+		if (res > (family == AF_INET ? 32 : 128) || *endptr != '\0' ||
+		    sep + 1 == endptr)
+			return false;
+
+		*sep = '\0';
+	}
+
+	if (family == AF_INET) {
+		rip->has_ipv4 = true;
+		return inet_pton(AF_INET, value, &rip->ipv4) == 1;
+	}
+
+	rip->has_ipv6 = true;
+	return inet_pton(AF_INET6, value, &rip->ipv6) == 1;
+}
+
+/* Parses one response from buf, which is modified */
+static bool ref_parse(char *buf, struct wg_dynamic_request_ip *rip)
+{
+	char *line = buf, *end, *eq;
+
+	memset(rip, 0, sizeof *rip);
+
+	while ((end = strchr(line, '\n'))) {
+		if (end == line)
+			return true;
+
+		*end = '\0';
+		eq = strchr(line, '=');
+		if (!eq)
+			return false;
+
+		*eq++ = '\0';
+		if (!strcmp(line, WG_DYNAMIC_KEY[WGKEY_IP])) {
+			if (!ref_parse_ip(eq, rip))
+				return false;
+		} else if (!strcmp(line, WG_DYNAMIC_KEY[WGKEY_LEASESTART])) {
+			if (!ref_parse_u32(eq, &rip->start))
+				return false;
+		} else if (!strcmp(line, WG_DYNAMIC_KEY[WGKEY_LEASETIME])) {
+			if (!ref_parse_u32(eq, &rip->leasetime))
+				return false;
+		} else if (!strcmp(line, WG_DYNAMIC_KEY[WGKEY_ERRNO])) {
+			if (!ref_parse_u32(eq, &rip->wg_errno))
+				return false;
+		} else if (!strcmp(line, WG_DYNAMIC_KEY[WGKEY_ERRMSG])) {
+			strncpy(rip->errmsg, eq, sizeof rip->errmsg - 1);
+		}
+
+		line = end + 1;
+	}
+
+	return false;
+}
+
+/* Parses one response from buf with the codec in common.c. The buffer is
+ * handed to handle_request() as if it had been read from a socket; it never
+ * needs to actually read since the response is complete.
+ */
+static int parse(const char *buf, size_t len, struct wg_dynamic_request *req)
+{
+	memset(req, 0, offsetof(struct wg_dynamic_request, buf));
+	req->cmd = WGKEY_REQUEST_IP;
+	req->version = 1;
+	memcpy(req->buf, buf, len);
+	req->end = len;
+
+	return handle_request(-1, req);
+}
+
+static void random_rip(struct wg_dynamic_request_ip *rip)
+{
+	uint64_t r = rng();
+
+	memset(rip, 0, sizeof *rip);
+	rip->has_ipv4 = r & 1;
+	rip->has_ipv6 = r & 2 || !rip->has_ipv4;
+	rip->ipv4.s_addr = rng();
+
+	/* mostly mimic pool addresses, with runs of zeros */
+	for (int i = 0; i < 8; ++i) {
+		uint16_t w = (rng() & 3) ? 0 : rng();
+		rip->ipv6.s6_addr[2 * i] = w >> 8;
+		rip->ipv6.s6_addr[2 * i + 1] = w;
+	}
+
+	if ((r >> 8) % 16 == 0) {
+		/* v4-mapped and v4-compatible addresses print specially */
+		memset(rip->ipv6.s6_addr, 0, 10);
+		memset(rip->ipv6.s6_addr + 10, (r >> 12) & 1 ? 0xff : 0, 2);
+	}
+
+	rip->start = rng();
+	rip->leasetime = (r >> 16) % 3 ? 3600 : (uint32_t)rng();
+	rip->wg_errno = (r >> 20) % 8 ? 0 : E_IP_UNAVAIL;
+}
+
+static void check_equal(struct wg_dynamic_request_ip *a,
+			struct wg_dynamic_request_ip *b, const char *msg)
+{
+	if (a->has_ipv4 != b->has_ipv4 || a->has_ipv6 != b->has_ipv6 ||
+	    (a->has_ipv4 && a->ipv4.s_addr != b->ipv4.s_addr) ||
+	    (a->has_ipv6 && memcmp(&a->ipv6, &b->ipv6, sizeof a->ipv6)) ||
+	    a->start != b->start || a->leasetime != b->leasetime ||
+	    a->wg_errno != b->wg_errno || strcmp(a->errmsg, b->errmsg))
+		die("Parsed results differ: %s\n", msg);
+}
+
+static void check_compat(void)
+{
+	static const char *const addrs[] = {
+		"10.0.0.1/32", "0.0.0.0", "255.255.255.255", "256.0.0.1",
+		"01.2.3.4", "1.2.3", "1.2.3.4.", "1..2.3", "1.2.3.4/33",
+		"1.2.3.4/", "1.2.3.4/+8", "2001:db8::1/128", "::", "::1",
+		"1::", ":1::", "1:::2", "::ffff:1.2.3.4", "::1.2.3.4",
+		"1:2:3:4:5:6:7:8", "1:2:3:4:5:6:7:8:9", "1:2:3:4:5:6:7::",
+		"::1:2:3:4:5:6:7", "1:2:3:4:5:6:7:8::", "12345::",
+		"fe80::1.2.3", "abcd:EF01::", "1:2:3:4:5:6:1.2.3.4", ":",
+		"1:", "2001:db8::/129", "2001:db8::/64",
+	};
+	struct wg_dynamic_request_ip rip, ref;
+	static struct wg_dynamic_request req;
+	char a[MAX_RESPONSE_SIZE], b[MAX_RESPONSE_SIZE];
+	size_t alen, blen;
+
+	for (int i = 0; i < ROUNDS; ++i) {
+		random_rip(&rip);
+		alen = serialize_request_ip(i & 1, a, sizeof a, &rip);
+		blen = ref_serialize(i & 1, b, sizeof b, &rip);
+		if (alen != blen || memcmp(a, b, alen))
+			die("Serialized output differs:\n%.*s\nvs\n%.*s\n",
+			    (int)alen, a, (int)blen, b);
+
+		if (i & 1)
+			continue;
+
+		if (parse(a, alen, &req) != 1 || !ref_parse(b, &ref))
+			die("Failed to parse:\n%.*s\n", (int)alen, a);
+
+		check_equal(&req.result.ip, &ref, a);
+	}
+
+	for (size_t i = 0; i < ARRAY_SIZE(addrs); ++i) {
+		bool ok, ref_ok;
+
+		alen = 0;
+		print_to_buf(a, sizeof a, &alen, "ip=%s\nleasetime=+7\n\n",
+			     addrs[i]);
+		memcpy(b, a, alen + 1);
+
+		ok = parse(a, alen, &req) == 1;
+		ref_ok = ref_parse(b, &ref);
+		if (ok != ref_ok)
+			die("%s is %s, but was %s before\n", addrs[i],
+			    ok ? "accepted" : "rejected",
+			    ref_ok ? "accepted" : "rejected");
+
+		if (ok)
+			check_equal(&req.result.ip, &ref, addrs[i]);
+	}
+}
+
+static void bench(void)
+{
+	static struct wg_dynamic_request_ip rips[NADDRS];
+	static struct wg_dynamic_request req;
+	char msgs[BATCH][256], tmp[256];
+	size_t lens[BATCH], total = 0;
+	struct wg_dynamic_request_ip ref;
+	double start, fast_ser, ref_ser, fast_parse, ref_parse_ns;
+	char buf[MAX_RESPONSE_SIZE];
+
+	for (int i = 0; i < NADDRS; ++i) {
+		random_rip(&rips[i]);
+		rips[i].has_ipv4 = rips[i].has_ipv6 = true;
+		rips[i].wg_errno = 0;
+	}
+
+	start = now_ns();
+	for (int i = 0; i < ROUNDS; ++i)
+		total += serialize_request_ip(false, buf, sizeof buf,
+					      &rips[i % NADDRS]);
+	fast_ser = (now_ns() - start) / ROUNDS;
+
+	start = now_ns();
+	for (int i = 0; i < ROUNDS; ++i)
+		total += ref_serialize(false, buf, sizeof buf,
+				       &rips[i % NADDRS]);
+	ref_ser = (now_ns() - start) / ROUNDS;
+
+	for (int i = 0; i < BATCH; ++i)
+		lens[i] = serialize_request_ip(false, msgs[i], sizeof msgs[i],
+					       &rips[i]);
+
+	start = now_ns();
+	for (int i = 0; i < ROUNDS; ++i) {
+		if (parse(msgs[i % BATCH], lens[i % BATCH], &req) != 1)
+			die("Failed to parse:\n%s", msgs[i % BATCH]);
+		total += req.result.ip.leasetime;
+	}
+	fast_parse = (now_ns() - start) / ROUNDS;
+
+	start = now_ns();
+	for (int i = 0; i < ROUNDS; ++i) {
+		memcpy(tmp, msgs[i % BATCH], lens[i % BATCH] + 1);
+		if (!ref_parse(tmp, &ref))
+			die("Failed to parse:\n%s", msgs[i % BATCH]);
+		total += ref.leasetime;
+	}
+	ref_parse_ns = (now_ns() - start) / ROUNDS;
+
+	printf("%-28s %10s %10s\n", "codec", "ns/op", "libc ns/op");
+	printf("%-28s %10.1f %10.1f\n", "serialize_request_ip()", fast_ser,
+	       ref_ser);
+	printf("%-28s %10.1f %10.1f\n", "parse request_ip response",
+	       fast_parse, ref_parse_ns);
+
+	/* keep the compiler from dropping the loops */
+	if (!total)
+		printf("\n");
+}
+
+int main(void)
+{
+	check_compat();
+	bench();
+
+	return 0;
+}
@@ -0,0 +1,307 @@
+/* SPDX-License-Identifier: MIT
+ *
+ * Copyright (C) 2019 WireGuard LLC. All Rights Reserved.
+ */
+
+/* Drives the address allocator in radix-trie.c through the patterns the
+ * server produces: filling a pool with random leases, renewing and expiring
+ * them at a steady occupancy and finally removing the pool, which orphans
+ * whatever is still leased. Allocations are counted by wrapping malloc() and
+ * friends at link time, see the Makefile.
+ */
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../dbg.h"
+#include "../radix-trie.h"
+
+#define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
+
+#define DEFAULT_MAX_LEASES (1U << 20)
+#define CHURN_OPS (1U << 18)
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+static uint64_t nallocs;
+static int64_t heap_bytes;
+
+void *__wrap_malloc(size_t size)
+{
+	void *ptr = __real_malloc(size);
+
+	++nallocs;
+	heap_bytes += malloc_usable_size(ptr);
+	return ptr;
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	void *ptr = __real_calloc(nmemb, size);
+
+	++nallocs;
+	heap_bytes += malloc_usable_size(ptr);
+	return ptr;
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	heap_bytes -= malloc_usable_size(ptr);
+	ptr = __real_realloc(ptr, size);
+
+	++nallocs;
+	heap_bytes += malloc_usable_size(ptr);
+	return ptr;
+}
+
+void __wrap_free(void *ptr)
+{
+	heap_bytes -= malloc_usable_size(ptr);
+	__real_free(ptr);
+}
+
+static uint64_t rng_state = 0x2545f4914f6cdd1dULL;
+
+static uint64_t rng(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts))
+		fatal("clock_gettime()");
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static long rss_bytes(void)
+{
+	long size, resident;
+	FILE *f = fopen("/proc/self/statm", "r");
+
+	if (!f)
+		return 0;
+
+	if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+		resident = 0;
+
+	fclose(f);
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+struct scenario {
+	int family;
+	uint8_t cidr;
+	unsigned int occupancy; /* in percent */
+};
+
+union addr {
+	struct in_addr ip4;
+	struct in6_addr ip6;
+};
+
+/* Free addresses left, capped to what ipp_addnth_v6() can index */
+static uint64_t available(struct ipns *ns, int family)
+{
+	if (family == AF_INET)
+		return ns->total_ipv4;
+
+	if (ns->totalh_ipv6 || ns->totall_ipv6 > UINT32_MAX)
+		return UINT32_MAX;
+
+	return ns->totall_ipv6;
+}
+
+static void alloc_random(struct ipns *ns, int family, union addr *dest)
+{
+	uint64_t index = rng() % available(ns, family);
+
+	if (family == AF_INET)
+		ipp_addnth_v4(ns, &dest->ip4, index);
+	else
+		ipp_addnth_v6(ns, &dest->ip6, index, 0);
+}
+
+/* Takes a specific random address of the pool, like a client asking for one */
+static bool alloc_specific(struct ipns *ns, int family, const union addr *pool,
+			   uint8_t cidr, union addr *dest)
+{
+	uint64_t r = rng();
+
+	*dest = *pool;
+	if (family == AF_INET) {
+		uint32_t host = ntohl(pool->ip4.s_addr);
+
+		host |= (uint32_t)r & ((1ULL << (32 - cidr)) - 1);
+		dest->ip4.s_addr = htonl(host);
+		return !ipp_add_v4(ns, &dest->ip4, 32);
+	}
+
+	for (int i = 15; i >= cidr / 8 && i >= 8; --i, r >>= 8) {
+		uint8_t mask = i == cidr / 8 ? 0xff >> cidr % 8 : 0xff;
+
+		dest->ip6.s6_addr[i] |= r & mask;
+	}
+
+	return !ipp_add_v6(ns, &dest->ip6, 128);
+}
+
+static void release(struct ipns *ns, int family, const union addr *addr)
+{
+	int ret;
+
+	if (family == AF_INET)
+		ret = ipp_del_v4(ns, &addr->ip4, 32);
+	else
+		ret = ipp_del_v6(ns, &addr->ip6, 128);
+
+	if (ret)
+		die("Failed to release an address\n");
+}
+
+static void run(const struct scenario *s, unsigned int max_leases)
+{
+	uint8_t bits = s->family == AF_INET ? 32 : 128;
+	uint64_t size, nleases, allocs, ops;
+	union addr pool = { 0 }, *leases;
+	long rss;
+	int64_t heap;
+	double start, fill_ns, churn_ns, remove_ns;
+	struct ipns ns;
+	int ret;
+
+	size = bits - s->cidr >= 64 ? UINT64_MAX : 1ULL << (bits - s->cidr);
+	nleases = size / 100 * s->occupancy + size % 100 * s->occupancy / 100;
+	if (nleases > max_leases)
+		nleases = max_leases;
+
+	leases = __real_calloc(nleases ? nleases : 1, sizeof *leases);
+	if (!leases)
+		fatal("calloc()");
+
+	if (s->family == AF_INET) {
+		pool.ip4.s_addr = htonl(0x0a000000);
+		ipp_init(&ns);
+		ret = ipp_addpool_v4(&ns, &pool.ip4, s->cidr);
+	} else {
+		pool.ip6.s6_addr[0] = 0x20;
+		pool.ip6.s6_addr[1] = 0x01;
+		pool.ip6.s6_addr[2] = 0x0d;
+		pool.ip6.s6_addr[3] = 0xb8;
+		ipp_init(&ns);
+		ret = ipp_addpool_v6(&ns, &pool.ip6, s->cidr);
+	}
+	if (ret)
+		die("Failed to add pool\n");
+
+	/* random fill up to the target occupancy */
+	rss = rss_bytes();
+	heap = heap_bytes;
+	allocs = nallocs;
+	start = now_ns();
+	for (uint64_t i = 0; i < nleases; ++i)
+		alloc_random(&ns, s->family, &leases[i]);
+	fill_ns = nleases ? (now_ns() - start) / nleases : 0;
+
+	printf("%-4s /%-3u %3u%% %8" PRIu64 "  %8.1f %6.3f %7.1f %7.1f",
+	       s->family == AF_INET ? "ipv4" : "ipv6", s->cidr, s->occupancy,
+	       nleases, fill_ns,
+	       nleases ? (double)(nallocs - allocs) / nleases : 0,
+	       nleases ? (double)(heap_bytes - heap) / nleases : 0,
+	       nleases ? (double)(rss_bytes() - rss) / nleases : 0);
+
+	/* steady state: leases expire and get replaced, half of them with a
+	 * random address and half with one the client asked for
+	 */
+	allocs = nallocs;
+	ops = 0;
+	start = now_ns();
+	for (unsigned int i = 0; nleases && i < CHURN_OPS; ++i) {
+		union addr *lease = &leases[rng() % nleases];
+
+		release(&ns, s->family, lease);
+		++ops;
+
+		if (i % 2 && available(&ns, s->family) > 1 &&
+		    alloc_specific(&ns, s->family, &pool, s->cidr, lease)) {
+			++ops;
+			continue;
+		}
+
+		alloc_random(&ns, s->family, lease);
+		++ops;
+	}
+	churn_ns = ops ? (now_ns() - start) / ops : 0;
+
+	printf("  %8.1f %6.3f", churn_ns,
+	       ops ? (double)(nallocs - allocs) / ops : 0);
+
+	/* removing the pool orphans all leases still in it */
+	start = now_ns();
+	if (s->family == AF_INET)
+		ret = ipp_removepool_v4(&ns, &pool.ip4, s->cidr);
+	else
+		ret = ipp_removepool_v6(&ns, &pool.ip6, s->cidr);
+	remove_ns = now_ns() - start;
+	if (ret)
+		die("Failed to remove pool\n");
+
+	printf("  %10.1f\n", nleases ? remove_ns / nleases : remove_ns);
+
+	ipp_free(&ns);
+	__real_free(leases);
+}
+
+int main(int argc, char *argv[])
+{
+	static const uint8_t v4_pools[] = { 24, 20, 16, 12, 8 };
+	static const uint8_t v6_pools[] = { 120, 112, 104, 96, 64 };
+	static const unsigned int occupancies[] = { 1, 10, 50, 90, 99 };
+	unsigned int max_leases = DEFAULT_MAX_LEASES;
+	struct scenario s;
+
+	if (argc > 2 || (argc == 2 && !(max_leases = atoi(argv[1])))) {
+		fprintf(stderr, "usage: %s [<max-leases>]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	printf("leases per scenario are capped at %u\n\n", max_leases);
+	printf("%-20s %8s  %-32s  %-15s  %10s\n", "", "",
+	       "random fill", "renew/expire", "removepool");
+	printf("%-4s %-4s %4s %8s  %8s %6s %7s %7s  %8s %6s  %10s\n", "fam",
+	       "pool", "occ", "leases", "ns/op", "alloc", "B/lease", "RSS/l",
+	       "ns/op", "alloc", "ns/lease");
+
+	for (size_t i = 0; i < ARRAY_SIZE(v4_pools); ++i) {
+		for (size_t j = 0; j < ARRAY_SIZE(occupancies); ++j) {
+			s = (struct scenario){ AF_INET, v4_pools[i],
+					       occupancies[j] };
+			run(&s, max_leases);
+		}
+	}
+
+	for (size_t i = 0; i < ARRAY_SIZE(v6_pools); ++i) {
+		for (size_t j = 0; j < ARRAY_SIZE(occupancies); ++j) {
+			s = (struct scenario){ AF_INET6, v6_pools[i],
+					       occupancies[j] };
+			run(&s, max_leases);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,291 @@
+/* SPDX-License-Identifier: MIT
+ *
+ * Copyright (C) 2019 WireGuard LLC. All Rights Reserved.
+ */
+
+/* Checks the free address totals of radix-trie.c against a model, over random
+ * sequences of pool additions, removals and re-additions with addresses taken
+ * and released in between. Pools are kept within a range of 2^16 addresses,
+ * 10.0.0.0/16 and 2001:db8::/112, which the model tracks one by one.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../dbg.h"
+#include "../radix-trie.h"
+
+#define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
+
+#define RANGE_BITS 16
+#define RANGE_SIZE (1U << RANGE_BITS)
+#define MAX_POOLS 8
+#define DEFAULT_OPS 200000
+
+static uint64_t rng_state = 0x2545f4914f6cdd1dULL;
+
+static uint64_t rng(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+union addr {
+	struct in_addr ip4;
+	struct in6_addr ip6;
+};
+
+struct pool {
+	uint32_t start;
+	uint8_t cidr; /* within the range, from 0 to RANGE_BITS */
+};
+
+/* What the trie should hold, for the addresses of the range */
+struct model {
+	int family;
+	struct pool pools[MAX_POOLS];
+	size_t npools;
+	uint8_t covered[RANGE_SIZE]; /* by how many pools */
+	bool taken[RANGE_SIZE];
+	uint64_t free;
+	uint64_t ops;
+};
+
+static void to_addr(int family, uint32_t offset, union addr *dest)
+{
+	memset(dest, 0, sizeof *dest);
+	if (family == AF_INET) {
+		dest->ip4.s_addr = htonl(0x0a000000 | offset);
+	} else {
+		inet_pton(AF_INET6, "2001:db8::", &dest->ip6);
+		dest->ip6.s6_addr[14] = offset >> 8;
+		dest->ip6.s6_addr[15] = offset & 0xff;
+	}
+}
+
+static uint32_t from_addr(int family, const union addr *addr)
+{
+	uint32_t host;
+
+	if (family == AF_INET) {
+		host = ntohl(addr->ip4.s_addr);
+		if (host >> RANGE_BITS != 0x0a00)
+			die("Address outside of 10.0.0.0/16 taken\n");
+
+		return host & (RANGE_SIZE - 1);
+	}
+
+	return addr->ip6.s6_addr[14] << 8 | addr->ip6.s6_addr[15];
+}
+
+static uint8_t prefix_len(int family, uint8_t cidr)
+{
+	return (family == AF_INET ? 32 : 128) - RANGE_BITS + cidr;
+}
+
+static void check_total(struct ipns *ns, struct model *m, const char *what)
+{
+	uint64_t total = m->family == AF_INET ? ns->total_ipv4 :
+						ns->totall_ipv6;
+
+	if (m->family == AF_INET6 && ns->totalh_ipv6)
+		total = UINT64_MAX;
+
+	if (total != m->free)
+		die("ipv%d, op %" PRIu64 " (%s): %" PRIu64 " addresses free, "
+		    "expected %" PRIu64 "\n", m->family == AF_INET ? 4 : 6,
+		    m->ops, what, total, m->free);
+}
+
+static void add_pool(struct ipns *ns, struct model *m, uint32_t start,
+		     uint8_t cidr)
+{
+	uint32_t size = RANGE_SIZE >> cidr;
+	union addr addr;
+	bool exists = false;
+	int ret;
+
+	start &= (RANGE_SIZE - 1) & ~(size - 1);
+	for (size_t i = 0; i < m->npools; ++i) {
+		if (m->pools[i].start == start && m->pools[i].cidr == cidr)
+			exists = true;
+	}
+
+	if (!exists && m->npools == MAX_POOLS)
+		return;
+
+	to_addr(m->family, start, &addr);
+	if (m->family == AF_INET)
+		ret = ipp_addpool_v4(ns, &addr.ip4, prefix_len(AF_INET, cidr));
+	else
+		ret = ipp_addpool_v6(ns, &addr.ip6,
+				     prefix_len(AF_INET6, cidr));
+
+	if (exists != !!ret)
+		die("Adding the pool %" PRIu32 "/%u returned %d\n", start,
+		    cidr, ret);
+
+	if (exists)
+		return;
+
+	m->pools[m->npools++] = (struct pool){ start, cidr };
+	for (uint32_t i = start; i < start + size; ++i) {
+		if (!m->covered[i]++)
+			++m->free;
+	}
+	check_total(ns, m, "addpool");
+}
+
+/* Whatever is leased in the pool and not in any other pool is orphaned */
+static void remove_pool(struct ipns *ns, struct model *m, size_t n)
+{
+	struct pool pool = m->pools[n];
+	uint32_t size = RANGE_SIZE >> pool.cidr;
+	union addr addr;
+	int ret;
+
+	to_addr(m->family, pool.start, &addr);
+	if (m->family == AF_INET)
+		ret = ipp_removepool_v4(ns, &addr.ip4,
+					prefix_len(AF_INET, pool.cidr));
+	else
+		ret = ipp_removepool_v6(ns, &addr.ip6,
+					prefix_len(AF_INET6, pool.cidr));
+
+	if (ret)
+		die("Removing the pool %" PRIu32 "/%u failed\n", pool.start,
+		    pool.cidr);
+
+	m->pools[n] = m->pools[--m->npools];
+	for (uint32_t i = pool.start; i < pool.start + size; ++i) {
+		if (--m->covered[i])
+			continue;
+
+		if (m->taken[i])
+			m->taken[i] = false;
+		else
+			--m->free;
+	}
+	check_total(ns, m, "removepool");
+}
+
+static void take_nth(struct ipns *ns, struct model *m)
+{
+	union addr addr;
+	uint32_t offset;
+
+	if (!m->free)
+		return;
+
+	if (m->family == AF_INET)
+		ipp_addnth_v4(ns, &addr.ip4, rng() % m->free);
+	else
+		ipp_addnth_v6(ns, &addr.ip6, rng() % m->free, 0);
+
+	offset = from_addr(m->family, &addr);
+	if (!m->covered[offset] || m->taken[offset])
+		die("ipv%d, op %" PRIu64 ": took %" PRIu32 ", which wasn't "
+		    "free\n", m->family == AF_INET ? 4 : 6, m->ops, offset);
+
+	m->taken[offset] = true;
+	--m->free;
+	check_total(ns, m, "addnth");
+}
+
+/* Takes or releases a random address, which may be outside of the pools */
+static void toggle(struct ipns *ns, struct model *m)
+{
+	uint32_t offset = rng() % RANGE_SIZE;
+	bool taken = m->taken[offset];
+	union addr addr;
+	int ret;
+
+	to_addr(m->family, offset, &addr);
+	if (m->family == AF_INET)
+		ret = taken ? ipp_del_v4(ns, &addr.ip4, 32) :
+			      ipp_add_v4(ns, &addr.ip4, 32);
+	else
+		ret = taken ? ipp_del_v6(ns, &addr.ip6, 128) :
+			      ipp_add_v6(ns, &addr.ip6, 128);
+
+	if (!taken && !m->covered[offset]) {
+		if (!ret)
+			die("Took %" PRIu32 ", which is outside of the pools\n",
+			    offset);
+		return;
+	}
+
+	if (ret)
+		die("ipv%d, op %" PRIu64 ": %s %" PRIu32 " failed\n",
+		    m->family == AF_INET ? 4 : 6, m->ops,
+		    taken ? "releasing" : "taking", offset);
+
+	m->taken[offset] = !taken;
+	m->free += taken ? 1 : -1;
+	check_total(ns, m, taken ? "del" : "add");
+}
+
+static void run(int family, uint64_t nops)
+{
+	struct model *m;
+	struct ipns ns;
+
+	m = calloc(1, sizeof *m);
+	if (!m)
+		fatal("calloc()");
+	m->family = family;
+	ipp_init(&ns);
+
+	/* the sequence that used to leave the totals at 2^64 - 1 */
+	add_pool(&ns, m, 0x9000, 6);
+	remove_pool(&ns, m, 0);
+	add_pool(&ns, m, 0xb200, 7);
+	take_nth(&ns, m);
+	remove_pool(&ns, m, 0);
+	add_pool(&ns, m, 0x8000, 2);
+	remove_pool(&ns, m, 0);
+
+	for (m->ops = 0; m->ops < nops; ++m->ops) {
+		uint64_t r = rng() % 1000;
+
+		if (r < 5)
+			add_pool(&ns, m, rng(), rng() % 13);
+		else if (r < 9 && m->npools)
+			remove_pool(&ns, m, rng() % m->npools);
+		else if (r < 600)
+			take_nth(&ns, m);
+		else
+			toggle(&ns, m);
+	}
+
+	while (m->npools)
+		remove_pool(&ns, m, 0);
+
+	ipp_free(&ns);
+	free(m);
+}
+
+int main(int argc, char *argv[])
+{
+	uint64_t nops = DEFAULT_OPS;
+	int families[] = { AF_INET, AF_INET6 };
+
+	if (argc > 1)
+		nops = strtoull(argv[1], NULL, 0);
+	if (argc > 2)
+		rng_state = strtoull(argv[2], NULL, 0);
+
+	for (size_t i = 0; i < ARRAY_SIZE(families); ++i)
+		run(families[i], nops);
+
+	printf("%" PRIu64 " operations per family, totals as expected\n",
+	       nops);
+	return 0;
+}
@@ -0,0 +1,97 @@
+#!/bin/bash
+# SPDX-License-Identifier: MIT
+#
+# Copyright (C) 2019 WireGuard LLC. All Rights Reserved.
+#
+# Runs wg-dynamic-loadgen against tests/wg-dynamic-server-stub, both built
+# with `make loadgen`. The two namespaces are connected with a veth pair
+# instead of WireGuard, the stub server pretends that there is one peer for
+# each of the $PEERS link-local addresses on the client side. Arguments are
+# passed on to wg-dynamic-loadgen, e.g.:
+#
+#   PEERS=5000 tests/loadgen.bash --concurrency 1000 --storm 3
+#
+# Debug output of the server dominates the latencies unless both were built
+# with CFLAGS=-DNDEBUG, or with CFLAGS=-DDEBUG_LEVEL=1 to keep everything but
+# the messages written for each request.
+
+set -e
+exec 3>&1
+
+PEERS=${PEERS:-1000}
+SERVER_ARGS=${SERVER_ARGS:-}
+
+netnsn() { echo wg-test-$$-$1; }
+pretty() { echo -e "\x1b[32m\x1b[1m[+] ${1:+NS$1: }${2}\x1b[0m" >&3; }
+pp() { pretty "" "$*"; "$@"; }
+maybe_exec() { if [[ $BASHPID -eq $$ ]]; then "$@"; else exec "$@"; fi; }
+nn() { local netns=$(netnsn $1) n=$1; shift; pretty $n "$*"; maybe_exec ip netns exec $netns "$@"; }
+ipn() { local netns=$(netnsn $1) n=$1; shift; pretty $n "ip $*"; ip -n $netns "$@"; }
+
+ns="1 2"
+tmpdir=$(mktemp -d)
+
+cleanup() {
+	set +e
+	exec 2>/dev/null
+
+	ipn 1 link del dev wg0
+
+	local to_kill="$(for n in $ns; do ip netns pids $(netnsn $n); done)"
+	[[ -n $to_kill ]] && kill $to_kill
+
+	for n in $ns; do pp ip netns del $(netnsn $n); done
+	rm -rf "$tmpdir"
+
+	exit
+}
+
+trap cleanup EXIT
+
+[[ -x ./wg-dynamic-loadgen && -x ./tests/wg-dynamic-server-stub ]] ||
+	{ echo "Run \`make loadgen' first" >&2; exit 1; }
+
+pp ip netns add $(netnsn 1)
+pp ip netns add $(netnsn 2)
+
+# No automatic link-local addresses, the server needs exactly one and the
+# client side only the ones of the simulated peers.
+ipn 1 link add dev wg0 type veth peer name wg0 netns $(netnsn 2)
+ipn 1 link set dev wg0 addrgenmode none
+ipn 2 link set dev wg0 addrgenmode none
+
+ipn 1 addr add fe80::/64 dev wg0 nodad
+for ((i = 0; i < PEERS; ++i)); do
+	printf "addr add fe80::1:%x/128 dev wg0 nodad\n" $i
+done | ip -n $(netnsn 2) -b -
+pretty 2 "added $PEERS peer addresses"
+
+# Permanent neighbour entries don't count towards the gc thresholds of the
+# neighbour table, which would otherwise limit us to ~1000 peers.
+client_mac=$(ip -n $(netnsn 2) -br link show dev wg0 | awk '{ print $3 }')
+for ((i = 0; i < PEERS; ++i)); do
+	printf "neigh add fe80::1:%x lladdr %s dev wg0 nud permanent\n" \
+		$i $client_mac
+done | ip -n $(netnsn 1) -b -
+pretty 1 "added $PEERS neighbour entries"
+
+ipn 1 link set up dev wg0
+ipn 2 link set up dev wg0
+
+ipn 2 route add fe80::/128 dev wg0
+ipn 1 route add 10.0.0.0/16 dev wg0
+ipn 1 route add 2001:db8::/112 dev wg0
+
+exec 4< <(nn 1 env WG_DYNAMIC_STUB_PEERS=$PEERS \
+	./tests/wg-dynamic-server-stub --leasefile "$tmpdir/leases" \
+	--stats-socket "$tmpdir/stats" $SERVER_ARGS wg0)
+sleep 1
+
+nn 2 ./wg-dynamic-loadgen --peers $PEERS "$@" wg0
+
+if command -v socat >/dev/null; then
+	pretty 1 "server metrics"
+	socat - UNIX-CONNECT:"$tmpdir/stats" | grep -v '^#\|_bucket'
+fi
+
+pretty "" "SUCCESS\n"
@@ -0,0 +1,28 @@
+#!/bin/bash
+# SPDX-License-Identifier: MIT
+#
+# Copyright (C) 2019 WireGuard LLC. All Rights Reserved.
+#
+# Captures a few renewal storms of tests/loadgen.bash and replays them with
+# every allocator, built with `make loadgen replay'. Fails unless each replay
+# ends with every address of the pools either free or leased. Arguments are
+# passed on to tests/loadgen.bash, e.g.:
+#
+#   PEERS=5000 tests/replay.bash --concurrency 1000 --storm 5
+
+set -e
+
+[[ -x ./tests/wg-dynamic-replay ]] ||
+	{ echo "Run \`make loadgen replay' first" >&2; exit 1; }
+
+tmpdir=$(mktemp -d)
+trap 'rm -rf "$tmpdir"' EXIT
+
+[[ $# -gt 0 ]] || set -- --concurrency 100 --storm 3
+SERVER_ARGS="${SERVER_ARGS:+$SERVER_ARGS }--capture $tmpdir/trace" \
+	tests/loadgen.bash "$@"
+
+for alloc in random compact sticky-hash; do
+	echo "--alloc $alloc:"
+	tests/wg-dynamic-replay --alloc $alloc "$tmpdir/trace"
+done
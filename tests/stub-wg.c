@@ -0,0 +1,90 @@
+/* SPDX-License-Identifier: MIT
+ *
+ * Copyright (C) 2019 WireGuard LLC. All Rights Reserved.
+ */
+
+/* Stands in for the kernel side of WireGuard, so that wg-dynamic-server can
+ * run on a plain interface like a veth, see tests/loadgen.bash. Linked in
+ * with --wrap, everything but the device configuration goes to the kernel as
+ * usual.
+ *
+ * The device has WG_DYNAMIC_STUB_PEERS peers (default 1000), peer i having
+ * the link-local address WG_DYNAMIC_STUB_BASE + i (default fe80::1:0) as its
+ * only allowedip, the same layout wg-dynamic-loadgen uses. If
+ * WG_DYNAMIC_STUB_IPV4 is set, peer i also has that address + i, like peers
+ * that held leases before a restart. Updates of the allowedips are accepted
+ * and dropped.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <net/if.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../dbg.h"
+#include "../netlink.h"
+
+int __wrap_wg_for_each_peer_stream(const char *device_name, wg_device *dev,
+				   wg_peer_cb cb, void *ctx)
+{
+	const char *env_peers = getenv("WG_DYNAMIC_STUB_PEERS");
+	const char *env_base = getenv("WG_DYNAMIC_STUB_BASE");
+	const char *env_ipv4 = getenv("WG_DYNAMIC_STUB_IPV4");
+	unsigned long npeers = env_peers ? strtoul(env_peers, NULL, 10) : 1000;
+	wg_allowedip allowedip = { .family = AF_INET6, .cidr = 128 };
+	wg_allowedip allowedip4 = { .family = AF_INET, .cidr = 32 };
+	wg_peer peer = { .flags = WGPEER_HAS_PUBLIC_KEY };
+	struct in6_addr base;
+	struct in_addr base4;
+	wg_device local;
+	int ret;
+
+	if (inet_pton(AF_INET6, env_base ? env_base : "fe80::1:0", &base) != 1)
+		die("Invalid WG_DYNAMIC_STUB_BASE: %s\n", env_base);
+	if (env_ipv4 && inet_pton(AF_INET, env_ipv4, &base4) != 1)
+		die("Invalid WG_DYNAMIC_STUB_IPV4: %s\n", env_ipv4);
+
+	if (!dev)
+		dev = &local;
+	memset(dev, 0, sizeof *dev);
+	strncpy(dev->name, device_name, sizeof dev->name - 1);
+	dev->ifindex = if_nametoindex(device_name);
+	if (!dev->ifindex)
+		return -ENODEV;
+
+	peer.first_allowedip = peer.last_allowedip = &allowedip;
+	if (env_ipv4) {
+		allowedip.next_allowedip = &allowedip4;
+		peer.last_allowedip = &allowedip4;
+	}
+	peer.public_key[31] = 0x40;
+	for (unsigned long i = 0; i < npeers; ++i) {
+		uint32_t low;
+
+		/* any key will do as long as it's unique */
+		low = htonl(i);
+		memcpy(peer.public_key, &low, sizeof low);
+
+		allowedip.ip6 = base;
+		memcpy(&low, &base.s6_addr[12], sizeof low);
+		low = htonl(ntohl(low) + i);
+		memcpy(&allowedip.ip6.s6_addr[12], &low, sizeof low);
+		if (env_ipv4)
+			allowedip4.ip4.s_addr = htonl(ntohl(base4.s_addr) + i);
+
+		ret = cb(dev, &peer, ctx);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+int __wrap_wg_set_device(wg_device *dev)
+{
+	(void)dev;
+	return 0;
+}
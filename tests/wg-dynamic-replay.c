@@ -0,0 +1,590 @@
+/* SPDX-License-Identifier: MIT
+ *
+ * Copyright (C) 2019 WireGuard LLC. All Rights Reserved.
+ */
+
+/* Feeds a trace written by wg-dynamic-server --capture back into lease.c and
+ * radix-trie.c, as fast as possible, and reports where the time went. The
+ * kernel is stubbed out by tests/stub-wg.c, and clock_gettime() and
+ * getentropy() are wrapped at link time, see the Makefile: CLOCK_BOOTTIME
+ * and CLOCK_REALTIME follow the timestamps of the trace, and all randomness
+ * derives from --seed. Replaying the same trace with the same options thus
+ * always ends in the same leases, which the digest printed at the end
+ * identifies, while the options can be varied to compare allocators:
+ *
+ *   wg-dynamic-replay --alloc compact trace
+ *
+ * Leases expire when the server would have noticed, as the server refreshes
+ * them whenever its event loop wakes up, at the latest when the next one is
+ * due. Peers renewing the addresses the server gave them ask for the ones the
+ * replay gave them instead, so the two needn't allocate alike.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../capture.h"
+#include "../dbg.h"
+#include "../khash.h"
+#include "../lease.h"
+#include "../siphash.h"
+
+#define NSEC_PER_SEC 1000000000ULL
+
+int __real_clock_gettime(clockid_t clock, struct timespec *tp);
+
+/* ns since the start of the trace */
+static uint64_t now;
+static const struct capture_header *hdr;
+
+static uint64_t rng_state;
+
+static void to_timespec(uint64_t ns, struct timespec *tp)
+{
+	tp->tv_sec = ns / NSEC_PER_SEC;
+	tp->tv_nsec = ns % NSEC_PER_SEC;
+}
+
+int __wrap_clock_gettime(clockid_t clock, struct timespec *tp)
+{
+	if (clock == CLOCK_BOOTTIME) {
+		to_timespec(hdr->start_boot + now, tp);
+		return 0;
+	}
+	if (clock == CLOCK_REALTIME) {
+		to_timespec(hdr->start_real + now, tp);
+		return 0;
+	}
+
+	/* the metrics and our own measurements */
+	return __real_clock_gettime(clock, tp);
+}
+
+/* splitmix64, only needs to be deterministic */
+int __wrap_getentropy(void *buf, size_t len)
+{
+	uint8_t *p = buf;
+
+	while (len) {
+		uint64_t z = (rng_state += 0x9e3779b97f4a7c15ULL);
+		size_t n = MIN(len, sizeof z);
+
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		z ^= z >> 31;
+		memcpy(p, &z, n);
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static uint64_t real_ns(void)
+{
+	struct timespec ts;
+
+	if (__real_clock_gettime(CLOCK_MONOTONIC, &ts))
+		fatal("clock_gettime(CLOCK_MONOTONIC)");
+
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+enum replay_op {
+	OP_SET_LEASE,
+	OP_FLUSH,
+	OP_POOL,
+	OP_IMPORT,
+	OP_REFRESH,
+	OP_MAX,
+};
+
+static const char *op_names[OP_MAX] = {
+	[OP_SET_LEASE] = "set_lease",
+	[OP_FLUSH] = "leases_flush",
+	[OP_POOL] = "pool changes",
+	[OP_IMPORT] = "imports",
+	[OP_REFRESH] = "leases_refresh",
+};
+
+/* The addresses a peer got from the server and from the replay, when it last
+ * asked for a lease
+ */
+struct peer_addrs {
+	struct in_addr server_ipv4, replay_ipv4;
+	struct in6_addr server_ipv6, replay_ipv6;
+};
+
+/* keyed by the pubkeys in the trace, which stays mapped */
+KHASH_MAP_INIT_SECURE_WGKEY(peerht, struct peer_addrs)
+
+struct replay_iface {
+	struct wg_dynamic_leases *leases;
+	uint64_t next_refresh; /* like now */
+	khash_t(peerht) *peers;
+	/* the pools addresses are handed out from, see count_pool() */
+	struct capture_record *pools;
+	size_t npools, pools_cap;
+};
+
+static struct replay_iface ifaces[CAPTURE_MAX_INTERFACES];
+static uint64_t op_count[OP_MAX], op_ns[OP_MAX];
+static uint64_t failed_leases;
+
+static void refresh(struct replay_iface *iface)
+{
+	uint64_t start = real_ns();
+	int next = leases_refresh(iface->leases);
+
+	op_ns[OP_REFRESH] += real_ns() - start;
+	++op_count[OP_REFRESH];
+	iface->next_refresh = now + next * NSEC_PER_SEC;
+}
+
+/* Runs all refreshes due until t, the time of the next record */
+static void advance(uint64_t t)
+{
+	for (uint32_t i = 0; i < hdr->ninterfaces; ++i) {
+		while (ifaces[i].next_refresh <= t) {
+			now = MAX(now, ifaces[i].next_refresh);
+			refresh(&ifaces[i]);
+		}
+	}
+
+	now = MAX(now, t);
+}
+
+/* Keeps track of the pools, except for those ipp_addpool_*() refuses as too
+ * small to hand out addresses from
+ */
+static void count_pool(struct replay_iface *iface,
+		       const struct capture_record *rec)
+{
+	bool ipv6 = rec->flags & CAPTURE_IPV6;
+	size_t i;
+
+	if (ipv6 ? rec->cidr < 64 || rec->cidr >= 128 :
+		   !rec->cidr || rec->cidr >= 32)
+		return;
+
+	for (i = 0; i < iface->npools; ++i) {
+		const struct capture_record *pool = &iface->pools[i];
+
+		if (pool->flags == rec->flags && pool->cidr == rec->cidr &&
+		    (ipv6 ? IN6_ARE_ADDR_EQUAL(&pool->ipv6, &rec->ipv6) :
+			    pool->ipv4.s_addr == rec->ipv4.s_addr))
+			break;
+	}
+
+	if (rec->type == CAPTURE_POOL_DEL) {
+		if (i < iface->npools)
+			iface->pools[i] = iface->pools[--iface->npools];
+		return;
+	}
+
+	if (iface->npools == iface->pools_cap) {
+		iface->pools_cap = iface->pools_cap ? 2 * iface->pools_cap : 8;
+		iface->pools = realloc(iface->pools,
+				       iface->pools_cap * sizeof *iface->pools);
+		if (!iface->pools)
+			fatal("realloc()");
+	}
+	iface->pools[iface->npools++] = *rec;
+}
+
+static void set_lease_of(struct replay_iface *iface,
+			 const struct capture_record *rec)
+{
+	const struct in6_addr *lladdr, *ipv6;
+	const struct in_addr *ipv4;
+	struct wg_dynamic_lease *lease;
+	struct peer_addrs *addrs = NULL;
+	khiter_t k;
+	int ret;
+
+	lladdr = rec->flags & CAPTURE_LLADDR ? &rec->lladdr : NULL;
+	ipv4 = rec->flags & CAPTURE_IPV4 ? &rec->ipv4 : NULL;
+	ipv6 = rec->flags & CAPTURE_IPV6 ? &rec->ipv6 : NULL;
+
+	k = kh_get(peerht, iface->peers, rec->pubkey);
+	if (k != kh_end(iface->peers)) {
+		addrs = &kh_value(iface->peers, k);
+		if (ipv4 && ipv4->s_addr &&
+		    ipv4->s_addr == addrs->server_ipv4.s_addr)
+			ipv4 = &addrs->replay_ipv4;
+		if (ipv6 && !IN6_IS_ADDR_UNSPECIFIED(ipv6) &&
+		    IN6_ARE_ADDR_EQUAL(ipv6, &addrs->server_ipv6))
+			ipv6 = &addrs->replay_ipv6;
+	}
+
+	leases_lock(iface->leases);
+	lease = set_lease(iface->leases, rec->pubkey, rec->leasetime, lladdr,
+			  ipv4, ipv6);
+	if (!lease) {
+		leases_unlock(iface->leases);
+		++failed_leases;
+		return;
+	}
+
+	if (!addrs) {
+		k = kh_put(peerht, iface->peers, rec->pubkey, &ret);
+		if (ret < 0)
+			fatal("kh_put()");
+		addrs = &kh_value(iface->peers, k);
+	}
+	addrs->server_ipv4 = rec->lease_ipv4;
+	addrs->server_ipv6 = rec->lease_ipv6;
+	addrs->replay_ipv4 = lease->ipv4;
+	addrs->replay_ipv6 = lease->ipv6;
+	leases_unlock(iface->leases);
+}
+
+static void replay(const struct capture_record *rec)
+{
+	struct replay_iface *iface = &ifaces[rec->iface];
+	struct journal_record jrec;
+	enum replay_op op;
+	uint64_t start;
+	khiter_t k;
+
+	advance(rec->time);
+
+	start = real_ns();
+	switch (rec->type) {
+	case CAPTURE_SET_LEASE:
+		op = OP_SET_LEASE;
+		set_lease_of(iface, rec);
+		break;
+	case CAPTURE_FLUSH:
+		op = OP_FLUSH;
+		leases_flush(iface->leases);
+		break;
+	case CAPTURE_POOL_ADD:
+	case CAPTURE_POOL_DEL:
+		op = OP_POOL;
+		if (rec->flags & CAPTURE_IPV6)
+			leases_set_pool(iface->leases, AF_INET6, &rec->ipv6,
+					rec->cidr,
+					rec->type == CAPTURE_POOL_ADD);
+		else
+			leases_set_pool(iface->leases, AF_INET, &rec->ipv4,
+					rec->cidr,
+					rec->type == CAPTURE_POOL_ADD);
+		count_pool(iface, rec);
+		break;
+	case CAPTURE_IMPORT:
+	case CAPTURE_REMOVE:
+		op = OP_IMPORT;
+		/* both now hold whatever the record says */
+		k = kh_get(peerht, iface->peers, rec->pubkey);
+		if (k != kh_end(iface->peers))
+			kh_del(peerht, iface->peers, k);
+		memset(&jrec, 0, sizeof jrec);
+		memcpy(jrec.pubkey, rec->pubkey, sizeof jrec.pubkey);
+		if (rec->type == CAPTURE_IMPORT) {
+			jrec.ipv4 = rec->ipv4;
+			jrec.ipv6 = rec->ipv6;
+			jrec.lladdr = rec->lladdr;
+			jrec.leasetime = rec->leasetime;
+			jrec.start_real = rec->start_real;
+		}
+		leases_replicate(iface->leases, &jrec, 1, false);
+		break;
+	default:
+		die("Unknown record type %u\n", rec->type);
+	}
+	op_ns[op] += real_ns() - start;
+	++op_count[op];
+
+	/* the server looks again once its event loop wakes up */
+	if (op != OP_POOL)
+		iface->next_refresh = MIN(iface->next_refresh, now);
+}
+
+struct digest_ctx {
+	struct journal_record *recs;
+	size_t n, cap;
+};
+
+static void collect_record(const struct journal_record *rec, void *ctx)
+{
+	struct digest_ctx *dc = ctx;
+
+	if (dc->n == dc->cap) {
+		dc->cap = dc->cap ? dc->cap * 2 : 1024;
+		dc->recs = realloc(dc->recs, dc->cap * sizeof *dc->recs);
+		if (!dc->recs)
+			fatal("realloc()");
+	}
+	dc->recs[dc->n++] = *rec;
+}
+
+static int compare_records(const void *a, const void *b)
+{
+	return memcmp(a, b, sizeof(wg_key));
+}
+
+/* Identifies the leases of all interfaces, independent of the table layout */
+static uint64_t digest(void)
+{
+	static const siphash_key_t key = { { 0x7265706c6179ULL, 0 } };
+	struct digest_ctx dc = { 0 };
+	uint64_t h = 0;
+
+	for (uint32_t i = 0; i < hdr->ninterfaces; ++i) {
+		dc.n = 0;
+		leases_export(ifaces[i].leases, collect_record, &dc);
+		qsort(dc.recs, dc.n, sizeof *dc.recs, compare_records);
+		for (size_t j = 0; j < dc.n; ++j) {
+			dc.recs[j].check = h;
+			h = siphash(&dc.recs[j], sizeof dc.recs[j], &key);
+		}
+	}
+	free(dc.recs);
+
+	return h;
+}
+
+static bool in_pool(const struct capture_record *pool, int family,
+		    const void *addr)
+{
+	const uint8_t *a = addr, *p;
+	uint8_t bytes = pool->cidr / 8, bits = pool->cidr % 8;
+
+	if ((family == AF_INET6) != !!(pool->flags & CAPTURE_IPV6))
+		return false;
+
+	p = family == AF_INET6 ? pool->ipv6.s6_addr :
+				 (const uint8_t *)&pool->ipv4.s_addr;
+	return !memcmp(a, p, bytes) &&
+	       (!bits || !((a[bytes] ^ p[bytes]) >> (8 - bits)));
+}
+
+struct held_ctx {
+	const struct replay_iface *iface;
+	uint64_t ipv4, ipv6;
+};
+
+/* Counts the addresses leased from the pools; pools that went away leave
+ * their leases' addresses outside of them
+ */
+static void count_held(const struct journal_record *rec, void *ctx)
+{
+	struct held_ctx *held = ctx;
+	const struct replay_iface *iface = held->iface;
+
+	for (size_t i = 0; i < iface->npools; ++i) {
+		held->ipv4 += rec->ipv4.s_addr &&
+			      in_pool(&iface->pools[i], AF_INET, &rec->ipv4);
+		held->ipv6 += !IN6_IS_ADDR_UNSPECIFIED(&rec->ipv6) &&
+			      in_pool(&iface->pools[i], AF_INET6, &rec->ipv6);
+	}
+}
+
+/* Every address of the pools must be either free or leased, assuming they
+ * don't overlap. Returns false if any went missing.
+ */
+static bool check_pools(struct replay_iface *iface,
+			const struct wg_dynamic_leases_usage *usage)
+{
+	struct held_ctx held = { .iface = iface };
+	unsigned __int128 free_ipv6, size_ipv6 = 0;
+	uint64_t size_ipv4 = 0;
+
+	for (size_t i = 0; i < iface->npools; ++i) {
+		const struct capture_record *pool = &iface->pools[i];
+
+		if (pool->flags & CAPTURE_IPV6)
+			size_ipv6 += (unsigned __int128)1 << (128 - pool->cidr);
+		else
+			size_ipv4 += 1ULL << (32 - pool->cidr);
+	}
+
+	leases_export(iface->leases, count_held, &held);
+	free_ipv6 = (unsigned __int128)usage->free_ipv6_high << 64 |
+		    usage->free_ipv6_low;
+
+	if (usage->free_ipv4 + held.ipv4 == size_ipv4 &&
+	    free_ipv6 + held.ipv6 == size_ipv6)
+		return true;
+
+	printf("%s: %" PRId64 " ipv4 and %" PRId64 " ipv6 addresses neither "
+	       "free nor leased\n", usage->devname,
+	       (int64_t)(size_ipv4 - usage->free_ipv4 - held.ipv4),
+	       (int64_t)(size_ipv6 - free_ipv6 - held.ipv6));
+	return false;
+}
+
+static bool report(size_t nrecs, uint64_t elapsed)
+{
+	bool ok = true;
+
+	double span = (double)now / NSEC_PER_SEC;
+
+	printf("replayed %zu records, %.1f s of traffic, in %.3f s (%.0fx)\n",
+	       nrecs, span, (double)elapsed / NSEC_PER_SEC,
+	       elapsed ? span * NSEC_PER_SEC / elapsed : 0);
+	printf("%zu set_lease() calls found no address\n\n",
+	       (size_t)failed_leases);
+
+	printf("%-16s %10s %10s %10s\n", "", "calls", "total s", "mean us");
+	for (int i = 0; i < OP_MAX; ++i)
+		printf("%-16s %10" PRIu64 " %10.3f %10.2f\n", op_names[i],
+		       op_count[i], (double)op_ns[i] / NSEC_PER_SEC,
+		       op_count[i] ? op_ns[i] / 1000.0 / op_count[i] : 0);
+	printf("\n");
+
+	for (uint32_t i = 0; i < hdr->ninterfaces; ++i) {
+		struct wg_dynamic_leases_usage usage;
+
+		leases_get_usage(ifaces[i].leases, &usage);
+		printf("%s: %zu leases, %" PRIu64 " ipv4 and %" PRIu64
+		       " ipv6 (+%" PRIu32 " << 64) addresses free\n",
+		       usage.devname, usage.leases, usage.free_ipv4,
+		       usage.free_ipv6_low, usage.free_ipv6_high);
+		ok &= check_pools(&ifaces[i], &usage);
+	}
+
+	printf("digest %016" PRIx64 "\n", digest());
+	return ok;
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr,
+		"usage: %s [--alloc random|compact|sticky-hash]\n"
+		"       [--reuse-grace <seconds>] [--seed <n>] <trace>\n",
+		progname);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	enum leases_alloc alloc = LEASES_ALLOC_RANDOM;
+	uint32_t reuse_grace = LEASES_REUSE_GRACE;
+	const struct capture_record *recs;
+	const char (*names)[IFNAMSIZ];
+	wg_key alloc_seed;
+	uint64_t start;
+	struct stat st;
+	size_t nrecs;
+	char *endptr;
+	void *map;
+	bool ok;
+	int fd;
+
+	while (1) {
+		int index, c;
+		static struct option long_options[] = {
+			{ "alloc", required_argument, NULL, 0 },
+			{ "reuse-grace", required_argument, NULL, 0 },
+			{ "seed", required_argument, NULL, 0 },
+			{ 0, 0, 0, 0 }
+		};
+
+		c = getopt_long(argc, argv, "", long_options, &index);
+		if (c == -1)
+			break;
+		if (c != 0)
+			usage(argv[0]);
+
+		if (index == 0) {
+			if (!strcmp(optarg, "random"))
+				alloc = LEASES_ALLOC_RANDOM;
+			else if (!strcmp(optarg, "compact"))
+				alloc = LEASES_ALLOC_COMPACT;
+			else if (!strcmp(optarg, "sticky-hash"))
+				alloc = LEASES_ALLOC_STICKY_HASH;
+			else
+				usage(argv[0]);
+		} else if (index == 1) {
+			reuse_grace = (uint32_t)strtoul(optarg, &endptr, 10);
+			if (*endptr)
+				usage(argv[0]);
+		} else {
+			rng_state = strtoull(optarg, &endptr, 0);
+			if (*endptr)
+				usage(argv[0]);
+		}
+	}
+
+	if (optind != argc - 1)
+		usage(argv[0]);
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0 || fstat(fd, &st))
+		fatal("Opening %s failed", argv[optind]);
+	if ((size_t)st.st_size < sizeof *hdr)
+		die("%s is not a trace\n", argv[optind]);
+
+	/* MAP_POPULATE keeps page faults out of the measurements */
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE,
+		   fd, 0);
+	if (map == MAP_FAILED)
+		fatal("mmap()");
+	close(fd);
+
+	hdr = map;
+	if (memcmp(hdr->magic, CAPTURE_MAGIC, sizeof hdr->magic) ||
+	    hdr->record_size != sizeof(struct capture_record) ||
+	    hdr->ninterfaces > CAPTURE_MAX_INTERFACES ||
+	    sizeof *hdr + hdr->ninterfaces * IFNAMSIZ > (size_t)st.st_size)
+		die("%s is not a trace or has an unsupported format\n",
+		    argv[optind]);
+
+	names = (const void *)(hdr + 1);
+	recs = (const void *)(names + hdr->ninterfaces);
+	nrecs = (st.st_size - ((const uint8_t *)recs - (uint8_t *)map)) /
+		sizeof *recs;
+
+	/* differs from the server's, so sticky-hash addresses only match
+	 * between replays
+	 */
+	if (__wrap_getentropy(alloc_seed, sizeof alloc_seed))
+		fatal("getentropy()");
+
+	for (uint32_t i = 0; i < hdr->ninterfaces; ++i) {
+		char *name = strndup(names[i], IFNAMSIZ - 1);
+
+		if (!name)
+			fatal("strndup()");
+
+		ifaces[i].leases = leases_init(name, i + 1);
+		leases_set_alloc(ifaces[i].leases, alloc, alloc_seed);
+		leases_set_reuse_grace(ifaces[i].leases, reuse_grace);
+		ifaces[i].next_refresh = UINT64_MAX;
+		ifaces[i].peers = kh_init(peerht);
+		if (!ifaces[i].peers)
+			fatal("kh_init()");
+	}
+
+	start = real_ns();
+	for (size_t i = 0; i < nrecs; ++i) {
+		if (recs[i].iface >= hdr->ninterfaces)
+			die("Record %zu is of an unknown interface\n", i);
+
+		replay(&recs[i]);
+	}
+	advance(now);
+	ok = report(nrecs, real_ns() - start);
+
+	for (uint32_t i = 0; i < hdr->ninterfaces; ++i) {
+		leases_free(ifaces[i].leases);
+		kh_destroy(peerht, ifaces[i].peers);
+		free(ifaces[i].pools);
+	}
+	munmap(map, st.st_size);
+
+	return ok ? 0 : EXIT_FAILURE;
+}
@@ -0,0 +1,56 @@
+/* SPDX-License-Identifier: MIT
+ *
+ * Copyright (C) 2019 WireGuard LLC. All Rights Reserved.
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+/* Statically defined tracepoints. When built with the SystemTap headers
+ * (sys/sdt.h), every trace() leaves a single nop and an ELF note behind that
+ * bpftrace, perf or SystemTap can attach to while the server is running:
+ *
+ *   bpftrace -e 'usdt:./wg-dynamic-server:lease__set { @s[tid] = nsecs; }
+ *                usdt:./wg-dynamic-server:lease__set__done /@s[tid]/ {
+ *                        @ns = hist(nsecs - @s[tid]); delete(@s[tid]); }'
+ *
+ * Without them, trace() compiles to nothing. Arguments are never formatted:
+ * keys and IPv6 addresses are passed as pointers, IPv4 addresses as integers
+ * in network byte order. Anything needing more work than that belongs behind
+ * DEBUG_LEVEL, see dbg.h.
+ *
+ * The tracepoints of provider wg_dynamic, with their arguments:
+ *
+ *   connection__accept     fd, pubkey, lladdr, interface name
+ *   lease__set             pubkey, requested ipv4, requested ipv6
+ *   lease__set__done       pubkey, ipv4, ipv6, whether the lease is new
+ *   lease__expire          pubkey, ipv4, ipv6
+ *   pool__addnth           family, index (low 64 bits), index (high bits)
+ *   pool__addnth__done     family, address
+ *   allowedips__update     pubkey, ipv4, ipv6, lladdr, whether add-only
+ *   wg__set_device         interface name, number of peers
+ *   wg__set_device__done   interface name, return value
+ *   wg__dump               interface name
+ *   wg__dump__done         interface name, return value
+ *
+ * A requested ipv4 or ipv6 of 0 (NULL) asks for the address to be removed,
+ * one pointing to the unspecified address for a new one to be allocated.
+ */
+
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+#define trace(name, ...) STAP_PROBEV(wg_dynamic, name, ##__VA_ARGS__)
+#else
+/* still type checks the arguments and counts them as used */
+static inline void trace_nop(int dummy, ...)
+{
+	(void)dummy;
+}
+#define trace(name, ...)                                                       \
+	do {                                                                   \
+		if (0)                                                         \
+			trace_nop(0, ##__VA_ARGS__);                           \
+	} while (0)
+#endif
+
+#endif
@@ -0,0 +1,443 @@
+/* SPDX-License-Identifier: MIT
+ *
+ * Copyright (C) 2019 WireGuard LLC. All Rights Reserved.
+ */
+
+#define _GNU_SOURCE
+
+#include <endian.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "dbg.h"
+#include "uring.h"
+
+#define BUFFER_GROUP 0
+
+struct uring {
+	int fd;
+	uint32_t features;
+	uint8_t skip_success; /* IOSQE_CQE_SKIP_SUCCESS, if supported */
+
+	/* submissions up to sq_tail are ours until they're passed to the
+	 * kernel by publishing sq_tail
+	 */
+	unsigned int sq_entries, sq_mask, sq_tail;
+	unsigned int *ksq_head, *ksq_tail;
+	struct io_uring_sqe *sqes;
+
+	unsigned int cq_mask;
+	unsigned int *kcq_head, *kcq_tail;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+
+	struct io_uring_buf_ring *buf_ring;
+	size_t buf_ring_size;
+	unsigned char *bufs;
+	unsigned int nbufs, bufsize;
+	uint16_t buf_tail;
+};
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit,
+			      unsigned int min_complete, unsigned int flags,
+			      void *arg, size_t argsz)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			    flags, arg, argsz);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void *arg,
+				 unsigned int nr_args)
+{
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static bool probe_ops(struct uring *ring)
+{
+	static const uint8_t ops[] = {
+		IORING_OP_ACCEPT, IORING_OP_RECV,	  IORING_OP_SEND,
+		IORING_OP_CLOSE,  IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL,
+	};
+	size_t len = sizeof(struct io_uring_probe) +
+		     256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, len);
+	bool ok = true;
+
+	if (!probe)
+		fatal("calloc()");
+
+	if (sys_io_uring_register(ring->fd, IORING_REGISTER_PROBE, probe,
+				  256)) {
+		free(probe);
+		return false;
+	}
+
+	for (size_t i = 0; i < sizeof ops; ++i) {
+		if (ops[i] > probe->last_op ||
+		    !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+			ok = false;
+	}
+
+	free(probe);
+	return ok;
+}
+
+static bool map_rings(struct uring *ring, const struct io_uring_params *p)
+{
+	ring->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+	ring->cq_ring_size =
+		p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+	if (p->features & IORING_FEAT_SINGLE_MMAP)
+		ring->sq_ring_size = ring->cq_ring_size =
+			MAX(ring->sq_ring_size, ring->cq_ring_size);
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd,
+			     IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		return false;
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size,
+				     PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_POPULATE, ring->fd,
+				     IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED)
+			return false;
+	}
+
+	ring->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		return false;
+
+	ring->sq_entries = p->sq_entries;
+	ring->sq_mask = *(unsigned int *)((char *)ring->sq_ring +
+					  p->sq_off.ring_mask);
+	ring->ksq_head = (unsigned int *)((char *)ring->sq_ring +
+					  p->sq_off.head);
+	ring->ksq_tail = (unsigned int *)((char *)ring->sq_ring +
+					  p->sq_off.tail);
+	ring->sq_tail = *ring->ksq_tail;
+
+	/* submissions always sit in the slot of the same index */
+	unsigned int *array =
+		(unsigned int *)((char *)ring->sq_ring + p->sq_off.array);
+	for (unsigned int i = 0; i < p->sq_entries; ++i)
+		array[i] = i;
+
+	ring->cq_mask = *(unsigned int *)((char *)ring->cq_ring +
+					  p->cq_off.ring_mask);
+	ring->kcq_head = (unsigned int *)((char *)ring->cq_ring +
+					  p->cq_off.head);
+	ring->kcq_tail = (unsigned int *)((char *)ring->cq_ring +
+					  p->cq_off.tail);
+	ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring +
+					     p->cq_off.cqes);
+
+	return true;
+}
+
+static void add_buffer(struct uring *ring, uint16_t bid)
+{
+	struct io_uring_buf *buf =
+		&ring->buf_ring->bufs[ring->buf_tail & (ring->nbufs - 1)];
+
+	buf->addr = (uintptr_t)(ring->bufs + (size_t)bid * ring->bufsize);
+	buf->len = ring->bufsize;
+	buf->bid = bid;
+	__atomic_store_n(&ring->buf_ring->tail, ++ring->buf_tail,
+			 __ATOMIC_RELEASE);
+}
+
+static bool setup_buffers(struct uring *ring, unsigned int nbufs,
+			  unsigned int bufsize)
+{
+	struct io_uring_buf_reg reg = { .ring_entries = nbufs,
+					.bgid = BUFFER_GROUP };
+
+	BUG_ON(!nbufs || nbufs & (nbufs - 1) || nbufs > 32768);
+
+	ring->buf_ring_size = nbufs * sizeof(struct io_uring_buf);
+	ring->buf_ring = mmap(NULL, ring->buf_ring_size,
+			      PROT_READ | PROT_WRITE,
+			      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring->buf_ring == MAP_FAILED) {
+		ring->buf_ring = NULL;
+		return false;
+	}
+
+	reg.ring_addr = (uintptr_t)ring->buf_ring;
+	if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg,
+				  1))
+		return false;
+
+	ring->nbufs = nbufs;
+	ring->bufsize = bufsize;
+	ring->bufs = malloc((size_t)nbufs * bufsize);
+	if (!ring->bufs)
+		fatal("malloc()");
+
+	for (unsigned int i = 0; i < nbufs; ++i)
+		add_buffer(ring, i);
+
+	return true;
+}
+
+struct uring *uring_new(unsigned int entries, unsigned int nbufs,
+			unsigned int bufsize)
+{
+	struct io_uring_params p = { 0 };
+	struct uring *ring;
+	int err;
+
+	ring = calloc(1, sizeof *ring);
+	if (!ring)
+		fatal("calloc()");
+
+	/* completions outnumber submissions with multishot operations */
+	p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP |
+		  IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER;
+	p.cq_entries = entries * 4;
+	ring->fd = sys_io_uring_setup(entries, &p);
+	if (ring->fd < 0 && errno == EINVAL) {
+		/* both of these are merely optimizations */
+		p = (struct io_uring_params){ 0 };
+		p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+		p.cq_entries = entries * 4;
+		ring->fd = sys_io_uring_setup(entries, &p);
+	}
+	if (ring->fd < 0) {
+		err = errno;
+		free(ring);
+		errno = err;
+		return NULL;
+	}
+
+	ring->features = p.features;
+	if (p.features & IORING_FEAT_CQE_SKIP)
+		ring->skip_success = IOSQE_CQE_SKIP_SUCCESS;
+
+	err = EOPNOTSUPP;
+	if (!(p.features & IORING_FEAT_NODROP) ||
+	    !(p.features & IORING_FEAT_EXT_ARG) || !probe_ops(ring))
+		goto err;
+
+	err = ENOMEM;
+	if (!map_rings(ring, &p))
+		goto err;
+
+	/* also tells us whether multishot accept is there, as both came
+	 * with 5.19
+	 */
+	err = EOPNOTSUPP;
+	if (!setup_buffers(ring, nbufs, bufsize))
+		goto err;
+
+	return ring;
+
+err:
+	uring_free(ring);
+	errno = err;
+	return NULL;
+}
+
+void uring_free(struct uring *ring)
+{
+	if (!ring)
+		return;
+
+	/* unregisters the buffer ring, too */
+	close(ring->fd);
+
+	if (ring->buf_ring)
+		munmap(ring->buf_ring, ring->buf_ring_size);
+	free(ring->bufs);
+
+	if (ring->sqes && ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring && ring->cq_ring != MAP_FAILED &&
+	    ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring && ring->sq_ring != MAP_FAILED)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+
+	free(ring);
+}
+
+static unsigned int sq_pending(struct uring *ring)
+{
+	return ring->sq_tail -
+	       __atomic_load_n(ring->ksq_head, __ATOMIC_ACQUIRE);
+}
+
+static void submit(struct uring *ring)
+{
+	__atomic_store_n(ring->ksq_tail, ring->sq_tail, __ATOMIC_RELEASE);
+
+	while (sys_io_uring_enter(ring->fd, sq_pending(ring), 0, 0, NULL, 0) <
+	       0) {
+		if (errno != EINTR)
+			fatal("io_uring_enter()");
+	}
+}
+
+/* Makes sure the next n submissions end up in the same io_uring_enter(), as
+ * links don't carry over from one to the next
+ */
+static void reserve(struct uring *ring, unsigned int n)
+{
+	if (ring->sq_entries - sq_pending(ring) < n)
+		submit(ring);
+
+	if (ring->sq_entries - sq_pending(ring) < n)
+		die("io_uring submission queue stuck\n");
+}
+
+static struct io_uring_sqe *get_sqe(struct uring *ring, uint8_t opcode,
+				    int fd, uint64_t user_data)
+{
+	struct io_uring_sqe *sqe;
+
+	reserve(ring, 1);
+	sqe = &ring->sqes[ring->sq_tail++ & ring->sq_mask];
+	memset(sqe, 0, sizeof *sqe);
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->user_data = user_data;
+
+	return sqe;
+}
+
+void uring_accept_multishot(struct uring *ring, int fd, uint64_t user_data)
+{
+	struct io_uring_sqe *sqe = get_sqe(ring, IORING_OP_ACCEPT, fd,
+					   user_data);
+
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+}
+
+void uring_poll_multishot(struct uring *ring, int fd, uint64_t user_data)
+{
+	struct io_uring_sqe *sqe = get_sqe(ring, IORING_OP_POLL_ADD, fd,
+					   user_data);
+	uint32_t events = POLLIN;
+
+#if __BYTE_ORDER == __BIG_ENDIAN
+	events = events << 16 | events >> 16;
+#endif
+	sqe->poll32_events = events;
+	sqe->len = IORING_POLL_ADD_MULTI;
+}
+
+void uring_recv(struct uring *ring, int fd, uint64_t user_data)
+{
+	struct io_uring_sqe *sqe = get_sqe(ring, IORING_OP_RECV, fd,
+					   user_data);
+
+	sqe->len = ring->bufsize;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = BUFFER_GROUP;
+}
+
+void uring_cancel(struct uring *ring, uint64_t target)
+{
+	struct io_uring_sqe *sqe = get_sqe(ring, IORING_OP_ASYNC_CANCEL, -1, 0);
+
+	sqe->addr = target;
+	sqe->flags = ring->skip_success;
+}
+
+void uring_close(struct uring *ring, int fd)
+{
+	struct io_uring_sqe *sqe = get_sqe(ring, IORING_OP_CLOSE, fd, 0);
+
+	sqe->flags = ring->skip_success;
+}
+
+void uring_send(struct uring *ring, int fd, const void *buf, size_t len,
+		bool then_close, uint64_t user_data)
+{
+	struct io_uring_sqe *sqe;
+
+	reserve(ring, then_close ? 2 : 1);
+	sqe = get_sqe(ring, IORING_OP_SEND, fd, user_data);
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	/* the kernel retries short sends itself */
+	sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+
+	if (then_close) {
+		/* a hard link goes on even if the send failed */
+		sqe->flags |= IOSQE_IO_HARDLINK;
+		uring_close(ring, fd);
+	}
+}
+
+int uring_wait(struct uring *ring, int timeout_ms)
+{
+	struct __kernel_timespec ts = {
+		.tv_sec = timeout_ms / 1000,
+		.tv_nsec = (timeout_ms % 1000) * 1000000LL,
+	};
+	struct io_uring_getevents_arg arg = { .ts = (uintptr_t)&ts };
+	unsigned int wait;
+
+	__atomic_store_n(ring->ksq_tail, ring->sq_tail, __ATOMIC_RELEASE);
+	wait = *ring->kcq_head ==
+	       __atomic_load_n(ring->kcq_tail, __ATOMIC_ACQUIRE);
+
+	if (sys_io_uring_enter(ring->fd, sq_pending(ring), wait,
+			       IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+			       &arg, sizeof arg) < 0 &&
+	    errno != ETIME && errno != EINTR && errno != EBUSY)
+		return -errno;
+
+	return 0;
+}
+
+bool uring_pop_cqe(struct uring *ring, struct io_uring_cqe *cqe)
+{
+	unsigned int head = *ring->kcq_head;
+
+	if (head == __atomic_load_n(ring->kcq_tail, __ATOMIC_ACQUIRE))
+		return false;
+
+	*cqe = ring->cqes[head & ring->cq_mask];
+	__atomic_store_n(ring->kcq_head, head + 1, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+const unsigned char *uring_cqe_buffer(struct uring *ring,
+				      const struct io_uring_cqe *cqe)
+{
+	if (!(cqe->flags & IORING_CQE_F_BUFFER))
+		return NULL;
+
+	return ring->bufs +
+	       (size_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) * ring->bufsize;
+}
+
+void uring_recycle_buffer(struct uring *ring, const struct io_uring_cqe *cqe)
+{
+	if (cqe->flags & IORING_CQE_F_BUFFER)
+		add_buffer(ring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+}
@@ -0,0 +1,70 @@
+/* SPDX-License-Identifier: MIT
+ *
+ * Copyright (C) 2019 WireGuard LLC. All Rights Reserved.
+ */
+
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <linux/io_uring.h>
+
+/* Just enough of io_uring for the event loop of the server, without pulling
+ * in liburing. The ring is only ever used by the thread that created it.
+ * Completions for operations queued with a user_data of 0 are of no
+ * interest and are suppressed where the kernel allows it.
+ */
+struct uring;
+
+/*
+ * Sets up a ring with room for entries submissions and a ring of nbufs
+ * provided buffers of bufsize bytes each, which uring_recv() reads into.
+ * Returns NULL with errno set if the kernel lacks any of the features used
+ * here, which all came with Linux 5.19.
+ */
+struct uring *uring_new(unsigned int entries, unsigned int nbufs,
+			unsigned int bufsize);
+
+void uring_free(struct uring *ring);
+
+/*
+ * Queued operations. None of them is passed to the kernel before the next
+ * uring_wait(), unless the submission queue fills up.
+ */
+void uring_accept_multishot(struct uring *ring, int fd, uint64_t user_data);
+void uring_poll_multishot(struct uring *ring, int fd, uint64_t user_data);
+void uring_recv(struct uring *ring, int fd, uint64_t user_data);
+void uring_cancel(struct uring *ring, uint64_t target);
+void uring_close(struct uring *ring, int fd);
+
+/*
+ * Sends all of buf, which must stay valid until the completion. If
+ * then_close is set, fd is closed right after, whether the send succeeded
+ * or not.
+ */
+void uring_send(struct uring *ring, int fd, const void *buf, size_t len,
+		bool then_close, uint64_t user_data);
+
+/*
+ * Submits everything queued and waits up to timeout_ms for at least one
+ * completion, unless there already is one. Returns 0 or a negative errno on
+ * failure; timeouts and signals aren't one.
+ */
+int uring_wait(struct uring *ring, int timeout_ms);
+
+/* Takes the next completion off the ring, if there is one */
+bool uring_pop_cqe(struct uring *ring, struct io_uring_cqe *cqe);
+
+/*
+ * The provided buffer a completed uring_recv() read into and which has to be
+ * handed back with uring_recycle_buffer() once done with it. Returns NULL if
+ * the completion didn't consume a buffer.
+ */
+const unsigned char *uring_cqe_buffer(struct uring *ring,
+				      const struct io_uring_cqe *cqe);
+void uring_recycle_buffer(struct uring *ring, const struct io_uring_cqe *cqe);
+
+#endif
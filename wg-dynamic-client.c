@@ -5,6 +5,7 @@
 #define _POSIX_C_SOURCE 200112L
 
 #include <arpa/inet.h>
+#include <getopt.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -18,6 +19,18 @@
 #include "dbg.h"
 #include "ipm.h"
 #include "netlink.h"
+#include "random.h"
+
+/* Retries after a failed request back off exponentially, starting at
+ * BACKOFF_BASE and capped at BACKOFF_MAX seconds, with full jitter: each
+ * delay is drawn uniformly from [1, current cap].
+ */
+#define BACKOFF_BASE 2
+#define BACKOFF_MAX 300
+/* Leases are renewed at a random point between half of their remaining time
+ * and RENEW_MARGIN seconds before they expire
+ */
+#define RENEW_MARGIN 30
 
 static const char *progname;
 static const char *wg_interface;
@@ -30,12 +43,15 @@ static bool ipv4_assigned = false, ipv6_assigned = false;
 
 static wg_device *device = NULL;
 static int sockfd = -1;
+/* keep the connection to the server open between requests */
+static bool keepalive = false;
 
 static volatile sig_atomic_t should_exit = 0;
+static unsigned int failures = 0; /* consecutive failed requests */
 
 static void usage()
 {
-	die("usage: %s <wg-interface>\n", progname);
+	die("usage: %s [--keepalive] <wg-interface>\n", progname);
 }
 
 /* NOTE: do NOT call exit() in here */
@@ -50,6 +66,7 @@ static void cleanup()
 		close(sockfd);
 
 	ipm_free();
+	wg_close_netlink();
 	wg_free_device(device);
 }
 
@@ -65,10 +82,19 @@ static void check_signal()
 		exit(EXIT_FAILURE);
 }
 
-static int request_ip(struct wg_dynamic_request_ip *rip)
+static void disconnect()
+{
+	if (sockfd >= 0 && close(sockfd))
+		debug("Failed to close socket: %s\n", strerror(errno));
+
+	sockfd = -1;
+}
+
+/* Returns -1 if the server can't be reached, e.g. while it restarts, so the
+ * request can be retried after backing off
+ */
+static int connect_server()
 {
-	unsigned char buf[RECV_BUFSIZE + MAX_LINESIZE];
-	size_t msglen, remaining = 0, off = 0;
 	struct sockaddr_in6 dstaddr = {
 		.sin6_family = AF_INET6,
 		.sin6_addr = well_known,
@@ -81,13 +107,7 @@ static int request_ip(struct wg_dynamic_request_ip *rip)
 		.sin6_port = htons(WG_DYNAMIC_PORT),
 		.sin6_scope_id = device->ifindex,
 	};
-	struct wg_dynamic_request req = {
-		.cmd = WGKEY_REQUEST_IP,
-		.version = 1,
-		.result = rip,
-	};
 	struct timeval timeout = { .tv_sec = 30 };
-	ssize_t ret;
 	int val = 1;
 
 	sockfd = socket(AF_INET6, SOCK_STREAM, 0);
@@ -105,11 +125,41 @@ static int request_ip(struct wg_dynamic_request_ip *rip)
 		       sizeof timeout))
 		fatal("setsockopt(SO_SNDTIMEO)");
 
-	if (bind(sockfd, (struct sockaddr *)&srcaddr, sizeof(srcaddr)))
-		fatal("Binding socket failed");
+	if (bind(sockfd, (struct sockaddr *)&srcaddr, sizeof(srcaddr))) {
+		log_err("Binding socket failed: %s\n", strerror(errno));
+		disconnect();
+		return -1;
+	}
+
+	if (connect(sockfd, (struct sockaddr *)&dstaddr, sizeof(dstaddr))) {
+		log_err("Connecting to the server failed: %s\n",
+			strerror(errno));
+		disconnect();
+		check_signal();
+		return -1;
+	}
 
-	if (connect(sockfd, (struct sockaddr *)&dstaddr, sizeof(dstaddr)))
-		fatal("connect()");
+	return 0;
+}
+
+/* Sends a request for rip, over the already open connection in keepalive
+ * mode. The server may have closed that one in the meantime, which is only
+ * noticed here, so the request is sent once more over a new connection if it
+ * fails.
+ */
+static int request_ip(struct wg_dynamic_request_ip *rip)
+{
+	unsigned char buf[MAX_RESPONSE_SIZE];
+	size_t msglen, off = 0;
+	struct wg_dynamic_request req = {
+		.cmd = WGKEY_REQUEST_IP,
+		.version = 1,
+	};
+	bool reused = sockfd >= 0;
+	ssize_t ret;
+
+	if (!reused && connect_server())
+		return -1;
 
 	rip->has_ipv4 = rip->has_ipv6 = true;
 	if (ipv4_assigned)
@@ -118,42 +168,59 @@ static int request_ip(struct wg_dynamic_request_ip *rip)
 	if (ipv6_assigned)
 		memcpy(&rip->ipv6, &ipv6, sizeof rip->ipv6);
 
-	msglen = serialize_request_ip(true, (char *)buf, RECV_BUFSIZE, rip);
+	msglen = serialize_request_ip(true, (char *)buf, sizeof buf, rip);
 	do {
-		ssize_t written = write(sockfd, buf + off, msglen - off);
+		ssize_t written = send(sockfd, buf + off, msglen - off,
+				       MSG_NOSIGNAL);
 		if (written == -1) {
 			if (errno == EINTR) {
 				check_signal();
 				continue;
 			}
 
-			fatal("write()");
+			if (reused && (errno == EPIPE || errno == ECONNRESET)) {
+				debug("Reconnecting to the server\n");
+				disconnect();
+				return request_ip(rip);
+			}
+
+			log_err("Sending the request failed: %s\n",
+				strerror(errno));
+			disconnect();
+			return -1;
 		}
 
 		off += written;
 	} while (off < msglen);
 
-	memset(rip, 0, sizeof *rip);
-
-	while ((ret = handle_request(sockfd, &req, buf, &remaining)) <= 0) {
+	while ((ret = handle_request(sockfd, &req)) <= 0) {
 		if (ret == 0) {
 			check_signal();
 			continue;
 		}
 
-		if (close(sockfd))
-			debug("Failed to close socket: %s\n", strerror(errno));
+		free_wg_dynamic_request(&req);
+		disconnect();
+		if (reused) {
+			debug("Reconnecting to the server\n");
+			return request_ip(rip);
+		}
 
 		log_err("Server communication error.\n");
 		return -1;
 	}
 
-	if (remaining > 0)
+	if (req.end > req.start)
 		log_err("Warning: discarding %zu extra bytes sent by the server\n",
-			remaining);
+			req.end - req.start);
+
+	memcpy(rip, &req.result.ip, sizeof *rip);
+	free_wg_dynamic_request(&req);
+	if (!keepalive)
+		disconnect();
 
 	if (rip->wg_errno && !rip->has_ipv4 && !rip->has_ipv6) {
-		if (rip->errmsg) {
+		if (rip->errmsg[0]) {
 			log_err("Server refused request: %s\n", rip->errmsg);
 			return -1;
 		} else if (rip->wg_errno <= ARRAY_SIZE(WG_DYNAMIC_ERR) - 1) {
@@ -164,10 +231,8 @@ static int request_ip(struct wg_dynamic_request_ip *rip)
 				rip->wg_errno);
 		}
 
-		free(rip->errmsg); /* TODO: this could be done cleaner */
 		return -1;
 	}
-	free(rip->errmsg);
 
 	if (!ipv4_assigned || memcmp(&ipv4, &rip->ipv4, sizeof ipv4)) {
 		if (ipv4_assigned && ipm_deladdr_v4(device->ifindex, &ipv4))
@@ -199,9 +264,6 @@ static int request_ip(struct wg_dynamic_request_ip *rip)
 		}
 	}
 
-	if (close(sockfd))
-		debug("Failed to close socket: %s\n", strerror(errno));
-
 	return 0;
 }
 
@@ -259,6 +321,41 @@ static void xnanosleep(time_t duration)
 	}
 }
 
+/* Seconds to wait after the last of failures requests failed. A busy server
+ * tells us when to come back; we wait up to that long again on top of it, so
+ * the clients it turned away at the same time don't all return at once.
+ */
+static time_t backoff(const struct wg_dynamic_request_ip *rip)
+{
+	time_t cap = BACKOFF_MAX, delay;
+
+	if (failures <= 8)
+		cap = MIN(cap, BACKOFF_BASE << (failures - 1));
+
+	delay = 1 + random_bounded(cap);
+	if (rip->retry_after) {
+		time_t hint = rip->retry_after;
+
+		delay = MAX(delay, hint + (time_t)random_bounded(hint + 1));
+	}
+
+	return delay;
+}
+
+/* A random time in [timeout / 2, timeout - RENEW_MARGIN], or timeout / 2 if
+ * that range is empty, so that clients which got their leases at the same
+ * time, e.g. after a server restart, don't renew them at the same time
+ */
+static time_t renew_after(time_t timeout)
+{
+	time_t earliest = timeout / 2, latest = timeout - RENEW_MARGIN;
+
+	if (latest <= earliest)
+		return earliest;
+
+	return earliest + random_bounded(latest - earliest + 1);
+}
+
 static void loop()
 {
 	struct wg_dynamic_request_ip rip = { 0 };
@@ -269,11 +366,13 @@ static void loop()
 		fatal("clock_gettime(CLOCK_REALTIME)");
 
 	if (request_ip(&rip)) {
-		/* TODO: implement some sort of exponential backoff */
-		log_err("Trying again in 30s.\n");
-		xnanosleep(30);
+		++failures;
+		timeout = backoff(&rip);
+		log_err("Trying again in %llds.\n", (long long)timeout);
+		xnanosleep(timeout);
 		return;
 	}
+	failures = 0;
 
 	if (clock_gettime(CLOCK_REALTIME, &trecv))
 		fatal("clock_gettime(CLOCK_REALTIME)");
@@ -288,9 +387,7 @@ static void loop()
 		return;
 	}
 
-	/* TODO: implement random jitter */
-	timeout = (expires - trecv.tv_sec);
-	timeout -= MIN(30, timeout * 0.5);
+	timeout = renew_after(expires - trecv.tv_sec);
 
 	debug("Sleeping for %zus\n", timeout);
 	xnanosleep(timeout);
@@ -298,11 +395,28 @@ static void loop()
 
 int main(int argc, char *argv[])
 {
+	const struct option options[] = {
+		{ "keepalive", no_argument, NULL, 0 },
+		{ 0, 0, 0, 0 }
+	};
+	int ret, index;
+
 	progname = argv[0];
-	if (argc != 2)
+	while ((ret = getopt_long(argc, argv, "", options, &index)) != -1) {
+		switch (ret) {
+		case 0:
+			if (index == 0)
+				keepalive = true;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind != argc - 1)
 		usage();
 
-	wg_interface = argv[1];
+	wg_interface = argv[optind];
 	setup();
 
 	while (1)
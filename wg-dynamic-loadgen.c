@@ -0,0 +1,501 @@
+/* SPDX-License-Identifier: MIT
+ *
+ * Copyright (C) 2019 WireGuard LLC. All Rights Reserved.
+ */
+
+/* Simulates many wg-dynamic clients against a single server. Peer i talks
+ * from the link-local address base + i, which has to be assigned to the
+ * interface, see tests/loadgen.bash.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "dbg.h"
+
+struct peer {
+	struct in6_addr lladdr;
+	struct in_addr ipv4;
+	struct in6_addr ipv6;
+	bool has_lease;
+	bool busy; /* has a session open */
+};
+
+enum session_state { SESSION_FREE, SESSION_CONNECTING, SESSION_WAITING };
+
+struct session {
+	enum session_state state;
+	int fd;
+	struct peer *peer;
+	uint64_t start; /* ns, when connect() was called */
+	char msg[MAX_RESPONSE_SIZE];
+	size_t msglen, sent;
+	struct wg_dynamic_request req;
+};
+
+static const char *progname;
+static const char *wg_interface;
+static unsigned int ifindex;
+static struct in6_addr well_known;
+
+static struct peer *peers;
+static unsigned long npeers = 1000;
+static struct in6_addr base;
+static struct session *sessions;
+static unsigned long concurrency = 256;
+static unsigned long nrequests = 0; /* default: 10 per peer */
+static unsigned int renew_percent = 80;
+static unsigned long storm_rounds = 0;
+static uint32_t timeout_secs = 10;
+
+static int epollfd;
+static uint64_t *latencies;
+static unsigned long started, completed, succeeded, refused, failed;
+
+static uint64_t rng_state = 0x853c49e6748fea9bULL;
+
+static uint64_t rng(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts))
+		fatal("clock_gettime()");
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage()
+{
+	die("usage: %s [--peers <n>] [--base <lladdr>] [--concurrency <n>]\n"
+	    "       [--requests <n> | --storm <rounds>] [--renew <percent>]\n"
+	    "       [--timeout <seconds>] <wg-interface>\n",
+	    progname);
+}
+
+static void finish_session(struct session *s, bool ok)
+{
+	if (epoll_ctl(epollfd, EPOLL_CTL_DEL, s->fd, NULL))
+		fatal("epoll_ctl()");
+
+	if (close(s->fd))
+		debug("Failed to close socket: %s\n", strerror(errno));
+
+	if (ok)
+		latencies[succeeded++] = now_ns() - s->start;
+	else
+		++failed;
+
+	++completed;
+	s->peer->busy = false;
+	s->state = SESSION_FREE;
+	s->fd = -1;
+}
+
+static void start_session(struct session *s, struct peer *p)
+{
+	struct sockaddr_in6 dstaddr = {
+		.sin6_family = AF_INET6,
+		.sin6_addr = well_known,
+		.sin6_port = htons(WG_DYNAMIC_PORT),
+		.sin6_scope_id = ifindex,
+	};
+	struct sockaddr_in6 srcaddr = {
+		.sin6_family = AF_INET6,
+		.sin6_addr = p->lladdr,
+		.sin6_port = htons(WG_DYNAMIC_PORT),
+		.sin6_scope_id = ifindex,
+	};
+	/* Each peer always uses the same source address and port, so close
+	 * with a reset instead of going through TIME_WAIT, or the next
+	 * connection of the peer couldn't be made for a while.
+	 */
+	struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+	struct wg_dynamic_request_ip rip = { 0 };
+	struct epoll_event ev;
+	int val = 1;
+
+	s->peer = p;
+	s->sent = 0;
+	s->start = now_ns();
+	p->busy = true;
+	++started;
+
+	/* Same as wg-dynamic-client: ask for the current lease, if any */
+	rip.has_ipv4 = rip.has_ipv6 = true;
+	if (p->has_lease && rng() % 100 < renew_percent) {
+		rip.ipv4 = p->ipv4;
+		rip.ipv6 = p->ipv6;
+	}
+	s->msglen = serialize_request_ip(true, s->msg, sizeof s->msg, &rip);
+
+	memset(&s->req, 0, offsetof(struct wg_dynamic_request, buf));
+	s->req.cmd = WGKEY_REQUEST_IP;
+	s->req.version = 1;
+
+	s->fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		       0);
+	if (s->fd < 0)
+		fatal("Creating a socket failed");
+
+	if (setsockopt(s->fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof val) ||
+	    setsockopt(s->fd, SOL_SOCKET, SO_LINGER, &linger, sizeof linger))
+		fatal("setsockopt()");
+
+	s->state = SESSION_CONNECTING;
+	ev.events = EPOLLIN | EPOLLOUT;
+	ev.data.ptr = s;
+	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, s->fd, &ev))
+		fatal("epoll_ctl()");
+
+	if (bind(s->fd, (struct sockaddr *)&srcaddr, sizeof srcaddr)) {
+		debug("Binding socket failed: %s\n", strerror(errno));
+		finish_session(s, false);
+		return;
+	}
+
+	if (connect(s->fd, (struct sockaddr *)&dstaddr, sizeof dstaddr) &&
+	    errno != EINPROGRESS) {
+		debug("connect(): %s\n", strerror(errno));
+		finish_session(s, false);
+	}
+}
+
+static void handle_session(struct session *s, uint32_t events)
+{
+	struct wg_dynamic_request_ip *rip = &s->req.result.ip;
+	struct epoll_event ev;
+	ssize_t written;
+	int ret;
+
+	if (s->state == SESSION_CONNECTING) {
+		socklen_t len = sizeof ret;
+
+		if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+			return;
+
+		if (getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &ret, &len))
+			fatal("getsockopt()");
+
+		if (ret) {
+			debug("connect(): %s\n", strerror(ret));
+			finish_session(s, false);
+			return;
+		}
+
+		s->state = SESSION_WAITING;
+	}
+
+	if (s->sent < s->msglen) {
+		written = write(s->fd, s->msg + s->sent, s->msglen - s->sent);
+		if (written < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK ||
+			    errno == EINTR)
+				return;
+
+			finish_session(s, false);
+			return;
+		}
+
+		s->sent += written;
+		if (s->sent == s->msglen) {
+			ev.events = EPOLLIN;
+			ev.data.ptr = s;
+			if (epoll_ctl(epollfd, EPOLL_CTL_MOD, s->fd, &ev))
+				fatal("epoll_ctl()");
+		}
+
+		return;
+	}
+
+	ret = handle_request(s->fd, &s->req);
+	if (ret == 0)
+		return;
+
+	if (ret < 0) {
+		finish_session(s, false);
+		return;
+	}
+
+	if (rip->wg_errno)
+		++refused;
+
+	if (rip->has_ipv4 || rip->has_ipv6) {
+		s->peer->has_lease = true;
+		s->peer->ipv4 = rip->ipv4;
+		s->peer->ipv6 = rip->ipv6;
+	} else {
+		s->peer->has_lease = false;
+	}
+
+	finish_session(s, true);
+}
+
+static void expire_sessions(uint64_t now)
+{
+	uint64_t timeout = timeout_secs * 1000000000ULL;
+
+	for (unsigned long i = 0; i < concurrency; ++i) {
+		if (sessions[i].state != SESSION_FREE &&
+		    now - sessions[i].start > timeout) {
+			debug("Session of peer %lu timed out\n",
+			      (unsigned long)(sessions[i].peer - peers));
+			finish_session(&sessions[i], false);
+		}
+	}
+}
+
+/* Returns the next peer to start a session for, or NULL if there is none
+ * right now
+ */
+static struct peer *next_peer()
+{
+	struct peer *p;
+
+	if (started >= nrequests)
+		return NULL;
+
+	if (storm_rounds) {
+		/* all peers of a round reconnect at once, but the next round
+		 * only starts once the previous one is done
+		 */
+		if (started % npeers == 0 && completed < started)
+			return NULL;
+
+		return &peers[started % npeers];
+	}
+
+	if (completed + concurrency <= started)
+		return NULL;
+
+	for (int tries = 0; tries < 16; ++tries) {
+		p = &peers[rng() % npeers];
+		if (!p->busy)
+			return p;
+	}
+
+	return NULL;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile_us(double p)
+{
+	unsigned long idx;
+
+	if (!succeeded)
+		return 0;
+
+	idx = p * succeeded;
+	if (idx >= succeeded)
+		idx = succeeded - 1;
+
+	return latencies[idx] / 1000.0;
+}
+
+static void report(uint64_t elapsed)
+{
+	qsort(latencies, succeeded, sizeof *latencies, compare_u64);
+
+	printf("requests:    %lu answered, %lu refused, %lu failed\n",
+	       succeeded, refused, failed);
+	printf("duration:    %.3f s\n", elapsed / 1e9);
+	printf("throughput:  %.1f requests/s\n",
+	       succeeded / (elapsed / 1e9));
+	printf("latency:     p50 %.1f us, p99 %.1f us, p99.9 %.1f us, "
+	       "max %.1f us\n",
+	       percentile_us(0.5), percentile_us(0.99), percentile_us(0.999),
+	       percentile_us(1));
+}
+
+static void run()
+{
+	struct epoll_event events[256];
+	uint64_t start, last_expiry;
+	unsigned long free_idx = 0;
+
+	latencies = calloc(nrequests, sizeof *latencies);
+	sessions = calloc(concurrency, sizeof *sessions);
+	if (!latencies || !sessions)
+		fatal("calloc()");
+
+	for (unsigned long i = 0; i < concurrency; ++i)
+		sessions[i].fd = -1;
+
+	epollfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epollfd < 0)
+		fatal("epoll_create1()");
+
+	start = last_expiry = now_ns();
+	while (completed < nrequests) {
+		struct peer *p;
+		uint64_t now;
+		int nfds;
+
+		/* fill up free sessions */
+		for (unsigned long n = 0; n < concurrency; ++n) {
+			struct session *s = &sessions[free_idx];
+
+			free_idx = (free_idx + 1) % concurrency;
+			if (s->state != SESSION_FREE)
+				continue;
+
+			p = next_peer();
+			if (!p)
+				break;
+
+			start_session(s, p);
+		}
+
+		nfds = epoll_wait(epollfd, events, ARRAY_SIZE(events), 100);
+		if (nfds < 0) {
+			if (errno == EINTR)
+				continue;
+
+			fatal("epoll_wait()");
+		}
+
+		for (int i = 0; i < nfds; ++i)
+			handle_session(events[i].data.ptr, events[i].events);
+
+		now = now_ns();
+		if (now - last_expiry > 100000000ULL) {
+			expire_sessions(now);
+			last_expiry = now;
+		}
+	}
+
+	report(now_ns() - start);
+
+	close(epollfd);
+	free(sessions);
+	free(latencies);
+}
+
+static void setup()
+{
+	peers = calloc(npeers, sizeof *peers);
+	if (!peers)
+		fatal("calloc()");
+
+	for (unsigned long i = 0; i < npeers; ++i) {
+		uint32_t low;
+
+		peers[i].lladdr = base;
+		memcpy(&low, &base.s6_addr[12], sizeof low);
+		low = htonl(ntohl(low) + i);
+		memcpy(&peers[i].lladdr.s6_addr[12], &low, sizeof low);
+	}
+
+	ifindex = if_nametoindex(wg_interface);
+	if (!ifindex)
+		fatal("Unable to access interface %s", wg_interface);
+
+	if (inet_pton(AF_INET6, WG_DYNAMIC_ADDR, &well_known) != 1)
+		fatal("inet_pton()");
+}
+
+int main(int argc, char *argv[])
+{
+	progname = argv[0];
+	if (inet_pton(AF_INET6, "fe80::1:0", &base) != 1)
+		fatal("inet_pton()");
+
+	while (1) {
+		int ret, index;
+		char *endptr = NULL;
+		const struct option options[] = {
+			{ "peers", required_argument, NULL, 0 },
+			{ "base", required_argument, NULL, 0 },
+			{ "concurrency", required_argument, NULL, 0 },
+			{ "requests", required_argument, NULL, 0 },
+			{ "renew", required_argument, NULL, 0 },
+			{ "storm", required_argument, NULL, 0 },
+			{ "timeout", required_argument, NULL, 0 },
+			{ 0, 0, 0, 0 }
+		};
+
+		ret = getopt_long(argc, argv, "", options, &index);
+		if (ret == -1)
+			break;
+
+		if (ret != 0)
+			usage();
+
+		if (index == 1) {
+			if (inet_pton(AF_INET6, optarg, &base) != 1 ||
+			    !IN6_IS_ADDR_LINKLOCAL(&base))
+				usage();
+			continue;
+		}
+
+		unsigned long val = strtoul(optarg, &endptr, 10);
+		if (*endptr || (!val && index != 4))
+			usage();
+
+		if (index == 0)
+			npeers = val;
+		else if (index == 2)
+			concurrency = val;
+		else if (index == 3)
+			nrequests = val;
+		else if (index == 4 && val <= 100)
+			renew_percent = val;
+		else if (index == 5)
+			storm_rounds = val;
+		else if (index == 6)
+			timeout_secs = val;
+		else
+			usage();
+	}
+
+	if (optind != argc - 1)
+		usage();
+
+	/* --storm makes rounds times peers requests */
+	if (storm_rounds && nrequests)
+		usage();
+
+	wg_interface = argv[optind];
+	if (storm_rounds)
+		nrequests = storm_rounds * npeers;
+	else if (!nrequests)
+		nrequests = 10 * npeers;
+
+	if (concurrency > npeers)
+		concurrency = npeers;
+
+	setup();
+	run();
+
+	free(peers);
+
+	return failed ? EXIT_FAILURE : 0;
+}
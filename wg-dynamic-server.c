@@ -7,6 +7,7 @@
 #define _POSIX_C_SOURCE 200112L
 
 #include <getopt.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -17,106 +18,358 @@
 #include <netdb.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 
 #include <libmnl/libmnl.h>
 #include <linux/rtnetlink.h>
 
+#include "capture.h"
 #include "common.h"
+#include "control.h"
 #include "dbg.h"
 #include "ipm.h"
 #include "khash.h"
 #include "lease.h"
+#include "metrics.h"
 #include "netlink.h"
+#include "replication.h"
+#include "trace.h"
+#ifdef HAVE_IO_URING
+#include "uring.h"
+#endif
 
 static const char *progname;
-static const char *wg_interface = NULL;
 static struct in6_addr well_known;
 
-static wg_device *device = NULL;
 static uint32_t leasetime = 3600;
+static char *leasefile = NULL;
+static char *stats_socket = NULL;
+static char *control_socket = NULL;
+static enum leases_alloc alloc = LEASES_ALLOC_RANDOM;
+static uint32_t reuse_grace = LEASES_REUSE_GRACE;
+static char *replication_listen = NULL;
+static char *replicate_from = NULL;
+static char *capture_file = NULL;
+static struct capture *capture = NULL;
+static pthread_t reconciler;
+static bool reconciling = false;
+
+enum event_loop {
+	EVENT_LOOP_EPOLL,
+	EVENT_LOOP_IO_URING,
+};
+
+static enum event_loop event_loop = EVENT_LOOP_EPOLL;
 
-static int sockfd = -1;
-static int epollfd = -1;
 static struct mnl_socket *nlsock = NULL;
 
-KHASH_MAP_INIT_SECURE_INT64(allowedht, wg_key *)
-khash_t(allowedht) * allowedips_ht;
+/* Default receive buffer of the route socket, enough for a few thousand
+ * route updates in a row
+ */
+#define NETLINK_RCVBUF (4 << 20)
+
+/* Default for how long a connection may stay idle, in seconds */
+#define CONNECTION_TIMEOUT 10
+/* Connections idle for at least this long, in seconds, are closed early to
+ * make room when all max_connections are in use
+ */
+#define EVICT_MIN_IDLE 10
+/* Connections each worker takes on top of max_connections only to tell their
+ * clients to come back later, instead of leaving them in the backlog
+ */
+#define BUSY_CONNECTIONS 16
+#define MIN_EPOLL_EVENTS 64
+
+/* Submission queue size of each worker's ring. Requests and responses are
+ * a few hundred bytes at most, so the provided buffers needn't be large.
+ */
+#define URING_ENTRIES 256
+#define URING_BUFS 256
+#define URING_BUFSIZE 512
+
+/* Rebuild the lladdr index at most this often, in seconds */
+#define REBUILD_INTERVAL 1
+/* How long an lladdr that didn't match any peer is remembered, in seconds */
+#define NEGATIVE_TTL 10
+#define NEGATIVE_MAX 4096
+
+struct peer_ref {
+	wg_key pubkey;
+};
+
+KHASH_MAP_INIT_SECURE_INT64(allowedht, struct peer_ref)
+KHASH_MAP_INIT_SECURE_INT64(negativeht, time_t)
+
+struct wg_dynamic_interface {
+	const char *name;
+	char *leasefile;
+	struct wg_dynamic_leases *leases;
+
+	uint32_t ifindex;
+	wg_key pubkey;
+
+	/* lladdr -> pubkey index, guarded by index_lock once the workers are
+	 * running
+	 */
+	khash_t(allowedht) * allowedips_ht;
+	khash_t(negativeht) * negative_ht;
+	time_t last_rebuild;
+	pthread_mutex_t index_lock;
+
+	/* the peers with addresses found by the first dump, which are
+	 * compared with the leases once the pools are known
+	 */
+	struct leases_peer *peers;
+	size_t npeers, peers_cap;
+	bool collect_peers;
+};
+
+static struct wg_dynamic_interface *interfaces = NULL;
+static unsigned int ninterfaces = 0;
+
+/* Everything we register with epoll starts with one of these, except for the
+ * netlink socket
+ */
+enum wg_dynamic_event_type {
+	EVENT_LISTENER,
+	EVENT_CONNECTION,
+	EVENT_STATS,
+};
+
+struct wg_dynamic_worker;
+struct uring;
+
+struct wg_dynamic_listener {
+	enum wg_dynamic_event_type type;
+	int fd;
+	struct wg_dynamic_interface *iface;
+	bool accepting; /* has a multishot accept armed, with io_uring */
+};
 
 struct wg_dynamic_connection {
+	enum wg_dynamic_event_type type;
+	struct wg_dynamic_worker *worker;
+	struct wg_dynamic_interface *iface;
 	struct wg_dynamic_request req;
 	int fd;
 	wg_key pubkey;
 	struct in6_addr lladdr;
 	unsigned char *outbuf;
 	size_t buflen;
+	bool queued; /* has output waiting for send_queued_responses() */
+	bool closing; /* close once the queued output is sent */
+	bool busy; /* over max_connections, answered with E_BUSY */
+	time_t deadline; /* closed if idle until then */
+
+	/* with io_uring, a closed connection is only reused once all of its
+	 * operations completed, and the output being sent moves to sendbuf
+	 * so that more can be queued meanwhile
+	 */
+	unsigned int inflight;
+	bool receiving;
+	unsigned char *sendbuf;
+	size_t sendlen;
+
+	/* active list ordered by deadline while open, free list otherwise */
+	struct wg_dynamic_connection *prev, *next;
+	struct wg_dynamic_connection *next_queued;
+};
+
+/* Connections are allocated in chunks and never move, since epoll and the
+ * lists below hold pointers to them. All open connections share the same
+ * idle timeout, so moving a connection to the tail of the active list on
+ * activity keeps that list sorted by deadline.
+ */
+#define CONNECTION_CHUNK 64
+
+struct connection_chunk {
+	struct connection_chunk *next;
+	struct wg_dynamic_connection cons[CONNECTION_CHUNK];
+};
+
+/* Each worker runs its own event loop with its own SO_REUSEPORT listener on
+ * every interface and owns its connections. Leases are shared, see
+ * leases_lock(). The first worker runs on the main thread and also takes care
+ * of route updates and lease expiry.
+ */
+struct wg_dynamic_worker {
+	pthread_t thread;
+	struct wg_dynamic_listener *listeners; /* one per interface */
+	int epollfd;
+	struct uring *ring; /* instead of epollfd, with --event-loop io_uring */
+
+	struct connection_chunk *chunks;
+	struct wg_dynamic_connection *free_cons;
+	struct wg_dynamic_connection *active_head, *active_tail;
+	size_t nconnections, max_connections;
+	bool accept_blocked;
+
+	/* Responses are held back until the allowedips updates they depend
+	 * on were pushed to the kernel, see worker_loop()
+	 */
+	struct wg_dynamic_connection *queued;
+};
+
+/* Serves metrics to whoever connects, from the main worker */
+static struct wg_dynamic_listener stats_listener = {
+	.type = EVENT_STATS,
+	.fd = -1,
+};
+
+/* Lease import, export and queries, served by a thread of their own, see
+ * control_start()
+ */
+static int control_fd = -1;
+
+#ifdef HAVE_IO_URING
+/* What an io_uring operation is for, kept in the low bits of its user_data
+ * next to a pointer to the listener, connection or netlink socket it's about
+ */
+enum uring_op {
+	URING_ACCEPT = 1,
+	URING_POLL,
+	URING_RECV,
+	URING_SEND,
 };
 
-static struct wg_dynamic_connection connections[MAX_CONNECTIONS] = { 0 };
+#define URING_OP_MASK 7
+#define URING_DATA(ptr, op) ((uint64_t)(uintptr_t)(ptr) | (op))
+#endif
+
+static struct wg_dynamic_worker *workers = NULL;
+static unsigned int nworkers = 1;
+static size_t max_connections = MAX_CONNECTIONS;
+static uint32_t idle_timeout = CONNECTION_TIMEOUT;
+static int netlink_rcvbuf = NETLINK_RCVBUF;
 
 static void usage()
 {
-	fprintf(stderr, "usage: %s [--leasetime <leasetime>] <wg-interface>\n",
+	fprintf(stderr,
+		"usage: %s [--leasetime <leasetime>] [--leasefile <file>]\n"
+		"       [--max-connections <n>] [--idle-timeout <seconds>]\n"
+		"       [--threads <n>] [--stats-socket <path>]\n"
+		"       [--control-socket <path>]\n"
+		"       [--netlink-rcvbuf <bytes>]\n"
+		"       [--alloc random|compact|sticky-hash]\n"
+		"       [--event-loop epoll|io_uring]\n"
+		"       [--reuse-grace <seconds>]\n"
+		"       [--replication-listen <host>:<port>]\n"
+		"       [--replicate-from <host>:<port>]\n"
+		"       [--capture <file>]\n"
+		"       <wg-interface> [<wg-interface>...]\n",
 		progname);
 	exit(EXIT_FAILURE);
 }
 
-static bool valid_peer_found(wg_device *device)
+static time_t get_monotonic_time()
+{
+	struct timespec monotime;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &monotime))
+		fatal("clock_gettime(CLOCK_MONOTONIC)");
+
+	return monotime.tv_sec;
+}
+
+/* Remembers the addresses of peer for leases_adopt() */
+static void collect_peer(struct wg_dynamic_interface *iface,
+			 const wg_peer *peer)
 {
-	wg_peer *peer;
-	wg_key_b64_string key;
+	struct leases_peer p = { .exact = true };
+	bool has_lladdr = false;
 	wg_allowedip *allowedip;
-	wg_for_each_peer (device, peer) {
-		wg_key_to_base64(key, peer->public_key);
-		debug("- peer %s\n", key);
-		debug("  allowedips:\n");
-
-		wg_for_each_allowedip (peer, allowedip) {
-			char out[INET6_ADDRSTRLEN];
-			inet_ntop(allowedip->family, &allowedip->ip6, out,
-				  sizeof(out));
-			debug("    %s\n", out);
-
-			if (is_link_local(allowedip->ip6.s6_addr) &&
-			    allowedip->cidr == 128)
-				return true;
+
+	wg_for_each_allowedip (peer, allowedip) {
+		if (allowedip->family == AF_INET6 &&
+		    IN6_IS_ADDR_LINKLOCAL(&allowedip->ip6)) {
+			if (has_lladdr || allowedip->cidr != 128)
+				p.exact = false;
+			p.lladdr = allowedip->ip6;
+			has_lladdr = true;
+		} else if (allowedip->family == AF_INET && !p.ipv4.s_addr) {
+			if (allowedip->cidr != 32)
+				p.exact = false;
+			p.ipv4 = allowedip->ip4;
+		} else if (allowedip->family == AF_INET6 &&
+			   IN6_IS_ADDR_UNSPECIFIED(&p.ipv6)) {
+			if (allowedip->cidr != 128)
+				p.exact = false;
+			p.ipv6 = allowedip->ip6;
+		} else {
+			p.exact = false;
 		}
 	}
 
-	return false;
+	if (!p.ipv4.s_addr && IN6_IS_ADDR_UNSPECIFIED(&p.ipv6))
+		return;
+
+	if (iface->npeers == iface->peers_cap) {
+		iface->peers_cap = MAX(2 * iface->peers_cap, 256);
+		iface->peers = realloc(iface->peers,
+				       iface->peers_cap * sizeof *iface->peers);
+		if (!iface->peers)
+			fatal("realloc()");
+	}
+
+	memcpy(p.pubkey, peer->public_key, sizeof p.pubkey);
+	iface->peers[iface->npeers++] = p;
 }
 
-static void rebuild_allowedips_ht()
+static int index_peer(const wg_device *dev, const wg_peer *peer, void *ctx)
 {
-	wg_peer *peer;
+	struct wg_dynamic_interface *iface = ctx;
 	wg_allowedip *allowedip;
 	khiter_t k;
 	uint64_t lh;
 	int ret;
 
-	kh_clear(allowedht, allowedips_ht);
-
-	wg_free_device(device);
-	if (wg_get_device(&device, wg_interface))
-		fatal("Unable to access interface %s", wg_interface);
+	UNUSED(dev);
+	wg_for_each_allowedip (peer, allowedip) {
+		if (allowedip->family != AF_INET6 ||
+		    !is_link_local(allowedip->ip6.s6_addr) ||
+		    allowedip->cidr != 128)
+			continue;
 
-	wg_for_each_peer (device, peer) {
-		wg_for_each_allowedip (peer, allowedip) {
-			if (allowedip->family == AF_INET6 &&
-			    is_link_local(allowedip->ip6.s6_addr) &&
-			    allowedip->cidr == 128) {
-				memcpy(&lh, allowedip->ip6.s6_addr + 8, 8);
-				k = kh_put(allowedht, allowedips_ht, lh, &ret);
-				if (ret <= 0)
-					die("Failed to rebuild allowedips hashtable\n");
+		/* a peer seen again, if the dump started over */
+		memcpy(&lh, allowedip->ip6.s6_addr + 8, 8);
+		k = kh_put(allowedht, iface->allowedips_ht, lh, &ret);
+		if (ret < 0)
+			die("Failed to rebuild allowedips hashtable\n");
 
-				kh_value(allowedips_ht, k) = &peer->public_key;
-			}
-		}
+		memcpy(kh_value(iface->allowedips_ht, k).pubkey,
+		       peer->public_key, sizeof(wg_key));
 	}
+
+	if (iface->collect_peers)
+		collect_peer(iface, peer);
+
+	return 0;
+}
+
+/* Rebuilds the lladdr index from a dump of the peers, which isn't kept. If
+ * dev isn't NULL, it receives the attributes of the device.
+ */
+static void rebuild_allowedips_ht(struct wg_dynamic_interface *iface,
+				  wg_device *dev)
+{
+	int ret;
+
+	kh_clear(allowedht, iface->allowedips_ht);
+	kh_clear(negativeht, iface->negative_ht);
+	iface->last_rebuild = get_monotonic_time();
+	metrics_inc(METRIC_INDEX_REBUILDS);
+
+	trace(wg__dump, iface->name);
+	ret = wg_for_each_peer_stream(iface->name, dev, index_peer, iface);
+	trace(wg__dump__done, iface->name, ret);
+	if (ret)
+		fatal("Unable to access interface %s", iface->name);
 }
 
-static wg_key *addr_to_pubkey(struct sockaddr_storage *addr)
+static wg_key *addr_to_pubkey(struct wg_dynamic_interface *iface,
+			      struct sockaddr_storage *addr)
 {
 	khiter_t k;
 	uint64_t lh;
@@ -124,80 +377,153 @@ static wg_key *addr_to_pubkey(struct sockaddr_storage *addr)
 	if (addr->ss_family == AF_INET6) {
 		lh = *(uint64_t *)&((struct sockaddr_in6 *)addr)
 			      ->sin6_addr.s6_addr[8];
-		k = kh_get(allowedht, allowedips_ht, lh);
-		if (k != kh_end(allowedips_ht))
-			return kh_val(allowedips_ht, k);
+		k = kh_get(allowedht, iface->allowedips_ht, lh);
+		if (k != kh_end(iface->allowedips_ht))
+			return &kh_val(iface->allowedips_ht, k).pubkey;
 	}
 
 	return NULL;
 }
 
-static int accept_connection(wg_key *dest_pubkey, struct in6_addr *dest_lladdr)
+static wg_key *lookup_pubkey_locked(struct wg_dynamic_interface *iface,
+				    struct sockaddr_storage *addr)
 {
-	int fd;
+	time_t now;
 	wg_key *pubkey;
-	struct sockaddr_storage addr;
-	socklen_t size = sizeof addr;
-#ifdef __linux__
-	fd = accept4(sockfd, (struct sockaddr *)&addr, &size, SOCK_NONBLOCK);
-	if (fd < 0)
-		return -errno;
-#else
-	fd = accept(sockfd, (struct sockaddr *)&addr, &size);
-	if (fd < 0)
-		return -errno;
+	khiter_t k;
+	uint64_t lh;
+	int ret;
 
-	int res = fcntl(fd, F_GETFL, 0);
-	if (res < 0 || fcntl(fd, F_SETFL, res | O_NONBLOCK) < 0)
-		fatal("Setting socket to nonblocking failed");
-#endif
+	pubkey = addr_to_pubkey(iface, addr);
+	if (pubkey || addr->ss_family != AF_INET6)
+		return pubkey;
+
+	now = get_monotonic_time();
+	lh = *(uint64_t *)&((struct sockaddr_in6 *)addr)->sin6_addr.s6_addr[8];
+	k = kh_get(negativeht, iface->negative_ht, lh);
+	if (k != kh_end(iface->negative_ht) &&
+	    kh_val(iface->negative_ht, k) > now)
+		return NULL;
+
+	if (now - iface->last_rebuild >= REBUILD_INTERVAL) {
+		/* our copy of allowedips is outdated, refresh */
+		rebuild_allowedips_ht(iface, NULL);
+		pubkey = addr_to_pubkey(iface, addr);
+		if (pubkey)
+			return pubkey;
+	}
+
+	if (kh_size(iface->negative_ht) >= NEGATIVE_MAX)
+		kh_clear(negativeht, iface->negative_ht);
+
+	k = kh_put(negativeht, iface->negative_ht, lh, &ret);
+	if (ret < 0)
+		fatal("kh_put()");
+
+	kh_value(iface->negative_ht, k) = now + NEGATIVE_TTL;
+
+	return NULL;
+}
+
+/* Looks up the pubkey for addr like addr_to_pubkey() and copies it to dest,
+ * but on a miss refreshes the index from the kernel. Addresses that still
+ * don't match any peer are remembered for NEGATIVE_TTL seconds, and the kernel
+ * isn't asked more than once every REBUILD_INTERVAL seconds, so a misbehaving
+ * client reconnecting in a loop can't make us dump the whole device over and
+ * over.
+ */
+static bool lookup_pubkey(struct wg_dynamic_interface *iface,
+			  struct sockaddr_storage *addr, wg_key dest)
+{
+	wg_key *pubkey;
+
+	pthread_mutex_lock(&iface->index_lock);
+	pubkey = lookup_pubkey_locked(iface, addr);
+	if (pubkey)
+		memcpy(dest, *pubkey, sizeof(wg_key));
+	pthread_mutex_unlock(&iface->index_lock);
+
+	return pubkey != NULL;
+}
 
-	if (addr.ss_family != AF_INET6) {
+/* Finds the peer that connected on fd from addr. Returns fd, or a negative
+ * errno after closing fd if it isn't one we talk to.
+ */
+static int identify_peer(struct wg_dynamic_listener *listener, int fd,
+			 struct sockaddr_storage *addr, wg_key *dest_pubkey,
+			 struct in6_addr *dest_lladdr)
+{
+	if (addr->ss_family != AF_INET6) {
 		debug("Rejecting client for not using an IPv6 address\n");
+		close(fd);
 		return -EINVAL;
 	}
 
-	if (((struct sockaddr_in6 *)&addr)->sin6_port !=
+	if (((struct sockaddr_in6 *)addr)->sin6_port !=
 	    htons(WG_DYNAMIC_PORT)) {
 		debug("Rejecting client for using port %u != %u\n",
-		      htons(((struct sockaddr_in6 *)&addr)->sin6_port),
+		      htons(((struct sockaddr_in6 *)addr)->sin6_port),
 		      WG_DYNAMIC_PORT);
+		close(fd);
 		return -EINVAL;
 	}
 
-	pubkey = addr_to_pubkey(&addr);
-	if (!pubkey) {
-		/* our copy of allowedips is outdated, refresh */
-		rebuild_allowedips_ht();
-		pubkey = addr_to_pubkey(&addr);
-		if (!pubkey) {
-			/* either we lost the race or something is very wrong */
-			close(fd);
-			return -ENOENT;
-		}
+	if (!lookup_pubkey(listener->iface, addr, *dest_pubkey)) {
+		/* either we lost the race or something is very wrong */
+		close(fd);
+		return -ENOENT;
 	}
-	memcpy(dest_pubkey, pubkey, sizeof *dest_pubkey);
 
-	memcpy(dest_lladdr, &((struct sockaddr_in6 *)&addr)->sin6_addr,
+	memcpy(dest_lladdr, &((struct sockaddr_in6 *)addr)->sin6_addr,
 	       sizeof *dest_lladdr);
 
-	wg_key_b64_string key;
-	char out[INET6_ADDRSTRLEN];
-	wg_key_to_base64(key, *pubkey);
-	inet_ntop(addr.ss_family, &((struct sockaddr_in6 *)&addr)->sin6_addr,
-		  out, sizeof(out));
-	debug("%s has pubkey: %s\n", out, key);
+	trace(connection__accept, fd, (const uint8_t *)*dest_pubkey,
+	      dest_lladdr, listener->iface->name);
+	if (DEBUG_LEVEL > 1) {
+		wg_key_b64_string key;
+		char out[INET6_ADDRSTRLEN];
+
+		wg_key_to_base64(key, *dest_pubkey);
+		inet_ntop(AF_INET6, dest_lladdr, out, sizeof(out));
+		debug_hot("%s on %s has pubkey: %s\n", out,
+			  listener->iface->name, key);
+	}
 
 	return fd;
 }
 
+static int accept_connection(struct wg_dynamic_listener *listener,
+			     wg_key *dest_pubkey, struct in6_addr *dest_lladdr)
+{
+	int fd;
+	struct sockaddr_storage addr;
+	socklen_t size = sizeof addr;
+#ifdef __linux__
+	fd = accept4(listener->fd, (struct sockaddr *)&addr, &size,
+		     SOCK_NONBLOCK);
+	if (fd < 0)
+		return -errno;
+#else
+	fd = accept(listener->fd, (struct sockaddr *)&addr, &size);
+	if (fd < 0)
+		return -errno;
+
+	int res = fcntl(fd, F_GETFL, 0);
+	if (res < 0 || fcntl(fd, F_SETFL, res | O_NONBLOCK) < 0)
+		fatal("Setting socket to nonblocking failed");
+#endif
+
+	return identify_peer(listener, fd, &addr, dest_pubkey, dest_lladdr);
+}
+
 static bool send_message(struct wg_dynamic_connection *con,
 			 const unsigned char *buf, size_t len)
 {
 	size_t offset = 0;
 
 	while (1) {
-		ssize_t written = write(con->fd, buf + offset, len - offset);
+		ssize_t written = send(con->fd, buf + offset, len - offset,
+				       MSG_NOSIGNAL);
 		if (written < 0) {
 			if (errno == EWOULDBLOCK || errno == EAGAIN)
 				break;
@@ -211,8 +537,14 @@ static bool send_message(struct wg_dynamic_connection *con,
 		}
 
 		offset += written;
-		if (offset == len)
+		if (offset == len) {
+			if (buf == con->outbuf) {
+				free(con->outbuf);
+				con->outbuf = NULL;
+				con->buflen = 0;
+			}
 			return true;
+		}
 	}
 
 	debug("Socket %d blocking on write with %lu bytes left, postponing\n",
@@ -233,35 +565,310 @@ static bool send_message(struct wg_dynamic_connection *con,
 	return true;
 }
 
-void close_connection(struct wg_dynamic_connection *con)
+static void unlink_connection(struct wg_dynamic_connection *con)
 {
-	free_wg_dynamic_request(&con->req);
+	struct wg_dynamic_worker *w = con->worker;
 
-	if (close(con->fd))
-		debug("Failed to close socket\n");
+	if (con->prev)
+		con->prev->next = con->next;
+	else
+		w->active_head = con->next;
+
+	if (con->next)
+		con->next->prev = con->prev;
+	else
+		w->active_tail = con->prev;
+
+	con->prev = con->next = NULL;
+}
+
+/* Pushes back the deadline of con, moving it to the tail of the active list */
+static void touch_connection(struct wg_dynamic_connection *con)
+{
+	struct wg_dynamic_worker *w = con->worker;
+
+	con->deadline = get_monotonic_time() + idle_timeout;
+
+	if (con == w->active_tail)
+		return;
+
+	if (con->prev || con == w->active_head)
+		unlink_connection(con);
+
+	con->prev = w->active_tail;
+	if (w->active_tail)
+		w->active_tail->next = con;
+	else
+		w->active_head = con;
+	w->active_tail = con;
+}
+
+static struct wg_dynamic_connection *get_connection(struct wg_dynamic_worker *w)
+{
+	struct wg_dynamic_connection *con;
+
+	/* see uring_accepted() for why it's different with io_uring */
+	BUG_ON(!w->ring &&
+	       w->nconnections >= w->max_connections + BUSY_CONNECTIONS);
+
+	if (!w->free_cons) {
+		struct connection_chunk *chunk = calloc(1, sizeof *chunk);
+		if (!chunk)
+			fatal("calloc()");
+
+		chunk->next = w->chunks;
+		w->chunks = chunk;
+		for (int i = CONNECTION_CHUNK - 1; i >= 0; --i) {
+			chunk->cons[i].type = EVENT_CONNECTION;
+			chunk->cons[i].worker = w;
+			chunk->cons[i].fd = -1;
+			chunk->cons[i].next = w->free_cons;
+			w->free_cons = &chunk->cons[i];
+		}
+	}
+
+	con = w->free_cons;
+	w->free_cons = con->next;
+	con->next = NULL;
+	++w->nconnections;
+
+	return con;
+}
+
+/* Forgets about con once its socket is closed, or about to be */
+static void release_connection(struct wg_dynamic_connection *con)
+{
+	struct wg_dynamic_worker *w = con->worker;
+
+	free_wg_dynamic_request(&con->req);
+	con->req.start = con->req.end = 0;
 
 	con->fd = -1;
 	memset(con->pubkey, 0, sizeof con->pubkey);
 	free(con->outbuf);
 	con->outbuf = NULL;
 	con->buflen = 0;
+	con->closing = false;
+	con->busy = false;
+
+	/* con stays on the queued list if it's on it, see
+	 * send_queued_responses()
+	 */
+	unlink_connection(con);
+	--w->nconnections;
+
+	/* see uring_complete() */
+	if (con->inflight)
+		return;
+
+	con->next = w->free_cons;
+	w->free_cons = con;
+}
+
+void close_connection(struct wg_dynamic_connection *con)
+{
+	BUG_ON(con->fd < 0);
+
+#ifdef HAVE_IO_URING
+	if (con->worker->ring) {
+		/* a pending recv holds on to the socket otherwise */
+		if (con->receiving)
+			uring_cancel(con->worker->ring,
+				     URING_DATA(con, URING_RECV));
+		uring_close(con->worker->ring, con->fd);
+		release_connection(con);
+		return;
+	}
+#endif
+
+	if (close(con->fd))
+		debug("Failed to close socket\n");
+
+	release_connection(con);
+}
+
+/* Closes the connection that was idle for the longest time, if it was idle
+ * for at least EVICT_MIN_IDLE seconds and has nothing left to send. That way
+ * clients holding on to their connection between renewals, as with a long
+ * idle_timeout, can't lock out others. Returns whether one was closed.
+ */
+static bool evict_oldest_connection(struct wg_dynamic_worker *w)
+{
+	struct wg_dynamic_connection *con = w->active_head;
+
+	if (!con || con->outbuf || con->queued || con->req.end > con->req.start)
+		return false;
+
+	if (con->deadline - idle_timeout + EVICT_MIN_IDLE >
+	    get_monotonic_time())
+		return false;
+
+	debug("Closing oldest connection on socket %d to make room\n", con->fd);
+	metrics_inc(METRIC_CONNECTIONS_EVICTED);
+	close_connection(con);
+
+	return true;
+}
+
+/* Closes all connections that were idle for longer than idle_timeout and
+ * returns the amount of seconds until the next one would be.
+ */
+static int evict_idle_connections(struct wg_dynamic_worker *w)
+{
+	time_t now = get_monotonic_time(), next, evict_at;
+
+	while (w->active_head && w->active_head->deadline <= now) {
+		debug("Closing idle connection on socket %d\n",
+		      w->active_head->fd);
+		close_connection(w->active_head);
+	}
+
+	if (!w->active_head)
+		return INT_MAX / 1000;
+
+	/* a blocked accept can go on once the oldest one may be evicted */
+	next = w->active_head->deadline;
+	evict_at = next - idle_timeout + EVICT_MIN_IDLE;
+	if (w->accept_blocked && evict_at > now)
+		next = MIN(next, evict_at);
+
+	return MIN(INT_MAX / 1000, next - now);
+}
+
+static void queue_message(struct wg_dynamic_connection *con,
+			  const unsigned char *buf, size_t len)
+{
+	unsigned char *outbuf = realloc(con->outbuf, con->buflen + len);
+	if (!outbuf)
+		fatal("realloc()");
+
+	memcpy(outbuf + con->buflen, buf, len);
+	con->outbuf = outbuf;
+	con->buflen += len;
+
+	if (!con->queued) {
+		con->queued = true;
+		con->next_queued = con->worker->queued;
+		con->worker->queued = con;
+	}
+}
+
+#ifdef HAVE_IO_URING
+/* Hands the output of con to the ring, unless a send is still in flight, in
+ * which case its completion comes back here. The socket is closed right
+ * behind the last send.
+ */
+static void uring_send_output(struct wg_dynamic_connection *con)
+{
+	struct uring *ring = con->worker->ring;
+
+	if (con->sendbuf)
+		return;
+
+	if (!con->outbuf) {
+		if (con->closing)
+			close_connection(con);
+		return;
+	}
+
+	con->sendbuf = con->outbuf;
+	con->sendlen = con->buflen;
+	con->outbuf = NULL;
+	con->buflen = 0;
+	++con->inflight;
+
+	if (!con->closing) {
+		uring_send(ring, con->fd, con->sendbuf, con->sendlen, false,
+			   URING_DATA(con, URING_SEND));
+		return;
+	}
+
+	if (con->receiving)
+		uring_cancel(ring, URING_DATA(con, URING_RECV));
+	uring_send(ring, con->fd, con->sendbuf, con->sendlen, true,
+		   URING_DATA(con, URING_SEND));
+	release_connection(con);
+}
+#endif
+
+static void send_queued_responses(struct wg_dynamic_worker *w)
+{
+	while (w->queued) {
+		struct wg_dynamic_connection *con = w->queued;
+
+		w->queued = con->next_queued;
+		con->next_queued = NULL;
+		con->queued = false;
+
+		/* closed in the meantime */
+		if (con->fd < 0)
+			continue;
+
+#ifdef HAVE_IO_URING
+		if (w->ring) {
+			uring_send_output(con);
+			continue;
+		}
+#endif
+
+		if (!send_message(con, con->outbuf, con->buflen) ||
+		    con->closing)
+			close_connection(con);
+	}
+}
+
+/* Seconds a client turned away with E_BUSY should wait before trying again,
+ * roughly until the oldest connection may be evicted
+ */
+static uint32_t busy_retry_after(struct wg_dynamic_worker *w)
+{
+	time_t evict_at;
+
+	if (!w->active_head)
+		return 1;
+
+	evict_at = w->active_head->deadline - idle_timeout + EVICT_MIN_IDLE;
+	return MAX(1, MIN(evict_at - get_monotonic_time(), EVICT_MIN_IDLE));
+}
+
+static void send_busy(struct wg_dynamic_connection *con)
+{
+	struct wg_dynamic_request_ip ans = { .wg_errno = E_BUSY };
+	char buf[MAX_RESPONSE_SIZE];
+	size_t msglen;
+
+	ans.retry_after = busy_retry_after(con->worker);
+	msglen = serialize_request_ip(false, buf, sizeof buf, &ans);
+	metrics_inc(METRIC_BUSY_RESPONSES);
+	queue_message(con, (unsigned char *)buf, msglen);
+	con->closing = true;
 }
 
-static bool send_response(struct wg_dynamic_connection *con)
+static void send_response(struct wg_dynamic_connection *con)
 {
 	char buf[MAX_RESPONSE_SIZE];
 	size_t msglen;
 
+	if (con->busy) {
+		send_busy(con);
+		return;
+	}
+
 	switch (con->req.cmd) {
 	case WGKEY_REQUEST_IP:;
-		struct wg_dynamic_request_ip *rip = con->req.result;
+		struct wg_dynamic_request_ip *rip = &con->req.result.ip;
 		struct in_addr *ip4 = rip->has_ipv4 ? &rip->ipv4 : NULL;
 		struct in6_addr *ip6 = rip->has_ipv6 ? &rip->ipv6 : NULL;
+		struct wg_dynamic_leases *leases = con->iface->leases;
 		struct wg_dynamic_lease *lease;
 		struct wg_dynamic_request_ip ans = { 0 };
+		uint64_t start;
 
-		lease = set_lease(con->pubkey, leasetime, &con->lladdr, ip4,
-				  ip6);
+		leases_lock(leases);
+		start = metrics_start();
+		lease = set_lease(leases, con->pubkey, leasetime, &con->lladdr,
+				  ip4, ip6);
+		metrics_observe(HIST_SET_LEASE, start);
 
 		if (lease->ipv4.s_addr) {
 			ans.has_ipv4 = true;
@@ -278,55 +885,81 @@ static bool send_response(struct wg_dynamic_connection *con)
 
 		ans.start = lease->start_real;
 		ans.leasetime = lease->leasetime;
+		leases_unlock(leases);
 
 		msglen = serialize_request_ip(false, buf, sizeof buf, &ans);
+		metrics_inc(METRIC_REQUESTS);
 		break;
 	default:
 		debug("Unknown command: %d\n", con->req.cmd);
 		BUG();
 	}
 
-	return send_message(con, (unsigned char *)buf, msglen);
+	queue_message(con, (unsigned char *)buf, msglen);
 }
 
-static void handle_client(struct wg_dynamic_connection *con)
+static void send_error(struct wg_dynamic_connection *con, int ret)
 {
-	unsigned char buf[RECV_BUFSIZE + MAX_LINESIZE];
-	size_t rem = 0;
-	ssize_t ret;
+	char buf[128];
+	size_t len = 0;
+	uint32_t err = E_INVALID_REQ;
+	if (-ret == EPROTONOSUPPORT)
+		err = E_UNSUPP_PROTO;
+
+	print_to_buf(buf, sizeof buf, &len, "errno=%u\nerrmsg=%s\n\n", err,
+		     WG_DYNAMIC_ERR[err]);
+	queue_message(con, (unsigned char *)buf, len);
+	con->closing = true;
+}
 
-	while ((ret = handle_request(con->fd, &con->req, buf, &rem)) > 0) {
-		if (!send_response(con)) {
-			close_connection(con);
-			break;
-		}
+static void handle_client(struct wg_dynamic_connection *con)
+{
+	int ret;
 
+	touch_connection(con);
+	while ((ret = handle_request(con->fd, &con->req)) > 0) {
+		send_response(con);
 		free_wg_dynamic_request(&con->req);
 	}
 
-	if (ret < 0) {
-		size_t len = 0;
-		uint32_t err = E_INVALID_REQ;
-		if (-ret == EPROTONOSUPPORT)
-			err = E_UNSUPP_PROTO;
-
-		print_to_buf((char *)buf, sizeof buf, &len,
-			     "errno=%u\nerrmsg=%s\n\n", err,
-			     WG_DYNAMIC_ERR[err]);
-		send_message(con, buf, len);
-		close_connection(con);
-	}
+	if (ret < 0)
+		send_error(con, ret);
 }
 
-static void setup_sockets()
+#ifdef HAVE_IO_URING
+/* Same as handle_client(), for the len bytes io_uring received. A len of 0
+ * means the client closed its end.
+ */
+static void handle_client_data(struct wg_dynamic_connection *con,
+			       const unsigned char *data, size_t len)
 {
-	int val = 1, res;
-	struct sockaddr_in6 addr = {
-		.sin6_family = AF_INET6,
-		.sin6_port = htons(WG_DYNAMIC_PORT),
-		.sin6_addr = well_known,
-		.sin6_scope_id = device->ifindex,
-	};
+	int ret;
+
+	touch_connection(con);
+	if (!len) {
+		send_error(con, -1);
+		return;
+	}
+
+	while ((ret = handle_request_data(&con->req, &data, &len)) > 0) {
+		send_response(con);
+		free_wg_dynamic_request(&con->req);
+	}
+
+	if (ret < 0)
+		send_error(con, ret);
+}
+#endif
+
+static int setup_listener(struct wg_dynamic_interface *iface)
+{
+	int sockfd, val = 1, res;
+	struct sockaddr_in6 addr = {
+		.sin6_family = AF_INET6,
+		.sin6_port = htons(WG_DYNAMIC_PORT),
+		.sin6_addr = well_known,
+		.sin6_scope_id = iface->ifindex,
+	};
 
 	sockfd = socket(AF_INET6, SOCK_STREAM, 0);
 	if (sockfd < 0)
@@ -339,12 +972,143 @@ static void setup_sockets()
 	if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof val))
 		fatal("Setting socket option failed");
 
+	/* the kernel spreads incoming connections over all workers */
+	if (nworkers > 1 &&
+	    setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof val))
+		fatal("Setting socket option failed");
+
 	if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
-		fatal("Binding socket failed");
+		fatal("Binding socket on %s failed", iface->name);
 
 	if (listen(sockfd, SOMAXCONN) == -1)
 		fatal("Listening to socket failed");
 
+	return sockfd;
+}
+
+static int setup_unix_socket(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd;
+
+	if (strlen(path) >= sizeof addr.sun_path)
+		die("Socket path too long: %s\n", path);
+
+	strcpy(addr.sun_path, path);
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		fatal("Creating a socket failed");
+
+	/* left behind if we didn't exit cleanly */
+	if (unlink(path) && errno != ENOENT)
+		fatal("Removing %s failed", path);
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof addr))
+		fatal("Binding socket to %s failed", path);
+
+	if (listen(fd, SOMAXCONN))
+		fatal("Listening to socket failed");
+
+	return fd;
+}
+
+static void write_pool_metrics(FILE *f)
+{
+	struct wg_dynamic_leases_usage usage;
+
+	fprintf(f, "# HELP wg_dynamic_leases Leases currently held\n");
+	fprintf(f, "# TYPE wg_dynamic_leases gauge\n");
+	for (unsigned int i = 0; i < ninterfaces; ++i) {
+		leases_get_usage(interfaces[i].leases, &usage);
+		fprintf(f, "wg_dynamic_leases{interface=\"%s\"} %zu\n",
+			usage.devname, usage.leases);
+	}
+
+	fprintf(f, "# HELP wg_dynamic_pool_free_addresses "
+		   "Addresses left to hand out\n");
+	fprintf(f, "# TYPE wg_dynamic_pool_free_addresses gauge\n");
+	for (unsigned int i = 0; i < ninterfaces; ++i) {
+		leases_get_usage(interfaces[i].leases, &usage);
+		fprintf(f,
+			"wg_dynamic_pool_free_addresses{interface=\"%s\","
+			"family=\"ipv4\"} %ju\n",
+			usage.devname, (uintmax_t)usage.free_ipv4);
+		fprintf(f,
+			"wg_dynamic_pool_free_addresses{interface=\"%s\","
+			"family=\"ipv6\"} %.0f\n",
+			usage.devname,
+			usage.free_ipv6_high * 18446744073709551616.0 +
+				usage.free_ipv6_low);
+	}
+}
+
+/* Writes out all metrics in the Prometheus text format to every client that
+ * connected, and closes the connection right away. The output is far smaller
+ * than the send buffer of a unix socket, so this doesn't block.
+ */
+static void serve_stats()
+{
+	char *buf;
+	size_t len, off;
+	FILE *f;
+	int fd;
+
+	while ((fd = accept4(stats_listener.fd, NULL, NULL, SOCK_CLOEXEC)) >=
+	       0) {
+		f = open_memstream(&buf, &len);
+		if (!f)
+			fatal("open_memstream()");
+
+		metrics_write(f);
+		write_pool_metrics(f);
+		if (fclose(f))
+			fatal("fclose()");
+
+		for (off = 0; off < len;) {
+			ssize_t ret = send(fd, buf + off, len - off,
+					   MSG_NOSIGNAL | MSG_DONTWAIT);
+			if (ret < 0) {
+				debug("Writing stats failed: %s\n",
+				      strerror(errno));
+				break;
+			}
+			off += ret;
+		}
+
+		free(buf);
+		close(fd);
+	}
+
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		debug("Failed to accept stats connection: %s\n",
+		      strerror(errno));
+}
+
+static void setup_sockets()
+{
+	int val, res;
+
+	workers = calloc(nworkers, sizeof *workers);
+	if (!workers)
+		fatal("calloc()");
+
+	for (unsigned int i = 0; i < nworkers; ++i) {
+		workers[i].listeners =
+			calloc(ninterfaces, sizeof *workers[i].listeners);
+		if (!workers[i].listeners)
+			fatal("calloc()");
+
+		for (unsigned int j = 0; j < ninterfaces; ++j) {
+			workers[i].listeners[j].type = EVENT_LISTENER;
+			workers[i].listeners[j].iface = &interfaces[j];
+			workers[i].listeners[j].fd =
+				setup_listener(&interfaces[j]);
+		}
+		workers[i].epollfd = -1;
+		workers[i].max_connections =
+			(max_connections + nworkers - 1) / nworkers;
+	}
+
 	/* netlink route socket */
 	nlsock = mnl_socket_open(NETLINK_ROUTE);
 	if (!nlsock)
@@ -358,6 +1122,15 @@ static void setup_sockets()
 	if (mnl_socket_bind(nlsock, 0, MNL_SOCKET_AUTOPID) < 0)
 		fatal("mnl_socket_bind()");
 
+	/* past rmem_max if we're allowed to, see leases_update_pools() for
+	 * what happens when it overflows anyway
+	 */
+	if (setsockopt(mnl_socket_get_fd(nlsock), SOL_SOCKET, SO_RCVBUFFORCE,
+		       &netlink_rcvbuf, sizeof netlink_rcvbuf) &&
+	    setsockopt(mnl_socket_get_fd(nlsock), SOL_SOCKET, SO_RCVBUF,
+		       &netlink_rcvbuf, sizeof netlink_rcvbuf))
+		fatal("Setting netlink receive buffer failed");
+
 	val = RTNLGRP_IPV4_ROUTE;
 	if (mnl_socket_setsockopt(nlsock, NETLINK_ADD_MEMBERSHIP, &val,
 				  sizeof val) < 0)
@@ -367,128 +1140,325 @@ static void setup_sockets()
 	if (mnl_socket_setsockopt(nlsock, NETLINK_ADD_MEMBERSHIP, &val,
 				  sizeof val) < 0)
 		fatal("mnl_socket_setsockopt()");
+
+	if (stats_socket)
+		stats_listener.fd = setup_unix_socket(stats_socket);
+
+	/* anyone who can connect can change leases */
+	if (control_socket) {
+		control_fd = setup_unix_socket(control_socket);
+		if (chmod(control_socket, 0600))
+			fatal("chmod(%s)", control_socket);
+	}
 }
 
-static void cleanup()
+static void cleanup_worker(struct wg_dynamic_worker *w)
 {
-	leases_free();
-	kh_destroy(allowedht, allowedips_ht);
-	wg_free_device(device);
+	for (unsigned int i = 0; w->listeners && i < ninterfaces; ++i) {
+		if (w->listeners[i].fd >= 0)
+			close(w->listeners[i].fd);
+	}
+	free(w->listeners);
 
-	if (nlsock)
-		mnl_socket_close(nlsock);
+	if (w->epollfd >= 0)
+		close(w->epollfd);
 
-	if (sockfd >= 0)
-		close(sockfd);
+#ifdef HAVE_IO_URING
+	/* drops whatever is still in flight */
+	uring_free(w->ring);
+	w->ring = NULL;
+#endif
 
-	if (epollfd >= 0)
-		close(epollfd);
+	while (w->active_head)
+		close_connection(w->active_head);
 
-	for (int i = 0; i < MAX_CONNECTIONS; ++i) {
-		if (connections[i].fd < 0)
-			continue;
+	while (w->chunks) {
+		struct connection_chunk *chunk = w->chunks;
 
-		close_connection(&connections[i]);
+		w->chunks = chunk->next;
+		for (int i = 0; i < CONNECTION_CHUNK; ++i)
+			free(chunk->cons[i].sendbuf);
+		free(chunk);
 	}
 }
 
-static void init_leases_from_peers()
+static void cleanup()
 {
-	wg_peer *peer;
+	if (control_fd >= 0)
+		unlink(control_socket);
+
+	/* Other workers, replication, the control socket or
+	 * reconcile_thread() may still be using the shared state while we
+	 * exit, so leave that to the kernel. Everything acknowledged to a
+	 * client has already been synced to the lease file.
+	 */
+	if (nworkers > 1 || replication_listen || replicate_from ||
+	    control_fd >= 0 || __atomic_load_n(&reconciling, __ATOMIC_ACQUIRE))
+		return;
 
-	wg_for_each_peer (device, peer) {
-		wg_allowedip *allowedip;
-		struct in6_addr *lladdr = NULL;
-		struct in_addr *ipv4 = NULL;
-		struct in6_addr *ipv6 = NULL;
-		wg_for_each_allowedip (peer, allowedip) {
-			if (allowedip->family == AF_INET6 &&
-			    IN6_IS_ADDR_LINKLOCAL(&allowedip->ip6))
-				lladdr = &allowedip->ip6;
-			else if (allowedip->family == AF_INET && !ipv4)
-				ipv4 = &allowedip->ip4;
-			else if (allowedip->family == AF_INET6 && !ipv6)
-				ipv6 = &allowedip->ip6;
-		}
+	for (unsigned int i = 0; i < ninterfaces; ++i) {
+		struct wg_dynamic_interface *iface = &interfaces[i];
 
-		if (!ipv4 && !ipv6)
-			continue;
+		leases_free(iface->leases);
+		kh_destroy(allowedht, iface->allowedips_ht);
+		kh_destroy(negativeht, iface->negative_ht);
+		free(iface->leasefile);
+		pthread_mutex_destroy(&iface->index_lock);
+	}
+	free(interfaces);
+
+	if (nlsock)
+		mnl_socket_close(nlsock);
+	wg_close_netlink();
+
+	if (workers)
+		cleanup_worker(&workers[0]);
+	free(workers);
 
-		set_lease(peer->public_key, leasetime, lladdr, ipv4, ipv6);
+	if (stats_listener.fd >= 0) {
+		close(stats_listener.fd);
+		unlink(stats_socket);
 	}
 }
 
-static void setup()
+static void setup_interface(struct wg_dynamic_interface *iface)
 {
 	struct wg_combined_ip ip;
+	wg_device dev;
 	int ret;
 
-	if (inet_pton(AF_INET6, WG_DYNAMIC_ADDR, &well_known) != 1)
-		fatal("inet_pton()");
-
-	allowedips_ht = kh_init(allowedht);
-	if (!allowedips_ht)
+	iface->allowedips_ht = kh_init(allowedht);
+	iface->negative_ht = kh_init(negativeht);
+	if (!iface->allowedips_ht || !iface->negative_ht)
 		fatal("kh_init()");
 
-	for (int i = 0; i < MAX_CONNECTIONS; ++i)
-		connections[i].fd = -1;
-
-	if (atexit(cleanup))
-		die("Failed to set exit function\n");
+	if (pthread_mutex_init(&iface->index_lock, NULL))
+		fatal("pthread_mutex_init()");
 
-	rebuild_allowedips_ht();
+	/* the only dump of the device at startup */
+	iface->collect_peers = true;
+	rebuild_allowedips_ht(iface, &dev);
+	iface->collect_peers = false;
+	iface->ifindex = dev.ifindex;
+	memcpy(iface->pubkey, dev.public_key, sizeof iface->pubkey);
 
-	ipm_init();
-	ret = ipm_getlladdr(device->ifindex, &ip);
+	ret = ipm_getlladdr(iface->ifindex, &ip);
 	if (ret == -1)
 		fatal("ipm_getlladdr()");
 	if (ret == -2)
 		die("Interface must not have multiple link-local addresses assigned\n");
-	ipm_free();
 
 	if (ret == -1 || ip.family != AF_INET6 ||
 	    memcmp(&ip.ip6, well_known.s6_addr, 16))
 		/* TODO: assign IP instead? */
-		die("%s needs to have %s assigned\n", wg_interface,
+		die("%s needs to have %s assigned\n", iface->name,
 		    WG_DYNAMIC_ADDR);
 
 	if (ip.cidr != 64)
 		die("Link-local address must have a CIDR of 64\n");
 
-	if (!valid_peer_found(device))
+	if (!kh_size(iface->allowedips_ht))
 		die("%s has no peers with link-local allowedips\n",
-		    wg_interface);
+		    iface->name);
+
+	/* with several interfaces, each one gets its own lease file */
+	if (leasefile && ninterfaces > 1) {
+		if (asprintf(&iface->leasefile, "%s.%s", leasefile,
+			     iface->name) < 0)
+			fatal("asprintf()");
+	} else if (leasefile) {
+		iface->leasefile = strdup(leasefile);
+		if (!iface->leasefile)
+			fatal("strdup()");
+	}
 
-	setup_sockets();
-	leases_init(wg_interface, device->ifindex, NULL, nlsock);
-	init_leases_from_peers();
+	iface->leases = leases_init(iface->name, iface->ifindex);
+	leases_set_alloc(iface->leases, alloc, iface->pubkey);
+	leases_set_reuse_grace(iface->leases, reuse_grace);
+}
+
+/* Falls back to epoll if io_uring can't be used after all */
+static void check_event_loop()
+{
+	if (event_loop != EVENT_LOOP_IO_URING)
+		return;
+
+#ifdef HAVE_IO_URING
+	struct uring *ring;
+
+	ring = uring_new(URING_ENTRIES, URING_BUFS, URING_BUFSIZE);
+	if (ring) {
+		uring_free(ring);
+		return;
+	}
+
+	log_err("io_uring is unavailable, falling back to epoll: %s\n",
+		strerror(errno));
+#else
+	log_err("Built without io_uring, falling back to epoll\n");
+#endif
+	event_loop = EVENT_LOOP_EPOLL;
+}
+
+/* Brings the allowedips in line with the leases restored or adopted at
+ * startup, while the workers already serve requests. Requests of peers that
+ * weren't reconciled yet are fine, answering them pushes their leases first.
+ */
+static void *reconcile_thread(void *arg)
+{
+	UNUSED(arg);
+
+	for (unsigned int i = 0; i < ninterfaces; ++i) {
+		size_t n = leases_reconcile(interfaces[i].leases);
+
+		debug("%s: updated the allowedips of %zu peers\n",
+		      interfaces[i].name, n);
+	}
+
+	wg_close_netlink();
+	__atomic_store_n(&reconciling, false, __ATOMIC_RELEASE);
+
+	return NULL;
+}
+
+/* Replication runs in threads of its own, which take the leases' locks like
+ * the workers do
+ */
+static void setup_replication()
+{
+	struct wg_dynamic_leases **leases;
+
+	if (replication_listen) {
+		leases = calloc(ninterfaces, sizeof *leases);
+		if (!leases)
+			fatal("calloc()");
+
+		for (unsigned int i = 0; i < ninterfaces; ++i)
+			leases[i] = interfaces[i].leases;
+
+		replication_start_primary(replication_listen, leases,
+					  ninterfaces);
+		free(leases);
+	}
+
+	if (replicate_from)
+		replication_start_standby(replicate_from);
 }
 
-static int get_avail_request()
+static void setup()
 {
-	for (int nfds = 0;; ++nfds) {
-		if (nfds >= MAX_CONNECTIONS)
-			return -1;
+	if (inet_pton(AF_INET6, WG_DYNAMIC_ADDR, &well_known) != 1)
+		fatal("inet_pton()");
+
+	if (atexit(cleanup))
+		die("Failed to set exit function\n");
+
+	check_event_loop();
+
+	ipm_init();
+	for (unsigned int i = 0; i < ninterfaces; ++i)
+		setup_interface(&interfaces[i]);
+	ipm_free();
+
+	setup_sockets();
 
-		if (connections[nfds].fd < 0)
-			return nfds;
+	/* one dump fills the pools of all interfaces */
+	leases_dump_pools(nlsock);
+
+	/* Peers the lease file doesn't know about, if there is one, keep the
+	 * addresses they have. The kernel is only told about what differs, by
+	 * reconcile_thread().
+	 */
+	for (unsigned int i = 0; i < ninterfaces; ++i) {
+		struct wg_dynamic_interface *iface = &interfaces[i];
+		size_t n;
+
+		if (iface->leasefile)
+			leases_restore(iface->leases, iface->leasefile);
+		n = leases_adopt(iface->leases, iface->peers, iface->npeers,
+				 leasetime);
+		debug("%s: %zu peers with addresses, %zu leases created\n",
+		      iface->name, iface->npeers, n);
+		free(iface->peers);
+		iface->peers = NULL;
+		iface->npeers = iface->peers_cap = 0;
 	}
+
+	/* before anything else may change the leases */
+	if (capture_file) {
+		struct wg_dynamic_leases **leases;
+
+		leases = calloc(ninterfaces, sizeof *leases);
+		if (!leases)
+			fatal("calloc()");
+
+		for (unsigned int i = 0; i < ninterfaces; ++i)
+			leases[i] = interfaces[i].leases;
+
+		capture = capture_open(capture_file, leases, ninterfaces);
+		free(leases);
+	}
+
+	setup_replication();
+	if (control_fd >= 0)
+		control_start(control_fd);
+
+	reconciling = true;
+	if (pthread_create(&reconciler, NULL, reconcile_thread, NULL))
+		fatal("pthread_create()");
+	if (pthread_detach(reconciler))
+		fatal("pthread_detach()");
+}
+
+static struct wg_dynamic_connection *
+add_connection(struct wg_dynamic_worker *w,
+	       struct wg_dynamic_listener *listener, int fd,
+	       const wg_key pubkey, const struct in6_addr *lladdr, bool busy)
+{
+	struct wg_dynamic_connection *con = get_connection(w);
+
+	con->iface = listener->iface;
+	memcpy(con->pubkey, pubkey, sizeof con->pubkey);
+	con->lladdr = *lladdr;
+	con->fd = fd;
+	con->busy = busy;
+	touch_connection(con);
+
+	return con;
 }
 
-static void accept_incoming()
+static void accept_incoming(struct wg_dynamic_worker *w,
+			    struct wg_dynamic_listener *listener)
 {
-	int n, fd;
+	struct wg_dynamic_connection *con;
+	struct in6_addr lladdr = { 0 };
 	struct epoll_event ev;
+	wg_key pubkey;
+	int fd;
+
+	w->accept_blocked = false;
+	while (1) {
+		bool busy = w->nconnections >= w->max_connections &&
+			    !evict_oldest_connection(w);
+
+		if (busy && w->nconnections >=
+				    w->max_connections + BUSY_CONNECTIONS) {
+			/* edge triggered, so we need to remember to resume
+			 * once a connection was closed
+			 */
+			w->accept_blocked = true;
+			return;
+		}
 
-	while ((n = get_avail_request()) >= 0) {
-		fd = accept_connection(&connections[n].pubkey,
-				       &connections[n].lladdr);
+		fd = accept_connection(listener, &pubkey, &lladdr);
 		if (fd < 0) {
+			if (fd == -EAGAIN || fd == -EWOULDBLOCK)
+				return;
+
+			metrics_inc(METRIC_ACCEPT_REJECTED);
 			if (fd == -ENOENT) {
 				debug("Failed to match IP to pubkey\n");
 				continue;
-			} else if (fd == -EAGAIN || fd == -EWOULDBLOCK) {
-				return;
 			}
 
 			debug("Failed to accept connection: %s\n",
@@ -496,60 +1466,126 @@ static void accept_incoming()
 			continue;
 		}
 
-		ev.events = EPOLLIN | EPOLLET;
-		ev.data.ptr = &connections[n];
-		if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev) == -1)
-			fatal("epoll_ctl()");
+		con = add_connection(w, listener, fd, pubkey, &lladdr, busy);
 
-		connections[n].fd = fd;
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+		ev.data.ptr = con;
+		if (epoll_ctl(w->epollfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+			fatal("epoll_ctl()");
 	}
 }
 
-static void handle_event(void *ptr, uint32_t events)
+static void handle_event(struct wg_dynamic_worker *w, void *ptr,
+			 uint32_t events)
 {
 	struct wg_dynamic_connection *con;
+	uint64_t start;
 
-	if (ptr == &sockfd) {
-		accept_incoming();
+	if (ptr == nlsock) {
+		start = metrics_start();
+		leases_update_pools(nlsock);
+		metrics_observe(HIST_UPDATE_POOLS, start);
 		return;
 	}
 
-	if (ptr == nlsock) {
-		leases_update_pools(nlsock);
+	if (*(enum wg_dynamic_event_type *)ptr == EVENT_LISTENER) {
+		accept_incoming(w, ptr);
+		return;
+	}
+
+	if (*(enum wg_dynamic_event_type *)ptr == EVENT_STATS) {
+		serve_stats();
 		return;
 	}
 
 	con = (struct wg_dynamic_connection *)ptr;
+
+	/* closed earlier in the same batch */
+	if (con->fd < 0)
+		return;
+
 	if (events & EPOLLIN) {
+		start = metrics_start();
 		handle_client(con);
+		metrics_observe(HIST_HANDLE_CLIENT, start);
 	}
 
-	if (events & EPOLLOUT) {
+	if ((events & EPOLLOUT) && con->outbuf && !con->queued) {
 		if (!send_message(con, con->outbuf, con->buflen))
 			close_connection(con);
 	}
 }
 
-static void poll_loop()
+/* Milliseconds until the next lease expires or connection times out */
+static int next_timeout(struct wg_dynamic_worker *w)
 {
-	struct epoll_event ev, events[MAX_CONNECTIONS];
-	epollfd = epoll_create1(0);
-	if (epollfd == -1)
+	time_t next = INT_MAX / 1000;
+
+	for (unsigned int i = 0; w == &workers[0] && i < ninterfaces; ++i) {
+		uint64_t start = metrics_start();
+
+		next = MIN(next, leases_refresh(interfaces[i].leases));
+		metrics_observe(HIST_LEASES_REFRESH, start);
+	}
+
+	return MIN(next, evict_idle_connections(w)) * 1000;
+}
+
+/* One netlink round trip and one sync for all the requests handled in a
+ * round of the event loop, before any of them is answered
+ */
+static void send_responses(struct wg_dynamic_worker *w)
+{
+	for (unsigned int i = 0; i < ninterfaces; ++i) {
+		leases_flush(interfaces[i].leases);
+		leases_sync(interfaces[i].leases);
+	}
+	if (capture)
+		capture_sync(capture);
+	send_queued_responses(w);
+}
+
+static void epoll_loop(struct wg_dynamic_worker *w)
+{
+	bool is_main = w == &workers[0];
+	struct epoll_event ev, *events;
+	int maxevents = MIN_EPOLL_EVENTS;
+
+	events = malloc(maxevents * sizeof *events);
+	if (!events)
+		fatal("malloc()");
+
+	w->epollfd = epoll_create1(0);
+	if (w->epollfd == -1)
 		fatal("epoll_create1()");
 
-	ev.events = EPOLLIN | EPOLLET;
-	ev.data.ptr = &sockfd;
-	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, sockfd, &ev))
-		fatal("epoll_ctl()");
+	for (unsigned int i = 0; i < ninterfaces; ++i) {
+		ev.events = EPOLLIN | EPOLLET;
+		ev.data.ptr = &w->listeners[i];
+		if (epoll_ctl(w->epollfd, EPOLL_CTL_ADD, w->listeners[i].fd,
+			      &ev))
+			fatal("epoll_ctl()");
+	}
 
-	ev.events = EPOLLIN;
-	ev.data.ptr = nlsock;
-	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, mnl_socket_get_fd(nlsock), &ev))
-		fatal("epoll_ctl()");
+	if (is_main) {
+		ev.events = EPOLLIN;
+		ev.data.ptr = nlsock;
+		if (epoll_ctl(w->epollfd, EPOLL_CTL_ADD,
+			      mnl_socket_get_fd(nlsock), &ev))
+			fatal("epoll_ctl()");
+	}
+
+	if (is_main && stats_listener.fd >= 0) {
+		ev.events = EPOLLIN;
+		ev.data.ptr = &stats_listener;
+		if (epoll_ctl(w->epollfd, EPOLL_CTL_ADD, stats_listener.fd,
+			      &ev))
+			fatal("epoll_ctl()");
+	}
 
 	while (1) {
-		time_t next = leases_refresh() * 1000;
-		int nfds = epoll_wait(epollfd, events, MAX_CONNECTIONS, next);
+		int nfds = epoll_wait(w->epollfd, events, maxevents,
+				      next_timeout(w));
 		if (nfds == -1) {
 			if (errno == EINTR)
 				continue;
@@ -558,10 +1594,281 @@ static void poll_loop()
 		}
 
 		for (int i = 0; i < nfds; ++i)
-			handle_event(events[i].data.ptr, events[i].events);
+			handle_event(w, events[i].data.ptr, events[i].events);
+
+		send_responses(w);
+
+		if (w->accept_blocked) {
+			for (unsigned int i = 0; i < ninterfaces; ++i)
+				accept_incoming(w, &w->listeners[i]);
+		}
+
+		/* a full batch means more events are likely waiting */
+		if (nfds == maxevents &&
+		    (size_t)maxevents < w->max_connections) {
+			struct epoll_event *tmp;
+
+			maxevents *= 2;
+			tmp = realloc(events, maxevents * sizeof *events);
+			if (!tmp)
+				fatal("realloc()");
+			events = tmp;
+		}
 	}
 }
 
+#ifdef HAVE_IO_URING
+static void uring_poll(struct uring *ring, void *ptr)
+{
+	int fd = ptr == nlsock ? mnl_socket_get_fd(nlsock) :
+				 ((struct wg_dynamic_listener *)ptr)->fd;
+
+	uring_poll_multishot(ring, fd, URING_DATA(ptr, URING_POLL));
+}
+
+/* Stops all multishot accepts until there's room for more connections */
+static void uring_block_accept(struct wg_dynamic_worker *w)
+{
+	w->accept_blocked = true;
+	for (unsigned int i = 0; i < ninterfaces; ++i) {
+		if (w->listeners[i].accepting)
+			uring_cancel(w->ring, URING_DATA(&w->listeners[i],
+							 URING_ACCEPT));
+	}
+}
+
+/* Unlike with epoll, connections keep arriving without asking for them until
+ * the multishot accepts are cancelled. Those that are accepted in the
+ * meantime can't be left in the backlog, so they are told to come back later
+ * like any other busy connection, even past BUSY_CONNECTIONS.
+ */
+static void uring_accepted(struct wg_dynamic_worker *w,
+			   struct wg_dynamic_listener *listener, int fd)
+{
+	struct wg_dynamic_connection *con;
+	struct sockaddr_storage addr;
+	socklen_t size = sizeof addr;
+	struct in6_addr lladdr;
+	wg_key pubkey;
+	bool busy;
+
+	busy = w->nconnections >= w->max_connections &&
+	       !evict_oldest_connection(w);
+	if (busy && !w->accept_blocked &&
+	    w->nconnections + 1 >= w->max_connections + BUSY_CONNECTIONS)
+		uring_block_accept(w);
+
+	if (getpeername(fd, (struct sockaddr *)&addr, &size))
+		fatal("getpeername()");
+
+	fd = identify_peer(listener, fd, &addr, &pubkey, &lladdr);
+	if (fd < 0) {
+		metrics_inc(METRIC_ACCEPT_REJECTED);
+		if (fd == -ENOENT)
+			debug("Failed to match IP to pubkey\n");
+		return;
+	}
+
+	con = add_connection(w, listener, fd, pubkey, &lladdr, busy);
+	con->receiving = true;
+	++con->inflight;
+	uring_recv(w->ring, fd, URING_DATA(con, URING_RECV));
+}
+
+static void uring_received(struct wg_dynamic_connection *con,
+			   const struct io_uring_cqe *cqe)
+{
+	struct uring *ring = con->worker->ring;
+	const unsigned char *data = uring_cqe_buffer(ring, cqe);
+	uint64_t start;
+
+	/* a request needs more than one buffer every now and then */
+	if (cqe->res == -ENOBUFS && con->fd >= 0 && !con->closing) {
+		con->receiving = true;
+		++con->inflight;
+		uring_recv(ring, con->fd, URING_DATA(con, URING_RECV));
+		return;
+	}
+
+	if (con->fd < 0 || con->closing) {
+		uring_recycle_buffer(ring, cqe);
+		return;
+	}
+
+	if (cqe->res < 0) {
+		debug("Reading from socket %d failed: %s\n", con->fd,
+		      strerror(-cqe->res));
+		uring_recycle_buffer(ring, cqe);
+		close_connection(con);
+		return;
+	}
+
+	start = metrics_start();
+	handle_client_data(con, data, cqe->res);
+	metrics_observe(HIST_HANDLE_CLIENT, start);
+	uring_recycle_buffer(ring, cqe);
+
+	if (!con->closing) {
+		con->receiving = true;
+		++con->inflight;
+		uring_recv(ring, con->fd, URING_DATA(con, URING_RECV));
+	}
+}
+
+static void uring_sent(struct wg_dynamic_connection *con,
+		       const struct io_uring_cqe *cqe)
+{
+	bool failed = cqe->res < 0 || (size_t)cqe->res < con->sendlen;
+
+	free(con->sendbuf);
+	con->sendbuf = NULL;
+	con->sendlen = 0;
+
+	if (con->fd < 0)
+		return;
+
+	if (failed) {
+		debug("Writing to socket %d failed: %s\n", con->fd,
+		      strerror(cqe->res < 0 ? -cqe->res : EPIPE));
+		close_connection(con);
+		return;
+	}
+
+	/* queued up while the send was in flight */
+	if (con->outbuf && !con->queued)
+		uring_send_output(con);
+}
+
+static void uring_complete(struct wg_dynamic_worker *w,
+			   const struct io_uring_cqe *cqe)
+{
+	void *ptr = (void *)(uintptr_t)(cqe->user_data & ~URING_OP_MASK);
+	struct wg_dynamic_listener *listener = ptr;
+	struct wg_dynamic_connection *con = ptr;
+
+	switch (cqe->user_data & URING_OP_MASK) {
+	case 0:
+		/* closes and cancellations, of which only failures show up */
+		break;
+	case URING_ACCEPT:
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+			listener->accepting = false;
+
+		if (cqe->res >= 0)
+			uring_accepted(w, listener, cqe->res);
+		else if (cqe->res != -ECANCELED)
+			debug("Failed to accept connection: %s\n",
+			      strerror(-cqe->res));
+		break;
+	case URING_POLL:
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+			uring_poll(w->ring, ptr);
+
+		handle_event(w, ptr, EPOLLIN);
+		break;
+	case URING_RECV:
+	case URING_SEND:;
+		/* if it's closed below, release_connection() takes care */
+		bool released = con->fd < 0;
+
+		--con->inflight;
+		if ((cqe->user_data & URING_OP_MASK) == URING_RECV) {
+			con->receiving = false;
+			uring_received(con, cqe);
+		} else {
+			uring_sent(con, cqe);
+		}
+
+		/* released while still in use by the kernel */
+		if (released && !con->inflight) {
+			con->next = w->free_cons;
+			w->free_cons = con;
+		}
+		break;
+	default:
+		BUG();
+	}
+}
+
+/* The same as epoll_loop(), with the reads and writes for connections, as
+ * well as accepting and closing them, done by the kernel. All of that is
+ * submitted while waiting for the next completions, leaving a single
+ * syscall per round with nothing but short exchanges going on.
+ */
+static void uring_loop(struct wg_dynamic_worker *w)
+{
+	bool is_main = w == &workers[0];
+	struct io_uring_cqe cqe;
+	int ret;
+
+	w->ring = uring_new(URING_ENTRIES, URING_BUFS, URING_BUFSIZE);
+	if (!w->ring)
+		fatal("Setting up io_uring failed");
+
+	if (is_main)
+		uring_poll(w->ring, nlsock);
+	if (is_main && stats_listener.fd >= 0)
+		uring_poll(w->ring, &stats_listener);
+
+	while (1) {
+		for (unsigned int i = 0; !w->accept_blocked && i < ninterfaces;
+		     ++i) {
+			struct wg_dynamic_listener *listener = &w->listeners[i];
+
+			if (listener->accepting)
+				continue;
+
+			listener->accepting = true;
+			uring_accept_multishot(w->ring, listener->fd,
+					       URING_DATA(listener,
+							  URING_ACCEPT));
+		}
+
+		ret = uring_wait(w->ring, next_timeout(w));
+		if (ret) {
+			errno = -ret;
+			fatal("io_uring_enter()");
+		}
+
+		while (uring_pop_cqe(w->ring, &cqe))
+			uring_complete(w, &cqe);
+
+		send_responses(w);
+
+		if (w->accept_blocked &&
+		    (w->nconnections < w->max_connections + BUSY_CONNECTIONS ||
+		     evict_oldest_connection(w)))
+			w->accept_blocked = false;
+	}
+}
+#endif
+
+static void *worker_loop(void *arg)
+{
+#ifdef HAVE_IO_URING
+	if (event_loop == EVENT_LOOP_IO_URING) {
+		uring_loop(arg);
+		return NULL;
+	}
+#endif
+
+	epoll_loop(arg);
+	return NULL;
+}
+
+static void start_workers()
+{
+	for (unsigned int i = 1; i < nworkers; ++i) {
+		int ret = pthread_create(&workers[i].thread, NULL, worker_loop,
+					 &workers[i]);
+		if (ret)
+			die("pthread_create(): %s\n", strerror(ret));
+	}
+
+	workers[0].thread = pthread_self();
+	worker_loop(&workers[0]);
+}
+
 int main(int argc, char *argv[])
 {
 	progname = argv[0];
@@ -571,6 +1878,19 @@ int main(int argc, char *argv[])
 		char *endptr = NULL;
 		const struct option options[] = {
 			{ "leasetime", required_argument, NULL, 0 },
+			{ "leasefile", required_argument, NULL, 0 },
+			{ "max-connections", required_argument, NULL, 0 },
+			{ "idle-timeout", required_argument, NULL, 0 },
+			{ "threads", required_argument, NULL, 0 },
+			{ "stats-socket", required_argument, NULL, 0 },
+			{ "netlink-rcvbuf", required_argument, NULL, 0 },
+			{ "alloc", required_argument, NULL, 0 },
+			{ "control-socket", required_argument, NULL, 0 },
+			{ "event-loop", required_argument, NULL, 0 },
+			{ "reuse-grace", required_argument, NULL, 0 },
+			{ "replication-listen", required_argument, NULL, 0 },
+			{ "replicate-from", required_argument, NULL, 0 },
+			{ "capture", required_argument, NULL, 0 },
 			{ 0, 0, 0, 0 }
 		};
 
@@ -580,26 +1900,92 @@ int main(int argc, char *argv[])
 
 		switch (ret) {
 		case 0:
-			if (index != 0)
-				usage();
-			leasetime = (uint32_t)strtoul(optarg, &endptr, 10);
-			if (*endptr)
+			if (index == 0) {
+				leasetime = (uint32_t)strtoul(optarg, &endptr,
+							      10);
+				if (*endptr)
+					usage();
+			} else if (index == 1) {
+				leasefile = optarg;
+			} else if (index == 2) {
+				max_connections = strtoul(optarg, &endptr, 10);
+				if (*endptr || !max_connections)
+					usage();
+			} else if (index == 3) {
+				idle_timeout = (uint32_t)strtoul(optarg,
+								 &endptr, 10);
+				if (*endptr || !idle_timeout)
+					usage();
+			} else if (index == 4) {
+				nworkers = (unsigned int)strtoul(optarg,
+								 &endptr, 10);
+				if (*endptr || !nworkers)
+					usage();
+			} else if (index == 5) {
+				stats_socket = optarg;
+			} else if (index == 6) {
+				unsigned long val = strtoul(optarg, &endptr,
+							    10);
+				if (*endptr || !val || val > INT_MAX)
+					usage();
+				netlink_rcvbuf = (int)val;
+			} else if (index == 7) {
+				if (!strcmp(optarg, "random"))
+					alloc = LEASES_ALLOC_RANDOM;
+				else if (!strcmp(optarg, "compact"))
+					alloc = LEASES_ALLOC_COMPACT;
+				else if (!strcmp(optarg, "sticky-hash"))
+					alloc = LEASES_ALLOC_STICKY_HASH;
+				else
+					usage();
+			} else if (index == 8) {
+				control_socket = optarg;
+			} else if (index == 9) {
+				if (!strcmp(optarg, "epoll"))
+					event_loop = EVENT_LOOP_EPOLL;
+				else if (!strcmp(optarg, "io_uring"))
+					event_loop = EVENT_LOOP_IO_URING;
+				else
+					usage();
+			} else if (index == 10) {
+				reuse_grace = (uint32_t)strtoul(optarg,
+								&endptr, 10);
+				if (*endptr)
+					usage();
+			} else if (index == 11) {
+				replication_listen = optarg;
+			} else if (index == 12) {
+				replicate_from = optarg;
+			} else if (index == 13) {
+				capture_file = optarg;
+			} else {
 				usage();
+			}
 			break;
 		default:
 			usage();
 		}
 	}
 
-	if (optind < argc)
-		wg_interface = argv[optind++];
-
-	if (!wg_interface || optind < argc)
+	if (optind >= argc)
 		usage();
 
+	ninterfaces = argc - optind;
+	interfaces = calloc(ninterfaces, sizeof *interfaces);
+	if (!interfaces)
+		fatal("calloc()");
+
+	for (unsigned int i = 0; i < ninterfaces; ++i) {
+		interfaces[i].name = argv[optind + i];
+		for (unsigned int j = 0; j < i; ++j) {
+			if (!strcmp(interfaces[i].name, interfaces[j].name))
+				usage();
+		}
+	}
+
 	setup();
 
-	poll_loop();
+	start_workers();
 
 	return 0;
 }